@@ -9,13 +9,78 @@
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <algorithm>
 
 #include "include/c_interactive_client.h"
+#include "include/c_file_transfer_protocol.h"
+#include "include/c_cipher_registry.h"
 
 
+// --window=N --chunk=N|auto --streams=N --channels=N --delta=on|off --dedupe=on|off --hash-first=on|off --cipher=auto|hard|simple --cipher-cache=PATH
+static bool parseOptions(int argc, char* argv[], uint32_t& windowChunks, uint32_t& chunkSize, uint32_t& streams, uint32_t& channels, bool& delta, bool& dedupe, bool& hashFirst, std::string& cipher, std::string& cipherCache) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        try {
+            if (arg.rfind("--window=", 0) == 0) {
+                windowChunks = std::stoul(arg.substr(9));
+            } else if (arg == "--chunk=auto") {
+                chunkSize = 0;
+            } else if (arg.rfind("--chunk=", 0) == 0) {
+                chunkSize = std::clamp<unsigned long>(std::stoul(arg.substr(8)), FTPProtocol::MIN_CHUNK_SIZE, FTPProtocol::MAX_CHUNK_SIZE);
+            } else if (arg.rfind("--streams=", 0) == 0) {
+                streams = std::stoul(arg.substr(10));
+            } else if (arg.rfind("--channels=", 0) == 0) {
+                channels = std::stoul(arg.substr(11));
+            } else if (arg == "--delta=on" || arg == "--delta=off") {
+                delta = arg == "--delta=on";
+            } else if (arg == "--dedupe=on" || arg == "--dedupe=off") {
+                dedupe = arg == "--dedupe=on";
+            } else if (arg == "--hash-first=on" || arg == "--hash-first=off") {
+                hashFirst = arg == "--hash-first=on";
+            } else if (arg == "--cipher=auto") {
+                cipher = FileTransferClient::DEFAULT_CIPHER;
+            } else if (arg == "--cipher=hard" || arg == "--cipher=simple") {
+                cipher = arg.substr(9) + "-encrypt";
+            } else if (arg.rfind("--cipher-cache=", 0) == 0) {
+                cipherCache = arg.substr(15);
+            } else {
+                std::cerr << "Unknown option: " << arg << std::endl;
+                return false;
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Invalid value for option: " << arg << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
 int main(int argc, char* argv[]) {
+    uint32_t windowChunks = FileTransferClient::DEFAULT_WINDOW_CHUNKS;
+    uint32_t chunkSize = 0; // adaptive
+    uint32_t streams = 1;
+    uint32_t channels = FileTransferClient::DEFAULT_CHANNELS;
+    bool delta = true;
+    bool dedupe = false;
+    bool hashFirst = true;
+    std::string cipher = FileTransferClient::DEFAULT_CIPHER;
+    std::string cipherCache;
+    if (!parseOptions(argc, argv, windowChunks, chunkSize, streams, channels, delta, dedupe, hashFirst, cipher, cipherCache)) {
+        std::cerr << "Correct usage --> [--window=N] [--chunk=N|auto] [--streams=N] [--channels=N] [--delta=on|off] [--dedupe=on|off] [--hash-first=on|off] [--cipher=auto|hard|simple] [--cipher-cache=PATH]\n";
+        return 1;
+    }
+
+    // timed for the log and the session summary, the strongest cipher is offered first either way
+    CipherRegistry::benchmark(cipherCache);
+    CipherRegistry::Stats ciphers = CipherRegistry::stats();
+    std::cout << "Ciphers, fastest first:";
+    for (const CipherRegistry::Measurement& measurement : ciphers.measurements) {
+        std::cout << " " << measurement.name << " " << (uint64_t)measurement.megabytesPerSecond << " MB/s";
+    }
+    std::cout << (ciphers.fromCache ? " (from " + cipherCache + ")" : " (measured in " + std::to_string((int)ciphers.benchmarkMs) + " ms)") << std::endl;
+
     // start the client
-    InteractiveClient client;
+    InteractiveClient client(windowChunks, chunkSize, streams, channels, delta, dedupe, hashFirst, cipher);
     client.run();
     return 0;
-} 
\ No newline at end of file
+}
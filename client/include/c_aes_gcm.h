@@ -0,0 +1,50 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <string>
+#include <span>
+
+// openssl/evp.h is left out on purpose, its DH typedef clashes with our DH class
+struct evp_cipher_ctx_st;
+
+// HKDF-SHA256 of the DH shared secret into length bytes, info keeps keys for different uses apart
+bool hkdfSha256(uint64_t sharedSecret, const std::string& info, uint8_t* out, size_t length);
+
+/**
+ * AES-256-GCM for the "hard-encrypt" cipher, through OpenSSL EVP so AES-NI/VAES and PCLMUL are used
+ * when the CPU has them
+ * key and IV come from HKDF-SHA256 over the DH shared secret, one pair per direction, and the nonce
+ * of each packet is the IV with a 64 bit packet counter XORed into its last 8 bytes
+ * the 16 byte GCM tag takes the place of the MAC, so packets keep the same layout
+ */
+
+class AesGcm {
+    private:
+        evp_cipher_ctx_st* ctx_;
+        uint8_t iv_[12];
+        uint64_t counter_;
+
+        // point the context at the next packet's nonce, encrypting or decrypting
+        bool start(bool encrypt);
+        void fail(const char* what);
+
+    public:
+        static constexpr size_t KEY_SIZE = 32;
+        static constexpr size_t IV_SIZE = 12;
+        static constexpr size_t TAG_SIZE = 16;
+
+        AesGcm(uint64_t sharedSecret, bool is_client);
+        ~AesGcm();
+        AesGcm(const AesGcm&) = delete;
+        AesGcm& operator=(const AesGcm&) = delete;
+
+        // false when the keys or the OpenSSL context could not be set up, nothing can be sent with it
+        bool valid() const { return ctx_ != nullptr; }
+
+        // packet is [data][TAG_SIZE bytes of room], on false the packet is zeroed and must not be sent
+        bool encryptInPlace(std::span<uint8_t> packet);
+        // packet is [encrypted data][tag], the data is decrypted before the tag is checked so on
+        // false it is garbage and the connection has to be dropped
+        bool decryptInPlace(std::span<uint8_t> packet);
+};
@@ -4,6 +4,8 @@
 #include <cstdint>
 #include <map>
 
+class FrameReader;
+
 namespace AuthProtocol {
     // max lengths for strings
     constexpr uint32_t MAX_USERNAME_LENGTH = 256;
@@ -31,6 +33,6 @@ namespace AuthProtocol {
     bool parseAuthMessage(const std::vector<uint8_t>& data, std::string& username, std::string& password);
 
     bool sendAuthRequest(int socket_fd, const std::string& username, const std::string& password);
-    bool receiveAuthResponse(int socket_fd, bool& success);
+    bool receiveAuthResponse(FrameReader& reader, bool& success);
 
 }
\ No newline at end of file
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * picks the FILE_DATA chunk size for one upload
+ * a fixed size is used as is, the adaptive mode starts small and doubles the size while
+ * each doubling still makes the upload measurably faster, then stays at the best one
+ */
+
+class ChunkSizer {
+    private:
+        static constexpr uint32_t ADAPTIVE_START = 64 * 1024;
+        static constexpr uint64_t MIN_STEP_BYTES = 2 * 1024 * 1024; // measured per size before deciding
+        static constexpr double MIN_GAIN = 1.05; // a doubling has to buy at least 5%
+
+        uint32_t size_;
+        uint32_t max_;
+        bool settled_;
+        double bestRate_;
+        uint32_t bestSize_;
+        uint64_t stepBytes_;
+        std::chrono::steady_clock::time_point stepStart_;
+
+    public:
+        // fixedSize 0 means adaptive, maxSize is what the server agreed to
+        ChunkSizer(uint32_t fixedSize, uint32_t maxSize);
+
+        uint32_t size() const { return size_; }
+        bool settled() const { return settled_; }
+
+        // called for every chunk handed to the socket
+        void record(size_t bytes);
+};
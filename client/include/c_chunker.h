@@ -0,0 +1,26 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include "c_file_transfer_protocol.h"
+
+/**
+ * content defined chunking for deduplicated uploads (FastCDC)
+ * a gear hash over the last 64 bytes decides where a chunk ends, so an insert or delete only
+ * moves the cuts next to it and the rest of the file still cuts into the same chunks
+ * the cut is harder to hit before the average size and easier after it, which keeps most
+ * chunks close to the average
+ */
+
+namespace Chunker {
+
+    constexpr uint32_t MIN_SIZE = 16 * 1024;
+    constexpr uint32_t AVERAGE_SIZE = 64 * 1024;
+    constexpr uint32_t MAX_SIZE = 256 * 1024;
+
+    // length of the chunk that starts at data
+    size_t nextCut(const uint8_t* data, size_t len);
+    // the whole file cut into chunks, each with its SHA-256
+    std::vector<FTPProtocol::ChunkRef> split(const uint8_t* data, uint64_t size);
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <string>
+#include <span>
+#include <memory>
+#include <variant>
+#include "c_simple_crypto.h"
+#include "c_aes_gcm.h"
+
+/**
+ * every encryption and MAC this side can run, under the names KEXINIT uses for them
+ * a direction's cipher is picked once when the keys are made and kept as its concrete type in a
+ * variant, so the protocol code only ever sees PacketCipher and each packet costs one jump into
+ * that type, the per byte and per block loops inside it are compiled for it alone
+ * a new algorithm is a new alternative in the variant and a line in the registry table
+ * benchmark() times every implementation on this CPU at startup, the numbers are logged through
+ * stats() and each session reports the speed of its own cipher
+ * names are advertised strongest first and only ordered by speed within the same strength, the
+ * strongest tier holds a single cipher and a single MAC so the benchmark never changes what
+ * KEXINIT picks, it only would once a tier has two implementations in it
+ */
+
+class PacketCipher {
+    private:
+        std::variant<SimpleCrypto<KimMac>, SimpleCrypto<HmacSha256>, AesGcm> cipher_;
+        std::string name_;
+        double measuredSpeed_ = 0; // MB/s benchmark() got for this implementation, 0 without one
+
+    public:
+        // every alternative leaves the same room for its MAC or tag, the frame layout never changes
+        static constexpr size_t MAC_SIZE = 16;
+
+        template <typename Cipher>
+        PacketCipher(std::in_place_type_t<Cipher> type, const std::string& name, uint64_t sharedSecret, bool is_client)
+            : cipher_(type, sharedSecret, is_client), name_(name) {}
+
+        const std::string& name() const { return name_; }
+        void setMeasuredSpeed(double megabytesPerSecond) { measuredSpeed_ = megabytesPerSecond; }
+        double measuredSpeed() const { return measuredSpeed_; }
+        // false when the alternative could not set up its keys
+        bool valid() const {
+            return std::visit([](const auto& cipher) { return cipher.valid(); }, cipher_);
+        }
+
+        // false means the packet must not go out and the connection has to be dropped
+        bool encryptInPlace(std::span<uint8_t> packet) {
+            return std::visit([packet](auto& cipher) { return cipher.encryptInPlace(packet); }, cipher_);
+        }
+        bool decryptInPlace(std::span<uint8_t> packet) {
+            return std::visit([packet](auto& cipher) { return cipher.decryptInPlace(packet); }, cipher_);
+        }
+};
+
+static_assert(SimpleCrypto<KimMac>::MAC_SIZE == PacketCipher::MAC_SIZE);
+static_assert(SimpleCrypto<HmacSha256>::MAC_SIZE == PacketCipher::MAC_SIZE);
+static_assert(AesGcm::TAG_SIZE == PacketCipher::MAC_SIZE);
+
+namespace CipherRegistry {
+
+    struct Measurement {
+        std::string name;
+        double megabytesPerSecond; // encrypt and decrypt of a 64 KB packet
+    };
+
+    struct Stats {
+        std::vector<Measurement> measurements; // fastest first, empty before benchmark()
+        bool fromCache = false;
+        double benchmarkMs = 0;
+    };
+
+    // time every implementation, a few tens of ms each, has to run before the first connection
+    // nothing is printed, stats() has the results
+    // with a cachePath the numbers are read from it when they were measured on this same CPU,
+    // otherwise they are measured and written to it
+    void benchmark(const std::string& cachePath = "");
+    Stats stats();
+
+    // what buildKexPayload advertises, AEAD before XOR and HMAC before the XOR hash, fastest first
+    // within each once benchmark() has run, every name in a tier shares one implementation today
+    std::vector<std::string> encryptionNames();
+    std::vector<std::string> macNames();
+
+    // the cipher for one direction from the names KEXINIT agreed on, the MAC is ignored for
+    // ciphers that carry their own tag, nullptr when either name is not registered or the
+    // cipher could not set up its keys
+    std::unique_ptr<PacketCipher> create(const std::string& encryption, const std::string& mac, uint64_t sharedSecret, bool is_client);
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <vector>
+#include <functional>
+#include <cstdint>
+#include <cstddef>
+#include "c_file_transfer_protocol.h"
+
+/**
+ * finds the blocks of the server copy in a local file and describes the file as copies of
+ * those blocks and literal bytes, the server keeps the same checksums in s_delta
+ * the weak checksum rolls a byte at a time so a block is found at any offset, not only on
+ * block boundaries, the strong one is only computed once the weak one matches
+ */
+
+namespace Delta {
+
+    // low 16 bits are the byte sum, high 16 bits the sum weighted by distance from the block end
+    uint32_t weakChecksum(const uint8_t* data, size_t len);
+    void strongHash(const uint8_t* data, size_t len, uint8_t* out);
+    // full SHA-256, sent with FILE_END so the server can check the file it rebuilt
+    void fileHash(const uint8_t* data, size_t len, uint8_t* out);
+
+    // the weak checksum of a window that slides one byte at a time
+    class RollingChecksum {
+        private:
+            uint32_t a_;
+            uint32_t b_;
+            uint32_t length_;
+
+        public:
+            RollingChecksum() : a_(0), b_(0), length_(0) {}
+
+            void reset(const uint8_t* data, uint32_t length);
+            // out leaves the window at the front, in joins it at the back
+            void roll(uint8_t out, uint8_t in) {
+                a_ += in - out;
+                b_ += a_ - length_ * out;
+            }
+            uint32_t value() const { return (a_ & 0xffff) | (b_ << 16); }
+    };
+
+    struct Stats {
+        uint64_t copiedBytes = 0;
+        uint64_t literalBytes = 0;
+        uint32_t messages = 0;
+    };
+
+    // every DELTA_DATA payload goes to send in file order, false from send stops the encode
+    bool encode(const uint8_t* data, uint64_t size, uint32_t blockSize, const std::vector<FTPProtocol::BlockSignature>& signatures,
+                const std::function<bool(const std::vector<uint8_t>&)>& send, Stats& stats);
+}
@@ -2,30 +2,102 @@
 
 #include <string>
 #include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <fstream>
+#include <memory>
 #include "c_ssh_socket.h"
+#include "c_file_transfer_protocol.h"
+#include "c_kex.h"
 
-class SimpleCrypto;
+class PacketCipher;
+
+// one file of a sendFiles batch, on its own channel
+struct OutgoingFile {
+    enum class State { STARTING, SENDING, ENDING };
+
+    std::string path;
+    std::ifstream file;
+    uint64_t size = 0;
+    uint64_t sent = 0;
+    uint32_t chunkSize = 0; // agreed in the FILE_START reply
+    uint32_t chunkNumber = 0;
+    uint32_t nextChunk = 0;       // every chunk below this is acked
+    uint32_t selectiveChunks = 0; // acked past a gap
+    State state = State::STARTING;
+};
 
 class FileTransferClient {
     private:
         std::string hostname_;
         int port_;
         SSHSocket ssh_;
-        SimpleCrypto* sendCrypto_;
-        SimpleCrypto* recvCrypto_; 
+        std::unique_ptr<PacketCipher> sendCrypto_;
+        std::unique_ptr<PacketCipher> recvCrypto_;
+        uint32_t windowChunks_; // FILE_DATA chunks allowed in flight before waiting for an ack
+        uint32_t chunkSize_;    // bytes per FILE_DATA, 0 lets the client find the best size itself
+        uint32_t streams_;      // connections one large upload is split over
+        uint32_t channels_;     // files sendFiles keeps in flight on this connection
+        bool delta_;            // a file the server already has is re-uploaded as a delta against its copy
+        bool dedupe_;           // files are cut into chunks and only the ones the server store lacks are sent
+        bool hashFirst_;        // FILE_START carries the file SHA-256 so content the server has is never sent
+        std::string cipher_;    // encryption offered first in KEXINIT, "auto" for the registry order
+        KexMatch kex_;          // what KEXINIT agreed on, the keys are made for it
+        std::string username_;
+        std::string password_;
+        std::vector<uint8_t> ackPayload_; // reused by every FILE_ACK
 
     public:
+        static constexpr uint32_t DEFAULT_WINDOW_CHUNKS = 64;
+        static constexpr uint32_t MAX_STREAMS = 16;
+        static constexpr uint32_t DEFAULT_CHANNELS = 8;
+        static constexpr uint32_t MAX_CHANNELS = 64; // what the server lets one connection have open
+        // not a cipher name, the ciphers are offered in the order the startup benchmark put them
+        static constexpr const char* DEFAULT_CIPHER = "auto";
+
         FileTransferClient(const std::string& hostname, int port = 2222);
         ~FileTransferClient();
         
         bool connect();
         bool authenticate(const std::string& username, const std::string& password);
         bool sendFile(const std::string& filePath);
+        // many files at once, each on its own channel of this connection, returns how many made it
+        size_t sendFiles(const std::vector<std::string>& filePaths);
+        // download a file this user uploaded, large ones are fetched as byte ranges over several connections
+        bool getFile(const std::string& filename, const std::string& localPath);
         void disconnect();
+        void setWindowChunks(uint32_t chunks) { windowChunks_ = chunks > 0 ? chunks : 1; }
+        void setChunkSize(uint32_t bytes) { chunkSize_ = bytes; }
+        void setStreams(uint32_t streams) { streams_ = std::clamp<uint32_t>(streams, 1, MAX_STREAMS); }
+        void setChannels(uint32_t channels) { channels_ = std::clamp<uint32_t>(channels, 1, MAX_CHANNELS); }
+        void setDelta(bool delta) { delta_ = delta; }
+        void setDedupe(bool dedupe) { dedupe_ = dedupe; }
+        void setHashFirst(bool hashFirst) { hashFirst_ = hashFirst; }
+        void setCipher(const std::string& cipher) { cipher_ = cipher; }
 
     private:
         bool handleVersionExchange();
         bool handleKexinitExchange();
         bool handleKeyExchange();
         bool handleAuthentication(const std::string& username, const std::string& password);
+        // read FILE_ACKs, wait blocks for at least one, otherwise only what already arrived
+        bool receiveAcks(uint32_t& nextChunk, uint32_t& selectiveChunks, bool wait);
+        bool applyAck(const std::vector<uint8_t>& payload, uint32_t& nextChunk, uint32_t& selectiveChunks);
+        // digest of length bytes at offset is the one the server has for its partial copy
+        bool prefixMatches(std::ifstream& file, uint64_t offset, uint64_t length, uint64_t digest);
+        // UPLOAD_INIT here, one UPLOAD_PART per connection in parallel, then UPLOAD_COMPLETE here
+        bool sendStriped(const std::string& filePath, const std::string& filename, uint64_t fileSize, uint32_t parts, const std::vector<uint8_t>& contentHash);
+        // FILE_START or UPLOAD_PART, the FILE_DATA window for [offset, offset + length), then FILE_END
+        // or nothing at all when the server answers FILE_PRESENT
+        bool sendRange(FTPProtocol::FTPMessageType startType, const std::vector<uint8_t>& startPayload, const std::string& filePath, uint64_t offset, uint64_t length, bool showProgress);
+        // DELTA_START, the server block signatures, then DELTA_DATA and FILE_END with the file SHA-256
+        // false when the server has no copy to diff against or the rebuilt file did not match, the caller sends the whole file
+        bool sendDelta(const std::string& filePath, const std::string& filename, uint64_t fileSize, const std::vector<uint8_t>& contentHash);
+        // DEDUPE_START with the chunk hashes of the file, CHUNK_DATA for the ones the server asks for, then FILE_END
+        // false when the server keeps no chunk store or did not get every chunk, the caller sends the whole file
+        bool sendDeduped(const std::string& filePath, const std::string& filename, uint64_t fileSize);
+        // small files packed into FILE_BATCH messages, a few batches in flight, returns how many were written
+        size_t sendBatched(const std::vector<std::string>& filePaths);
+        // FILE_GET for [offset, offset + length), every chunk is written to fileFd where it belongs
+        bool receiveRange(const std::string& filename, int fileFd, uint64_t offset, uint64_t length, bool showProgress);
 };
\ No newline at end of file
@@ -3,8 +3,12 @@
 #include <vector>
 #include <string>
 #include <cstdint>
+#include <utility>
+#include <span>
 
-class SimpleCrypto;
+class PacketCipher;
+class FrameReader;
+class SendBatch;
 
 namespace FTPProtocol {
 
@@ -13,32 +17,68 @@ namespace FTPProtocol {
         FILE_DATA = 2,
         FILE_END = 3,
         FILE_ERROR = 4,
-        DISCONNECT = 5
+        DISCONNECT = 5,
+        FILE_ACK = 6,
+        UPLOAD_INIT = 7,     // striped upload, creates it and answers with its id
+        UPLOAD_PART = 8,     // this connection sends one byte range of it
+        UPLOAD_COMPLETE = 9, // all parts are in, publish the file
+        FILE_GET = 10,       // read a byte range of a stored file back, answered with FILE_DATA
+        FILE_BATCH = 11,     // many small files in one message, answered once for all of them
+        DELTA_START = 12,    // re-upload against the copy the server already has, answered with its block size
+        DELTA_SIGNATURES = 13, // server block signatures of that copy
+        DELTA_DATA = 14,     // copy and literal instructions that rebuild the new file from it
+        DEDUPE_START = 15,   // a file as a list of chunk hashes, answered with the chunks the server does not have
+        CHUNK_DATA = 16,     // one of those chunks
+        FILE_PRESENT = 17,   // FILE_START, DELTA_START or UPLOAD_INIT reply, the server already has that content under the name
+        DEDUPE_UNSUPPORTED = 18 // DEDUPE_START reply, the server keeps no chunk store
     };
 
-    constexpr uint32_t MAX_CHUNK_SIZE = 8192;
+    constexpr size_t FILE_VERSION_OFFSET = 16;
+    // running digest of a resumable upload, 64 bit FNV-1a so it fits in a journal line
+    constexpr uint64_t DIGEST_SEED = 0xcbf29ce484222325ULL;
+    constexpr uint32_t DEFAULT_CHUNK_SIZE = 8192; // what an older server that sends no chunk size uses
+    constexpr uint32_t MIN_CHUNK_SIZE = 4096;
+    constexpr uint32_t MAX_CHUNK_SIZE = 4 * 1024 * 1024; // the most the client ever asks for
     constexpr uint32_t MAX_FILENAME_LENGTH = 255;
+    constexpr uint32_t MAX_ENCRYPTED_FRAME_SIZE = 1 << 24;
+    constexpr uint32_t MAX_ACK_RANGES = 16;
+    constexpr uint64_t WHOLE_FILE = UINT64_MAX; // FILE_GET length for everything from the offset on
+    constexpr uint32_t MAX_BATCH_FILES = 4096;
+    constexpr size_t STRONG_HASH_SIZE = 16; // leading bytes of the SHA-256 of a block
+    constexpr size_t FILE_HASH_SIZE = 32;   // SHA-256 of a whole file, sent with the FILE_END of a delta
+    constexpr uint32_t SIGNATURES_PER_MESSAGE = 32768;
+    // DELTA_DATA is a run of these, each followed by its fields
+    constexpr uint8_t DELTA_COPY = 1;    // [first block][block count] of the server copy
+    constexpr uint8_t DELTA_LITERAL = 2; // [length][bytes] that are new
+    constexpr size_t CHUNK_HASH_SIZE = 32;  // SHA-256, a stored chunk is named after it
+    constexpr uint32_t MAX_CHUNK_REFS = 1 << 18; // keeps a DEDUPE_START under the server frame limit
 
     // file tranfer struct header
+    // channelId sits in what used to be padding, 0 is the one channel older peers know about
+    // every file in flight on a connection has its own channel, replies carry the same id
     struct FTPHeader {
         uint8_t messageType;
+        uint16_t channelId;
         uint32_t payloadLength;
         uint32_t sequenceNumber;
         
-        FTPHeader(uint8_t type = 0, uint32_t length = 0, uint32_t seq = 0){
+        FTPHeader(uint8_t type = 0, uint32_t length = 0, uint32_t seq = 0, uint16_t channel = 0){
             messageType = type;
+            channelId = channel;
             payloadLength = length;
             sequenceNumber = seq;
         }
     };
 
     // file start message struct
+    // the client file version (modification time) is sent in the 8 padding bytes at FILE_VERSION_OFFSET,
+    // 0 there means the server keeps no resume journal for the file
     struct FileStartMessage {
         uint32_t filenameLength;
         uint64_t fileSize;
         uint32_t chunkSize;
         
-        FileStartMessage(uint32_t name_len = 0, uint64_t size = 0, uint32_t chunk = MAX_CHUNK_SIZE){
+        FileStartMessage(uint32_t name_len = 0, uint64_t size = 0, uint32_t chunk = DEFAULT_CHUNK_SIZE){
             filenameLength = name_len;
             fileSize = size;
             chunkSize = chunk;
@@ -46,24 +86,166 @@ namespace FTPProtocol {
     };
 
     // file data message struct
+    // offset is where the chunk goes in the file (or part), chunk sizes may change mid file
     struct FileDataMessage {
         uint32_t chunkNumber;
         uint32_t dataLength;
+        uint64_t offset;
         
-        FileDataMessage(uint32_t chunk = 0, uint32_t length = 0){
+        FileDataMessage(uint32_t chunk = 0, uint32_t length = 0, uint64_t off = 0){
             chunkNumber = chunk;
             dataLength = length;
+            offset = off;
         }
     };
 
+    // FILE_ACK from the server, every chunk below nextChunk has arrived
+    // followed by rangeCount pairs of [first, last] chunks that arrived past a gap
+    struct FileAckMessage {
+        uint32_t nextChunk;
+        uint32_t rangeCount;
 
-    std::vector<uint8_t> serializeHeader(const FTPHeader& header);
-    bool deserializeHeader(const std::vector<uint8_t>& data, FTPHeader& header);
+        FileAckMessage(uint32_t next = 0, uint32_t count = 0){
+            nextChunk = next;
+            rangeCount = count;
+        }
+    };
+
+    using ChunkRange = std::pair<uint32_t, uint32_t>; // first and last chunk, both included
+
+    // UPLOAD_INIT payload, same layout as FILE_START with the part count in place of the chunk size
+    struct UploadInitMessage {
+        uint32_t filenameLength;
+        uint64_t fileSize;
+        uint32_t partCount;
+
+        UploadInitMessage(uint32_t name_len = 0, uint64_t size = 0, uint32_t parts = 1){
+            filenameLength = name_len;
+            fileSize = size;
+            partCount = parts;
+        }
+    };
+
+    // UPLOAD_PART payload, FILE_DATA chunks that follow are relative to offset
+    struct UploadPartMessage {
+        uint64_t uploadId;
+        uint64_t offset;
+        uint64_t length;
+        uint32_t chunkSize;
+
+        UploadPartMessage(uint64_t id = 0, uint64_t off = 0, uint64_t len = 0, uint32_t chunk = DEFAULT_CHUNK_SIZE){
+            uploadId = id;
+            offset = off;
+            length = len;
+            chunkSize = chunk;
+        }
+    };
+
+    // FILE_GET payload, followed by the file name
+    // the range is clamped to the file, a length of 0 only asks for the file size
+    struct FileGetMessage {
+        uint64_t offset;
+        uint64_t length;
+        uint32_t chunkSize;
+        uint32_t filenameLength;
+
+        FileGetMessage(uint64_t off = 0, uint64_t len = WHOLE_FILE, uint32_t chunk = DEFAULT_CHUNK_SIZE, uint32_t name_len = 0){
+            offset = off;
+            length = len;
+            chunkSize = chunk;
+            filenameLength = name_len;
+        }
+    };
+
+    // FILE_BATCH payload is [file count] then for every file this, its name and its data
+    struct FileBatchEntry {
+        uint64_t fileSize;
+        uint32_t filenameLength;
+
+        FileBatchEntry(uint64_t size = 0, uint32_t name_len = 0){
+            fileSize = size;
+            filenameLength = name_len;
+        }
+    };
+
+    // DEDUPE_START payload is this, the file name, then [length][hash] for every chunk in file order
+    struct DedupeStartMessage {
+        uint64_t fileSize;
+        uint32_t chunkCount;
+        uint32_t filenameLength;
+
+        DedupeStartMessage(uint64_t size = 0, uint32_t count = 0, uint32_t name_len = 0){
+            fileSize = size;
+            chunkCount = count;
+            filenameLength = name_len;
+        }
+    };
+
+    // one chunk of a deduplicated file
+    struct ChunkRef {
+        uint32_t length;
+        uint8_t hash[CHUNK_HASH_SIZE];
+    };
+
+    // one block of the server copy, weak is the rolling checksum
+    struct BlockSignature {
+        uint32_t weak;
+        uint8_t strong[STRONG_HASH_SIZE];
+    };
+
+
+    // sizeof(FTPHeader) bytes at out
+    void serializeHeader(const FTPHeader& header, uint8_t* out);
+    bool deserializeHeader(std::span<const uint8_t> data, FTPHeader& header);
 
-    std::vector<uint8_t> createFileStartMessage(const std::string& filename, uint64_t fileSize);
-    std::vector<uint8_t> createFileDataMessage(uint32_t chunkNumber, const std::vector<uint8_t>& data);
+    std::vector<uint8_t> createFileStartMessage(const std::string& filename, uint64_t fileSize, uint32_t chunkSize, uint64_t fileVersion = 0);
+    // SHA-256 of the whole file after the name of a FILE_START, DELTA_START or UPLOAD_INIT payload,
+    // a server that has the content answers FILE_PRESENT, an older one never looks past the name
+    void appendContentHash(std::vector<uint8_t>& startPayload, const std::vector<uint8_t>& hash);
+    // chunk size the server agreed to in its FILE_START reply
+    bool parseFileStartReply(const std::vector<uint8_t>& data, uint32_t& chunkSize);
+    // resumeOffset is 0 unless the server still has the start of this file
+    bool parseFileStartReply(const std::vector<uint8_t>& data, uint32_t& chunkSize, uint64_t& resumeOffset, uint64_t& digest);
+    uint64_t updateDigest(uint64_t digest, const uint8_t* data, size_t len);
+    std::vector<uint8_t> createUploadInitMessage(const std::string& filename, uint64_t fileSize, uint32_t partCount);
+    std::vector<uint8_t> createUploadPartMessage(uint64_t uploadId, uint64_t offset, uint64_t length, uint32_t chunkSize);
+    // UPLOAD_INIT reply and UPLOAD_COMPLETE request, just the id
+    std::vector<uint8_t> createUploadIdMessage(uint64_t uploadId);
+    bool parseUploadIdMessage(const std::vector<uint8_t>& data, uint64_t& uploadId);
     std::vector<uint8_t> createFileEndMessage();
+    bool parseFileAckMessage(const std::vector<uint8_t>& data, uint32_t& nextChunk, std::vector<ChunkRange>& ranges);
+    // FILE_ACK for a download, every chunk below nextChunk is written
+    std::vector<uint8_t> createFileAckMessage(uint32_t nextChunk);
+    std::vector<uint8_t> createFileGetMessage(const std::string& filename, uint64_t offset, uint64_t length, uint32_t chunkSize);
+    // file size and the range the server is about to send
+    bool parseFileGetReply(const std::vector<uint8_t>& data, uint64_t& fileSize, uint64_t& offset, uint64_t& length, uint32_t& chunkSize);
+    // blockCount 0 --> the server has no copy worth diffing against
+    bool parseDeltaStartReply(const std::vector<uint8_t>& data, uint32_t& blockSize, uint32_t& blockCount);
+    // signatures are appended
+    bool parseDeltaSignaturesMessage(const std::vector<uint8_t>& data, std::vector<BlockSignature>& signatures);
+    void addDeltaCopy(std::vector<uint8_t>& ops, uint32_t firstBlock, uint32_t blockCount);
+    void addDeltaLiteral(std::vector<uint8_t>& ops, const uint8_t* data, uint32_t length);
+    // empty FILE_BATCH payload, files are appended one at a time
+    std::vector<uint8_t> createFileBatchMessage();
+    void addToFileBatch(std::vector<uint8_t>& batch, const std::string& filename, const uint8_t* data, uint64_t size);
+    uint32_t fileBatchCount(const std::vector<uint8_t>& batch);
+    // failed lists the index of every file in the batch the server could not write
+    bool parseFileBatchReply(const std::vector<uint8_t>& data, uint32_t& fileCount, std::vector<uint32_t>& failed);
+    std::vector<uint8_t> createDedupeStartMessage(const std::string& filename, uint64_t fileSize, const std::vector<ChunkRef>& chunks);
+    // index of every chunk the server does not have yet
+    bool parseMissingChunksReply(const std::vector<uint8_t>& data, uint32_t chunkCount, std::vector<uint32_t>& missing);
+    // CHUNK_DATA payload --> [chunk index][bytes]
+    std::vector<uint8_t> createChunkDataMessage(uint32_t index, const uint8_t* data, uint32_t length);
+    // chunkData points into data, the chunk is not copied out
+    bool parseFileDataMessage(const std::vector<uint8_t>& data, uint32_t& chunkNumber, uint64_t& offset, const uint8_t*& chunkData, uint32_t& chunkLength);
 
-    bool sendEncryptedMessage(int socket_fd, uint8_t messageType, const std::vector<uint8_t>& payload, uint32_t sequenceNumber, SimpleCrypto& crypto);
-    bool receiveEncryptedMessage(int socket_fd, FTPHeader& header, std::vector<uint8_t>& payload, SimpleCrypto& crypto);
+    // encrypt and queue, nothing is sent until the batch is flushed
+    // false when encrypting failed, the batch then holds frames that must never be flushed
+    bool queueEncryptedMessage(SendBatch& batch, uint8_t messageType, const std::vector<uint8_t>& payload, uint32_t sequenceNumber, PacketCipher& crypto, uint16_t channelId = 0);
+    // FILE_DATA built and encrypted in the batch's own buffer, the chunk is copied once
+    bool queueEncryptedFileData(SendBatch& batch, uint32_t chunkNumber, uint64_t offset, const uint8_t* data, uint32_t length, uint32_t sequenceNumber, PacketCipher& crypto, uint16_t channelId = 0);
+    bool sendEncryptedMessage(int socket_fd, uint8_t messageType, const std::vector<uint8_t>& payload, uint32_t sequenceNumber, PacketCipher& crypto);
+    // the payload is read into payload and decrypted there, keep passing the same vector and
+    // steady state reads do not allocate
+    bool receiveEncryptedMessage(FrameReader& reader, FTPHeader& header, std::vector<uint8_t>& payload, PacketCipher& crypto);
 }
\ No newline at end of file
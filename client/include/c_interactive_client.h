@@ -13,9 +13,17 @@ class InteractiveClient {
         FileTransferClient* client_;
         bool connected_;
         bool authenticated_;
+        uint32_t windowChunks_;
+        uint32_t chunkSize_;
+        uint32_t streams_;
+        uint32_t channels_;
+        bool delta_;
+        bool dedupe_;
+        bool hashFirst_;
+        std::string cipher_;
 
     public:
-        InteractiveClient();
+        explicit InteractiveClient(uint32_t windowChunks = FileTransferClient::DEFAULT_WINDOW_CHUNKS, uint32_t chunkSize = 0, uint32_t streams = 1, uint32_t channels = FileTransferClient::DEFAULT_CHANNELS, bool delta = true, bool dedupe = false, bool hashFirst = true, const std::string& cipher = FileTransferClient::DEFAULT_CIPHER);
         ~InteractiveClient();
         
         void run();
@@ -28,5 +36,6 @@ class InteractiveClient {
         void uploadSingleFile();
         void uploadMultipleFiles();
         void browseAndSelectFile();
+        void downloadFile();
         void reconnect();
 };
\ No newline at end of file
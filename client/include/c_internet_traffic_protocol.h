@@ -3,6 +3,8 @@
 #include <string>
 #include <cstdint>
 
+class FrameReader;
+
 namespace ITPProtocol {
     constexpr uint32_t MAX_PAYLOAD_SIZE = 65536;
     constexpr uint32_t HEADER_SIZE = 16;
@@ -30,7 +32,7 @@ namespace ITPProtocol {
     bool deserializeHeader(const std::vector<uint8_t>& data, ITPHeader& header);
 
     bool sendMessage(int socket_fd, uint8_t messageType, const std::vector<uint8_t>& payload, uint32_t sequenceNumber);
-    bool receiveMessage(int socket_fd, ITPHeader& header, std::vector<uint8_t>& payload);
+    bool receiveMessage(FrameReader& reader, ITPHeader& header, std::vector<uint8_t>& payload);
 
     uint32_t calculateChecksum(const std::vector<uint8_t>& data);
     bool validateChecksum(const std::vector<uint8_t>& data, uint32_t expected_checksum);
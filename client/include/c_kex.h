@@ -27,7 +27,8 @@ struct KexMatch {
     std::string CompressionServerToClient;
 };
 
-std::vector<uint8_t> buildKexPayload();
+// cipher is the encryption to offer ahead of the rest of the cipher registry
+std::vector<uint8_t> buildKexPayload(const std::string& cipher);
 
 struct KexInformation parseKexPayload(std::vector<uint8_t> rawPayload);
 
@@ -3,31 +3,44 @@
 #include <vector>
 #include <cstdint>
 #include <string>
+#include <span>
+#include "c_xor_kernel.h"
+#include "c_mac.h"
 
 /**
  * simplified symetric encryption system using XOR for IV and the ley from DH shared secret
- * MAC integrity checks
+ * MAC integrity checks, with whichever MAC was negotiated for the direction
+ * Mac is a type from c_mac.h, the members are defined in c_simple_crypto.cpp for each one of them
  */
 
+template <typename Mac>
 class SimpleCrypto {
     private:
         std::vector<uint8_t> key_;
         std::vector<uint8_t> iv_;
         uint32_t sequence_number_;
-        
+        // one period of this packet's keystream, worked out again whenever the IV changes
+        uint8_t keystream_[XorKernel::TABLE_SIZE];
+        Mac mac_;
+
         static std::vector<uint8_t> deriveKey(uint64_t sharedSecret, const std::string& purpose);
-        
-        std::vector<uint8_t> xorEncrypt(const std::vector<uint8_t>& data);
-        std::vector<uint8_t> xorDecrypt(const std::vector<uint8_t>& data);
-        
-        static std::vector<uint8_t> simpleHash(const std::vector<uint8_t>& data);
-        
+
+        // position is where data starts in the packet, the keystream depends on it
+        void xorEncryptInto(const uint8_t* data, size_t len, uint8_t* out, size_t position);
+
         void updateIV();
 
     public:
+        static constexpr size_t MAC_SIZE = Mac::SIZE;
+
         SimpleCrypto(uint64_t sharedSecret, bool is_client);
-        
-        std::vector<uint8_t> encryptPacket(const std::vector<uint8_t>& rawPacket);
-        
-        bool decryptPacket(const std::vector<uint8_t>& encryptedPacket, std::vector<uint8_t>& rawPacketOut);
-}; 
\ No newline at end of file
+        bool valid() const { return mac_.valid(); }
+
+        // packet is [data][MAC_SIZE bytes of room], the data is encrypted where it lies and the MAC
+        // goes in the room behind it, false when the MAC failed
+        bool encryptInPlace(std::span<uint8_t> packet);
+
+        // packet is [encrypted data][MAC], once the MAC checks out the data is decrypted where it lies
+        // and the first packet.size() - MAC_SIZE bytes are the plaintext, on false nothing changed
+        bool decryptInPlace(std::span<uint8_t> packet);
+};
@@ -1,5 +1,7 @@
 #pragma once
 #include <string>
+#include "c_frame_reader.h"
+#include "c_buffer_tuner.h"
 
 class SSHSocket {
     public:
@@ -10,9 +12,13 @@ class SSHSocket {
         bool exchangeVersionStrings(std::string& serverVersion);
         void closeConnection();
         int getSocketFd() const { return socketfd_; }
+        FrameReader& reader() { return reader_; }
+        BufferTuner& tuner() { return tuner_; }
     
     private:
         std::string hostname_;
         int port_;
         int socketfd_;
+        FrameReader reader_; // everything received on this connection goes through here
+        BufferTuner tuner_; // socket buffers follow the measured bandwidth-delay product
     };
\ No newline at end of file
@@ -0,0 +1,111 @@
+#include "../include/c_aes_gcm.h"
+#include <iostream>
+#include <cstring>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/crypto.h>
+
+namespace {
+    const std::string HKDF_SALT = "KimCloud hard-encrypt";
+}
+
+bool hkdfSha256(uint64_t sharedSecret, const std::string& info, uint8_t* out, size_t length) {
+    uint8_t secret[8];
+    for (int i = 0; i < 8; i++) {
+        secret[i] = (sharedSecret >> (i * 8)) & 0xFF;
+    }
+
+    EVP_PKEY_CTX* hkdf = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr);
+    bool ok = hkdf && EVP_PKEY_derive_init(hkdf) > 0 &&
+              EVP_PKEY_CTX_set_hkdf_md(hkdf, EVP_sha256()) > 0 &&
+              EVP_PKEY_CTX_set1_hkdf_salt(hkdf, (const uint8_t*)HKDF_SALT.data(), HKDF_SALT.size()) > 0 &&
+              EVP_PKEY_CTX_set1_hkdf_key(hkdf, secret, sizeof(secret)) > 0 &&
+              EVP_PKEY_CTX_add1_hkdf_info(hkdf, (const uint8_t*)info.data(), info.size()) > 0 &&
+              EVP_PKEY_derive(hkdf, out, &length) > 0;
+    EVP_PKEY_CTX_free(hkdf);
+    return ok;
+}
+
+AesGcm::AesGcm(uint64_t sharedSecret, bool is_client) : ctx_(nullptr), counter_(0) {
+    // each direction gets its own key and IV
+    std::string direction = is_client ? "client_to_server" : "server_to_client";
+    uint8_t keys[KEY_SIZE + IV_SIZE];
+    memset(iv_, 0, IV_SIZE);
+    if (!hkdfSha256(sharedSecret, direction, keys, sizeof(keys))) {
+        std::cerr << "Failed to derive hard-encrypt keys" << std::endl;
+        return;
+    }
+    memcpy(iv_, keys + KEY_SIZE, IV_SIZE);
+
+    // the key schedule is worked out once, every packet after this only sets its nonce
+    ctx_ = EVP_CIPHER_CTX_new();
+    if (!ctx_ || EVP_CipherInit_ex(ctx_, EVP_aes_256_gcm(), nullptr, keys, nullptr, 1) != 1) {
+        std::cerr << "Failed to set up AES-256-GCM" << std::endl;
+        EVP_CIPHER_CTX_free(ctx_);
+        ctx_ = nullptr;
+    }
+    OPENSSL_cleanse(keys, sizeof(keys));
+}
+
+AesGcm::~AesGcm() {
+    EVP_CIPHER_CTX_free(ctx_);
+}
+
+bool AesGcm::start(bool encrypt) {
+    // 64 bit counter, a nonce is never used twice under one key
+    uint8_t nonce[IV_SIZE];
+    memcpy(nonce, iv_, IV_SIZE);
+    for (int i = 0; i < 8; i++) {
+        nonce[IV_SIZE - 8 + i] ^= (counter_ >> (56 - i * 8)) & 0xFF;
+    }
+    counter_++;
+    return ctx_ && EVP_CipherInit_ex(ctx_, nullptr, nullptr, nullptr, nonce, encrypt ? 1 : 0) == 1;
+}
+
+void AesGcm::fail(const char* what) {
+    std::cerr << "AES-256-GCM " << what << " failed" << std::endl;
+}
+
+bool AesGcm::encryptInPlace(std::span<uint8_t> packet) {
+    if (packet.size() < TAG_SIZE) {
+        std::cerr << "Packet too short for GCM tag" << std::endl;
+        return false;
+    }
+
+    // [encrypted data][tag]
+    size_t dataSize = packet.size() - TAG_SIZE;
+    uint8_t* tag = packet.data() + dataSize;
+    int length = 0;
+    if (!start(true) || EVP_EncryptUpdate(ctx_, packet.data(), &length, packet.data(), (int)dataSize) != 1 ||
+        EVP_EncryptFinal_ex(ctx_, tag, &length) != 1 ||
+        EVP_CIPHER_CTX_ctrl(ctx_, EVP_CTRL_GCM_GET_TAG, TAG_SIZE, tag) != 1) {
+        // the packet may still hold plaintext, none of it is left for a caller to send by mistake
+        OPENSSL_cleanse(packet.data(), packet.size());
+        fail("encrypt");
+        return false;
+    }
+    return true;
+}
+
+bool AesGcm::decryptInPlace(std::span<uint8_t> packet) {
+    if (packet.size() < TAG_SIZE) {
+        std::cerr << "Packet too short for GCM tag" << std::endl;
+        return false;
+    }
+
+    size_t dataSize = packet.size() - TAG_SIZE;
+    uint8_t* tag = packet.data() + dataSize;
+    uint8_t rest[TAG_SIZE];
+    int length = 0;
+    if (!start(false) || EVP_CIPHER_CTX_ctrl(ctx_, EVP_CTRL_GCM_SET_TAG, TAG_SIZE, tag) != 1 ||
+        EVP_DecryptUpdate(ctx_, packet.data(), &length, packet.data(), (int)dataSize) != 1) {
+        fail("decrypt");
+        return false;
+    }
+    // the tag is checked here
+    if (EVP_DecryptFinal_ex(ctx_, rest, &length) != 1) {
+        std::cerr << "GCM tag verification failed" << std::endl;
+        return false;
+    }
+    return true;
+}
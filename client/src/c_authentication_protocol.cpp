@@ -67,11 +67,11 @@ namespace AuthProtocol {
         return ITPProtocol::sendMessage(socket_fd, static_cast<uint8_t>(AuthMessageType::AUTH_REQUEST), authPayload, 0);
     }
 
-    bool receiveAuthResponse(int socket_fd, bool& success) {
+    bool receiveAuthResponse(FrameReader& reader, bool& success) {
         ITPProtocol::ITPHeader header;
         std::vector<uint8_t> payload;
         
-        if (!ITPProtocol::receiveMessage(socket_fd, header, payload)) {
+        if (!ITPProtocol::receiveMessage(reader, header, payload)) {
             return false;
         }
         
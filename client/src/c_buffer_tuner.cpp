@@ -0,0 +1,133 @@
+#include "c_buffer_tuner.h"
+
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <fstream>
+#include <cstddef>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+
+namespace {
+    // net.core.[rw]mem_max, what setsockopt clamps to, 0 when it cannot be read
+    uint64_t readLimit(const char* path) {
+        std::ifstream in(path);
+        uint64_t limit = 0;
+        in >> limit;
+        return limit;
+    }
+
+    uint64_t kernelLimit(int option) {
+        static const uint64_t sendMax = readLimit("/proc/sys/net/core/wmem_max");
+        static const uint64_t recvMax = readLimit("/proc/sys/net/core/rmem_max");
+        return option == SO_SNDBUF ? sendMax : recvMax;
+    }
+}
+
+BufferTuner::BufferTuner(int fd) {
+    fd_ = fd;
+    sampled_ = false;
+    lastBytesReceived_ = 0;
+    lastBytesAcked_ = 0;
+    rttUs_ = 0;
+    cwndBytes_ = 0;
+    sendRate_ = 0;
+    receiveRate_ = 0;
+    peakSendRate_ = 0;
+    peakReceiveRate_ = 0;
+    sendBuffer_ = 0;
+    recvBuffer_ = 0;
+    adjustments_ = 0;
+}
+
+bool BufferTuner::grow(int option, uint64_t target, int& current) {
+    socklen_t len = sizeof(current);
+    if (getsockopt(fd_, SOL_SOCKET, option, &current, &len) < 0) {
+        return false;
+    }
+
+    // the kernel clamps to net.core.[rw]mem_max and autotuning may already be past that,
+    // only ask when what would really be set is bigger than what the socket has
+    // reported size is already doubled, compare like with like
+    target = std::min(target, MAX_BUFFER);
+    uint64_t limit = kernelLimit(option);
+    if (limit > 0) {
+        target = std::min(target, limit);
+    }
+    if (target * 2 <= (uint64_t)current) {
+        return true;
+    }
+
+    int previous = current;
+    int value = target;
+    if (setsockopt(fd_, SOL_SOCKET, option, &value, sizeof(value)) < 0) {
+        std::cerr << "Failed to resize socket buffer to " << value << " bytes" << std::endl;
+        return false;
+    }
+    // keep what it actually gave us, never less than what it replaced
+    len = sizeof(current);
+    if (getsockopt(fd_, SOL_SOCKET, option, &current, &len) < 0 || current < previous) {
+        current = previous;
+    }
+    adjustments_++;
+    return true;
+}
+
+bool BufferTuner::sample() {
+    struct tcp_info info = {};
+    socklen_t len = sizeof(info);
+    if (fd_ < 0 || getsockopt(fd_, IPPROTO_TCP, TCP_INFO, &info, &len) < 0) {
+        return false;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(now - lastSample_).count();
+
+    // older kernels hand back a shorter struct, only trust fields that were filled
+    bool haveRate = len >= offsetof(struct tcp_info, tcpi_delivery_rate) + sizeof(info.tcpi_delivery_rate);
+    bool haveBytes = len >= offsetof(struct tcp_info, tcpi_bytes_received) + sizeof(info.tcpi_bytes_received);
+
+    // a mostly receiving side only has its own small replies to time, take the larger estimate
+    rttUs_ = std::max(info.tcpi_rtt, info.tcpi_rcv_rtt);
+    cwndBytes_ = (uint64_t)info.tcpi_snd_cwnd * info.tcpi_snd_mss;
+    // an app limited sample is the link speed, not what this connection pushes
+    sendRate_ = haveRate && !info.tcpi_delivery_rate_app_limited ? info.tcpi_delivery_rate : 0;
+
+    if (sampled_ && haveBytes && seconds > 0) {
+        receiveRate_ = (info.tcpi_bytes_received - lastBytesReceived_) / seconds;
+        sendRate_ = std::max<uint64_t>(sendRate_, (info.tcpi_bytes_acked - lastBytesAcked_) / seconds);
+    }
+    if (haveBytes) {
+        lastBytesReceived_ = info.tcpi_bytes_received;
+        lastBytesAcked_ = info.tcpi_bytes_acked;
+    }
+    lastSample_ = now;
+    sampled_ = true;
+    peakSendRate_ = std::max(peakSendRate_, sendRate_);
+    peakReceiveRate_ = std::max(peakReceiveRate_, receiveRate_);
+
+    // bandwidth-delay product, doubled so a buffer limited rate still has room to grow
+    // the window is only a fallback, it overshoots on paths like loopback with a huge mss
+    uint64_t sendBdp = sendRate_ > 0 ? sendRate_ * rttUs_ / 1000000 : cwndBytes_;
+    uint64_t receiveBdp = receiveRate_ * rttUs_ / 1000000;
+
+    bool ok = grow(SO_SNDBUF, sendBdp * 2, sendBuffer_);
+    ok = grow(SO_RCVBUF, receiveBdp * 2, recvBuffer_) && ok;
+    return ok;
+}
+
+void BufferTuner::maybeSample() {
+    if (sampled_ && std::chrono::steady_clock::now() - lastSample_ < SAMPLE_INTERVAL) {
+        return;
+    }
+    sample();
+}
+
+std::string BufferTuner::summary() const {
+    std::ostringstream out;
+    out << "rtt " << rttUs_ / 1000.0 << " ms, cwnd " << cwndBytes_ << " bytes, "
+        << "peak rate out " << peakSendRate_ << " B/s, peak rate in " << peakReceiveRate_ << " B/s, "
+        << "sndbuf " << sendBuffer_ << ", rcvbuf " << recvBuffer_ << " (" << adjustments_ << " adjustments)";
+    return out.str();
+}
@@ -0,0 +1,46 @@
+#include "c_chunk_sizer.h"
+
+#include <algorithm>
+
+ChunkSizer::ChunkSizer(uint32_t fixedSize, uint32_t maxSize) {
+    max_ = maxSize;
+    settled_ = fixedSize != 0;
+    size_ = settled_ ? std::min(fixedSize, maxSize) : std::min(ADAPTIVE_START, maxSize);
+    bestRate_ = 0;
+    bestSize_ = size_;
+    stepBytes_ = 0;
+    stepStart_ = std::chrono::steady_clock::now();
+}
+
+void ChunkSizer::record(size_t bytes) {
+    if (settled_) {
+        return;
+    }
+
+    // a few chunks of every size so one slow syscall does not decide it
+    stepBytes_ += bytes;
+    if (stepBytes_ < std::max<uint64_t>(MIN_STEP_BYTES, (uint64_t)size_ * 4)) {
+        return;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(now - stepStart_).count();
+    double rate = seconds > 0 ? stepBytes_ / seconds : 0;
+
+    if (rate > bestRate_ * MIN_GAIN) {
+        bestRate_ = rate;
+        bestSize_ = size_;
+        if (size_ >= max_) {
+            settled_ = true;
+        } else {
+            size_ = std::min(size_ * 2, max_);
+        }
+    } else {
+        // bigger stopped helping, go back to the best one and stay there
+        size_ = bestSize_;
+        settled_ = true;
+    }
+
+    stepBytes_ = 0;
+    stepStart_ = now;
+}
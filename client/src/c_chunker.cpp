@@ -0,0 +1,71 @@
+#include "c_chunker.h"
+
+#include <array>
+#include <algorithm>
+#include <openssl/evp.h>
+
+namespace {
+    // 256 fixed random values, every client has to cut the same file the same way
+    constexpr std::array<uint64_t, 256> makeGearTable() {
+        std::array<uint64_t, 256> table{};
+        uint64_t state = 0x4b696d436c6f7564ULL;
+        for (auto& value : table) {
+            // splitmix64
+            state += 0x9e3779b97f4a7c15ULL;
+            uint64_t z = state;
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            value = z ^ (z >> 31);
+        }
+        return table;
+    }
+    constexpr std::array<uint64_t, 256> GEAR = makeGearTable();
+
+    // the average is 2^16, two bits more before it and two bits fewer after it
+    // the top bits of the gear hash depend on all of the last 64 bytes
+    constexpr uint64_t MASK_SMALL = ~0ULL << (64 - 18);
+    constexpr uint64_t MASK_LARGE = ~0ULL << (64 - 14);
+}
+
+namespace Chunker {
+
+    size_t nextCut(const uint8_t* data, size_t len) {
+        if (len <= MIN_SIZE) {
+            return len;
+        }
+        len = std::min<size_t>(len, MAX_SIZE);
+        size_t normal = std::min<size_t>(len, AVERAGE_SIZE);
+
+        // nothing can cut before the minimum, hashing starts there
+        uint64_t hash = 0;
+        size_t i = MIN_SIZE;
+        for (; i < normal; i++) {
+            hash = (hash << 1) + GEAR[data[i]];
+            if (!(hash & MASK_SMALL)) {
+                return i + 1;
+            }
+        }
+        for (; i < len; i++) {
+            hash = (hash << 1) + GEAR[data[i]];
+            if (!(hash & MASK_LARGE)) {
+                return i + 1;
+            }
+        }
+        return len;
+    }
+
+    std::vector<FTPProtocol::ChunkRef> split(const uint8_t* data, uint64_t size) {
+        std::vector<FTPProtocol::ChunkRef> chunks;
+        chunks.reserve(size / AVERAGE_SIZE + 1);
+        uint64_t pos = 0;
+        while (pos < size) {
+            FTPProtocol::ChunkRef chunk;
+            chunk.length = nextCut(data + pos, size - pos);
+            unsigned int digestLength = 0;
+            EVP_Digest(data + pos, chunk.length, chunk.hash, &digestLength, EVP_sha256(), nullptr);
+            chunks.push_back(chunk);
+            pos += chunk.length;
+        }
+        return chunks;
+    }
+}
@@ -0,0 +1,175 @@
+#include "c_delta.h"
+
+#include <cstring>
+#include <algorithm>
+#include <unordered_map>
+#include <openssl/evp.h>
+
+namespace {
+    constexpr size_t DELTA_MESSAGE_BYTES = 1024 * 1024; // a DELTA_DATA payload is sent once it holds about this much
+    constexpr uint64_t MAX_LITERAL_BYTES = 1024 * 1024; // longer runs of new bytes are split
+    constexpr uint32_t FILTER_BITS = 1 << 20;           // most offsets match nothing, a bit per weak hash rules them out
+}
+
+namespace Delta {
+
+    uint32_t weakChecksum(const uint8_t* data, size_t len) {
+        // plain reductions over the block, the compiler vectorizes both sums
+        uint32_t a = 0;
+        uint32_t b = 0;
+        for (size_t i = 0; i < len; i++) {
+            a += data[i];
+            b += (uint32_t)(len - i) * data[i];
+        }
+        return (a & 0xffff) | (b << 16);
+    }
+
+    void strongHash(const uint8_t* data, size_t len, uint8_t* out) {
+        uint8_t digest[EVP_MAX_MD_SIZE];
+        unsigned int digestLength = 0;
+        EVP_Digest(data, len, digest, &digestLength, EVP_sha256(), nullptr);
+        memcpy(out, digest, FTPProtocol::STRONG_HASH_SIZE);
+    }
+
+    void fileHash(const uint8_t* data, size_t len, uint8_t* out) {
+        unsigned int digestLength = 0;
+        EVP_Digest(data, len, out, &digestLength, EVP_sha256(), nullptr);
+    }
+
+    void RollingChecksum::reset(const uint8_t* data, uint32_t length) {
+        // same sums as weakChecksum, kept whole so roll() can update them
+        length_ = length;
+        a_ = 0;
+        b_ = 0;
+        for (uint32_t i = 0; i < length; i++) {
+            a_ += data[i];
+            b_ += (length - i) * data[i];
+        }
+    }
+
+    bool encode(const uint8_t* data, uint64_t size, uint32_t blockSize, const std::vector<FTPProtocol::BlockSignature>& signatures,
+                const std::function<bool(const std::vector<uint8_t>&)>& send, Stats& stats) {
+        std::vector<uint8_t> ops;
+        uint32_t copyFirst = 0;
+        uint32_t copyCount = 0; // blocks of the copy that is still being extended
+
+        auto flush = [&](bool force) {
+            if (ops.empty() || (!force && ops.size() < DELTA_MESSAGE_BYTES)) {
+                return true;
+            }
+            stats.messages++;
+            bool ok = send(ops);
+            ops.clear();
+            return ok;
+        };
+        auto addCopy = [&]() {
+            if (copyCount > 0) {
+                FTPProtocol::addDeltaCopy(ops, copyFirst, copyCount);
+                stats.copiedBytes += (uint64_t)copyCount * blockSize;
+                copyCount = 0;
+            }
+            return flush(false);
+        };
+        // a pending copy always comes first, it covers the bytes before the literal
+        auto addLiteral = [&](uint64_t from, uint64_t to) {
+            if (!addCopy()) {
+                return false;
+            }
+            while (from < to) {
+                uint32_t length = std::min(to - from, MAX_LITERAL_BYTES);
+                FTPProtocol::addDeltaLiteral(ops, data + from, length);
+                stats.literalBytes += length;
+                from += length;
+                if (!flush(false)) {
+                    return false;
+                }
+            }
+            return true;
+        };
+
+        std::unordered_multimap<uint32_t, uint32_t> blocksByWeak; // weak checksum --> block index
+        std::vector<bool> filter(FILTER_BITS);
+        blocksByWeak.reserve(signatures.size());
+        for (uint32_t i = 0; i < signatures.size(); i++) {
+            blocksByWeak.emplace(signatures[i].weak, i);
+            filter[(signatures[i].weak ^ (signatures[i].weak >> 16)) % FILTER_BITS] = true;
+        }
+
+        uint64_t pos = 0;          // start of the window
+        uint64_t literalStart = 0; // bytes from here to pos matched nothing yet
+        uint32_t expected = 0;     // the block after the last match, edited files mostly match in runs
+        RollingChecksum rolling;
+        if (!signatures.empty() && size >= blockSize) {
+            rolling.reset(data, blockSize);
+        }
+
+        while (!signatures.empty() && pos + blockSize <= size) {
+            uint32_t weak = rolling.value();
+            uint8_t strong[FTPProtocol::STRONG_HASH_SIZE];
+            bool hashed = false;
+            auto matches = [&](uint32_t block) {
+                if (signatures[block].weak != weak) {
+                    return false;
+                }
+                if (!hashed) {
+                    strongHash(data + pos, blockSize, strong);
+                    hashed = true;
+                }
+                return memcmp(signatures[block].strong, strong, FTPProtocol::STRONG_HASH_SIZE) == 0;
+            };
+
+            int64_t match = -1;
+            if (expected < signatures.size() && matches(expected)) {
+                match = expected;
+            } else if (filter[(weak ^ (weak >> 16)) % FILTER_BITS]) {
+                auto range = blocksByWeak.equal_range(weak);
+                for (auto it = range.first; it != range.second; ++it) {
+                    if (matches(it->second)) {
+                        match = it->second;
+                        break;
+                    }
+                }
+            }
+
+            if (match >= 0) {
+                if (literalStart < pos && !addLiteral(literalStart, pos)) {
+                    return false;
+                }
+                if (copyCount > 0 && copyFirst + copyCount == match) {
+                    copyCount++;
+                } else {
+                    if (!addCopy()) {
+                        return false;
+                    }
+                    copyFirst = match;
+                    copyCount = 1;
+                }
+                expected = match + 1;
+                pos += blockSize;
+                literalStart = pos;
+                if (pos + blockSize <= size) {
+                    rolling.reset(data + pos, blockSize);
+                }
+                continue;
+            }
+
+            if (pos + blockSize < size) {
+                rolling.roll(data[pos], data[pos + blockSize]);
+            }
+            pos++;
+            // a long unmatched stretch goes out as it is found rather than held in memory
+            if (pos - literalStart >= MAX_LITERAL_BYTES) {
+                if (!addLiteral(literalStart, pos)) {
+                    return false;
+                }
+                literalStart = pos;
+            }
+        }
+
+        // also sends the copy still being extended when the file ends on a matched block
+        if (!addLiteral(literalStart, size)) {
+            return false;
+        }
+        return flush(true);
+    }
+}
@@ -2,34 +2,90 @@
 #include "c_kex.h"
 #include "c_dh.h"
 #include "c_packet.h"
-#include "c_simple_crypto.h"
+#include "c_cipher_registry.h"
 #include "c_file_transfer_protocol.h"
 #include "c_authentication_protocol.h"
+#include "c_send_batch.h"
+#include "c_chunk_sizer.h"
+#include "c_delta.h"
+#include "c_chunker.h"
 
 #include <iostream>
 #include <fstream>
 #include <filesystem>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <cstring>
+#include <poll.h>
+#include <algorithm>
+#include <memory>
+#include <thread>
+#include <chrono>
+#include <deque>
+
+namespace {
+    constexpr uint32_t MAX_HANDSHAKE_PACKET_SIZE = 35000; // RFC 4253 packet limit
+    constexpr size_t SEND_BATCH_BYTES = 64 * 1024; // queued FILE_DATA flushed once this much is waiting
+    constexpr uint32_t MAX_IN_FLIGHT_BYTES = 16 * 1024 * 1024; // caps the window when chunks are big
+    constexpr uint64_t MIN_PART_BYTES = 8 * 1024 * 1024; // smallest byte range worth its own connection
+    constexpr uint32_t CHANNEL_CHUNK_SIZE = 64 * 1024; // interleaved files cannot be timed one at a time, no adaptive size
+    constexpr uint32_t DOWNLOAD_CHUNK_SIZE = 256 * 1024;
+    constexpr uint64_t DOWNLOAD_ACK_BYTES = 1024 * 1024; // well under the window the server sends ahead
+    constexpr uint64_t BATCH_FILE_BYTES = 64 * 1024; // files up to this size go in a FILE_BATCH
+    constexpr size_t BATCH_BYTES = 1024 * 1024;      // a batch is sent once it holds about this much
+    constexpr size_t BATCH_WINDOW = 4;               // batches sent before waiting for the oldest reply
+    constexpr uint64_t DELTA_MIN_BYTES = 1024 * 1024; // smaller files are sent whole, the signatures would not save much
+    constexpr uint64_t DEDUPE_MIN_BYTES = Chunker::MIN_SIZE; // a file of one small chunk is not worth the extra round trip
+    constexpr uint64_t HASH_FIRST_MIN_BYTES = 1024 * 1024;   // reading a smaller file twice saves next to nothing
+
+    // SHA-256 of the whole file for FILE_START, empty when it cannot be read
+    std::vector<uint8_t> contentHash(const std::string& filePath, uint64_t fileSize) {
+        std::vector<uint8_t> hash;
+        int fileFd = ::open(filePath.c_str(), O_RDONLY);
+        void* map = fileFd < 0 || fileSize == 0 ? MAP_FAILED : mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fileFd, 0);
+        if (fileFd >= 0) {
+            ::close(fileFd);
+        }
+        if (map == MAP_FAILED) {
+            return hash;
+        }
+        madvise(map, fileSize, MADV_SEQUENTIAL);
+        hash.resize(FTPProtocol::FILE_HASH_SIZE);
+        Delta::fileHash(static_cast<const uint8_t*>(map), fileSize, hash.data());
+        munmap(map, fileSize);
+        return hash;
+    }
+
+    bool writeAt(int fd, const uint8_t* data, size_t len, uint64_t offset) {
+        while (len > 0) {
+            ssize_t written = pwrite(fd, data, len, offset);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                return false;
+            }
+            data += written;
+            len -= written;
+            offset += written;
+        }
+        return true;
+    }
+}
 
 // construct
 FileTransferClient::FileTransferClient(const std::string& hostname, int port) 
-    : hostname_(hostname), port_(port), ssh_(hostname, port), sendCrypto_(nullptr), recvCrypto_(nullptr) {
+    : hostname_(hostname), port_(port), ssh_(hostname, port), sendCrypto_(nullptr), recvCrypto_(nullptr), windowChunks_(DEFAULT_WINDOW_CHUNKS), chunkSize_(0), streams_(1), channels_(DEFAULT_CHANNELS), delta_(true), dedupe_(false), hashFirst_(true), cipher_(DEFAULT_CIPHER) {
 }
 
 // destroy
 FileTransferClient::~FileTransferClient() {
-    if (sendCrypto_) {
-        delete sendCrypto_;
-        sendCrypto_ = nullptr;
-    }
-    if (recvCrypto_) {
-        delete recvCrypto_;
-        recvCrypto_ = nullptr;
-    }
 }
 
 bool FileTransferClient::connect() {
@@ -65,6 +121,10 @@ bool FileTransferClient::authenticate(const std::string& username, const std::st
         return false;
     }
     
+    // striped uploads log in again on every extra connection
+    username_ = username;
+    password_ = password;
+    
     return true;
 }
 
@@ -85,18 +145,307 @@ bool FileTransferClient::sendFile(const std::string& filePath) {
     // get file size
     file.seekg(0, std::ios::end);
     size_t fileSize = file.tellg();
-    file.seekg(0, std::ios::beg);
+    file.close();
     
     // get filename
     std::string filename = std::filesystem::path(filePath).filename().string();
     
     std::cout << "Sending file: " << filename << " (" << fileSize << " bytes)" << std::endl;
     
+    // only the chunks the server store is missing go over the wire
+    if (dedupe_ && fileSize >= DEDUPE_MIN_BYTES && sendDeduped(filePath, filename, fileSize)) {
+        return true;
+    }
+    
+    // whichever way the file goes, the server gets its hash first and can answer that it already has it
+    std::vector<uint8_t> hash;
+    if (hashFirst_ && fileSize >= HASH_FIRST_MIN_BYTES) {
+        hash = contentHash(filePath, fileSize);
+    }
+    
+    // most of a file the server already has can be rebuilt from its copy, striping only pays off for new files
+    if (delta_ && fileSize >= DELTA_MIN_BYTES && sendDelta(filePath, filename, fileSize, hash)) {
+        return true;
+    }
+    
+    // big files are split over several connections, each part has to be worth its handshake
+    uint32_t parts = std::min<uint64_t>(streams_, fileSize / MIN_PART_BYTES);
+    if (parts > 1) {
+        return sendStriped(filePath, filename, fileSize, parts, hash);
+    }
+    
+    // the modification time tells the server whether a partial upload it kept is still this file
+    struct stat st;
+    uint64_t fileVersion = 0;
+    if (stat(filePath.c_str(), &st) == 0) {
+        fileVersion = (uint64_t)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+    }
+    
+    // send FILE_START, adaptive mode asks for the largest chunk and works its way up to it
+    uint32_t requestedChunkSize = chunkSize_ != 0 ? chunkSize_ : FTPProtocol::MAX_CHUNK_SIZE;
+    auto fileStartPayload = FTPProtocol::createFileStartMessage(filename, fileSize, requestedChunkSize, fileVersion);
+    FTPProtocol::appendContentHash(fileStartPayload, hash);
+    if (!sendRange(FTPProtocol::FTPMessageType::FILE_START, fileStartPayload, filePath, 0, fileSize, true)) {
+        return false;
+    }
+    
+    std::cout << "File sent successfully!" << std::endl;
+    return true;
+}
+
+bool FileTransferClient::sendStriped(const std::string& filePath, const std::string& filename, uint64_t fileSize, uint32_t parts, const std::vector<uint8_t>& contentHash) {
+    // UPLOAD_INIT --> upload id
+    auto initPayload = FTPProtocol::createUploadInitMessage(filename, fileSize, parts);
+    FTPProtocol::appendContentHash(initPayload, contentHash);
+    if (!FTPProtocol::sendEncryptedMessage(ssh_.getSocketFd(), static_cast<uint8_t>(FTPProtocol::FTPMessageType::UPLOAD_INIT), initPayload, 0, *sendCrypto_)) {
+        std::cerr << "Failed to send upload init message" << std::endl;
+        return false;
+    }
+    
+    FTPProtocol::FTPHeader header;
+    std::vector<uint8_t> payload;
+    uint64_t uploadId;
+    if (!FTPProtocol::receiveEncryptedMessage(ssh_.reader(), header, payload, *recvCrypto_)) {
+        std::cerr << "Failed to receive server response" << std::endl;
+        return false;
+    }
+    if (static_cast<FTPProtocol::FTPMessageType>(header.messageType) == FTPProtocol::FTPMessageType::FILE_PRESENT) {
+        std::cout << "Server already has this file, nothing to send" << std::endl;
+        return true;
+    }
+    if (static_cast<FTPProtocol::FTPMessageType>(header.messageType) != FTPProtocol::FTPMessageType::UPLOAD_INIT ||
+        !FTPProtocol::parseUploadIdMessage(payload, uploadId)) {
+        std::cerr << "Server rejected striped upload" << std::endl;
+        return false;
+    }
+    
+    // this connection sends the first part, every other part gets its own login
+    std::vector<std::unique_ptr<FileTransferClient>> extra;
+    for (uint32_t i = 1; i < parts; i++) {
+        auto client = std::make_unique<FileTransferClient>(hostname_, port_);
+        client->setWindowChunks(windowChunks_);
+        client->setChunkSize(chunkSize_);
+        client->setCipher(cipher_);
+        if (!client->connect() || !client->authenticate(username_, password_)) {
+            std::cerr << "Failed to open connection " << i + 1 << " of " << parts << std::endl;
+            for (auto& opened : extra) {
+                opened->disconnect();
+            }
+            return false;
+        }
+        extra.push_back(std::move(client));
+    }
+    
+    std::cout << "Striped upload " << uploadId << ": " << parts << " connections" << std::endl;
+    auto start = std::chrono::steady_clock::now();
+    
+    // one thread per connection, each sends its own byte range
+    uint64_t partSize = (fileSize + parts - 1) / parts;
+    uint32_t requestedChunkSize = chunkSize_ != 0 ? chunkSize_ : FTPProtocol::MAX_CHUNK_SIZE;
+    std::vector<std::thread> threads;
+    std::vector<char> partOk(parts, 0);
+    for (uint32_t i = 0; i < parts; i++) {
+        FileTransferClient* client = i == 0 ? this : extra[i - 1].get();
+        uint64_t offset = i * partSize;
+        uint64_t length = std::min(partSize, fileSize - offset);
+        threads.emplace_back([&, client, i, offset, length]() {
+            auto partPayload = FTPProtocol::createUploadPartMessage(uploadId, offset, length, requestedChunkSize);
+            partOk[i] = client->sendRange(FTPProtocol::FTPMessageType::UPLOAD_PART, partPayload, filePath, offset, length, false);
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    for (auto& client : extra) {
+        client->disconnect();
+    }
+    
+    // UPLOAD_COMPLETE is sent even after a failed part so the server drops the temp file
+    auto completePayload = FTPProtocol::createUploadIdMessage(uploadId);
+    if (!FTPProtocol::sendEncryptedMessage(ssh_.getSocketFd(), static_cast<uint8_t>(FTPProtocol::FTPMessageType::UPLOAD_COMPLETE), completePayload, 0, *sendCrypto_)) {
+        std::cerr << "Failed to send upload complete message" << std::endl;
+        return false;
+    }
+    if (!FTPProtocol::receiveEncryptedMessage(ssh_.reader(), header, payload, *recvCrypto_)) {
+        std::cerr << "Failed to receive final server response" << std::endl;
+        return false;
+    }
+    
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (static_cast<FTPProtocol::FTPMessageType>(header.messageType) != FTPProtocol::FTPMessageType::FILE_END ||
+        std::count(partOk.begin(), partOk.end(), 0) > 0) {
+        std::cerr << "Server reported error during striped upload, message type " << (int)header.messageType << std::endl;
+        return false;
+    }
+    
+    std::cout << "File sent successfully! " << fileSize << " bytes over " << parts << " connections in " << seconds << " s" << std::endl;
+    return true;
+}
+
+bool FileTransferClient::sendDelta(const std::string& filePath, const std::string& filename, uint64_t fileSize, const std::vector<uint8_t>& contentHash) {
+    uint32_t sequenceNumber = 0;
+    // same payload as FILE_START, block size 0 lets the server pick one for its copy
+    auto startPayload = FTPProtocol::createFileStartMessage(filename, fileSize, 0);
+    FTPProtocol::appendContentHash(startPayload, contentHash);
+    if (!FTPProtocol::sendEncryptedMessage(ssh_.getSocketFd(), static_cast<uint8_t>(FTPProtocol::FTPMessageType::DELTA_START), startPayload, sequenceNumber, *sendCrypto_)) {
+        std::cerr << "Failed to send delta start message" << std::endl;
+        return false;
+    }
+    sequenceNumber++;
+    
+    FTPProtocol::FTPHeader header;
+    std::vector<uint8_t> payload;
+    uint32_t blockSize;
+    uint32_t blockCount;
+    if (!FTPProtocol::receiveEncryptedMessage(ssh_.reader(), header, payload, *recvCrypto_)) {
+        std::cerr << "Failed to receive server response" << std::endl;
+        return false;
+    }
+    if (static_cast<FTPProtocol::FTPMessageType>(header.messageType) == FTPProtocol::FTPMessageType::FILE_PRESENT) {
+        std::cout << "Server already has this file, nothing to send" << std::endl;
+        return true;
+    }
+    if (static_cast<FTPProtocol::FTPMessageType>(header.messageType) != FTPProtocol::FTPMessageType::DELTA_START ||
+        !FTPProtocol::parseDeltaStartReply(payload, blockSize, blockCount)) {
+        std::cerr << "Server refused the delta upload" << std::endl;
+        return false;
+    }
+    if (blockCount == 0) {
+        // nothing stored under this name yet
+        return false;
+    }
+    
+    std::vector<FTPProtocol::BlockSignature> signatures;
+    signatures.reserve(blockCount);
+    while (signatures.size() < blockCount) {
+        if (!FTPProtocol::receiveEncryptedMessage(ssh_.reader(), header, payload, *recvCrypto_) ||
+            static_cast<FTPProtocol::FTPMessageType>(header.messageType) != FTPProtocol::FTPMessageType::DELTA_SIGNATURES ||
+            !FTPProtocol::parseDeltaSignaturesMessage(payload, signatures)) {
+            std::cerr << "Failed to receive block signatures" << std::endl;
+            return false;
+        }
+    }
+    
+    int fileFd = ::open(filePath.c_str(), O_RDONLY);
+    void* map = fileFd < 0 ? MAP_FAILED : mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fileFd, 0);
+    if (fileFd >= 0) {
+        ::close(fileFd);
+    }
+    if (map == MAP_FAILED) {
+        std::cerr << "Failed to map " << filePath << std::endl;
+        FTPProtocol::sendEncryptedMessage(ssh_.getSocketFd(), static_cast<uint8_t>(FTPProtocol::FTPMessageType::FILE_ERROR), {}, sequenceNumber, *sendCrypto_);
+        return false;
+    }
+    const uint8_t* data = static_cast<const uint8_t*>(map);
+    madvise(map, fileSize, MADV_SEQUENTIAL);
+    
+    // the server only keeps the rebuilt file when it hashes to the same as this one
+    std::vector<uint8_t> fileHash(FTPProtocol::FILE_HASH_SIZE);
+    Delta::fileHash(data, fileSize, fileHash.data());
+    
+    auto start = std::chrono::steady_clock::now();
+    Delta::Stats stats;
+    bool ok = Delta::encode(data, fileSize, blockSize, signatures, [&](const std::vector<uint8_t>& ops) {
+        return FTPProtocol::sendEncryptedMessage(ssh_.getSocketFd(), static_cast<uint8_t>(FTPProtocol::FTPMessageType::DELTA_DATA), ops, sequenceNumber++, *sendCrypto_);
+    }, stats);
+    munmap(map, fileSize);
+    if (!ok || !FTPProtocol::sendEncryptedMessage(ssh_.getSocketFd(), static_cast<uint8_t>(FTPProtocol::FTPMessageType::FILE_END), fileHash, sequenceNumber, *sendCrypto_)) {
+        std::cerr << "Failed to send delta" << std::endl;
+        return false;
+    }
+    
+    if (!FTPProtocol::receiveEncryptedMessage(ssh_.reader(), header, payload, *recvCrypto_) ||
+        static_cast<FTPProtocol::FTPMessageType>(header.messageType) != FTPProtocol::FTPMessageType::FILE_END) {
+        std::cerr << "Server could not rebuild " << filename << " from the delta, sending it whole" << std::endl;
+        return false;
+    }
+    
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "File sent as a delta! " << stats.literalBytes << " new bytes, " << stats.copiedBytes << " bytes reused from "
+              << blockCount << " server blocks of " << blockSize << " bytes, " << stats.messages << " messages in " << seconds << " s" << std::endl;
+    return true;
+}
+
+bool FileTransferClient::sendDeduped(const std::string& filePath, const std::string& filename, uint64_t fileSize) {
+    int fileFd = ::open(filePath.c_str(), O_RDONLY);
+    void* map = fileFd < 0 ? MAP_FAILED : mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fileFd, 0);
+    if (fileFd >= 0) {
+        ::close(fileFd);
+    }
+    if (map == MAP_FAILED) {
+        std::cerr << "Failed to map " << filePath << std::endl;
+        return false;
+    }
+    const uint8_t* data = static_cast<const uint8_t*>(map);
+    
+    auto start = std::chrono::steady_clock::now();
+    std::vector<FTPProtocol::ChunkRef> chunks = Chunker::split(data, fileSize);
+    std::vector<uint32_t> missing;
+    uint64_t sentBytes = 0;
+    uint32_t sequenceNumber = 0;
+    bool ok = chunks.size() <= FTPProtocol::MAX_CHUNK_REFS &&
+              FTPProtocol::sendEncryptedMessage(ssh_.getSocketFd(), static_cast<uint8_t>(FTPProtocol::FTPMessageType::DEDUPE_START), FTPProtocol::createDedupeStartMessage(filename, fileSize, chunks), sequenceNumber++, *sendCrypto_);
+    
+    FTPProtocol::FTPHeader header;
+    std::vector<uint8_t> payload;
+    bool received = ok && FTPProtocol::receiveEncryptedMessage(ssh_.reader(), header, payload, *recvCrypto_);
+    auto type = static_cast<FTPProtocol::FTPMessageType>(header.messageType);
+    if (received && type == FTPProtocol::FTPMessageType::DEDUPE_UNSUPPORTED) {
+        // the server keeps no chunk store, stop asking for the rest of this connection
+        std::cout << "Server does not deduplicate, sending files whole" << std::endl;
+        dedupe_ = false;
+        ok = false;
+    } else if (ok && (!received || type != FTPProtocol::FTPMessageType::DEDUPE_START || !FTPProtocol::parseMissingChunksReply(payload, chunks.size(), missing))) {
+        // too many channels, a name it refuses, ... --> only this file goes whole
+        std::cerr << "Server refused " << filename << " deduplicated, sending it whole" << std::endl;
+        ok = false;
+    }
+    
+    // the chunks the server is missing, then FILE_END to have it write the manifest
+    std::vector<uint64_t> offsets;
+    if (ok) {
+        uint64_t position = 0;
+        for (const auto& chunk : chunks) {
+            offsets.push_back(position);
+            position += chunk.length;
+        }
+    }
+    for (size_t i = 0; ok && i < missing.size(); i++) {
+        const FTPProtocol::ChunkRef& chunk = chunks[missing[i]];
+        ok = FTPProtocol::sendEncryptedMessage(ssh_.getSocketFd(), static_cast<uint8_t>(FTPProtocol::FTPMessageType::CHUNK_DATA),
+                                               FTPProtocol::createChunkDataMessage(missing[i], data + offsets[missing[i]], chunk.length), sequenceNumber++, *sendCrypto_);
+        sentBytes += chunk.length;
+    }
+    munmap(map, fileSize);
+    if (!ok) {
+        return false;
+    }
+    
+    if (!FTPProtocol::sendEncryptedMessage(ssh_.getSocketFd(), static_cast<uint8_t>(FTPProtocol::FTPMessageType::FILE_END), {}, sequenceNumber, *sendCrypto_) ||
+        !FTPProtocol::receiveEncryptedMessage(ssh_.reader(), header, payload, *recvCrypto_) ||
+        static_cast<FTPProtocol::FTPMessageType>(header.messageType) != FTPProtocol::FTPMessageType::FILE_END) {
+        std::cerr << "Server could not store " << filename << " deduplicated, sending it whole" << std::endl;
+        return false;
+    }
+    
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "File sent deduplicated! " << missing.size() << " of " << chunks.size() << " chunks were new, "
+              << sentBytes << " of " << fileSize << " bytes sent in " << seconds << " s" << std::endl;
+    return true;
+}
+
+bool FileTransferClient::sendRange(FTPProtocol::FTPMessageType startType, const std::vector<uint8_t>& startPayload, const std::string& filePath, uint64_t offset, uint64_t length, bool showProgress) {
+    std::ifstream file(filePath, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Failed to open file: " << filePath << std::endl;
+        return false;
+    }
+    file.seekg(offset, std::ios::beg);
+    
     uint32_t sequenceNumber = 0;
     
-    // send FILE_START
-    auto fileStartPayload = FTPProtocol::createFileStartMessage(filename, fileSize);
-    if (!FTPProtocol::sendEncryptedMessage(ssh_.getSocketFd(), static_cast<uint8_t>(FTPProtocol::FTPMessageType::FILE_START), fileStartPayload, sequenceNumber, *sendCrypto_)) {
+    // FILE_START or UPLOAD_PART, both are answered with the agreed chunk size
+    if (!FTPProtocol::sendEncryptedMessage(ssh_.getSocketFd(), static_cast<uint8_t>(startType), startPayload, sequenceNumber, *sendCrypto_)) {
         std::cerr << "Failed to send file start message" << std::endl;
         return false;
     }
@@ -105,82 +454,686 @@ bool FileTransferClient::sendFile(const std::string& filePath) {
     // wait for server FILE_START
     FTPProtocol::FTPHeader header;
     std::vector<uint8_t> payload;
-    std::cout << "Waiting for server response..." << std::endl;
-    if (!FTPProtocol::receiveEncryptedMessage(ssh_.getSocketFd(), header, payload, *recvCrypto_)) {
+    if (showProgress) {
+        std::cout << "Waiting for server response..." << std::endl;
+    }
+    if (!FTPProtocol::receiveEncryptedMessage(ssh_.reader(), header, payload, *recvCrypto_)) {
         std::cerr << "Failed to receive server response" << std::endl;
         return false;
     }
     
-    if (static_cast<FTPProtocol::FTPMessageType>(header.messageType) != FTPProtocol::FTPMessageType::FILE_START) {
+    if (static_cast<FTPProtocol::FTPMessageType>(header.messageType) == FTPProtocol::FTPMessageType::FILE_PRESENT) {
+        std::cout << "Server already has this file, nothing to send" << std::endl;
+        return true;
+    }
+    if (static_cast<FTPProtocol::FTPMessageType>(header.messageType) != startType) {
         std::cerr << "Server rejected file transfer" << std::endl;
         return false;
     }
     
+    uint32_t agreedChunkSize;
+    uint64_t resumeOffset;
+    uint64_t resumeDigest;
+    if (!FTPProtocol::parseFileStartReply(payload, agreedChunkSize, resumeOffset, resumeDigest)) {
+        std::cerr << "Server sent an invalid chunk size" << std::endl;
+        return false;
+    }
+    ChunkSizer sizer(chunkSize_ != 0 ? agreedChunkSize : 0, agreedChunkSize);
+    
+    // the server kept the start of this file from an earlier try, skip it if it is really ours
+    if (resumeOffset > 0) {
+        if (resumeOffset > length || !prefixMatches(file, offset, resumeOffset, resumeDigest)) {
+            std::cout << "Partial upload on the server does not match this file, starting over" << std::endl;
+            FTPProtocol::sendEncryptedMessage(ssh_.getSocketFd(), static_cast<uint8_t>(FTPProtocol::FTPMessageType::FILE_ERROR), {}, sequenceNumber, *sendCrypto_);
+            return sendRange(startType, startPayload, filePath, offset, length, showProgress);
+        }
+        std::cout << "Resuming upload at " << resumeOffset << " of " << length << " bytes" << std::endl;
+        file.seekg(offset + resumeOffset, std::ios::beg);
+    }
+    
     // send file data in chunks if too large
-    std::vector<uint8_t> buffer(FTPProtocol::MAX_CHUNK_SIZE);
+    std::vector<uint8_t> buffer(agreedChunkSize);
     uint32_t chunkNumber = 0;
-    size_t totalSent = 0;
+    uint64_t totalSent = resumeOffset;
+    SendBatch batch; // chunks are sent a batch at a time, one sendmsg each
+    uint32_t nextChunk = 0;       // every chunk below this is acked
+    uint32_t selectiveChunks = 0; // acked past a gap, still counted out of the window
     
-    // loop through all the bytes in the file
-    while (totalSent < fileSize) {
-        // read max number bytes into buffer
-        file.read((char*)buffer.data(), buffer.size());
+    // loop through all the bytes in the range
+    while (totalSent < length) {
+        // window full --> push out what is queued and wait for the server to catch up
+        // big chunks shrink the window so the bytes in flight stay bounded
+        uint32_t window = std::max<uint32_t>(2, std::min<uint32_t>(windowChunks_, MAX_IN_FLIGHT_BYTES / sizer.size()));
+        while (chunkNumber - nextChunk - selectiveChunks >= window) {
+            if (!batch.flush(ssh_.getSocketFd())) {
+                std::cerr << "Failed to send file data chunk " << chunkNumber << std::endl;
+                return false;
+            }
+            if (!receiveAcks(nextChunk, selectiveChunks, true)) {
+                return false;
+            }
+        }
+        
+        // read max number bytes into buffer, a part stops at the end of its range
+        file.read((char*)buffer.data(), std::min<uint64_t>(sizer.size(), length - totalSent));
         size_t bytesRead = file.gcount();
         
         if (bytesRead == 0) {
             break;
         }
         
-        // resize buffer to read bytes
-        std::vector<uint8_t> chunkData(buffer.begin(), buffer.begin() + bytesRead);
-        
-        // create and send FileMEssage struct
-        auto fileDataPayload = FTPProtocol::createFileDataMessage(chunkNumber, chunkData);
-        if (!FTPProtocol::sendEncryptedMessage(ssh_.getSocketFd(), static_cast<uint8_t>(FTPProtocol::FTPMessageType::FILE_DATA), fileDataPayload, sequenceNumber, *sendCrypto_)) {
-            std::cerr << "Failed to send file data chunk " << chunkNumber << std::endl;
+        // FILE_DATA is built in the batch, it leaves with the rest of it
+        if (!FTPProtocol::queueEncryptedFileData(batch, chunkNumber, totalSent, buffer.data(), bytesRead, sequenceNumber, *sendCrypto_)) {
+            std::cerr << "Failed to encrypt file data chunk " << chunkNumber << std::endl;
             return false;
         }
         sequenceNumber++;
+        ssh_.tuner().maybeSample();
+        sizer.record(bytesRead);
+        if (batch.pendingBytes() >= SEND_BATCH_BYTES) {
+            if (!batch.flush(ssh_.getSocketFd())) {
+                std::cerr << "Failed to send file data chunk " << chunkNumber << std::endl;
+                return false;
+            }
+            // take whatever acks already arrived so they never pile up
+            if (!receiveAcks(nextChunk, selectiveChunks, false)) {
+                return false;
+            }
+        }
         
         // update progress
         totalSent += bytesRead;
         chunkNumber++;
         
         // logging
-        if (fileSize > 0) {
-            int progress = (totalSent * 100) / fileSize;
-            std::cout << "\rProgress: " << progress << "% (" << totalSent << "/" << fileSize << " bytes)" << std::flush;
+        if (showProgress && length > 0) {
+            int progress = (totalSent * 100) / length;
+            std::cout << "\rProgress: " << progress << "% (" << totalSent << "/" << length << " bytes)" << std::flush;
         }
     }
     
-    std::cout << std::endl;
+    if (showProgress) {
+        std::cout << std::endl;
+    }
     
-    // send FILE_END
+    // send FILE_END together with whatever chunks are still queued
     auto fileEndPayload = FTPProtocol::createFileEndMessage();
-    if (!FTPProtocol::sendEncryptedMessage(ssh_.getSocketFd(), static_cast<uint8_t>(FTPProtocol::FTPMessageType::FILE_END), fileEndPayload, sequenceNumber, *sendCrypto_)) {
+    if (!FTPProtocol::queueEncryptedMessage(batch, static_cast<uint8_t>(FTPProtocol::FTPMessageType::FILE_END), fileEndPayload, sequenceNumber, *sendCrypto_) ||
+        !batch.flush(ssh_.getSocketFd())) {
         std::cerr << "Failed to send file end message" << std::endl;
         return false;
     }
     sequenceNumber++;
     
-    // wait for server responce
-    if (!FTPProtocol::receiveEncryptedMessage(ssh_.getSocketFd(), header, payload, *recvCrypto_)) {
-        std::cerr << "Failed to receive final server response" << std::endl;
+    // wait for server responce, acks still in flight come first
+    do {
+        if (!FTPProtocol::receiveEncryptedMessage(ssh_.reader(), header, payload, *recvCrypto_)) {
+            std::cerr << "Failed to receive final server response" << std::endl;
+            return false;
+        }
+    } while (static_cast<FTPProtocol::FTPMessageType>(header.messageType) == FTPProtocol::FTPMessageType::FILE_ACK);
+    
+    if (showProgress) {
+        std::cout << "Socket: " << ssh_.tuner().summary() << std::endl;
+        std::cout << "Chunk size: " << sizer.size() << " bytes (" << (chunkSize_ != 0 ? "fixed" : "adaptive") << ", up to " << agreedChunkSize << ")" << std::endl;
+    }
+    
+    if (static_cast<FTPProtocol::FTPMessageType>(header.messageType) != FTPProtocol::FTPMessageType::FILE_END) {
+        std::cerr << "Server reported error during file transfer, message type " << (int)header.messageType << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool FileTransferClient::getFile(const std::string& filename, const std::string& localPath) {
+    // a FILE_GET for no bytes at all only brings back the size, the destination is laid out before any data arrives
+    if (!FTPProtocol::sendEncryptedMessage(ssh_.getSocketFd(), static_cast<uint8_t>(FTPProtocol::FTPMessageType::FILE_GET), FTPProtocol::createFileGetMessage(filename, 0, 0, DOWNLOAD_CHUNK_SIZE), 0, *sendCrypto_)) {
+        std::cerr << "Failed to send file get message" << std::endl;
+        return false;
+    }
+    
+    FTPProtocol::FTPHeader header;
+    std::vector<uint8_t> payload;
+    uint64_t fileSize;
+    uint64_t offset;
+    uint64_t length;
+    uint32_t chunkSize;
+    if (!FTPProtocol::receiveEncryptedMessage(ssh_.reader(), header, payload, *recvCrypto_)) {
+        std::cerr << "Failed to receive server response" << std::endl;
+        return false;
+    }
+    if (static_cast<FTPProtocol::FTPMessageType>(header.messageType) != FTPProtocol::FTPMessageType::FILE_GET ||
+        !FTPProtocol::parseFileGetReply(payload, fileSize, offset, length, chunkSize)) {
+        std::cerr << "Server has no file named " << filename << std::endl;
+        return false;
+    }
+    // the empty range is over as soon as it starts
+    if (!FTPProtocol::receiveEncryptedMessage(ssh_.reader(), header, payload, *recvCrypto_)) {
+        std::cerr << "Failed to receive server response" << std::endl;
         return false;
     }
     
-    std::cout << "Received final server response: message type " << (int)header.messageType << std::endl;
+    std::cout << "Receiving file: " << filename << " (" << fileSize << " bytes)" << std::endl;
     
-    // syncronization is hard accept any mesage
-    if (static_cast<FTPProtocol::FTPMessageType>(header.messageType) == FTPProtocol::FTPMessageType::FILE_DATA ||
-        static_cast<FTPProtocol::FTPMessageType>(header.messageType) == FTPProtocol::FTPMessageType::FILE_START ||
-        static_cast<FTPProtocol::FTPMessageType>(header.messageType) == FTPProtocol::FTPMessageType::FILE_END) {
-        std::cout << "File sent successfully!" << std::endl;
-        return true;
+    // preallocated so every range can be written in place, in any order
+    int fileFd = ::open(localPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fileFd < 0) {
+        std::cerr << "Failed to create file: " << localPath << std::endl;
+        return false;
+    }
+    // sparse only where the filesystem has no fallocate, a full disk should fail here and not halfway through
+    int err = fileSize > 0 ? posix_fallocate(fileFd, 0, fileSize) : 0;
+    if ((err == EOPNOTSUPP || err == EINVAL) && ftruncate(fileFd, fileSize) == 0) {
+        err = 0;
+    }
+    if (err != 0) {
+        std::cerr << "Failed to allocate " << fileSize << " bytes for " << localPath << ": " << strerror(err) << std::endl;
+        ::close(fileFd);
+        unlink(localPath.c_str());
+        return false;
+    }
+    
+    auto start = std::chrono::steady_clock::now();
+    uint32_t parts = std::min<uint64_t>(streams_, fileSize / MIN_PART_BYTES);
+    bool ok = true;
+    if (parts > 1) {
+        // same as a striped upload, every extra range gets its own login
+        std::vector<std::unique_ptr<FileTransferClient>> extra;
+        for (uint32_t i = 1; i < parts && ok; i++) {
+            auto client = std::make_unique<FileTransferClient>(hostname_, port_);
+            client->setChunkSize(chunkSize_);
+            client->setCipher(cipher_);
+            ok = client->connect() && client->authenticate(username_, password_);
+            if (!ok) {
+                std::cerr << "Failed to open connection " << i + 1 << " of " << parts << std::endl;
+            }
+            extra.push_back(std::move(client));
+        }
+        
+        uint64_t partSize = (fileSize + parts - 1) / parts;
+        std::vector<std::thread> threads;
+        std::vector<char> partOk(parts, 0);
+        for (uint32_t i = 0; i < parts && ok; i++) {
+            FileTransferClient* client = i == 0 ? this : extra[i - 1].get();
+            uint64_t partOffset = i * partSize;
+            uint64_t partLength = std::min(partSize, fileSize - partOffset);
+            threads.emplace_back([&, client, i, partOffset, partLength]() {
+                partOk[i] = client->receiveRange(filename, fileFd, partOffset, partLength, false);
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        for (auto& client : extra) {
+            client->disconnect();
+        }
+        ok = ok && std::count(partOk.begin(), partOk.end(), 0) == 0;
     } else {
-        std::cerr << "Server reported error during file transfer" << std::endl;
+        ok = receiveRange(filename, fileFd, 0, fileSize, true);
+    }
+    
+    ::close(fileFd);
+    if (!ok) {
+        std::cerr << "Download failed, removing " << localPath << std::endl;
+        unlink(localPath.c_str());
+        return false;
+    }
+    
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "File received successfully! " << fileSize << " bytes over " << std::max<uint32_t>(parts, 1) << " connection(s) in " << seconds << " s" << std::endl;
+    return true;
+}
+
+bool FileTransferClient::receiveRange(const std::string& filename, int fileFd, uint64_t offset, uint64_t length, bool showProgress) {
+    uint32_t sequenceNumber = 0;
+    uint32_t requestedChunkSize = chunkSize_ != 0 ? chunkSize_ : DOWNLOAD_CHUNK_SIZE;
+    if (!FTPProtocol::sendEncryptedMessage(ssh_.getSocketFd(), static_cast<uint8_t>(FTPProtocol::FTPMessageType::FILE_GET), FTPProtocol::createFileGetMessage(filename, offset, length, requestedChunkSize), sequenceNumber, *sendCrypto_)) {
+        std::cerr << "Failed to send file get message" << std::endl;
+        return false;
+    }
+    sequenceNumber++;
+    
+    FTPProtocol::FTPHeader header;
+    std::vector<uint8_t> payload;
+    uint64_t fileSize;
+    uint64_t sentOffset;
+    uint64_t sentLength;
+    uint32_t chunkSize;
+    if (!FTPProtocol::receiveEncryptedMessage(ssh_.reader(), header, payload, *recvCrypto_)) {
+        std::cerr << "Failed to receive server response" << std::endl;
+        return false;
+    }
+    if (static_cast<FTPProtocol::FTPMessageType>(header.messageType) != FTPProtocol::FTPMessageType::FILE_GET ||
+        !FTPProtocol::parseFileGetReply(payload, fileSize, sentOffset, sentLength, chunkSize)) {
+        std::cerr << "Server refused to send " << filename << std::endl;
+        return false;
+    }
+    if (sentOffset != offset || sentLength != length) {
+        // the file was replaced since its size was asked for
+        std::cerr << "File changed on the server while downloading " << filename << std::endl;
+        FTPProtocol::sendEncryptedMessage(ssh_.getSocketFd(), static_cast<uint8_t>(FTPProtocol::FTPMessageType::FILE_ERROR), {}, sequenceNumber, *sendCrypto_);
+        return false;
+    }
+    
+    // chunks arrive in order, the server sends more each time they are acked
+    uint64_t received = 0;
+    uint32_t nextChunk = 0;
+    uint64_t bytesSinceAck = 0;
+    while (true) {
+        if (!FTPProtocol::receiveEncryptedMessage(ssh_.reader(), header, payload, *recvCrypto_)) {
+            std::cerr << "Failed to receive file data" << std::endl;
+            return false;
+        }
+        auto type = static_cast<FTPProtocol::FTPMessageType>(header.messageType);
+        if (type == FTPProtocol::FTPMessageType::FILE_END) {
+            break;
+        }
+        
+        uint32_t chunkNumber;
+        uint64_t chunkOffset;
+        const uint8_t* chunkData;
+        uint32_t chunkLength;
+        if (type != FTPProtocol::FTPMessageType::FILE_DATA ||
+            !FTPProtocol::parseFileDataMessage(payload, chunkNumber, chunkOffset, chunkData, chunkLength) ||
+            chunkNumber != nextChunk || chunkOffset > length || chunkLength > length - chunkOffset) {
+            std::cerr << "Server sent an invalid chunk, message type " << (int)header.messageType << std::endl;
+            return false;
+        }
+        if (!writeAt(fileFd, chunkData, chunkLength, offset + chunkOffset)) {
+            std::cerr << "Failed to write chunk " << chunkNumber << std::endl;
+            return false;
+        }
+        received += chunkLength;
+        bytesSinceAck += chunkLength;
+        nextChunk++;
+        
+        // nothing left to ask for once the last chunk is in
+        if (bytesSinceAck >= DOWNLOAD_ACK_BYTES && received < length) {
+            if (!FTPProtocol::sendEncryptedMessage(ssh_.getSocketFd(), static_cast<uint8_t>(FTPProtocol::FTPMessageType::FILE_ACK), FTPProtocol::createFileAckMessage(nextChunk), sequenceNumber, *sendCrypto_)) {
+                std::cerr << "Failed to send ack" << std::endl;
+                return false;
+            }
+            sequenceNumber++;
+            bytesSinceAck = 0;
+        }
+        
+        if (showProgress && length > 0) {
+            int progress = (received * 100) / length;
+            std::cout << "\rProgress: " << progress << "% (" << received << "/" << length << " bytes)" << std::flush;
+        }
+    }
+    
+    if (showProgress) {
+        std::cout << std::endl;
+    }
+    if (received != length) {
+        std::cerr << "Download ended after " << received << " of " << length << " bytes" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+size_t FileTransferClient::sendFiles(const std::vector<std::string>& allPaths) {
+    // small files cost a round trip each on their own, they go out packed together first
+    std::vector<std::string> smallPaths;
+    std::vector<std::string> filePaths;
+    for (const auto& path : allPaths) {
+        std::error_code ec;
+        uint64_t size = std::filesystem::file_size(path, ec);
+        (!ec && size <= BATCH_FILE_BYTES ? smallPaths : filePaths).push_back(path);
+    }
+    size_t succeeded = smallPaths.empty() ? 0 : sendBatched(smallPaths);
+    if (filePaths.empty()) {
+        return succeeded;
+    }
+    
+    // with a chunk store on the server most of a file may already be there, those go one at a time first
+    if (dedupe_ && channels_ > 1) {
+        std::vector<std::string> remaining;
+        for (const auto& path : filePaths) {
+            std::error_code ec;
+            uint64_t size = std::filesystem::file_size(path, ec);
+            if (!ec && dedupe_) {
+                std::cout << "\nUploading: " << path << std::endl;
+                if (sendDeduped(path, std::filesystem::path(path).filename().string(), size)) {
+                    succeeded++;
+                    continue;
+                }
+            }
+            remaining.push_back(path);
+        }
+        filePaths.swap(remaining);
+        if (filePaths.empty()) {
+            return succeeded;
+        }
+    }
+    size_t beforeChannels = succeeded;
+
+    // one channel is the old way, a file at a time
+    if (channels_ <= 1) {
+        for (const auto& path : filePaths) {
+            std::cout << "\nUploading: " << path << std::endl;
+            if (sendFile(path)) {
+                succeeded++;
+            }
+        }
+        return succeeded;
+    }
+
+    // channel id is the slot index + 1, 0 stays with sendFile
+    std::vector<std::unique_ptr<OutgoingFile>> slots(channels_);
+    size_t nextFile = 0;
+    size_t active = 0;
+    uint32_t sequenceNumber = 0;
+    uint32_t requestedChunkSize = chunkSize_ != 0 ? chunkSize_ : CHANNEL_CHUNK_SIZE;
+    std::vector<uint8_t> buffer;
+    SendBatch batch;
+    auto start = std::chrono::steady_clock::now();
+    uint64_t totalBytes = 0;
+
+    auto finish = [&](size_t slot, bool ok) {
+        std::cout << (ok ? "Sent: " : "Failed: ") << slots[slot]->path << std::endl;
+        if (ok) {
+            succeeded++;
+            totalBytes += slots[slot]->size;
+        }
+        slots[slot].reset();
+        active--;
+    };
+
+    // replies come back tagged with the channel they belong to
+    auto handle = [&](const FTPProtocol::FTPHeader& header, const std::vector<uint8_t>& payload) {
+        if (header.channelId == 0 || header.channelId > slots.size() || !slots[header.channelId - 1]) {
+            std::cerr << "Message for unknown channel " << header.channelId << std::endl;
+            return false;
+        }
+        size_t slot = header.channelId - 1;
+        OutgoingFile& out = *slots[slot];
+        auto type = static_cast<FTPProtocol::FTPMessageType>(header.messageType);
+
+        if (out.state == OutgoingFile::State::STARTING) {
+            if (type == FTPProtocol::FTPMessageType::FILE_PRESENT) {
+                // nothing of it was sent, it does not count towards the bytes per second
+                std::cout << "Already on the server: " << out.path << std::endl;
+                succeeded++;
+                slots[slot].reset();
+                active--;
+                return true;
+            }
+            if (type != FTPProtocol::FTPMessageType::FILE_START || !FTPProtocol::parseFileStartReply(payload, out.chunkSize)) {
+                std::cerr << "Server rejected file transfer: " << out.path << std::endl;
+                finish(slot, false);
+                return true;
+            }
+            out.state = OutgoingFile::State::SENDING;
+            buffer.resize(std::max<size_t>(buffer.size(), out.chunkSize));
+        } else if (type == FTPProtocol::FTPMessageType::FILE_ACK) {
+            return applyAck(payload, out.nextChunk, out.selectiveChunks);
+        } else {
+            bool ok = out.state == OutgoingFile::State::ENDING && type == FTPProtocol::FTPMessageType::FILE_END;
+            if (!ok) {
+                std::cerr << "Server reported error during file transfer, message type " << (int)header.messageType << std::endl;
+            }
+            finish(slot, ok);
+        }
+        return true;
+    };
+
+    while (nextFile < filePaths.size() || active > 0) {
+        // every free channel starts the next file right away, no round trip between files
+        for (size_t slot = 0; slot < slots.size() && nextFile < filePaths.size(); slot++) {
+            if (slots[slot]) {
+                continue;
+            }
+            auto out = std::make_unique<OutgoingFile>();
+            out->path = filePaths[nextFile++];
+            out->file.open(out->path, std::ios::binary | std::ios::ate);
+            if (!out->file.is_open()) {
+                std::cerr << "Failed to open file: " << out->path << std::endl;
+                continue;
+            }
+            out->size = out->file.tellg();
+            out->file.seekg(0, std::ios::beg);
+
+            std::string filename = std::filesystem::path(out->path).filename().string();
+            auto fileStartPayload = FTPProtocol::createFileStartMessage(filename, out->size, requestedChunkSize);
+            if (hashFirst_ && out->size >= HASH_FIRST_MIN_BYTES) {
+                FTPProtocol::appendContentHash(fileStartPayload, contentHash(out->path, out->size));
+            }
+            if (!FTPProtocol::queueEncryptedMessage(batch, static_cast<uint8_t>(FTPProtocol::FTPMessageType::FILE_START), fileStartPayload, sequenceNumber++, *sendCrypto_, slot + 1)) {
+                std::cerr << "Failed to encrypt file start for " << out->path << std::endl;
+                return succeeded;
+            }
+            slots[slot] = std::move(out);
+            active++;
+        }
+
+        // one chunk per channel per round so a big file never starves the small ones
+        bool progressed = false;
+        for (size_t slot = 0; slot < slots.size(); slot++) {
+            OutgoingFile* out = slots[slot].get();
+            if (!out || out->state != OutgoingFile::State::SENDING) {
+                continue;
+            }
+
+            if (out->sent == out->size) {
+                if (!FTPProtocol::queueEncryptedMessage(batch, static_cast<uint8_t>(FTPProtocol::FTPMessageType::FILE_END), FTPProtocol::createFileEndMessage(), sequenceNumber++, *sendCrypto_, slot + 1)) {
+                    std::cerr << "Failed to encrypt file end for " << out->path << std::endl;
+                    return succeeded;
+                }
+                out->state = OutgoingFile::State::ENDING;
+                progressed = true;
+                continue;
+            }
+
+            // the in flight limit is shared by every channel
+            uint32_t window = std::max<uint32_t>(2, std::min<uint32_t>(windowChunks_, MAX_IN_FLIGHT_BYTES / channels_ / out->chunkSize));
+            if (out->chunkNumber - out->nextChunk - out->selectiveChunks >= window) {
+                continue;
+            }
+
+            out->file.read((char*)buffer.data(), std::min<uint64_t>(out->chunkSize, out->size - out->sent));
+            size_t bytesRead = out->file.gcount();
+            if (bytesRead == 0) {
+                // the file got shorter under us, the server will never see all of it
+                std::cerr << "Failed to read file: " << out->path << std::endl;
+                return succeeded;
+            }
+            if (!FTPProtocol::queueEncryptedFileData(batch, out->chunkNumber, out->sent, buffer.data(), bytesRead, sequenceNumber++, *sendCrypto_, slot + 1)) {
+                std::cerr << "Failed to encrypt file data: " << out->path << std::endl;
+                return succeeded;
+            }
+            out->sent += bytesRead;
+            out->chunkNumber++;
+            progressed = true;
+        }
+        ssh_.tuner().maybeSample();
+
+        // nothing could move --> everything waits on the server, send what is queued and block for a reply
+        if (batch.pendingBytes() >= SEND_BATCH_BYTES || !progressed) {
+            if (!batch.flush(ssh_.getSocketFd())) {
+                std::cerr << "Failed to send file data" << std::endl;
+                return succeeded;
+            }
+        }
+
+        bool wait = !progressed;
+        while (active > 0) {
+            if (!wait && ssh_.reader().available() == 0) {
+                struct pollfd pfd = {ssh_.getSocketFd(), POLLIN, 0};
+                if (poll(&pfd, 1, 0) <= 0) {
+                    break;
+                }
+            }
+            wait = false;
+
+            FTPProtocol::FTPHeader header;
+            std::vector<uint8_t> payload;
+            if (!FTPProtocol::receiveEncryptedMessage(ssh_.reader(), header, payload, *recvCrypto_)) {
+                std::cerr << "Failed to receive server response" << std::endl;
+                return succeeded;
+            }
+            if (!handle(header, payload)) {
+                return succeeded;
+            }
+        }
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Sent " << succeeded - beforeChannels << " files (" << totalBytes << " bytes) over " << channels_ << " channels in " << seconds << " s" << std::endl;
+    std::cout << "Socket: " << ssh_.tuner().summary() << std::endl;
+    return succeeded;
+}
+
+size_t FileTransferClient::sendBatched(const std::vector<std::string>& filePaths) {
+    size_t succeeded = 0;
+    size_t batches = 0;
+    uint32_t sequenceNumber = 0;
+    std::vector<uint8_t> batch = FTPProtocol::createFileBatchMessage();
+    std::vector<std::string> batchPaths;
+    std::deque<std::vector<std::string>> inFlight; // paths of every batch not answered yet, oldest first
+    std::vector<uint8_t> data;
+    auto start = std::chrono::steady_clock::now();
+
+    // replies come back in the order the batches went out
+    auto receiveReply = [&]() {
+        FTPProtocol::FTPHeader header;
+        std::vector<uint8_t> payload;
+        if (!FTPProtocol::receiveEncryptedMessage(ssh_.reader(), header, payload, *recvCrypto_)) {
+            std::cerr << "Failed to receive server response" << std::endl;
+            return false;
+        }
+        std::vector<std::string> paths = std::move(inFlight.front());
+        inFlight.pop_front();
+
+        uint32_t fileCount;
+        std::vector<uint32_t> failed;
+        if (static_cast<FTPProtocol::FTPMessageType>(header.messageType) != FTPProtocol::FTPMessageType::FILE_BATCH ||
+            !FTPProtocol::parseFileBatchReply(payload, fileCount, failed) || fileCount != paths.size()) {
+            std::cerr << "Server rejected a batch of " << paths.size() << " files" << std::endl;
+            return true;
+        }
+        for (uint32_t index : failed) {
+            if (index < paths.size()) {
+                std::cerr << "Failed: " << paths[index] << std::endl;
+            }
+        }
+        succeeded += paths.size() - failed.size();
+        return true;
+    };
+
+    auto sendBatch = [&]() {
+        if (!FTPProtocol::sendEncryptedMessage(ssh_.getSocketFd(), static_cast<uint8_t>(FTPProtocol::FTPMessageType::FILE_BATCH), batch, sequenceNumber++, *sendCrypto_)) {
+            std::cerr << "Failed to send file batch" << std::endl;
+            return false;
+        }
+        batches++;
+        inFlight.push_back(std::move(batchPaths));
+        batchPaths.clear();
+        batch = FTPProtocol::createFileBatchMessage();
+        return inFlight.size() < BATCH_WINDOW || receiveReply();
+    };
+
+    for (const auto& path : filePaths) {
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (!file.is_open()) {
+            std::cerr << "Failed to open file: " << path << std::endl;
+            continue;
+        }
+        data.resize(file.tellg());
+        file.seekg(0, std::ios::beg);
+        if (!file.read((char*)data.data(), data.size())) {
+            std::cerr << "Failed to read file: " << path << std::endl;
+            continue;
+        }
+
+        std::string filename = std::filesystem::path(path).filename().string();
+        if (!batchPaths.empty() && (batch.size() + sizeof(FTPProtocol::FileBatchEntry) + filename.size() + data.size() > BATCH_BYTES ||
+                                    batchPaths.size() == FTPProtocol::MAX_BATCH_FILES)) {
+            if (!sendBatch()) {
+                return succeeded;
+            }
+        }
+        FTPProtocol::addToFileBatch(batch, filename, data.data(), data.size());
+        batchPaths.push_back(path);
+    }
+    if (!batchPaths.empty() && !sendBatch()) {
+        return succeeded;
+    }
+    while (!inFlight.empty()) {
+        if (!receiveReply()) {
+            return succeeded;
+        }
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Sent " << succeeded << " small files in " << batches << " batches in " << seconds << " s" << std::endl;
+    return succeeded;
+}
+
+bool FileTransferClient::prefixMatches(std::ifstream& file, uint64_t offset, uint64_t length, uint64_t digest) {
+    std::vector<uint8_t> buffer(1024 * 1024);
+    uint64_t ours = FTPProtocol::DIGEST_SEED;
+
+    file.seekg(offset, std::ios::beg);
+    while (length > 0) {
+        file.read((char*)buffer.data(), std::min<uint64_t>(length, buffer.size()));
+        size_t bytesRead = file.gcount();
+        if (bytesRead == 0) {
+            break;
+        }
+        ours = FTPProtocol::updateDigest(ours, buffer.data(), bytesRead);
+        length -= bytesRead;
+    }
+    file.clear();
+    return length == 0 && ours == digest;
+}
+
+bool FileTransferClient::applyAck(const std::vector<uint8_t>& payload, uint32_t& nextChunk, uint32_t& selectiveChunks) {
+    uint32_t acked;
+    std::vector<FTPProtocol::ChunkRange> ranges;
+    if (!FTPProtocol::parseFileAckMessage(payload, acked, ranges)) {
+        std::cerr << "Failed to parse ack" << std::endl;
         return false;
     }
+
+    // acks only move forward, the selective part is replaced by the newest one
+    nextChunk = std::max(nextChunk, acked);
+    selectiveChunks = 0;
+    for (const auto& range : ranges) {
+        if (range.first >= nextChunk) {
+            selectiveChunks += range.second - range.first + 1;
+        }
+    }
+    return true;
+}
+
+bool FileTransferClient::receiveAcks(uint32_t& nextChunk, uint32_t& selectiveChunks, bool wait) {
+    FTPProtocol::FTPHeader header;
+
+    while (true) {
+        // without wait only take what has already arrived
+        if (!wait && ssh_.reader().available() == 0) {
+            struct pollfd pfd = {ssh_.getSocketFd(), POLLIN, 0};
+            if (poll(&pfd, 1, 0) <= 0) {
+                return true;
+            }
+        }
+        wait = false;
+
+        if (!FTPProtocol::receiveEncryptedMessage(ssh_.reader(), header, ackPayload_, *recvCrypto_)) {
+            std::cerr << "Failed to receive ack" << std::endl;
+            return false;
+        }
+        if (static_cast<FTPProtocol::FTPMessageType>(header.messageType) != FTPProtocol::FTPMessageType::FILE_ACK) {
+            std::cerr << "Unexpected message during transfer: type " << (int)header.messageType << std::endl;
+            return false;
+        }
+
+        if (!applyAck(ackPayload_, nextChunk, selectiveChunks)) {
+            return false;
+        }
+    }
 }
 
 bool FileTransferClient::handleVersionExchange() {
@@ -190,6 +1143,12 @@ bool FileTransferClient::handleVersionExchange() {
         return false;
     }
     
+    // server at capacity answers with a busy line instead of its version
+    if (serverVersion.rfind("KimCloud_Busy", 0) == 0) {
+        std::cerr << "Server refused connection: " << serverVersion.substr(14);
+        return false;
+    }
+    
     std::cout << "Connected to server: " << serverVersion;
     
     return true;
@@ -199,20 +1158,18 @@ bool FileTransferClient::handleKexinitExchange() {
     std::cout << "\nPhase 1: Key Exchange Init" << std::endl;
     
     // send KEXINIT
-    std::vector<uint8_t> kexPayload = buildKexPayload();
+    std::vector<uint8_t> kexPayload = buildKexPayload(cipher_);
     std::vector<uint8_t> kexPacket = wrapPacket(kexPayload);
     send(ssh_.getSocketFd(), kexPacket.data(), kexPacket.size(), 0);
     std::cout << "Sent KEXINIT packet" << std::endl;
 
     // receive Server KEXINIT
-    uint8_t kexBuf[2048] = {0};
-    ssize_t kexLen = recv(ssh_.getSocketFd(), kexBuf, sizeof(kexBuf), 0);
-    if (kexLen <= 0) {
+    std::vector<uint8_t> serverKexReply;
+    if (!ssh_.reader().readFrame(serverKexReply, true, MAX_HANDSHAKE_PACKET_SIZE)) {
         std::cerr << "Failed to receive KEXINIT from server" << std::endl;
         return false;
     }
-    std::vector<uint8_t> serverKexReply(kexBuf, kexBuf + kexLen);
-    std::cout << "Received server KEXINIT (" << kexLen << " bytes)" << std::endl;
+    std::cout << "Received server KEXINIT (" << serverKexReply.size() << " bytes)" << std::endl;
 
     std::vector<uint8_t> serverKexInitPayload = unwrapPacket(serverKexReply);
     
@@ -226,13 +1183,12 @@ bool FileTransferClient::handleKexinitExchange() {
     std::cout << "Server Kex Info" << std::endl;
     printKexInformation(serverKexInfo);
     
-    KexMatch matchedKex;
-    if (!kexFirstMatch(matchedKex, serverKexInfo, clientKexInfo)) {
+    if (!kexFirstMatch(kex_, serverKexInfo, clientKexInfo)) {
         std::cout << "KexFirstMatch failed" << std::endl;
         return false;
     }
     std::cout << "===============================" << std::endl;
-    printMatchKex(matchedKex);
+    printMatchKex(kex_);
     
     return true;
 }
@@ -258,41 +1214,15 @@ bool FileTransferClient::handleKeyExchange() {
 
     std::cout << "Sent KEXDH_INIT" << std::endl;
 
-    // server response
-    uint8_t replyBuf[4096] = {0};
-    ssize_t replyLen = recv(ssh_.getSocketFd(), replyBuf, sizeof(replyBuf), 0);
-    if (replyLen <= 0) {
-        std::cerr << "Failed to receive server response" << std::endl;
-        return false;
-    }
-    
-    std::vector<uint8_t> serverResponse(replyBuf, replyBuf + replyLen);
-    
-    // parse to extract KEXDH_REPLY and NEWKEYS
+    // server response --> KEXDH_REPLY then NEWKEYS, read packet by packet so it does not matter how they arrive
     std::vector<uint8_t> kexdhReply, serverNewkeysPkt;
-    size_t offset = 0;
-    
-    while (offset < serverResponse.size()) {
-        if (offset + 4 > serverResponse.size()) {
-            std::cerr << "Incomplete packet at offset " << offset << std::endl;
+    for (int i = 0; i < 2; i++) {
+        std::vector<uint8_t> packet;
+        if (!ssh_.reader().readFrame(packet, true, MAX_HANDSHAKE_PACKET_SIZE)) {
+            std::cerr << "Failed to receive server response" << std::endl;
             return false;
         }
         
-        // read packet length from Big Endian
-        uint32_t packetLength = (serverResponse[offset] << 24) | 
-                               (serverResponse[offset + 1] << 16) | 
-                               (serverResponse[offset + 2] << 8) | 
-                               serverResponse[offset + 3];
-        
-        if (packetLength == 0 || offset + 4 + packetLength > serverResponse.size()) {
-            std::cerr << "Invalid packet length: " << packetLength << " at offset " << offset << std::endl;
-            return false;
-        }
-        
-        // copy the packet using length
-        std::vector<uint8_t> packet(serverResponse.begin() + offset, 
-                                   serverResponse.begin() + offset + 4 + packetLength);
-        
         // check for KEXDH_REPLY or NEWKEYS
         if (packet.size() > 5) {
             uint8_t messageType = packet[5];
@@ -305,8 +1235,6 @@ bool FileTransferClient::handleKeyExchange() {
                 serverNewkeysPkt = packet;
             }
         }
-        
-        offset += 4 + packetLength;
     }
     
     if (kexdhReply.empty()) {
@@ -338,8 +1266,12 @@ bool FileTransferClient::handleKeyExchange() {
     // get keys
     std::vector<uint8_t> sharedSecret_bytes = DH::uint64ToBytes(sharedSecret);
     
-    sendCrypto_ = new SimpleCrypto(sharedSecret, true);  // client_to_server
-    recvCrypto_ = new SimpleCrypto(sharedSecret, false); // server_to_client
+    sendCrypto_ = CipherRegistry::create(kex_.encryptionClientToServer, kex_.MACClientToServer, sharedSecret, true);  // client_to_server
+    recvCrypto_ = CipherRegistry::create(kex_.encryptionServerToClient, kex_.MACServerToClient, sharedSecret, false); // server_to_client
+    if (!sendCrypto_ || !recvCrypto_) {
+        return false;
+    }
+    std::cout << "Encryption: " << sendCrypto_->name() << " / " << recvCrypto_->name() << " (" << (uint64_t)sendCrypto_->measuredSpeed() << " MB/s here)" << std::endl;
 
     // NEWKEYS step
     std::cout << "\nPhase 3: NEWKEYS Exchange" << std::endl;
@@ -372,7 +1304,7 @@ bool FileTransferClient::handleAuthentication(const std::string& username, const
 
     // get responce
     bool auth_success;
-    if (!AuthProtocol::receiveAuthResponse(ssh_.getSocketFd(), auth_success)) {
+    if (!AuthProtocol::receiveAuthResponse(ssh_.reader(), auth_success)) {
         std::cerr << "Failed to receive authentication response" << std::endl;
         return false;
     }
@@ -1,5 +1,7 @@
 #include "../include/c_file_transfer_protocol.h"
-#include "c_simple_crypto.h"
+#include "c_cipher_registry.h"
+#include "c_frame_reader.h"
+#include "c_send_batch.h"
 #include <iostream>
 #include <cstring>
 #include <sys/socket.h>
@@ -8,52 +10,58 @@
 
 namespace FTPProtocol {
 
-    std::vector<uint8_t> serializeHeader(const FTPHeader& header) {
-        std::vector<uint8_t> data(sizeof(FTPHeader));
+    void serializeHeader(const FTPHeader& header, uint8_t* out) {
+        // channelId lives in the old padding, the header stays 12 bytes on the wire
+        static_assert(sizeof(FTPHeader) == 12);
         
         // convert to Big Endian network byte order
         uint32_t payloadLength = htonl(header.payloadLength);
         uint32_t sequenceNumber = htonl(header.sequenceNumber);
+        uint16_t channelId = htons(header.channelId);
         
-        // copy the data from the header to vector
-        data[0] = header.messageType;
-        memcpy(data.data() + 1, &payloadLength, sizeof(uint32_t));
-        memcpy(data.data() + 5, &sequenceNumber, sizeof(uint32_t));
-        
-        return data;
+        // copy the data from the header to out
+        out[0] = header.messageType;
+        memcpy(out + 1, &payloadLength, sizeof(uint32_t));
+        memcpy(out + 5, &sequenceNumber, sizeof(uint32_t));
+        memcpy(out + 9, &channelId, sizeof(uint16_t));
     }
 
-    bool deserializeHeader(const std::vector<uint8_t>& data, FTPHeader& header) {
+    bool deserializeHeader(std::span<const uint8_t> data, FTPHeader& header) {
         if (data.size() < sizeof(FTPHeader)) {
             return false;
         }
         
-        // copy data from vector to a FTPHeader
+        // copy data from the bytes to a FTPHeader
         header.messageType = data[0];
         memcpy(&header.payloadLength, data.data() + 1, sizeof(uint32_t));
         memcpy(&header.sequenceNumber, data.data() + 5, sizeof(uint32_t));
+        memcpy(&header.channelId, data.data() + 9, sizeof(uint16_t));
         
         // convert form Big Endian
         header.payloadLength = ntohl(header.payloadLength);
         header.sequenceNumber = ntohl(header.sequenceNumber);
+        header.channelId = ntohs(header.channelId);
         
         return true;
     }
 
-    std::vector<uint8_t> createFileStartMessage(const std::string& filename, uint64_t fileSize) {
-        FileStartMessage msg(filename.length(), fileSize, MAX_CHUNK_SIZE);
+    std::vector<uint8_t> createFileStartMessage(const std::string& filename, uint64_t fileSize, uint32_t chunkSize, uint64_t fileVersion) {
+        FileStartMessage msg(filename.length(), fileSize, chunkSize);
         
         // Big Endian
         uint32_t filenameLength = htonl(msg.filenameLength);
         uint64_t fileSizeNet = htobe64(msg.fileSize); 
-        uint32_t chunkSize = htonl(msg.chunkSize);
+        uint32_t chunkSizeNet = htonl(msg.chunkSize);
+        uint64_t fileVersionNet = htobe64(fileVersion);
         
         std::vector<uint8_t> data(sizeof(FileStartMessage) + filename.length());
         
         // copy header
         memcpy(data.data(), &filenameLength, sizeof(uint32_t));
         memcpy(data.data() + 4, &fileSizeNet, sizeof(uint64_t));
-        memcpy(data.data() + 12, &chunkSize, sizeof(uint32_t));
+        memcpy(data.data() + 12, &chunkSizeNet, sizeof(uint32_t));
+        static_assert(sizeof(FileStartMessage) >= FILE_VERSION_OFFSET + sizeof(uint64_t));
+        memcpy(data.data() + FILE_VERSION_OFFSET, &fileVersionNet, sizeof(uint64_t));
         
         // copy filename
         memcpy(data.data() + sizeof(FileStartMessage), filename.data(), filename.length());
@@ -61,136 +69,463 @@ namespace FTPProtocol {
         return data;
     }
 
-    std::vector<uint8_t> createFileDataMessage(uint32_t chunkNumber, const std::vector<uint8_t>& data) {
-        FileDataMessage msg(chunkNumber, data.size());
-        
+    void appendContentHash(std::vector<uint8_t>& startPayload, const std::vector<uint8_t>& hash) {
+        startPayload.insert(startPayload.end(), hash.begin(), hash.end());
+    }
+
+    bool parseFileStartReply(const std::vector<uint8_t>& data, uint32_t& chunkSize) {
+        // an empty reply is an older server that only knows the default
+        if (data.size() < sizeof(uint32_t)) {
+            chunkSize = DEFAULT_CHUNK_SIZE;
+            return true;
+        }
+
+        uint32_t chunkSizeNet;
+        memcpy(&chunkSizeNet, data.data(), sizeof(uint32_t));
+        chunkSize = ntohl(chunkSizeNet);
+        return chunkSize >= MIN_CHUNK_SIZE && chunkSize <= MAX_CHUNK_SIZE;
+    }
+
+    bool parseFileStartReply(const std::vector<uint8_t>& data, uint32_t& chunkSize, uint64_t& resumeOffset, uint64_t& digest) {
+        resumeOffset = 0;
+        digest = DIGEST_SEED;
+        if (!parseFileStartReply(data, chunkSize)) {
+            return false;
+        }
+
+        // older servers only send the chunk size and never resume
+        if (data.size() >= sizeof(uint32_t) + 2 * sizeof(uint64_t)) {
+            uint64_t resumeOffsetNet;
+            uint64_t digestNet;
+            memcpy(&resumeOffsetNet, data.data() + 4, sizeof(uint64_t));
+            memcpy(&digestNet, data.data() + 12, sizeof(uint64_t));
+            resumeOffset = be64toh(resumeOffsetNet);
+            digest = be64toh(digestNet);
+        }
+        return true;
+    }
+
+    uint64_t updateDigest(uint64_t digest, const uint8_t* data, size_t len) {
+        for (size_t i = 0; i < len; i++) {
+            digest ^= data[i];
+            digest *= 0x100000001b3ULL;
+        }
+        return digest;
+    }
+
+    std::vector<uint8_t> createUploadInitMessage(const std::string& filename, uint64_t fileSize, uint32_t partCount) {
+        // same bytes as FILE_START, the chunk size slot carries the part count
+        static_assert(sizeof(UploadInitMessage) == sizeof(FileStartMessage));
+        return createFileStartMessage(filename, fileSize, partCount);
+    }
+
+    std::vector<uint8_t> createUploadPartMessage(uint64_t uploadId, uint64_t offset, uint64_t length, uint32_t chunkSize) {
+        UploadPartMessage msg(uploadId, offset, length, chunkSize);
+
         // Big Endian
-        uint32_t chunkNumberNet = htonl(msg.chunkNumber);
-        uint32_t dataLengthNet = htonl(msg.dataLength);
-        
-        std::vector<uint8_t> result(sizeof(FileDataMessage) + data.size());
-        
-        // copy header
-        memcpy(result.data(), &chunkNumberNet, sizeof(uint32_t));
-        memcpy(result.data() + 4, &dataLengthNet, sizeof(uint32_t));
-        
-        // copy data
-        memcpy(result.data() + sizeof(FileDataMessage), data.data(), data.size());
-        
-        return result;
+        uint64_t uploadIdNet = htobe64(msg.uploadId);
+        uint64_t offsetNet = htobe64(msg.offset);
+        uint64_t lengthNet = htobe64(msg.length);
+        uint32_t chunkSizeNet = htonl(msg.chunkSize);
+
+        std::vector<uint8_t> data(sizeof(UploadPartMessage));
+        memcpy(data.data(), &uploadIdNet, sizeof(uint64_t));
+        memcpy(data.data() + 8, &offsetNet, sizeof(uint64_t));
+        memcpy(data.data() + 16, &lengthNet, sizeof(uint64_t));
+        memcpy(data.data() + 24, &chunkSizeNet, sizeof(uint32_t));
+
+        return data;
+    }
+
+    std::vector<uint8_t> createUploadIdMessage(uint64_t uploadId) {
+        std::vector<uint8_t> data(sizeof(uint64_t));
+        uint64_t uploadIdNet = htobe64(uploadId);
+        memcpy(data.data(), &uploadIdNet, sizeof(uint64_t));
+        return data;
+    }
+
+    bool parseUploadIdMessage(const std::vector<uint8_t>& data, uint64_t& uploadId) {
+        if (data.size() < sizeof(uint64_t)) {
+            return false;
+        }
+        uint64_t uploadIdNet;
+        memcpy(&uploadIdNet, data.data(), sizeof(uint64_t));
+        uploadId = be64toh(uploadIdNet);
+        return true;
     }
 
     std::vector<uint8_t> createFileEndMessage() {
         return std::vector<uint8_t>(); // empty message
     }
+
+    bool parseFileAckMessage(const std::vector<uint8_t>& data, uint32_t& nextChunk, std::vector<ChunkRange>& ranges) {
+        if (data.size() < sizeof(FileAckMessage)) {
+            return false;
+        }
+
+        uint32_t nextChunkNet;
+        uint32_t rangeCountNet;
+        memcpy(&nextChunkNet, data.data(), sizeof(uint32_t));
+        memcpy(&rangeCountNet, data.data() + 4, sizeof(uint32_t));
+
+        // convert from Big Endian
+        nextChunk = ntohl(nextChunkNet);
+        uint32_t rangeCount = ntohl(rangeCountNet);
+        if (rangeCount > MAX_ACK_RANGES || data.size() < sizeof(FileAckMessage) + rangeCount * 8) {
+            return false;
+        }
+
+        ranges.clear();
+        for (uint32_t i = 0; i < rangeCount; i++) {
+            uint32_t first;
+            uint32_t last;
+            memcpy(&first, data.data() + sizeof(FileAckMessage) + i * 8, sizeof(uint32_t));
+            memcpy(&last, data.data() + sizeof(FileAckMessage) + i * 8 + 4, sizeof(uint32_t));
+            ranges.emplace_back(ntohl(first), ntohl(last));
+        }
+
+        return true;
+    }
     
-    bool sendEncryptedMessage(int socket_fd, uint8_t messageType, const std::vector<uint8_t>& payload, uint32_t sequenceNumber, SimpleCrypto& crypto) {
-        FTPHeader header(messageType, payload.size(), sequenceNumber);
+    std::vector<uint8_t> createFileAckMessage(uint32_t nextChunk) {
+        // no selective ranges, the client writes chunks in the order they arrive
+        std::vector<uint8_t> data(sizeof(FileAckMessage), 0);
+        uint32_t nextChunkNet = htonl(nextChunk);
+        memcpy(data.data(), &nextChunkNet, sizeof(uint32_t));
+        return data;
+    }
 
-        std::vector<uint8_t> headerData = serializeHeader(header);
-        
-        // simple encryption of the header
-        std::vector<uint8_t> encryptedHeader = crypto.encryptPacket(headerData);
-        
-        // send encrypted header size
-        uint32_t headerSize = htonl(encryptedHeader.size());
-        ssize_t sent = send(socket_fd, &headerSize, sizeof(headerSize), 0);
-        if (sent != sizeof(headerSize)) {
+    std::vector<uint8_t> createFileGetMessage(const std::string& filename, uint64_t offset, uint64_t length, uint32_t chunkSize) {
+        FileGetMessage msg(offset, length, chunkSize, filename.length());
+
+        // Big Endian
+        uint64_t offsetNet = htobe64(msg.offset);
+        uint64_t lengthNet = htobe64(msg.length);
+        uint32_t chunkSizeNet = htonl(msg.chunkSize);
+        uint32_t filenameLengthNet = htonl(msg.filenameLength);
+
+        std::vector<uint8_t> data(sizeof(FileGetMessage) + filename.length());
+        memcpy(data.data(), &offsetNet, sizeof(uint64_t));
+        memcpy(data.data() + 8, &lengthNet, sizeof(uint64_t));
+        memcpy(data.data() + 16, &chunkSizeNet, sizeof(uint32_t));
+        memcpy(data.data() + 20, &filenameLengthNet, sizeof(uint32_t));
+        memcpy(data.data() + sizeof(FileGetMessage), filename.c_str(), filename.length());
+
+        return data;
+    }
+
+    bool parseFileGetReply(const std::vector<uint8_t>& data, uint64_t& fileSize, uint64_t& offset, uint64_t& length, uint32_t& chunkSize) {
+        if (data.size() < 3 * sizeof(uint64_t) + sizeof(uint32_t)) {
             return false;
         }
-        
-        // send encrypted header data
-        sent = send(socket_fd, encryptedHeader.data(), encryptedHeader.size(), 0);
-        if (sent != (ssize_t)encryptedHeader.size()) {
-            std::cerr << "Server: Failed to send encrypted header, sent " << sent << " bytes" << std::endl;
+
+        uint64_t fileSizeNet;
+        uint64_t offsetNet;
+        uint64_t lengthNet;
+        uint32_t chunkSizeNet;
+        memcpy(&fileSizeNet, data.data(), sizeof(uint64_t));
+        memcpy(&offsetNet, data.data() + 8, sizeof(uint64_t));
+        memcpy(&lengthNet, data.data() + 16, sizeof(uint64_t));
+        memcpy(&chunkSizeNet, data.data() + 24, sizeof(uint32_t));
+
+        // convert from Big Endian
+        fileSize = be64toh(fileSizeNet);
+        offset = be64toh(offsetNet);
+        length = be64toh(lengthNet);
+        chunkSize = ntohl(chunkSizeNet);
+        return chunkSize > 0 && offset <= fileSize && length <= fileSize - offset;
+    }
+
+    bool parseDeltaStartReply(const std::vector<uint8_t>& data, uint32_t& blockSize, uint32_t& blockCount) {
+        if (data.size() < 2 * sizeof(uint32_t)) {
             return false;
         }
-        
-        // send encrypted payload
-        if (!payload.empty()) {
-            std::vector<uint8_t> encryptedPayload = crypto.encryptPacket(payload);
-            
-            // payload size
-            uint32_t payloadSize = htonl(encryptedPayload.size());
-            sent = send(socket_fd, &payloadSize, sizeof(payloadSize), 0);
-            if (sent != sizeof(payloadSize)) {
-                return false;
-            }
-            
-            // encryped payload send
-            sent = send(socket_fd, encryptedPayload.data(), encryptedPayload.size(), 0);
-            if (sent != (ssize_t)encryptedPayload.size()) {
+        uint32_t blockSizeNet;
+        uint32_t blockCountNet;
+        memcpy(&blockSizeNet, data.data(), sizeof(uint32_t));
+        memcpy(&blockCountNet, data.data() + 4, sizeof(uint32_t));
+        blockSize = ntohl(blockSizeNet);
+        blockCount = ntohl(blockCountNet);
+        return blockSize > 0 || blockCount == 0;
+    }
+
+    bool parseDeltaSignaturesMessage(const std::vector<uint8_t>& data, std::vector<BlockSignature>& signatures) {
+        constexpr size_t SIGNATURE_SIZE = sizeof(uint32_t) + STRONG_HASH_SIZE;
+        if (data.size() < sizeof(uint32_t)) {
+            return false;
+        }
+        uint32_t countNet;
+        memcpy(&countNet, data.data(), sizeof(uint32_t));
+        uint32_t count = ntohl(countNet);
+        if (count > SIGNATURES_PER_MESSAGE || data.size() < sizeof(uint32_t) + count * SIGNATURE_SIZE) {
+            return false;
+        }
+
+        const uint8_t* p = data.data() + sizeof(uint32_t);
+        for (uint32_t i = 0; i < count; i++) {
+            BlockSignature signature;
+            uint32_t weakNet;
+            memcpy(&weakNet, p, sizeof(uint32_t));
+            signature.weak = ntohl(weakNet);
+            memcpy(signature.strong, p + 4, STRONG_HASH_SIZE);
+            signatures.push_back(signature);
+            p += SIGNATURE_SIZE;
+        }
+        return true;
+    }
+
+    void addDeltaCopy(std::vector<uint8_t>& ops, uint32_t firstBlock, uint32_t blockCount) {
+        uint32_t firstBlockNet = htonl(firstBlock);
+        uint32_t blockCountNet = htonl(blockCount);
+        ops.push_back(DELTA_COPY);
+        ops.insert(ops.end(), (uint8_t*)&firstBlockNet, (uint8_t*)&firstBlockNet + 4);
+        ops.insert(ops.end(), (uint8_t*)&blockCountNet, (uint8_t*)&blockCountNet + 4);
+    }
+
+    void addDeltaLiteral(std::vector<uint8_t>& ops, const uint8_t* data, uint32_t length) {
+        uint32_t lengthNet = htonl(length);
+        ops.push_back(DELTA_LITERAL);
+        ops.insert(ops.end(), (uint8_t*)&lengthNet, (uint8_t*)&lengthNet + 4);
+        ops.insert(ops.end(), data, data + length);
+    }
+
+    std::vector<uint8_t> createFileBatchMessage() {
+        return std::vector<uint8_t>(sizeof(uint32_t), 0);
+    }
+
+    void addToFileBatch(std::vector<uint8_t>& batch, const std::string& filename, const uint8_t* data, uint64_t size) {
+        FileBatchEntry entry(size, filename.length());
+
+        // Big Endian
+        uint64_t fileSizeNet = htobe64(entry.fileSize);
+        uint32_t filenameLengthNet = htonl(entry.filenameLength);
+
+        size_t pos = batch.size();
+        batch.resize(pos + sizeof(FileBatchEntry) + filename.length() + size);
+        memset(batch.data() + pos, 0, sizeof(FileBatchEntry));
+        memcpy(batch.data() + pos, &fileSizeNet, sizeof(uint64_t));
+        memcpy(batch.data() + pos + 8, &filenameLengthNet, sizeof(uint32_t));
+        memcpy(batch.data() + pos + sizeof(FileBatchEntry), filename.c_str(), filename.length());
+        if (size > 0) {
+            memcpy(batch.data() + pos + sizeof(FileBatchEntry) + filename.length(), data, size);
+        }
+
+        // bump the count at the front
+        uint32_t fileCountNet = htonl(fileBatchCount(batch) + 1);
+        memcpy(batch.data(), &fileCountNet, sizeof(uint32_t));
+    }
+
+    uint32_t fileBatchCount(const std::vector<uint8_t>& batch) {
+        uint32_t fileCountNet;
+        memcpy(&fileCountNet, batch.data(), sizeof(uint32_t));
+        return ntohl(fileCountNet);
+    }
+
+    bool parseFileBatchReply(const std::vector<uint8_t>& data, uint32_t& fileCount, std::vector<uint32_t>& failed) {
+        if (data.size() < 2 * sizeof(uint32_t)) {
+            return false;
+        }
+
+        uint32_t fileCountNet;
+        uint32_t failedCountNet;
+        memcpy(&fileCountNet, data.data(), sizeof(uint32_t));
+        memcpy(&failedCountNet, data.data() + 4, sizeof(uint32_t));
+
+        // convert from Big Endian
+        fileCount = ntohl(fileCountNet);
+        uint32_t failedCount = ntohl(failedCountNet);
+        if (failedCount > fileCount || data.size() < 2 * sizeof(uint32_t) + (size_t)failedCount * 4) {
+            return false;
+        }
+
+        failed.clear();
+        for (uint32_t i = 0; i < failedCount; i++) {
+            uint32_t indexNet;
+            memcpy(&indexNet, data.data() + 8 + i * 4, sizeof(uint32_t));
+            failed.push_back(ntohl(indexNet));
+        }
+        return true;
+    }
+
+    std::vector<uint8_t> createDedupeStartMessage(const std::string& filename, uint64_t fileSize, const std::vector<ChunkRef>& chunks) {
+        DedupeStartMessage msg(fileSize, chunks.size(), filename.length());
+        constexpr size_t REF_SIZE = sizeof(uint32_t) + CHUNK_HASH_SIZE;
+
+        // Big Endian
+        uint64_t fileSizeNet = htobe64(msg.fileSize);
+        uint32_t chunkCountNet = htonl(msg.chunkCount);
+        uint32_t filenameLengthNet = htonl(msg.filenameLength);
+
+        std::vector<uint8_t> data(sizeof(DedupeStartMessage) + filename.length() + chunks.size() * REF_SIZE);
+        memcpy(data.data(), &fileSizeNet, sizeof(uint64_t));
+        memcpy(data.data() + 8, &chunkCountNet, sizeof(uint32_t));
+        memcpy(data.data() + 12, &filenameLengthNet, sizeof(uint32_t));
+        memcpy(data.data() + sizeof(DedupeStartMessage), filename.c_str(), filename.length());
+
+        uint8_t* p = data.data() + sizeof(DedupeStartMessage) + filename.length();
+        for (const ChunkRef& chunk : chunks) {
+            uint32_t lengthNet = htonl(chunk.length);
+            memcpy(p, &lengthNet, sizeof(uint32_t));
+            memcpy(p + 4, chunk.hash, CHUNK_HASH_SIZE);
+            p += REF_SIZE;
+        }
+        return data;
+    }
+
+    bool parseMissingChunksReply(const std::vector<uint8_t>& data, uint32_t chunkCount, std::vector<uint32_t>& missing) {
+        if (data.size() < sizeof(uint32_t)) {
+            return false;
+        }
+
+        uint32_t missingCountNet;
+        memcpy(&missingCountNet, data.data(), sizeof(uint32_t));
+        uint32_t missingCount = ntohl(missingCountNet);
+        if (missingCount > chunkCount || data.size() < sizeof(uint32_t) + (size_t)missingCount * 4) {
+            return false;
+        }
+
+        missing.clear();
+        for (uint32_t i = 0; i < missingCount; i++) {
+            uint32_t indexNet;
+            memcpy(&indexNet, data.data() + 4 + i * 4, sizeof(uint32_t));
+            missing.push_back(ntohl(indexNet));
+            if (missing.back() >= chunkCount) {
                 return false;
             }
         }
-        
         return true;
     }
 
-    bool receiveEncryptedMessage(int socket_fd, FTPHeader& header, std::vector<uint8_t>& payload, SimpleCrypto& crypto) {
-        // recieve the size of the encryped message
-        std::cout << "Lisening for encrypted message..." << std::endl;
+    std::vector<uint8_t> createChunkDataMessage(uint32_t index, const uint8_t* data, uint32_t length) {
+        std::vector<uint8_t> message(sizeof(uint32_t) + length);
+        uint32_t indexNet = htonl(index);
+        memcpy(message.data(), &indexNet, sizeof(uint32_t));
+        memcpy(message.data() + sizeof(uint32_t), data, length);
+        return message;
+    }
 
-        uint32_t encryptedSize;
-        ssize_t received = recv(socket_fd, &encryptedSize, sizeof(encryptedSize), MSG_WAITALL);
-        if (received != sizeof(encryptedSize)) {
-            std::cerr << "Failed to receive encrypted size, got " << received << " bytes" << std::endl;
+    bool parseFileDataMessage(const std::vector<uint8_t>& data, uint32_t& chunkNumber, uint64_t& offset, const uint8_t*& chunkData, uint32_t& chunkLength) {
+        if (data.size() < sizeof(FileDataMessage)) {
             return false;
         }
-        encryptedSize = ntohl(encryptedSize);
-        
-        // receive the encrypted header
-        std::vector<uint8_t> encryptedHeaderData(encryptedSize);
-        received = recv(socket_fd, encryptedHeaderData.data(), encryptedHeaderData.size(), MSG_WAITALL);
-        if (received != (ssize_t)encryptedHeaderData.size()) {
-            std::cerr << "Failed to receive encrypted header, got " << received << " bytes, expected " << encryptedHeaderData.size() << std::endl;
+
+        uint32_t chunkNumberNet;
+        uint32_t dataLengthNet;
+        uint64_t offsetNet;
+        memcpy(&chunkNumberNet, data.data(), sizeof(uint32_t));
+        memcpy(&dataLengthNet, data.data() + 4, sizeof(uint32_t));
+        memcpy(&offsetNet, data.data() + 8, sizeof(uint64_t));
+
+        // convert from Big Endian
+        chunkNumber = ntohl(chunkNumberNet);
+        chunkLength = ntohl(dataLengthNet);
+        offset = be64toh(offsetNet);
+        if (data.size() < sizeof(FileDataMessage) + chunkLength) {
             return false;
         }
-        
-        // decrypt header
-        std::vector<uint8_t> headerData;
-        if (!crypto.decryptPacket(encryptedHeaderData, headerData)) {
+        chunkData = data.data() + sizeof(FileDataMessage);
+        return true;
+    }
+
+    bool queueEncryptedMessage(SendBatch& batch, uint8_t messageType, const std::vector<uint8_t>& payload, uint32_t sequenceNumber, PacketCipher& crypto, uint16_t channelId) {
+        FTPHeader header(messageType, payload.size(), sequenceNumber, channelId);
+
+        // header first then payload, the crypto sequence numbers depend on the order
+        // both are built and encrypted in the batch's own buffer
+        std::span<uint8_t> headerFrame = batch.stageFrame(sizeof(FTPHeader) + PacketCipher::MAC_SIZE);
+        serializeHeader(header, headerFrame.data());
+        if (!crypto.encryptInPlace(headerFrame)) {
+            return false;
+        }
+        if (!payload.empty()) {
+            std::span<uint8_t> payloadFrame = batch.stageFrame(payload.size() + PacketCipher::MAC_SIZE);
+            memcpy(payloadFrame.data(), payload.data(), payload.size());
+            return crypto.encryptInPlace(payloadFrame);
+        }
+        return true;
+    }
+
+    bool queueEncryptedFileData(SendBatch& batch, uint32_t chunkNumber, uint64_t offset, const uint8_t* data, uint32_t length, uint32_t sequenceNumber, PacketCipher& crypto, uint16_t channelId) {
+        FTPHeader header(static_cast<uint8_t>(FTPMessageType::FILE_DATA), sizeof(FileDataMessage) + length, sequenceNumber, channelId);
+        std::span<uint8_t> headerFrame = batch.stageFrame(sizeof(FTPHeader) + PacketCipher::MAC_SIZE);
+        serializeHeader(header, headerFrame.data());
+        if (!crypto.encryptInPlace(headerFrame)) {
+            return false;
+        }
+
+        // Big Endian [chunk number][length][offset] then the chunk
+        std::span<uint8_t> payloadFrame = batch.stageFrame(sizeof(FileDataMessage) + length + PacketCipher::MAC_SIZE);
+        uint32_t chunkNumberNet = htonl(chunkNumber);
+        uint32_t lengthNet = htonl(length);
+        uint64_t offsetNet = htobe64(offset);
+        memcpy(payloadFrame.data(), &chunkNumberNet, sizeof(uint32_t));
+        memcpy(payloadFrame.data() + 4, &lengthNet, sizeof(uint32_t));
+        memcpy(payloadFrame.data() + 8, &offsetNet, sizeof(uint64_t));
+        memcpy(payloadFrame.data() + sizeof(FileDataMessage), data, length);
+        return crypto.encryptInPlace(payloadFrame);
+    }
+
+    bool sendEncryptedMessage(int socket_fd, uint8_t messageType, const std::vector<uint8_t>& payload, uint32_t sequenceNumber, PacketCipher& crypto) {
+        // sizes, header and payload leave in a single sendmsg
+        SendBatch batch;
+        if (!queueEncryptedMessage(batch, messageType, payload, sequenceNumber, crypto)) {
+            std::cerr << "Failed to encrypt message" << std::endl;
+            return false;
+        }
+        if (!batch.flush(socket_fd)) {
+            std::cerr << "Failed to send encrypted message" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    bool receiveEncryptedMessage(FrameReader& reader, FTPHeader& header, std::vector<uint8_t>& payload, PacketCipher& crypto) {
+        std::vector<uint8_t>& frame = reader.scratch();
+
+        // encrypted header is small, usually already sitting in the buffer
+        if (!reader.readFrame(frame, false, MAX_ENCRYPTED_FRAME_SIZE)) {
+            std::cerr << "Failed to receive encrypted header" << std::endl;
+            return false;
+        }
+
+        if (!crypto.decryptInPlace(frame)) {
             std::cerr << "Failed to decrypt header" << std::endl;
             return false;
         }
-        
-        // parse header
-        if (!deserializeHeader(headerData, header)) {
+        if (!deserializeHeader(frame, header)) {
             std::cerr << "Failed to deserialize header" << std::endl;
             return false;
         }
-        
-        // receive encrupted payload
-        if (header.payloadLength > 0) {
-            // receive payload size
-            uint32_t payloadEncryptedSize;
-            received = recv(socket_fd, &payloadEncryptedSize, sizeof(payloadEncryptedSize), MSG_WAITALL);
-            if (received != sizeof(payloadEncryptedSize)) {
-                std::cerr << "Failed to receive payload encrypted size, got " << received << " bytes" << std::endl;
-                return false;
-            }
-            payloadEncryptedSize = ntohl(payloadEncryptedSize);
-            
-            // receive encrypted payload
-            std::vector<uint8_t> encryptedPayload(payloadEncryptedSize);
-            received = recv(socket_fd, encryptedPayload.data(), encryptedPayload.size(), MSG_WAITALL);
-            if (received != (ssize_t)encryptedPayload.size()) {
-                std::cerr << "Failed to receive encrypted payload, got " << received << " bytes, expected " << encryptedPayload.size() << std::endl;
-                return false;
-            }
-            
-            // decrypt payload
-            if (!crypto.decryptPacket(encryptedPayload, payload)) {
-                std::cerr << "Failed to decrypt payload" << std::endl;
-                return false;
-            }
-            // std::cout << "Decrypted payload size: " << payload.size() << " bytes" << std::endl;
-            
-        } else {
+
+        if (header.payloadLength == 0) {
             payload.clear();
+            return true;
         }
-        
+
+        // payload body goes through readExact so a big one skips the buffer
+        uint32_t payloadEncryptedSize;
+        if (!reader.readExact(&payloadEncryptedSize, sizeof(payloadEncryptedSize))) {
+            std::cerr << "Failed to receive payload encrypted size" << std::endl;
+            return false;
+        }
+        payloadEncryptedSize = ntohl(payloadEncryptedSize);
+        if (payloadEncryptedSize > MAX_ENCRYPTED_FRAME_SIZE) {
+            std::cerr << "Encrypted payload too large: " << payloadEncryptedSize << " bytes" << std::endl;
+            return false;
+        }
+
+        // straight into payload and decrypted there, the MAC is cut off afterwards
+        payload.resize(payloadEncryptedSize);
+        if (!reader.readExact(payload.data(), payload.size())) {
+            std::cerr << "Failed to receive encrypted payload, expected " << payload.size() << " bytes" << std::endl;
+            return false;
+        }
+        if (!crypto.decryptInPlace(payload)) {
+            std::cerr << "Failed to decrypt payload" << std::endl;
+            return false;
+        }
+        payload.resize(payloadEncryptedSize - PacketCipher::MAC_SIZE);
         return true;
     }
 
-}
\ No newline at end of file
+}
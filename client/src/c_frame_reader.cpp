@@ -0,0 +1,146 @@
+#include "c_frame_reader.h"
+
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <sys/socket.h>
+
+FrameReader::FrameReader(int fd, size_t capacity) {
+    fd_ = fd;
+    capacity_ = capacity;
+    start_ = 0;
+    end_ = 0;
+    recvCalls_ = 0;
+}
+
+void FrameReader::reserve(size_t len) {
+    if (buffer_.size() - start_ >= len) {
+        return;
+    }
+
+    // slide the partial frame to the front, grow only when it still does not fit
+    size_t unread = end_ - start_;
+    if (unread > 0 && start_ > 0) {
+        memmove(buffer_.data(), buffer_.data() + start_, unread);
+    }
+    start_ = 0;
+    end_ = unread;
+
+    if (buffer_.size() < len) {
+        buffer_.resize(std::max({len, buffer_.size() * 2, capacity_}));
+    }
+}
+
+ssize_t FrameReader::fill() {
+    if (end_ == buffer_.size()) {
+        reserve(available() + 1);
+    }
+
+    while (true) {
+        ssize_t bytesRead = recv(fd_, buffer_.data() + end_, buffer_.size() - end_, 0);
+        recvCalls_++;
+        if (bytesRead < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytesRead > 0) {
+            end_ += bytesRead;
+        }
+        return bytesRead;
+    }
+}
+
+void FrameReader::consume(size_t len) {
+    start_ += std::min(len, available());
+    if (start_ == end_) {
+        start_ = end_ = 0;
+    }
+}
+
+int FrameReader::takeFrame(std::vector<uint8_t>& frame, bool keepLength, uint32_t maxSize) {
+    if (available() < 4) {
+        return 0;
+    }
+
+    const uint8_t* p = data();
+    uint32_t length = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+    if (length > maxSize) {
+        std::cerr << "Frame too large: " << length << " bytes" << std::endl;
+        return -1;
+    }
+    if (available() < 4 + (size_t)length) {
+        // the rest has to fit behind what is already here
+        reserve(4 + (size_t)length);
+        return 0;
+    }
+
+    size_t skip = keepLength ? 0 : 4;
+    frame.assign(p + skip, p + 4 + length);
+    consume(4 + length);
+    return 1;
+}
+
+bool FrameReader::readExact(void* out, size_t len) {
+    uint8_t* dst = static_cast<uint8_t*>(out);
+
+    while (len > 0) {
+        size_t n = std::min(len, available());
+        if (n > 0) {
+            memcpy(dst, data(), n);
+            consume(n);
+            dst += n;
+            len -= n;
+            continue;
+        }
+
+        // nothing buffered and a big read --> straight into the caller memory
+        if (len >= capacity_ / 2) {
+            ssize_t bytesRead = recv(fd_, dst, len, MSG_WAITALL);
+            recvCalls_++;
+            if (bytesRead < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytesRead <= 0) {
+                return false;
+            }
+            dst += bytesRead;
+            len -= bytesRead;
+            continue;
+        }
+
+        if (fill() <= 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool FrameReader::readLine(std::string& line, size_t maxLength) {
+    while (true) {
+        const uint8_t* p = data();
+        const uint8_t* newline = std::find(p, p + available(), '\n');
+        if (newline != p + available()) {
+            line.assign(p, newline + 1);
+            consume(line.size());
+            return true;
+        }
+        if (available() > maxLength) {
+            return false;
+        }
+        if (fill() <= 0) {
+            return false;
+        }
+    }
+}
+
+bool FrameReader::readFrame(std::vector<uint8_t>& frame, bool keepLength, uint32_t maxSize) {
+    while (true) {
+        int taken = takeFrame(frame, keepLength, maxSize);
+        if (taken != 0) {
+            return taken > 0;
+        }
+        if (fill() <= 0) {
+            return false;
+        }
+    }
+}
@@ -14,10 +14,18 @@
 #include <algorithm>
 
 // constructor
-InteractiveClient::InteractiveClient(){
+InteractiveClient::InteractiveClient(uint32_t windowChunks, uint32_t chunkSize, uint32_t streams, uint32_t channels, bool delta, bool dedupe, bool hashFirst, const std::string& cipher){
     client_ = nullptr;
     connected_ = false;
     authenticated_ = false;
+    windowChunks_ = windowChunks;
+    chunkSize_ = chunkSize;
+    streams_ = streams;
+    channels_ = channels;
+    delta_ = delta;
+    dedupe_ = dedupe;
+    hashFirst_ = hashFirst;
+    cipher_ = cipher;
 }
 
 // destructor
@@ -109,6 +117,14 @@ bool InteractiveClient::connectToServer() {
     }
     
     client_ = new FileTransferClient(hostname_, port_);
+    client_->setWindowChunks(windowChunks_);
+    client_->setChunkSize(chunkSize_);
+    client_->setStreams(streams_);
+    client_->setChannels(channels_);
+    client_->setDelta(delta_);
+    client_->setDedupe(dedupe_);
+    client_->setHashFirst(hashFirst_);
+    client_->setCipher(cipher_);
     
     if (!client_->connect()) {
         std::cout << "Failed to connect to server!" << std::endl;
@@ -139,9 +155,10 @@ void InteractiveClient::showMainMenu() {
         std::cout << "1. Upload a file" << std::endl;
         std::cout << "2. Upload multiple files" << std::endl;
         std::cout << "3. Browse and select file" << std::endl;
-        std::cout << "4. Reconnect to server" << std::endl;
-        std::cout << "5. Exit" << std::endl;
-        std::cout << "Enter your choice (1-5): ";
+        std::cout << "4. Download a file" << std::endl;
+        std::cout << "5. Reconnect to server" << std::endl;
+        std::cout << "6. Exit" << std::endl;
+        std::cout << "Enter your choice (1-6): ";
         
         std::string choice;
         std::getline(std::cin, choice);
@@ -153,13 +170,15 @@ void InteractiveClient::showMainMenu() {
         } else if (choice == "3") {
             browseAndSelectFile();
         } else if (choice == "4") {
+            downloadFile();
+        } else if (choice == "5") {
             reconnect();
             break;
-        } else if (choice == "5") {
+        } else if (choice == "6") {
             std::cout << "Goodbye!" << std::endl;
             exit(0);
         } else {
-            std::cout << "Invalid choice! Please enter 1-5." << std::endl;
+            std::cout << "Invalid choice! Please enter 1-6." << std::endl;
         }
     }
 }
@@ -203,6 +222,40 @@ void InteractiveClient::uploadSingleFile() {
     }
 }
 
+void InteractiveClient::downloadFile() {
+    std::cout << "\n--- Download File ---" << std::endl;
+    std::cout << "Enter file name on the server: ";
+    
+    std::string filename;
+    std::getline(std::cin, filename);
+    
+    if (filename.empty()) {
+        std::cout << "File name cannot be empty!" << std::endl;
+        return;
+    }
+    
+    std::cout << "Save as (empty for ./" << filename << "): ";
+    std::string localPath;
+    std::getline(std::cin, localPath);
+    if (localPath.empty()) {
+        localPath = filename;
+    }
+    
+    // ~ is starting from home directory
+    if (localPath[0] == '~') {
+        const char* home = getenv("HOME");
+        if (home) {
+            localPath = std::string(home) + localPath.substr(1);
+        }
+    }
+    
+    if (client_->getFile(filename, localPath)) {
+        std::cout << "File downloaded successfully!" << std::endl;
+    } else {
+        std::cout << "File download failed!" << std::endl;
+    }
+}
+
 void InteractiveClient::uploadMultipleFiles() {
     std::cout << "\n--- Upload Multiple Files ---" << std::endl;
     std::cout << "Enter file paths (one per line, empty line to finish):" << std::endl;
@@ -247,16 +300,8 @@ void InteractiveClient::uploadMultipleFiles() {
     
     std::cout << "\nUploading " << filePaths.size() << " files..." << std::endl;
     
-    int successCount = 0;
-    for (const auto& path : filePaths) {
-        std::cout << "\nUploading: " << path << std::endl;
-        if (client_->sendFile(path)) {
-            std::cout << "Success!" << std::endl;
-            successCount++;
-        } else {
-            std::cout << "Failed!" << std::endl;
-        }
-    }
+    // several files share the connection, each on its own channel
+    size_t successCount = client_->sendFiles(filePaths);
     
     std::cout << "\nUpload complete: " << successCount << "/" << filePaths.size() << " files uploaded successfully." << std::endl;
 }
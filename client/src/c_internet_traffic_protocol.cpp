@@ -1,4 +1,6 @@
 #include "../include/c_internet_traffic_protocol.h"
+#include "../include/c_frame_reader.h"
+#include "../include/c_send_batch.h"
 #include <cstring>
 #include <sys/socket.h>
 #include <arpa/inet.h>
@@ -53,31 +55,23 @@ namespace ITPProtocol {
         ITPHeader header(messageType, payload.size(), sequenceNumber, checksum);
         std::vector<uint8_t> headerData = serializeHeader(header);
         
-        // send header so client knows what to expect
-        ssize_t sent = send(socket_fd, headerData.data(), headerData.size(), 0);
-        if (sent != (ssize_t)headerData.size()) {
-            std::cerr << "Failed to send header: " << sent << " != " << headerData.size() << std::endl;
+        // header and payload go out together, the header tells the other side what to expect
+        struct iovec iov[2];
+        iov[0] = {headerData.data(), headerData.size()};
+        iov[1] = {const_cast<uint8_t*>(payload.data()), payload.size()};
+        if (sendIovecs(socket_fd, iov, payload.empty() ? 1 : 2) < 0) {
+            std::cerr << "Failed to send message of " << headerData.size() + payload.size() << " bytes" << std::endl;
             return false;
         }
         
-        // send payload after sending header
-        if (!payload.empty()) {
-            sent = send(socket_fd, payload.data(), payload.size(), 0);
-            if (sent != (ssize_t)payload.size()) {
-                std::cerr << "Failed to send payload: " << sent << " != " << payload.size() << std::endl;
-                return false;
-            }
-        }
-        
         return true;
     }
 
-    bool receiveMessage(int socket_fd, ITPHeader& header, std::vector<uint8_t>& payload) {
+    bool receiveMessage(FrameReader& reader, ITPHeader& header, std::vector<uint8_t>& payload) {
         // receive header serailized
         std::vector<uint8_t> headerData(HEADER_SIZE);
-        ssize_t received = recv(socket_fd, headerData.data(), headerData.size(), MSG_WAITALL);
-        if (received != (ssize_t)headerData.size()) {
-            std::cerr << "Failed to receive header: " << received << " != " << headerData.size() << std::endl;
+        if (!reader.readExact(headerData.data(), headerData.size())) {
+            std::cerr << "Failed to receive header" << std::endl;
             return false;
         }
         
@@ -96,9 +90,8 @@ namespace ITPProtocol {
         // recieve payload
         if (header.payloadLength > 0) {
             payload.resize(header.payloadLength);
-            received = recv(socket_fd, payload.data(), payload.size(), MSG_WAITALL);
-            if (received != (ssize_t)payload.size()) {
-                std::cerr << "Failed to receive payload: " << received << " != " << payload.size() << std::endl;
+            if (!reader.readExact(payload.data(), payload.size())) {
+                std::cerr << "Failed to receive payload of " << payload.size() << " bytes" << std::endl;
                 return false;
             }
             
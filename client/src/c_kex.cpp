@@ -1,5 +1,6 @@
 #include "c_kex.h"
 #include "c_byte_stream.h"
+#include "c_cipher_registry.h"
 #include <cstdlib>
 #include <iostream>
 #include <algorithm>
@@ -8,7 +9,7 @@
 
 // client --> server then server --> client
 
-std::vector<uint8_t> buildKexPayload() {
+std::vector<uint8_t> buildKexPayload(const std::string& cipher) {
     ByteStream bs;
 
     // SSH message code
@@ -30,23 +31,17 @@ std::vector<uint8_t> buildKexPayload() {
         "RoseIsBestDog"
     });
 
-    // Encryption algorithms
-    bs.writeNameList({
-        "simple-encrypt",
-        "too-easy-encrypt"
-    });
-    bs.writeNameList({
-        "abcd123-ctr"
-    });
-
-    // MAC algorithms
-    bs.writeNameList({
-        "hmac-kim",
-        "mcChicken-MAC"
-    });
-    bs.writeNameList({
-        "bigMac-meal"
-    });
+    // Encryption and MAC algorithms, whatever the cipher registry can build
+    // the server takes the first one it also has, so the chosen cipher goes in front
+    std::vector<std::string> encryptions = CipherRegistry::encryptionNames();
+    auto chosen = std::find(encryptions.begin(), encryptions.end(), cipher);
+    if (chosen != encryptions.end()) {
+        std::rotate(encryptions.begin(), chosen, chosen + 1);
+    }
+    bs.writeNameList(encryptions);
+    bs.writeNameList(encryptions);
+    bs.writeNameList(CipherRegistry::macNames());
+    bs.writeNameList(CipherRegistry::macNames());
 
     // Compression algorithms
     bs.writeNameList({"none"});
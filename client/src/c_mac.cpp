@@ -0,0 +1,101 @@
+#include "../include/c_mac.h"
+#include "../include/c_aes_gcm.h"
+#include <iostream>
+#include <cstring>
+#include <openssl/evp.h>
+#include <openssl/crypto.h>
+
+namespace {
+    void sequenceBytes(uint32_t sequenceNumber, uint8_t* out) {
+        out[0] = (sequenceNumber >> 24) & 0xFF;
+        out[1] = (sequenceNumber >> 16) & 0xFF;
+        out[2] = (sequenceNumber >> 8) & 0xFF;
+        out[3] = sequenceNumber & 0xFF;
+    }
+}
+
+KimMac::KimMac(uint64_t, bool) {
+}
+
+void KimMac::simpleHashUpdate(uint8_t* hash, const uint8_t* data, size_t len, size_t position) {
+    // hash function, XOR with position and rotate
+    for (size_t n = 0; n < len; n++) {
+        size_t i = position + n;
+        uint8_t byte = data[n];
+        uint8_t pos = i & 0xFF;
+
+        // rotate and XOR
+        for (int j = 0; j < 16; j++) {
+            hash[j] ^= byte ^ pos ^ ((i + j) & 0xFF);
+            byte = (byte << 1) | (byte >> 7); // rotate left
+        }
+    }
+}
+
+bool KimMac::compute(uint32_t sequenceNumber, const uint8_t* encrypted, size_t len, uint8_t* mac) {
+    // MAC --> hash(sequenceNumber || encrypted_data)
+    uint8_t sequence[4];
+    sequenceBytes(sequenceNumber, sequence);
+    memset(mac, 0, SIZE);
+    simpleHashUpdate(mac, sequence, sizeof(sequence), 0);
+    simpleHashUpdate(mac, encrypted, len, sizeof(sequence));
+    return true;
+}
+
+HmacSha256::HmacSha256(uint64_t sharedSecret, bool is_client) : ready_(false) {
+    inner_ = EVP_MD_CTX_new();
+    outer_ = EVP_MD_CTX_new();
+    work_ = EVP_MD_CTX_new();
+
+    std::string direction = is_client ? "client_to_server" : "server_to_client";
+    uint8_t key[32];
+    if (!hkdfSha256(sharedSecret, "mac_" + direction, key, sizeof(key))) {
+        std::cerr << "Failed to derive hmac-sha2-256 key" << std::endl;
+        return;
+    }
+
+    // RFC 2104 with a 32 byte key, zero padded to the 64 byte SHA-256 block
+    uint8_t innerPad[64], outerPad[64];
+    memset(innerPad, 0x36, sizeof(innerPad));
+    memset(outerPad, 0x5c, sizeof(outerPad));
+    for (size_t i = 0; i < sizeof(key); i++) {
+        innerPad[i] ^= key[i];
+        outerPad[i] ^= key[i];
+    }
+    bool ok = inner_ && outer_ && work_ &&
+              EVP_DigestInit_ex(inner_, EVP_sha256(), nullptr) == 1 && EVP_DigestUpdate(inner_, innerPad, sizeof(innerPad)) == 1 &&
+              EVP_DigestInit_ex(outer_, EVP_sha256(), nullptr) == 1 && EVP_DigestUpdate(outer_, outerPad, sizeof(outerPad)) == 1;
+    if (!ok) {
+        std::cerr << "Failed to set up hmac-sha2-256" << std::endl;
+    }
+    ready_ = ok;
+    OPENSSL_cleanse(key, sizeof(key));
+    OPENSSL_cleanse(innerPad, sizeof(innerPad));
+    OPENSSL_cleanse(outerPad, sizeof(outerPad));
+}
+
+HmacSha256::~HmacSha256() {
+    EVP_MD_CTX_free(inner_);
+    EVP_MD_CTX_free(outer_);
+    EVP_MD_CTX_free(work_);
+}
+
+bool HmacSha256::compute(uint32_t sequenceNumber, const uint8_t* encrypted, size_t len, uint8_t* mac) {
+    uint8_t sequence[4];
+    sequenceBytes(sequenceNumber, sequence);
+    uint8_t digest[EVP_MAX_MD_SIZE];
+    unsigned int digestLength = 0;
+
+    // H(outer || H(inner || sequence || encrypted))
+    bool ok = ready_ && EVP_MD_CTX_copy_ex(work_, inner_) == 1 && EVP_DigestUpdate(work_, sequence, sizeof(sequence)) == 1 &&
+              EVP_DigestUpdate(work_, encrypted, len) == 1 && EVP_DigestFinal_ex(work_, digest, &digestLength) == 1 &&
+              EVP_MD_CTX_copy_ex(work_, outer_) == 1 && EVP_DigestUpdate(work_, digest, digestLength) == 1 &&
+              EVP_DigestFinal_ex(work_, digest, &digestLength) == 1;
+    if (!ok) {
+        // leave a MAC that will not verify rather than stale bytes
+        std::cerr << "hmac-sha2-256 failed" << std::endl;
+        memset(digest, 0, SIZE);
+    }
+    memcpy(mac, digest, SIZE);
+    return ok;
+}
@@ -48,6 +48,12 @@ bool SSHSocket::connectToServer() {
         return false;
     }
 
+    reader_ = FrameReader(socketfd_);
+
+    // first look at the path, the handshake RTT is known as soon as connect returns
+    tuner_ = BufferTuner(socketfd_);
+    tuner_.sample();
+
     std::cout << "connected to " << hostname_ << " on port number " << port_ <<std::endl;
 
     freeaddrinfo(res);
@@ -63,14 +69,11 @@ bool SSHSocket::exchangeVersionStrings(std::string& serverVersion) {
         return false;
     }
 
-    char buffer[256] = {0};
-    ssize_t bytesReceived = recv(socketfd_, buffer, sizeof(buffer) - 1, 0);
-    if (bytesReceived <= 0) {
+    // only up to the newline, whatever follows stays buffered for the next read
+    if (!reader_.readLine(serverVersion, 255)) {
         std::cerr << "Failed to receive version string from server\n";
         return false;
     }
-
-    serverVersion = std::string(buffer, bytesReceived);
     return true;
 }
 
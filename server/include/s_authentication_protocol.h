@@ -4,6 +4,8 @@
 #include <cstdint>
 #include <map>
 
+class FrameReader;
+
 namespace AuthProtocol {
     // max lengths for strings
     constexpr uint32_t MAX_USERNAME_LENGTH = 256;
@@ -33,5 +35,5 @@ namespace AuthProtocol {
                         const std::map<std::string, std::string>& users);
 
     bool sendAuthResponse(int socket_fd, bool success);
-    bool receiveAuthRequest(int socket_fd, std::string& username, std::string& password);
+    bool receiveAuthRequest(FrameReader& reader, std::string& username, std::string& password);
 }
\ No newline at end of file
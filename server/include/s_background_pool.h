@@ -0,0 +1,61 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+
+/**
+ * a few threads that live as long as the server for work that must not run on an event loop
+ * or coroutine scheduler thread, like writing the files of a FILE_BATCH
+ * every loop shares the one pool, whatever is still queued at shutdown is run before the threads exit
+ */
+
+class BackgroundPool {
+    private:
+        std::vector<std::thread> threads_;
+        std::deque<std::function<void()>> queue_;
+        std::mutex mutex_;
+        std::condition_variable notEmpty_;
+        bool stopping_;
+
+        void threadLoop();
+
+    public:
+        explicit BackgroundPool(size_t threads);
+        ~BackgroundPool();
+
+        BackgroundPool(const BackgroundPool&) = delete;
+        BackgroundPool& operator=(const BackgroundPool&) = delete;
+
+        size_t size() const { return threads_.size(); }
+        void submit(std::function<void()> work);
+};
+
+/**
+ * how finished background work gets back onto the one thread that owns a connection
+ * post from any thread, the owner waits on fd() with its other sockets and calls runAll when it is readable
+ * shared so a post still lands somewhere when the loop is already gone
+ */
+
+class CompletionQueue {
+    private:
+        int eventFd_;
+        std::mutex mutex_;
+        std::vector<std::function<void()>> done_;
+
+    public:
+        CompletionQueue();
+        ~CompletionQueue();
+
+        CompletionQueue(const CompletionQueue&) = delete;
+        CompletionQueue& operator=(const CompletionQueue&) = delete;
+
+        // -1 when the eventfd could not be created
+        int fd() const { return eventFd_; }
+        void post(std::function<void()> fn);
+        void runAll();
+};
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <string>
+#include <chrono>
+#include <cstdint>
+
+/**
+ * grows SO_SNDBUF/SO_RCVBUF to the bandwidth-delay product of the connection
+ * TCP_INFO is sampled now and then for the RTT, congestion window and how fast bytes
+ * are really moving, buffers are sized at twice that so the rate can keep climbing
+ * buffers are only ever grown, setting one turns off kernel autotuning for it so
+ * nothing is touched until the measured need, capped at net.core.[rw]mem_max, is past
+ * what the kernel already picked
+ */
+
+class BufferTuner {
+    private:
+        static constexpr uint64_t MAX_BUFFER = 16 * 1024 * 1024;
+        static constexpr std::chrono::milliseconds SAMPLE_INTERVAL{250};
+
+        int fd_;
+        bool sampled_;
+        std::chrono::steady_clock::time_point lastSample_;
+        uint64_t lastBytesReceived_;
+        uint64_t lastBytesAcked_;
+
+        // latest measurement
+        uint32_t rttUs_;
+        uint64_t cwndBytes_;
+        uint64_t sendRate_;    // bytes/s
+        uint64_t receiveRate_; // bytes/s
+        uint64_t peakSendRate_;
+        uint64_t peakReceiveRate_;
+
+        // what the kernel reports back, it doubles the requested value for bookkeeping
+        int sendBuffer_;
+        int recvBuffer_;
+        uint32_t adjustments_;
+
+        bool grow(int option, uint64_t target, int& current);
+
+    public:
+        explicit BufferTuner(int fd = -1);
+
+        // read TCP_INFO now and grow the buffers if the path needs more
+        bool sample();
+        // same but at most once per SAMPLE_INTERVAL, cheap enough to call per message
+        void maybeSample();
+
+        uint32_t rttUs() const { return rttUs_; }
+        int sendBuffer() const { return sendBuffer_; }
+        int recvBuffer() const { return recvBuffer_; }
+        uint32_t adjustments() const { return adjustments_; }
+
+        // one line for the session stats
+        std::string summary() const;
+};
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include "s_file_transfer_protocol.h"
+
+/**
+ * content addressed store for deduplicated uploads, only there with --dedupe=on
+ * every chunk is kept once in <upload dir>/.chunks under the hex of its SHA-256, a deduplicated
+ * file is a manifest next to where the file itself would be that lists its chunks in order
+ * chunks go to a temp name and are renamed into place, two uploads storing the same chunk at
+ * once write the same bytes so either rename is fine
+ * chunks are never removed, a replaced manifest leaves its old chunks behind
+ */
+
+class ChunkStore {
+    private:
+        std::string dir_;
+        std::atomic<uint64_t> tempCounter_; // keeps concurrent writers of one chunk off each other's temp file
+
+    public:
+        explicit ChunkStore(const std::string& uploadDir);
+
+        ChunkStore(const ChunkStore&) = delete;
+        ChunkStore& operator=(const ChunkStore&) = delete;
+
+        // creates the store directory and its 256 fan out directories
+        bool init();
+
+        std::string chunkPath(const uint8_t* hash) const;
+        bool has(const FTPProtocol::ChunkRef& chunk) const;
+        // false when the data does not hash to the chunk or could not be written
+        bool put(const FTPProtocol::ChunkRef& chunk, const uint8_t* data, uint32_t length);
+
+        static std::string manifestPath(const std::string& filePath);
+        // written to a temp name and renamed like the journal
+        static bool saveManifest(const std::string& filePath, uint64_t fileSize, const std::vector<FTPProtocol::ChunkRef>& chunks);
+        static bool loadManifest(const std::string& filePath, uint64_t& fileSize, std::vector<FTPProtocol::ChunkRef>& chunks);
+};
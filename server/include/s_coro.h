@@ -0,0 +1,154 @@
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+#include <set>
+#include <iostream>
+
+/**
+ * minimal C++20 coroutine types for the coroutine server mode
+ * Task<T> is lazy, it starts when awaited and resumes its awaiter when it finishes
+ * DetachedTask is a root coroutine that starts right away and frees itself at the end
+ */
+
+namespace Coro {
+
+    template <typename T>
+    class Task;
+
+    namespace detail {
+        // resume whoever awaited the task, nothing to resume for a root task
+        struct FinalAwaiter {
+            bool await_ready() const noexcept { return false; }
+
+            template <typename Promise>
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+                std::coroutine_handle<> continuation = handle.promise().continuation;
+                if (continuation) {
+                    return continuation;
+                }
+                return std::noop_coroutine();
+            }
+
+            void await_resume() const noexcept {}
+        };
+
+        struct PromiseBase {
+            std::coroutine_handle<> continuation;
+            std::exception_ptr exception;
+
+            std::suspend_always initial_suspend() const noexcept { return {}; }
+            FinalAwaiter final_suspend() const noexcept { return {}; }
+            void unhandled_exception() { exception = std::current_exception(); }
+        };
+    }
+
+    template <typename T = void>
+    class Task {
+        public:
+            struct promise_type : detail::PromiseBase {
+                std::optional<T> value;
+
+                Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+                void return_value(T v) { value = std::move(v); }
+            };
+
+            Task(Task&& other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+            Task(const Task&) = delete;
+            Task& operator=(const Task&) = delete;
+            ~Task() {
+                if (handle_) {
+                    handle_.destroy();
+                }
+            }
+
+            bool await_ready() const noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept {
+                handle_.promise().continuation = awaiter;
+                return handle_;
+            }
+            T await_resume() {
+                if (handle_.promise().exception) {
+                    std::rethrow_exception(handle_.promise().exception);
+                }
+                return std::move(*handle_.promise().value);
+            }
+
+        private:
+            explicit Task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+            std::coroutine_handle<promise_type> handle_;
+    };
+
+    template <>
+    class Task<void> {
+        public:
+            struct promise_type : detail::PromiseBase {
+                Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+                void return_void() {}
+            };
+
+            Task(Task&& other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+            Task(const Task&) = delete;
+            Task& operator=(const Task&) = delete;
+            ~Task() {
+                if (handle_) {
+                    handle_.destroy();
+                }
+            }
+
+            bool await_ready() const noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept {
+                handle_.promise().continuation = awaiter;
+                return handle_;
+            }
+            void await_resume() {
+                if (handle_.promise().exception) {
+                    std::rethrow_exception(handle_.promise().exception);
+                }
+            }
+
+        private:
+            explicit Task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+            std::coroutine_handle<promise_type> handle_;
+    };
+
+    // root coroutines still suspended, so the owner can free them on shutdown
+    using RootSet = std::set<std::coroutine_handle<>>;
+
+    class DetachedTask {
+        public:
+            struct promise_type {
+                RootSet& roots;
+
+                // the first parameter of every detached coroutine is the root set it registers in
+                template <typename... Args>
+                promise_type(RootSet& rootSet, Args&&...) : roots(rootSet) {
+                    roots.insert(std::coroutine_handle<promise_type>::from_promise(*this));
+                }
+                // member coroutines get the object first
+                template <typename Self, typename... Args>
+                promise_type(Self&, RootSet& rootSet, Args&&...) : roots(rootSet) {
+                    roots.insert(std::coroutine_handle<promise_type>::from_promise(*this));
+                }
+                ~promise_type() {
+                    roots.erase(std::coroutine_handle<promise_type>::from_promise(*this));
+                }
+
+                DetachedTask get_return_object() { return {}; }
+                std::suspend_never initial_suspend() const noexcept { return {}; }
+                std::suspend_never final_suspend() const noexcept { return {}; }
+                void return_void() {}
+                void unhandled_exception() {
+                    try {
+                        std::rethrow_exception(std::current_exception());
+                    } catch (const std::exception& e) {
+                        std::cerr << "Exception in coroutine: " << e.what() << std::endl;
+                    } catch (...) {
+                        std::cerr << "Unknown exception in coroutine" << std::endl;
+                    }
+                }
+            };
+    };
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <atomic>
+#include <cstdint>
+#include "s_coro.h"
+#include "s_coro_scheduler.h"
+#include "s_file_transfer_protocol.h"
+
+class Session;
+class BackgroundPool;
+class UploadRegistry;
+class ChunkStore;
+class HashIndex;
+
+/**
+ * coroutine version of FileTransferServer::handleClient, one scheduler per thread
+ * every connection is a coroutine that reads like the blocking handlers but only
+ * holds a coroutine frame while it waits instead of a whole thread stack
+ */
+
+class CoroLoop {
+    private:
+        int listenFd_;
+        std::string uploadDir_;
+        const std::map<std::string, std::string>& users_;
+        UploadRegistry& uploads_;
+        HashIndex& hashes_;
+        ChunkStore* chunks_;
+        std::atomic<bool>& running_;
+        BackgroundPool& background_;
+        CoroScheduler scheduler_;
+
+        Coro::DetachedTask acceptLoop(Coro::RootSet& roots);
+        Coro::DetachedTask handleClient(Coro::RootSet& roots, int clientSocket);
+
+        Coro::Task<bool> receivePacket(AsyncSocket& socket, std::vector<uint8_t>& packet);
+        Coro::Task<bool> receiveFrame(AsyncSocket& socket, std::vector<uint8_t>& frame);
+        Coro::Task<bool> receiveEncryptedMessage(AsyncSocket& socket, Session& session, FTPProtocol::FTPHeader& header, std::vector<uint8_t>& payload);
+
+        Coro::Task<bool> handleVersionExchange(AsyncSocket& socket);
+        Coro::Task<bool> handleKexinitExchange(AsyncSocket& socket, Session& session);
+        Coro::Task<bool> handleKeyExchange(AsyncSocket& socket, Session& session);
+        Coro::Task<bool> handleAuthentication(AsyncSocket& socket, std::string& username);
+        Coro::Task<void> handleFileTransfer(AsyncSocket& socket, Session& session);
+
+    public:
+        CoroLoop(int listenFd, const std::string& uploadDir, const std::map<std::string, std::string>& users, UploadRegistry& uploads, HashIndex& hashes, ChunkStore* chunks, std::atomic<bool>& running, BackgroundPool& background);
+
+        bool init();
+        void run();
+};
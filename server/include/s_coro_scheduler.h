@@ -0,0 +1,111 @@
+#pragma once
+
+#include <map>
+#include <vector>
+#include <string>
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <coroutine>
+#include <cstdint>
+#include <cstddef>
+#include <sys/types.h>
+#include "s_coro.h"
+
+class CompletionQueue;
+
+/**
+ * single threaded epoll scheduler for coroutines
+ * sockets are registered edge triggered once, a coroutine only suspends after the
+ * syscall said EAGAIN and is resumed when epoll reports the fd ready again
+ * work handed to another thread resumes its coroutine here through the completion queue
+ */
+
+class CoroScheduler {
+    private:
+        struct Waiters {
+            std::coroutine_handle<> reader;
+            std::coroutine_handle<> writer;
+        };
+
+        int epollFd_;
+        std::atomic<bool>& running_;
+        std::map<int, Waiters> waiters_;
+        Coro::RootSet roots_;
+        std::shared_ptr<CompletionQueue> completions_;
+
+    public:
+        explicit CoroScheduler(std::atomic<bool>& running);
+        ~CoroScheduler();
+
+        bool init();
+        // resume coroutines until running_ goes false
+        void run();
+
+        bool add(int fd, bool exclusive = false);
+        void remove(int fd);
+
+        // root coroutines register here so whatever is left suspended is freed with the scheduler
+        Coro::RootSet& roots() { return roots_; }
+
+        struct ReadyAwaiter {
+            CoroScheduler& scheduler;
+            int fd;
+            bool forWrite;
+
+            bool await_ready() const noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> handle);
+            void await_resume() const noexcept {}
+        };
+
+        ReadyAwaiter readable(int fd) { return ReadyAwaiter{*this, fd, false}; }
+        ReadyAwaiter writable(int fd) { return ReadyAwaiter{*this, fd, true}; }
+
+        // start gets a done callback and hands it to work on another thread, whichever thread calls
+        // done the coroutine carries on here on the scheduler thread
+        struct OffloadAwaiter {
+            CoroScheduler& scheduler;
+            std::function<void(std::function<void()>)> start;
+
+            bool await_ready() const noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> handle);
+            void await_resume() const noexcept {}
+        };
+
+        OffloadAwaiter offload(std::function<void(std::function<void()>)> start) { return OffloadAwaiter{*this, std::move(start)}; }
+};
+
+/**
+ * non-blocking socket for coroutines, owns the fd
+ * reads go through a small buffer so coalesced frames are never lost, reads larger than
+ * the buffer go straight into the caller memory
+ */
+
+class AsyncSocket {
+    private:
+        static constexpr size_t READ_BUFFER_SIZE = 4096;
+
+        CoroScheduler& scheduler_;
+        int fd_;
+        std::vector<uint8_t> readBuffer_;
+        size_t readStart_;
+        size_t readEnd_;
+
+        Coro::Task<ssize_t> recvSome(void* data, size_t len);
+
+    public:
+        AsyncSocket(CoroScheduler& scheduler, int fd);
+        ~AsyncSocket();
+
+        AsyncSocket(const AsyncSocket&) = delete;
+        AsyncSocket& operator=(const AsyncSocket&) = delete;
+
+        int fd() const { return fd_; }
+        // bytes received but not read yet
+        size_t buffered() const { return readEnd_ - readStart_; }
+
+        Coro::Task<bool> recvExact(void* data, size_t len);
+        // bytes up to and including '\n', false past maxLength
+        Coro::Task<bool> recvLine(std::string& line, size_t maxLength);
+        Coro::Task<bool> sendAll(const std::vector<uint8_t>& data);
+};
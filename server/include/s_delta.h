@@ -0,0 +1,28 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include "s_file_transfer_protocol.h"
+
+/**
+ * block checksums for delta uploads, the client keeps the same functions in c_delta
+ * weak is the rsync rolling checksum so the client can slide it a byte at a time,
+ * strong is the start of a SHA-256 and only checked once the weak one matches
+ */
+
+namespace Delta {
+
+    constexpr uint32_t MIN_BLOCK_SIZE = 2048;
+    constexpr uint32_t MAX_BLOCKS = 1 << 20; // bounds the signature list of a huge file
+
+    // about the square root of the file size like rsync, larger when that would make too many blocks
+    uint32_t blockSizeFor(uint64_t fileSize);
+
+    // low 16 bits are the byte sum, high 16 bits the sum weighted by distance from the block end
+    uint32_t weakChecksum(const uint8_t* data, size_t len);
+    void strongHash(const uint8_t* data, size_t len, uint8_t* out);
+
+    // one signature per whole block, a shorter tail is never matched and goes as literal data
+    std::vector<FTPProtocol::BlockSignature> sign(const uint8_t* data, uint64_t size, uint32_t blockSize);
+}
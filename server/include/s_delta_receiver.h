@@ -0,0 +1,61 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include "s_file_transfer_protocol.h"
+
+// EVP_MD_CTX, openssl headers stay out of here since they clash with the DH class
+struct evp_md_ctx_st;
+
+/**
+ * rebuilds a re-uploaded file from DELTA_DATA against the copy the server already has
+ * the old copy is mapped read only and the new file is written to a temp name next to it,
+ * it only replaces the old copy once its size and SHA-256 match what the client sent
+ */
+
+class DeltaReceiver {
+    private:
+        int basisFd_;
+        uint8_t* basis_;      // the old copy, blocks are copied straight out of the mapping
+        uint64_t basisSize_;
+        uint32_t blockSize_;
+        uint32_t blockCount_; // whole blocks in the old copy
+        int tempFd_;
+        std::string filePath_;
+        std::string tempPath_;
+        uint64_t fileSize_;
+        uint64_t bytesWritten_;
+        uint64_t copiedBytes_;
+        bool failed_;
+        evp_md_ctx_st* sha_;  // over everything written so far
+
+        bool write(const uint8_t* data, size_t len);
+        void close();
+
+    public:
+        DeltaReceiver();
+        ~DeltaReceiver();
+
+        DeltaReceiver(const DeltaReceiver&) = delete;
+        DeltaReceiver& operator=(const DeltaReceiver&) = delete;
+
+        // false when there is no old copy with at least one whole block to diff against
+        // a block size of 0 lets the server pick one from the size of the old copy
+        bool open(const std::string& filePath, uint64_t fileSize, uint32_t blockSize);
+        std::vector<FTPProtocol::BlockSignature> signatures() const;
+
+        // one DELTA_DATA payload, a bad instruction marks the rebuild failed and the rest is ignored
+        void apply(const std::vector<uint8_t>& payload);
+        // checks the rebuilt file against the client SHA-256 and renames it over the old copy
+        bool finish(const std::vector<uint8_t>& fileHash);
+        // drops the temp file, the old copy stays as it was
+        void abort();
+
+        uint32_t blockSize() const { return blockSize_; }
+        uint32_t blockCount() const { return blockCount_; }
+        uint64_t fileSize() const { return fileSize_; }
+        uint64_t copiedBytes() const { return copiedBytes_; }
+        const std::string& filePath() const { return filePath_; }
+};
@@ -26,4 +26,7 @@ class DH {
         
         static std::vector<uint8_t> uint64ToBytes(uint64_t value);
         static uint64_t bytesToUint64(const std::vector<uint8_t>& bytes);
-}; 
\ No newline at end of file
+};
+
+// build the KEXDH_REPLY for a client KEXDH_INIT payload and output the shared secret
+std::vector<uint8_t> generateServerKexdhReply(const std::vector<uint8_t>& clientKexdhPayload, uint64_t& sharedSecret);
\ No newline at end of file
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+
+class UploadRegistry;
+class ChunkStore;
+class HashIndex;
+class BackgroundPool;
+class CompletionQueue;
+
+/**
+ * non-blocking epoll reactor, one per thread
+ * every connection is a small state machine that walks the same phases as
+ * FileTransferServer::handleClient --> version, KEXINIT, KEXDH, NEWKEYS, auth, transfer
+ * the listening socket is either shared by every loop (EPOLL mode) or owned by this one (SHARDED mode)
+ * disk work a message leaves behind runs on the background pool, the connection stops reading until
+ * it comes back through the completion queue
+ */
+
+class EventLoop {
+    private:
+        struct Connection;
+
+        int epollFd_;
+        int listenFd_;
+        bool sharedListener_;
+        int cpu_; // core to pin the loop thread to, -1 --> no pinning
+        std::string uploadDir_;
+        const std::map<std::string, std::string>& users_;
+        UploadRegistry& uploads_;
+        HashIndex& hashes_;
+        ChunkStore* chunks_;
+        std::atomic<bool>& running_;
+        BackgroundPool& background_;
+        std::shared_ptr<CompletionQueue> completions_;
+        std::map<int, std::unique_ptr<Connection>> connections_;
+        uint64_t nextConnectionId_; // a job finishing late must not land on a new connection that got the same fd
+
+        void acceptConnections();
+        void closeConnection(int fd);
+
+        void handleReadable(Connection& conn);
+        // run every complete message already read, then ack and flush
+        bool processBuffered(Connection& conn);
+        bool flush(Connection& conn);
+        void updateInterest(Connection& conn);
+        void queueSend(Connection& conn, const std::vector<uint8_t>& data);
+
+        bool processInput(Connection& conn);
+        bool processVersion(Connection& conn);
+        bool processKexinit(Connection& conn);
+        bool processKexdh(Connection& conn);
+        bool processNewkeys(Connection& conn);
+        bool processAuth(Connection& conn);
+        bool processTransfer(Connection& conn);
+
+        void startJob(Connection& conn);
+        void finishJob(int fd, uint64_t connectionId);
+
+    public:
+        EventLoop(int listenFd, const std::string& uploadDir, const std::map<std::string, std::string>& users, UploadRegistry& uploads, HashIndex& hashes, ChunkStore* chunks, std::atomic<bool>& running, BackgroundPool& background, bool sharedListener = true);
+        ~EventLoop();
+
+        void pinToCpu(int cpu) { cpu_ = cpu; }
+
+        bool init();
+        void run();
+};
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <cstdint>
+#include "s_file_transfer_protocol.h"
+
+class BackgroundPool;
+
+/**
+ * writes the small files of one FILE_BATCH
+ * each file goes to a temp name next to its final one and is renamed into place once written,
+ * a big batch is split over the background pool so the writes overlap
+ */
+
+namespace FileBatch {
+
+    // one FILE_BATCH on its way to disk, it owns the message so the entries stay valid off the connection thread
+    struct Batch {
+        std::vector<uint8_t> payload;
+        std::vector<FTPProtocol::BatchEntry> entries; // point into payload
+        std::string pathPrefix; // every file lands at pathPrefix + its name
+        std::vector<char> written; // by entry index
+        std::atomic<size_t> slicesLeft;
+    };
+
+    // null when payload is not a FILE_BATCH, payload is moved out either way
+    std::shared_ptr<Batch> parse(std::vector<uint8_t>& payload, const std::string& pathPrefix);
+
+    // done runs once every file is written, on the pool thread that wrote the last of them
+    void writeFiles(BackgroundPool& pool, std::shared_ptr<Batch> batch, std::function<void()> done);
+
+    // index of every file that was not written
+    std::vector<uint32_t> failedFiles(const Batch& batch);
+}
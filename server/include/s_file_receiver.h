@@ -0,0 +1,92 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <utility>
+
+class UringIo;
+// EVP_MD_CTX, openssl headers stay out of here since they clash with the DH class
+struct evp_md_ctx_st;
+
+/**
+ * writes one uploaded file to disk from FILE_DATA chunks
+ * every chunk goes straight to its own offset, out of order ones included, and a ring
+ * bitmap over the next REORDER_WINDOW chunks remembers which ones are already written
+ * the contiguous prefix is tracked separately, with a running digest over it when the upload is resumable
+ * and a SHA-256 over it for the hash index once the whole file is in
+ * each chunk has to start where the one before it ended, a client that leaves holes or overlaps
+ * chunks is dropped instead of getting a file that does not match what the prefix says
+ * for a striped upload it writes one byte range of a file some other code owns
+ */
+
+class FileReceiver {
+    private:
+        int fileFd_;
+        std::string filePath_;
+        uint64_t fileSize_;
+        uint64_t bytesReceived_;
+        uint64_t baseOffset_; // where byte 0 of this upload goes in the file
+        bool ownsFd_;
+        uint32_t expectedChunk_;
+        uint32_t highestChunk_; // one past the highest chunk written so far
+        std::vector<uint64_t> doneBits_; // bit chunk % REORDER_WINDOW is set once a chunk past expectedChunk_ is written
+        // start and end offset of each chunk written ahead, only allocated once one is
+        std::vector<uint64_t> aheadStarts_;
+        std::vector<uint64_t> aheadEnds_;
+        uint64_t committedBytes_; // every byte below this is written
+        bool digestTracked_;
+        uint64_t digest_; // over [0, committedBytes_)
+        evp_md_ctx_st* sha_; // over [0, committedBytes_) as well, null unless trackHash() was called
+        bool hashTracked_;
+        UringIo* uring_; // queue writes on the connection ring instead of write(), null for blocking writes
+        bool uringAttached_;
+
+        bool writeAll(const uint8_t* data, size_t len, uint64_t offset);
+        // the prefix grew over chunks written ahead, read them back for the digest and hash
+        bool digestFromFile(uint64_t from, uint64_t to);
+        bool isDone(uint32_t chunk) const { return doneBits_[(chunk % REORDER_WINDOW) / 64] & (1ULL << (chunk % 64)); }
+        void setDone(uint32_t chunk, bool done);
+        void reset();
+
+    public:
+        // chunks this far past the first missing one are refused, more than any client window
+        static constexpr uint32_t REORDER_WINDOW = 8192;
+
+        FileReceiver();
+        ~FileReceiver();
+
+        FileReceiver(const FileReceiver&) = delete;
+        FileReceiver& operator=(const FileReceiver&) = delete;
+
+        void setUring(UringIo* uring) { uring_ = uring; }
+
+        bool open(const std::string& filePath, uint64_t fileSize);
+        // keep the first committedBytes of an existing file, the chunks that follow start at number 0
+        bool resume(const std::string& filePath, uint64_t fileSize, uint64_t committedBytes);
+        // digest the prefix from here on, starting from the digest of what is already committed
+        void trackDigest(uint64_t digest);
+        // SHA-256 of the whole file, only for an upload that starts at byte 0
+        bool trackHash();
+        // false unless the hash was tracked and every byte of the file is committed
+        bool contentHash(uint8_t* hash);
+        // one part of a striped upload, length bytes at offset into an fd that stays open after close()
+        bool openPart(int fileFd, const std::string& filePath, uint64_t offset, uint64_t length);
+        // offset is relative to the start of the file or part
+        bool writeChunk(uint32_t chunkNumber, uint64_t offset, const uint8_t* data, size_t len);
+        // everything written so far reaches the disk
+        bool sync();
+        bool close();
+
+        bool isOpen() const { return fileFd_ >= 0; }
+        bool isComplete() const { return committedBytes_ == fileSize_; }
+        // every chunk below this one is written
+        uint32_t expectedChunk() const { return expectedChunk_; }
+        // runs of out of order chunks already written as [first, last], at most maxRanges of them
+        std::vector<std::pair<uint32_t, uint32_t>> heldRanges(size_t maxRanges) const;
+        uint64_t bytesReceived() const { return bytesReceived_; }
+        uint64_t committedBytes() const { return committedBytes_; }
+        uint64_t digest() const { return digest_; }
+        uint64_t fileSize() const { return fileSize_; }
+        const std::string& filePath() const { return filePath_; }
+};
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+class ChunkStore;
+
+/**
+ * reads one byte range of a stored file for FILE_GET
+ * the range is mapped read only and chunks are handed out as pointers into the mapping,
+ * the caller encrypts them straight from the page cache without copying them first
+ * stored files are only ever replaced by rename, never rewritten, so a mapping stays valid
+ * a deduplicated file is read from its stored chunks instead, mapped one chunk at a time
+ */
+
+class FileSender {
+    private:
+        int fileFd_;
+        std::string filePath_;
+        uint8_t* map_;
+        size_t mapLength_;
+        const uint8_t* data_; // first byte of the range inside the mapping
+        uint64_t fileSize_;
+        uint64_t offset_;
+        uint64_t length_;
+        uint64_t bytesSent_;
+        uint32_t chunkSize_;
+        uint32_t chunkNumber_; // next chunk to hand out
+
+        // deduplicated file only, where each stored chunk sits in the file
+        struct Segment {
+            std::string path;
+            uint64_t offset;
+            uint32_t length;
+        };
+        std::vector<Segment> segments_;
+        size_t segment_; // the one currently mapped at map_
+
+        bool mapSegment(size_t index);
+
+    public:
+        FileSender();
+        ~FileSender();
+
+        FileSender(const FileSender&) = delete;
+        FileSender& operator=(const FileSender&) = delete;
+
+        // the range is clamped to the file, an offset past the end leaves nothing to send
+        bool open(const std::string& filePath, uint64_t offset, uint64_t length, uint32_t chunkSize);
+        // same for a file that only exists as a manifest of chunks in the store
+        bool openManifest(const ChunkStore& store, const std::string& filePath, uint64_t offset, uint64_t length, uint32_t chunkSize);
+        void close();
+
+        // next chunk of the range, points into the mapping and stays valid until close()
+        // or, for a deduplicated file, until the next call, a chunk never spans two stored chunks
+        // offset is relative to the start of the range, null once everything was handed out
+        const uint8_t* nextChunk(uint32_t& chunkNumber, uint64_t& offset, uint32_t& length);
+
+        bool isComplete() const { return bytesSent_ >= length_; }
+        uint32_t chunksSent() const { return chunkNumber_; }
+        uint64_t fileSize() const { return fileSize_; }
+        uint64_t offset() const { return offset_; }
+        uint64_t length() const { return length_; }
+        uint32_t chunkSize() const { return chunkSize_; }
+        const std::string& filePath() const { return filePath_; }
+};
@@ -3,8 +3,13 @@
 #include <vector>
 #include <string>
 #include <cstdint>
+#include <utility>
+#include <span>
 
-class SimpleCrypto;
+class PacketCipher;
+class UringIo;
+class FrameReader;
+class SendBatch;
 
 namespace FTPProtocol {
 
@@ -13,32 +18,70 @@ namespace FTPProtocol {
         FILE_DATA = 2,
         FILE_END = 3,
         FILE_ERROR = 4,
-        DISCONNECT = 5
+        DISCONNECT = 5,
+        FILE_ACK = 6,
+        UPLOAD_INIT = 7,     // striped upload, creates it and answers with its id
+        UPLOAD_PART = 8,     // this connection sends one byte range of it
+        UPLOAD_COMPLETE = 9, // all parts are in, publish the file
+        FILE_GET = 10,       // read a byte range of a stored file back, answered with FILE_DATA
+        FILE_BATCH = 11,     // many small files in one message, answered once for all of them
+        DELTA_START = 12,    // re-upload against the copy the server already has, answered with its block size
+        DELTA_SIGNATURES = 13, // server block signatures of that copy
+        DELTA_DATA = 14,     // copy and literal instructions that rebuild the new file from it
+        DEDUPE_START = 15,   // a file as a list of chunk hashes, answered with the chunks the server does not have
+        CHUNK_DATA = 16,     // one of those chunks
+        FILE_PRESENT = 17,   // FILE_START, DELTA_START or UPLOAD_INIT reply, the server already has that content under the name
+        DEDUPE_UNSUPPORTED = 18 // DEDUPE_START reply, the server keeps no chunk store
     };
 
-    constexpr uint32_t MAX_CHUNK_SIZE = 8192;
+    constexpr size_t FILE_VERSION_OFFSET = 16;
+    // running digest of a resumable upload, 64 bit FNV-1a so it fits in a journal line
+    constexpr uint64_t DIGEST_SEED = 0xcbf29ce484222325ULL;
+    constexpr uint32_t DEFAULT_CHUNK_SIZE = 8192; // what a client that asks for nothing gets
+    constexpr uint32_t MIN_CHUNK_SIZE = 4096;
+    constexpr uint32_t MAX_CHUNK_SIZE = 4 * 1024 * 1024; // the most the server agrees to in FILE_START
     constexpr uint32_t MAX_FILENAME_LENGTH = 255;
+    constexpr uint32_t MAX_ENCRYPTED_FRAME_SIZE = 1 << 24;
+    constexpr uint32_t MAX_ACK_RANGES = 16;
+    constexpr uint64_t WHOLE_FILE = UINT64_MAX; // FILE_GET length for everything from the offset on
+    constexpr uint32_t MAX_BATCH_FILES = 4096;
+    constexpr size_t STRONG_HASH_SIZE = 16; // leading bytes of the SHA-256 of a block
+    constexpr size_t FILE_HASH_SIZE = 32;   // SHA-256 of a whole file, sent with the FILE_END of a delta
+                                            // and after the name in FILE_START when the client wants a short cut
+    constexpr uint32_t SIGNATURES_PER_MESSAGE = 32768;
+    // DELTA_DATA is a run of these, each followed by its fields
+    constexpr uint8_t DELTA_COPY = 1;    // [first block][block count] of the server copy
+    constexpr uint8_t DELTA_LITERAL = 2; // [length][bytes] that are new
+    constexpr size_t CHUNK_HASH_SIZE = 32;  // SHA-256, a stored chunk is named after it
+    constexpr uint32_t MAX_CHUNK_REFS = 1 << 18; // keeps a DEDUPE_START under MAX_ENCRYPTED_FRAME_SIZE
+    constexpr uint32_t MAX_DEDUPE_CHUNK_SIZE = 1024 * 1024;
 
     // file tranfer struct header
+    // channelId sits in what used to be padding, 0 is the one channel older peers know about
+    // every file in flight on a connection has its own channel, replies carry the same id
     struct FTPHeader {
         uint8_t messageType;
+        uint16_t channelId;
         uint32_t payloadLength;
         uint32_t sequenceNumber;
         
-        FTPHeader(uint8_t type = 0, uint32_t length = 0, uint32_t seq = 0){
+        FTPHeader(uint8_t type = 0, uint32_t length = 0, uint32_t seq = 0, uint16_t channel = 0){
             messageType = type;
+            channelId = channel;
             payloadLength = length;
             sequenceNumber = seq;
         }
     };
 
     // file start message struct
+    // the client file version (modification time) is sent in the 8 padding bytes at FILE_VERSION_OFFSET,
+    // 0 there means the server keeps no resume journal for the file
     struct FileStartMessage {
         uint32_t filenameLength;
         uint64_t fileSize;
         uint32_t chunkSize;
         
-        FileStartMessage(uint32_t name_len = 0, uint64_t size = 0, uint32_t chunk = MAX_CHUNK_SIZE){
+        FileStartMessage(uint32_t name_len = 0, uint64_t size = 0, uint32_t chunk = DEFAULT_CHUNK_SIZE){
             filenameLength = name_len;
             fileSize = size;
             chunkSize = chunk;
@@ -46,24 +89,189 @@ namespace FTPProtocol {
     };
 
     // file data message struct
+    // offset is where the chunk goes in the file (or part), chunk sizes may change mid file
     struct FileDataMessage {
         uint32_t chunkNumber;
         uint32_t dataLength;
+        uint64_t offset;
         
-        FileDataMessage(uint32_t chunk = 0, uint32_t length = 0){
+        FileDataMessage(uint32_t chunk = 0, uint32_t length = 0, uint64_t off = 0){
             chunkNumber = chunk;
             dataLength = length;
+            offset = off;
         }
     };
 
+    // FILE_ACK from the server, every chunk below nextChunk has arrived
+    // followed by rangeCount pairs of [first, last] chunks that arrived past a gap
+    struct FileAckMessage {
+        uint32_t nextChunk;
+        uint32_t rangeCount;
 
+        FileAckMessage(uint32_t next = 0, uint32_t count = 0){
+            nextChunk = next;
+            rangeCount = count;
+        }
+    };
+
+    using ChunkRange = std::pair<uint32_t, uint32_t>; // first and last chunk, both included
+
+    // one DELTA_DATA instruction, literal points into the payload
+    struct DeltaOp {
+        uint8_t type;
+        uint32_t firstBlock;
+        uint32_t blockCount;
+        const uint8_t* literal;
+        uint32_t length;
+    };
+
+    // one file unpacked from a FILE_BATCH, data points into the payload
+    struct BatchEntry {
+        std::string filename;
+        const uint8_t* data;
+        uint64_t size;
+    };
+
+    // UPLOAD_INIT payload, same layout as FILE_START with the part count in place of the chunk size
+    struct UploadInitMessage {
+        uint32_t filenameLength;
+        uint64_t fileSize;
+        uint32_t partCount;
+
+        UploadInitMessage(uint32_t name_len = 0, uint64_t size = 0, uint32_t parts = 1){
+            filenameLength = name_len;
+            fileSize = size;
+            partCount = parts;
+        }
+    };
+
+    // UPLOAD_PART payload, FILE_DATA chunks that follow are relative to offset
+    struct UploadPartMessage {
+        uint64_t uploadId;
+        uint64_t offset;
+        uint64_t length;
+        uint32_t chunkSize;
+
+        UploadPartMessage(uint64_t id = 0, uint64_t off = 0, uint64_t len = 0, uint32_t chunk = DEFAULT_CHUNK_SIZE){
+            uploadId = id;
+            offset = off;
+            length = len;
+            chunkSize = chunk;
+        }
+    };
+
+    // FILE_GET payload, followed by the file name
+    // the range is clamped to the file, a length of 0 only asks for the file size
+    struct FileGetMessage {
+        uint64_t offset;
+        uint64_t length;
+        uint32_t chunkSize;
+        uint32_t filenameLength;
+
+        FileGetMessage(uint64_t off = 0, uint64_t len = WHOLE_FILE, uint32_t chunk = DEFAULT_CHUNK_SIZE, uint32_t name_len = 0){
+            offset = off;
+            length = len;
+            chunkSize = chunk;
+            filenameLength = name_len;
+        }
+    };
+
+    // FILE_BATCH payload is [file count] then for every file this, its name and its data
+    struct FileBatchEntry {
+        uint64_t fileSize;
+        uint32_t filenameLength;
+
+        FileBatchEntry(uint64_t size = 0, uint32_t name_len = 0){
+            fileSize = size;
+            filenameLength = name_len;
+        }
+    };
+
+    // DEDUPE_START payload is this, the file name, then [length][hash] for every chunk in file order
+    struct DedupeStartMessage {
+        uint64_t fileSize;
+        uint32_t chunkCount;
+        uint32_t filenameLength;
+
+        DedupeStartMessage(uint64_t size = 0, uint32_t count = 0, uint32_t name_len = 0){
+            fileSize = size;
+            chunkCount = count;
+            filenameLength = name_len;
+        }
+    };
+
+    // one chunk of a deduplicated file
+    struct ChunkRef {
+        uint32_t length;
+        uint8_t hash[CHUNK_HASH_SIZE];
+    };
+
+    // one block of the server copy, weak is the rolling checksum
+    struct BlockSignature {
+        uint32_t weak;
+        uint8_t strong[STRONG_HASH_SIZE];
+    };
+
+
+    // sizeof(FTPHeader) bytes at out
+    void serializeHeader(const FTPHeader& header, uint8_t* out);
+    bool deserializeHeader(std::span<const uint8_t> data, FTPHeader& header);
+
+    bool parseFileStartMessage(const std::vector<uint8_t>& data, std::string& filename, uint64_t& fileSize, uint32_t& chunkSize, uint64_t& fileVersion);
+    // SHA-256 of the whole file right after the name in FILE_START, DELTA_START or UPLOAD_INIT,
+    // false when the client did not send one
+    bool parseContentHash(const std::vector<uint8_t>& data, uint8_t* hash);
+    // chunkData points into data, the chunk is not copied out
+    bool parseFileDataMessage(const std::vector<uint8_t>& data, uint32_t& chunkNumber, uint64_t& offset, const uint8_t*& chunkData, uint32_t& chunkLength);
+    // FILE_START reply payload, the chunk size both sides use for this file
+    // resumeOffset bytes are already on the server, digest covers them
+    std::vector<uint8_t> createFileStartReply(uint32_t chunkSize, uint64_t resumeOffset = 0, uint64_t digest = DIGEST_SEED);
+    uint64_t updateDigest(uint64_t digest, const uint8_t* data, size_t len);
+    bool parseUploadInitMessage(const std::vector<uint8_t>& data, std::string& filename, uint64_t& fileSize, uint32_t& partCount);
+    bool parseUploadPartMessage(const std::vector<uint8_t>& data, uint64_t& uploadId, uint64_t& offset, uint64_t& length, uint32_t& chunkSize);
+    // UPLOAD_INIT reply and UPLOAD_COMPLETE request, just the id
+    std::vector<uint8_t> createUploadIdMessage(uint64_t uploadId);
+    bool parseUploadIdMessage(const std::vector<uint8_t>& data, uint64_t& uploadId);
+    // written into data so a session can reuse one buffer for every ack
+    void createFileAckMessage(std::vector<uint8_t>& data, uint32_t nextChunk, const std::vector<ChunkRange>& ranges);
+    // FILE_ACK from a downloading client, only the cumulative part
+    bool parseFileAckMessage(const std::vector<uint8_t>& data, uint32_t& nextChunk);
+    bool parseFileGetMessage(const std::vector<uint8_t>& data, std::string& filename, uint64_t& offset, uint64_t& length, uint32_t& chunkSize);
+    // FILE_GET reply payload --> [file size][offset][length][chunk size] of the range that follows
+    std::vector<uint8_t> createFileGetReply(uint64_t fileSize, uint64_t offset, uint64_t length, uint32_t chunkSize);
+    // DELTA_START reply payload --> [block size][block count], the signatures follow in DELTA_SIGNATURES
+    std::vector<uint8_t> createDeltaStartReply(uint32_t blockSize, uint32_t blockCount);
+    // count signatures starting at first, [count] then [weak][strong] for each
+    std::vector<uint8_t> createDeltaSignaturesMessage(const std::vector<BlockSignature>& signatures, size_t first, size_t count);
+    bool parseDeltaDataMessage(const std::vector<uint8_t>& data, std::vector<DeltaOp>& ops);
+    bool parseFileBatchMessage(const std::vector<uint8_t>& data, std::vector<BatchEntry>& entries);
+    // FILE_BATCH reply payload --> [file count][failed count][index of every file that was not written]
+    std::vector<uint8_t> createFileBatchReply(uint32_t fileCount, const std::vector<uint32_t>& failed);
+
+    bool parseDedupeStartMessage(const std::vector<uint8_t>& data, std::string& filename, uint64_t& fileSize, std::vector<ChunkRef>& chunks);
+    // DEDUPE_START reply payload --> [count][index of every chunk the client has to send]
+    std::vector<uint8_t> createMissingChunksReply(const std::vector<uint32_t>& missing);
+    // CHUNK_DATA payload --> [chunk index][bytes], chunkData points into data
+    bool parseChunkDataMessage(const std::vector<uint8_t>& data, uint32_t& index, const uint8_t*& chunkData, uint32_t& chunkLength);
 
-    std::vector<uint8_t> serializeHeader(const FTPHeader& header);
-    bool deserializeHeader(const std::vector<uint8_t>& data, FTPHeader& header);
+    // encrypted message appended to out as it goes on the wire --> [header size][header][payload size][payload]
+    // false when encrypting failed, out then ends where the failed frame would have started
+    bool appendEncryptedMessage(std::vector<uint8_t>& out, uint8_t messageType, const std::vector<uint8_t>& payload, uint32_t sequenceNumber, PacketCipher& crypto, uint16_t channelId = 0);
 
-    bool parseFileStartMessage(const std::vector<uint8_t>& data, std::string& filename, uint64_t& fileSize, uint32_t& chunkSize);
-    bool parseFileDataMessage(const std::vector<uint8_t>& data, uint32_t& chunkNumber, std::vector<uint8_t>& file_data);
+    // FILE_DATA appended to out as wire bytes, data is encrypted where it lies and never copied in the clear
+    bool appendEncryptedFileData(std::vector<uint8_t>& out, uint32_t chunkNumber, uint64_t offset, const uint8_t* data, uint32_t length, uint32_t sequenceNumber, PacketCipher& crypto, uint16_t channelId);
 
-    bool sendEncryptedMessage(int socket_fd, uint8_t messageType, const std::vector<uint8_t>& payload, uint32_t sequenceNumber, SimpleCrypto& crypto);
-    bool receiveEncryptedMessage(int socket_fd, FTPHeader& header, std::vector<uint8_t>& payload, SimpleCrypto& crypto);
+    // encrypt and queue, nothing is sent until the batch is flushed
+    // false when encrypting failed, the batch then holds frames that must never be flushed
+    bool queueEncryptedMessage(SendBatch& batch, uint8_t messageType, const std::vector<uint8_t>& payload, uint32_t sequenceNumber, PacketCipher& crypto, uint16_t channelId = 0);
+    bool sendEncryptedMessage(int socket_fd, uint8_t messageType, const std::vector<uint8_t>& payload, uint32_t sequenceNumber, PacketCipher& crypto);
+    // the frames every receive path ends up with, decrypted where they lie
+    // header frame --> header
+    bool openEncryptedHeader(std::span<uint8_t> frame, FTPHeader& header, PacketCipher& crypto);
+    // payload frame --> the plain payload, the MAC is cut off the end
+    bool openEncryptedPayload(std::vector<uint8_t>& frame, PacketCipher& crypto);
+    // the payload is read into payload and decrypted there, keep passing the same vector and
+    // steady state reads do not allocate
+    bool receiveEncryptedMessage(FrameReader& reader, FTPHeader& header, std::vector<uint8_t>& payload, PacketCipher& crypto);
+    bool receiveEncryptedMessage(UringIo& io, FTPHeader& header, std::vector<uint8_t>& payload, PacketCipher& crypto);
 }
\ No newline at end of file
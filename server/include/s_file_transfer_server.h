@@ -5,29 +5,88 @@
 #include <map>
 #include <atomic>
 #include <thread>
+#include <chrono>
+#include <memory>
+#include <sys/socket.h>
 #include "s_kex.h"
+#include "s_upload_registry.h"
+#include "s_chunk_store.h"
+#include "s_hash_index.h"
+#include "s_background_pool.h"
 
 // Forward declaration
-class SimpleCrypto;
+class Session;
+
+// how accepted connections are served
+enum class ServerMode {
+    THREADS, // one detached thread per client, blocking sockets
+    POOL,    // fixed worker pool fed from a bounded queue, blocking sockets
+    EPOLL,   // fixed number of non-blocking epoll event loops
+    CORO,    // fixed number of epoll schedulers running one coroutine per client
+    SHARDED  // one SO_REUSEPORT listener + event loop per core, each pinned to its core
+};
+
+// what the accept loop does when the worker pool queue is full
+enum class QueueFullPolicy {
+    REJECT,  // tell the client the server is busy and hang up
+    BACKLOG  // stop accepting so new clients wait in the kernel listen backlog
+};
+
+// how the blocking modes read the socket and write uploads in the transfer phase
+enum class IoBackend {
+    BLOCKING, // recv + write per message
+    URING     // io_uring with registered buffers and fixed files, falls back to BLOCKING
+};
+
+struct ServerConfig {
+    ServerMode mode;
+    int eventLoops; // number of event loop or coroutine scheduler threads, 0 --> one per core
+    int shards; // number of SO_REUSEPORT listeners, 0 --> one per core
+    int listenBacklog;
+    int poolWorkers; // 0 --> one per core
+    int poolQueueDepth;
+    QueueFullPolicy queueFullPolicy;
+    IoBackend ioBackend;
+    std::chrono::seconds resumeTimeout; // partial uploads untouched this long are deleted
+    bool dedupe; // keep a content addressed chunk store and accept deduplicated uploads
+    std::string cipherCache; // where the cipher benchmark is kept between starts, empty --> measured every start
+
+    ServerConfig(ServerMode serverMode = ServerMode::THREADS, int loops = 0, int backlog = SOMAXCONN){
+        mode = serverMode;
+        eventLoops = loops;
+        shards = 0;
+        listenBacklog = backlog;
+        poolWorkers = 0;
+        poolQueueDepth = 64;
+        queueFullPolicy = QueueFullPolicy::REJECT;
+        ioBackend = IoBackend::BLOCKING;
+        resumeTimeout = std::chrono::hours(24);
+        dedupe = false;
+    }
+};
 
 class FileTransferServer {
 private:
     int serverSocket_;
+    std::vector<int> shardSockets_; // SHARDED mode only, every one bound to port_
     int port_;
     std::string uploadDir_;
+    ServerConfig config_;
     std::atomic<bool> running_;
     
     // for user authentication
     // TODO: CHANGE THIS TO SOMETHING BETTER
     // Current is map<username, password>
     std::map<std::string, std::string> users_;
-
-    SimpleCrypto* sendCrypto_;
-    SimpleCrypto* recvCrypto_;
+    UploadRegistry uploads_; // striped uploads, shared by every connection
+    std::unique_ptr<HashIndex> hashes_; // SHA-256 of every stored upload, shared by every connection
+    std::unique_ptr<ChunkStore> chunks_; // only with --dedupe=on, shared by every connection
+    std::unique_ptr<BackgroundPool> background_; // disk work handed off by every connection
+    std::thread sweeper_; // removes partial uploads nobody came back for
 
 public:
     // defauly values --> port = 2222, uploadDir = ./uploads
-    FileTransferServer(int port = 2222, const std::string& uploadDir = "./uploads");
+    FileTransferServer(int port = 2222, const std::string& uploadDir = "./uploads", const ServerConfig& config = ServerConfig());
 
     ~FileTransferServer();
     
@@ -36,11 +95,17 @@ public:
     void stop();
 
 private:
+    int createListener(bool reusePort);
+    int acceptClient();
+    void runWorkerPool();
+    void runEventLoops();
+    void runCoroLoops();
+    void runShards();
     void handleClient(int clientSocket);
-    bool handleVersionExchange(int clientSocket);
-    bool handleKexinitExchange(int clientSocket, KexMatch& matchedKex);
-    bool handleKeyExchange(int clientSocket);
-    std::vector<uint8_t> generateServerKexdhReply(const std::vector<uint8_t>& clientKexdhPayload);
-    bool handleAuthentication(int clientSocket, std::string& username);
-    void handleFileTransfer(int clientSocket, const std::string& username);
+    bool handleVersionExchange(Session& session);
+    bool handleKexinitExchange(Session& session);
+    bool handleKeyExchange(Session& session);
+    bool handleAuthentication(Session& session, std::string& username);
+    void handleFileTransfer(Session& session);
+    void sweepPartialUploads();
 };
\ No newline at end of file
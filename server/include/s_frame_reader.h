@@ -0,0 +1,56 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#include <sys/types.h>
+
+/**
+ * per connection receive buffer
+ * one recv pulls in as much as the socket has so a single syscall can carry many frames,
+ * frames are parsed straight out of the buffer and a partial frame stays in place
+ * until the rest of it arrives
+ */
+
+class FrameReader {
+    private:
+        static constexpr size_t DEFAULT_CAPACITY = 64 * 1024;
+
+        int fd_;
+        size_t capacity_;
+        std::vector<uint8_t> buffer_; // allocated on the first fill so idle connections stay small
+        size_t start_; // first unread byte
+        size_t end_;   // one past the last received byte
+        std::vector<uint8_t> scratch_;
+        uint64_t recvCalls_;
+
+        // make room for len contiguous bytes from start_
+        void reserve(size_t len);
+
+    public:
+        explicit FrameReader(int fd = -1, size_t capacity = DEFAULT_CAPACITY);
+
+        int fd() const { return fd_; }
+
+        // one recv into the free space --> bytes read, 0 when the peer closed, -1 on error (check errno)
+        ssize_t fill();
+
+        const uint8_t* data() const { return buffer_.data() + start_; }
+        size_t available() const { return end_ - start_; }
+        void consume(size_t len);
+
+        // [4 byte big endian length][body], keepLength leaves the length in front like unwrapPacket expects
+        // returns 1 when a frame was taken, 0 while it is still incomplete, -1 on a bad length
+        int takeFrame(std::vector<uint8_t>& frame, bool keepLength, uint32_t maxSize);
+
+        // blocking versions, keep calling fill() until there is enough
+        bool readExact(void* out, size_t len);
+        bool readLine(std::string& line, size_t maxLength);
+        bool readFrame(std::vector<uint8_t>& frame, bool keepLength, uint32_t maxSize);
+
+        // reused between messages so steady state reads do not allocate
+        std::vector<uint8_t>& scratch() { return scratch_; }
+
+        uint64_t recvCalls() const { return recvCalls_; }
+};
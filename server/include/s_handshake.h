@@ -0,0 +1,34 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <map>
+#include "s_internet_traffic_protocol.h"
+
+class Session;
+
+/**
+ * server side of every handshake step as plain functions over bytes
+ * the threads, epoll and coroutine modes only differ in how the bytes get here and how
+ * the reply leaves, what is checked and what is answered lives in one place
+ */
+
+namespace Handshake {
+    extern const std::string SERVER_VERSION;
+
+    // the line the client sent, newline included
+    bool checkVersion(const std::string& clientVersion);
+
+    // client KEXINIT packet --> server KEXINIT packet in reply, the match is stored on the session
+    bool answerKexinit(Session& session, const std::vector<uint8_t>& clientKexPacket, std::vector<uint8_t>& reply);
+
+    // client KEXDH_INIT packet --> KEXDH_REPLY + NEWKEYS packets in reply, the session gets its ciphers
+    bool answerKexdh(Session& session, const std::vector<uint8_t>& clientKexdhPacket, std::vector<uint8_t>& reply);
+
+    bool checkNewkeys(const std::vector<uint8_t>& clientNewkeysPacket);
+
+    // AUTH_REQUEST --> true and the username once the credentials check out
+    // reply holds AUTH_SUCCESS or AUTH_FAILURE whenever credentials were checked, empty when the request was bad
+    bool answerAuth(const ITPProtocol::ITPHeader& header, const std::vector<uint8_t>& payload, const std::map<std::string, std::string>& users,
+                    std::string& username, std::vector<uint8_t>& reply);
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <cstdint>
+#include "s_file_transfer_protocol.h"
+
+/**
+ * SHA-256 of every stored upload, so a client that sends the hash of a file in FILE_START
+ * can skip sending content the server already has
+ * a file is only looked up for the user who uploaded it, knowing a hash is not enough to get
+ * someone else's file
+ * the index is kept in memory and every new entry is appended to <upload dir>/.hashindex,
+ * an entry remembers the size, modification time and inode it was made for and is dropped
+ * once the file no longer has them, so files replaced or edited behind its back are never linked
+ * uploads that were not seen in order (striped or resumed) are read back by a background thread
+ * shared by every connection, all calls are thread safe
+ */
+
+class HashIndex {
+    private:
+        struct Entry {
+            std::string hash; // raw SHA-256
+            std::string owner;
+            uint64_t size;
+            int64_t modified; // nanoseconds
+            uint64_t inode;
+        };
+
+        std::mutex mutex_;
+        std::string logPath_;
+        int logFd_;
+        std::unordered_map<std::string, Entry> byPath_;
+        std::unordered_multimap<std::string, std::string> byHash_; // hash --> path
+
+        std::thread hasher_;
+        std::condition_variable wake_;
+        std::deque<std::pair<std::string, std::string>> toHash_; // path and owner
+        bool stopping_;
+
+        // still the same file the entry was made for
+        static bool matches(const std::string& path, const Entry& entry);
+        void forget(const std::string& path);
+        void append(const std::string& path, const Entry& entry);
+        void insert(const std::string& path, const Entry& entry);
+        void runHasher();
+
+    public:
+        explicit HashIndex(const std::string& uploadDir);
+        ~HashIndex();
+
+        HashIndex(const HashIndex&) = delete;
+        HashIndex& operator=(const HashIndex&) = delete;
+
+        // loads the log, drops entries that went stale while the server was down and rewrites it
+        bool init();
+
+        // path was just written with this content
+        void add(const std::string& path, const std::string& owner, const uint8_t* hash);
+        // path was just written, its content is read back and hashed off the connection thread
+        void hashLater(const std::string& path, const std::string& owner);
+
+        // puts a stored file of owner with this content under path, a hard link since every upload
+        // replaces a file by renaming over it and never writes into it
+        // false when owner has no such file and the content has to be sent
+        bool claim(const uint8_t* hash, uint64_t size, const std::string& owner, const std::string& path);
+};
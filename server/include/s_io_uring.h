@@ -0,0 +1,112 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <sys/uio.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+/**
+ * minimal io_uring ring on top of the raw syscalls (no liburing needed)
+ */
+
+class IoUring {
+    private:
+        int ringFd_;
+        unsigned entries_;
+
+        void* sqRing_;
+        void* cqRing_;
+        size_t sqRingSize_;
+        size_t cqRingSize_;
+        io_uring_sqe* sqes_;
+        size_t sqesSize_;
+
+        unsigned* sqHead_;
+        unsigned* sqTail_;
+        unsigned* sqMask_;
+        unsigned* sqArray_;
+        unsigned* cqHead_;
+        unsigned* cqTail_;
+        unsigned* cqMask_;
+        io_uring_cqe* cqes_;
+
+        unsigned localTail_; // sqes handed out but not yet submitted to the kernel
+        unsigned submittedTail_;
+
+    public:
+        IoUring();
+        ~IoUring();
+
+        bool init(unsigned entries);
+        void destroy();
+        bool isReady() const { return ringFd_ >= 0; }
+
+        bool registerBuffers(const std::vector<struct iovec>& buffers);
+        bool registerFiles(const std::vector<int>& fds);
+        bool updateFile(unsigned index, int fd);
+
+        // null when the submission queue is full
+        io_uring_sqe* getSqe();
+        unsigned pendingSubmissions() const { return localTail_ - submittedTail_; }
+        // hand every queued sqe to the kernel and wait for at least waitNr completions
+        int submit(unsigned waitNr);
+
+        io_uring_cqe* peekCqe();
+        void cqeSeen();
+};
+
+/**
+ * io_uring backed I/O for one client connection in the transfer phase
+ * socket reads land in a registered receive buffer and upload writes are copied into
+ * registered write slots, queued writes ride along with the next socket read so one
+ * io_uring_enter covers both
+ */
+
+class UringIo {
+    private:
+        static constexpr size_t RECV_BUFFER_SIZE = 128 * 1024;
+        static constexpr size_t WRITE_SLOT_SIZE = 64 * 1024;
+        static constexpr size_t WRITE_SLOTS = 8;
+
+        IoUring ring_;
+        int socketFd_;
+        bool fileAttached_;
+
+        std::vector<uint8_t> recvBuffer_;
+        size_t recvStart_;
+        size_t recvEnd_;
+
+        std::vector<uint8_t> writeArena_;
+        std::vector<unsigned> freeSlots_;
+        size_t writesInFlight_;
+        bool writeFailed_;
+
+        bool readPending_;
+        int readResult_;
+
+        void reapCompletions();
+        bool waitForRead();
+        bool waitForSlot();
+
+    public:
+        UringIo();
+        ~UringIo();
+
+        bool init(int socketFd);
+
+        // bytes another reader already pulled off the socket, served before anything new
+        bool preload(const uint8_t* data, size_t len);
+        // blocking read of exactly len bytes from the socket
+        bool recvExact(void* data, size_t len);
+
+        // one upload file at a time, a second channel falls back to pwrite
+        bool attachFile(int fileFd);
+        void detachFile();
+        bool fileAttached() const { return fileAttached_; }
+        bool queueWrite(const uint8_t* data, size_t len, uint64_t offset);
+        bool flushWrites();
+        bool writeFailed() const { return writeFailed_; }
+};
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+// openssl/evp.h is left out on purpose, its DH typedef clashes with our DH class
+struct evp_md_ctx_st;
+
+/**
+ * the MACs SimpleCrypto can be built with, each one hashes the packet sequence number followed by
+ * the encrypted bytes into SIZE bytes, compute() is false when the MAC could not be worked out
+ */
+
+// the XOR and rotate hash SimpleCrypto always used, "hmac-kim"
+class KimMac {
+    private:
+        // feed len more bytes into a 16 byte hash, position is how many came before them
+        static void simpleHashUpdate(uint8_t* hash, const uint8_t* data, size_t len, size_t position);
+
+    public:
+        static constexpr size_t SIZE = 16;
+
+        KimMac(uint64_t sharedSecret, bool is_client);
+        bool valid() const { return true; }
+        bool compute(uint32_t sequenceNumber, const uint8_t* encrypted, size_t len, uint8_t* mac);
+};
+
+// HMAC-SHA256 cut to 16 bytes, "hmac-sha2-256", its key comes from HKDF over the DH shared secret
+class HmacSha256 {
+    private:
+        // SHA-256 already fed the inner and outer padded key, every packet starts from copies of them
+        evp_md_ctx_st* inner_;
+        evp_md_ctx_st* outer_;
+        evp_md_ctx_st* work_;
+        bool ready_;
+
+    public:
+        static constexpr size_t SIZE = 16;
+
+        HmacSha256(uint64_t sharedSecret, bool is_client);
+        ~HmacSha256();
+        HmacSha256(const HmacSha256&) = delete;
+        HmacSha256& operator=(const HmacSha256&) = delete;
+
+        // false when the key or the SHA-256 contexts could not be set up
+        bool valid() const { return ready_; }
+        bool compute(uint32_t sequenceNumber, const uint8_t* encrypted, size_t len, uint8_t* mac);
+};
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <span>
+#include <sys/uio.h>
+
+/**
+ * outgoing wire bytes gathered as separate pieces and pushed out with one sendmsg
+ * length prefixes sit next to the bytes they describe so nothing gets copied into
+ * a staging buffer, one message is one syscall and messages queued together share it
+ * frames can also be built straight in the batch's own buffer, which keeps its size between
+ * flushes so steady state sends do not allocate
+ */
+
+class SendBatch {
+    private:
+        struct Piece {
+            uint32_t lengthNet; // big endian length sent in front of bytes
+            bool prefixed;
+            std::vector<uint8_t> bytes;
+            size_t stagedAt; // where a staged piece starts in staged_
+            size_t stagedLength; // 0 for a piece that owns bytes
+        };
+
+        std::vector<Piece> pieces_;
+        std::vector<uint8_t> staged_;
+        size_t stagedEnd_;
+        std::vector<struct iovec> iov_; // rebuilt on every flush, kept for its capacity
+        size_t pendingBytes_;
+        uint64_t sendCalls_;
+
+    public:
+        SendBatch();
+
+        // [4 byte big endian length][bytes]
+        void addFrame(std::vector<uint8_t>&& bytes);
+        // bytes as they are
+        void addRaw(std::vector<uint8_t>&& bytes);
+        // [4 byte big endian length][length bytes] at the end of the batch, the caller fills in the
+        // returned bytes, they stay valid until the next stageFrame or flush
+        std::span<uint8_t> stageFrame(size_t length);
+
+        bool empty() const { return pieces_.empty(); }
+        size_t pendingBytes() const { return pendingBytes_; }
+
+        // blocking send of everything queued, the batch is empty afterwards either way
+        bool flush(int socketFd);
+
+        uint64_t sendCalls() const { return sendCalls_; }
+};
+
+// sendmsg until every iovec is out, a short send continues where the kernel stopped
+// the array is modified on the way, returns the number of sendmsg calls or -1 on error
+int sendIovecs(int socketFd, struct iovec* iov, size_t count);
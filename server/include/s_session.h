@@ -0,0 +1,215 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <chrono>
+#include <functional>
+#include <cstdint>
+#include "s_file_receiver.h"
+#include "s_file_sender.h"
+#include "s_delta_receiver.h"
+#include "s_frame_reader.h"
+#include "s_buffer_tuner.h"
+#include "s_upload_registry.h"
+#include "s_upload_journal.h"
+#include "s_chunk_store.h"
+#include "s_hash_index.h"
+#include "s_kex.h"
+
+class PacketCipher;
+class UringIo;
+class BackgroundPool;
+
+/**
+ * everything one client connection owns, created when the connection is accepted
+ * and gone when it closes so concurrent clients never share keys or sequence numbers
+ * the transfer phase is a message at a time state machine, replies are handed back as
+ * wire bytes so the blocking handlers and the event loops can both drive it
+ * every file in flight has its own channel, FILE_DATA for many files can arrive interleaved
+ * downloads run on channels too, their FILE_DATA goes out a window at a time as the client acks it
+ * so do delta uploads, which rebuild a file from the copy already stored instead of receiving all of it,
+ * and deduplicated uploads, which only receive the chunks the chunk store does not have yet
+ * a message that keeps the disk busy for a while leaves a job behind instead, whoever drives the
+ * session runs it off its own thread and the connection reads nothing more until it is finished
+ */
+
+class Session {
+    private:
+        int socketFd_;
+        std::string uploadDir_;
+        std::string username_;
+
+        std::unique_ptr<PacketCipher> sendCrypto_; // server_to_client
+        std::unique_ptr<PacketCipher> recvCrypto_; // client_to_server
+        KexMatch kex_; // what KEXINIT agreed on, setKeys builds the ciphers it names
+        FrameReader reader_; // receive buffer for the blocking handlers
+        std::unique_ptr<UringIo> uring_; // only when the io_uring backend is in use
+        BufferTuner tuner_; // SO_SNDBUF/SO_RCVBUF follow the measured bandwidth-delay product
+
+        uint32_t sequenceNumber_;
+
+        // one open file, from FILE_START or UPLOAD_PART until its last chunk
+        struct Channel {
+            FileReceiver receiver;
+            uint32_t chunkSize; // agreed in FILE_START, no FILE_DATA may be bigger
+            std::shared_ptr<StripedUpload> part; // set when this is one part of a striped upload
+            uint64_t partOffset;
+            std::string filePath; // where the file goes once complete, it is written to its .partial until then
+            std::shared_ptr<const std::string> partialHold; // keeps the sweeper off the .partial while this channel is open
+            uint64_t fileVersion; // 0 --> the client cannot resume, no journal
+            uint64_t journaledBytes; // committed bytes the journal on disk already covers
+            uint32_t chunksSinceAck;
+            uint64_t bytesSinceAck;
+            uint32_t lastDataSequence; // acks echo the sequence number of the newest FILE_DATA they cover
+            std::chrono::steady_clock::time_point lastAck;
+        };
+        static constexpr size_t MAX_CHANNELS = 64;
+        // the journal is brought up to date after this much more of the file is committed
+        static constexpr uint64_t JOURNAL_EVERY_BYTES = 16 * 1024 * 1024;
+        std::map<uint16_t, std::unique_ptr<Channel>> channels_; // by channel id
+
+        // one FILE_GET in progress, on a channel of its own
+        struct Download {
+            FileSender sender;
+            uint32_t ackedChunks; // every chunk below this reached the client
+        };
+        // about this much of a download is sent ahead of the client acks
+        static constexpr uint64_t DOWNLOAD_WINDOW_BYTES = 8 * 1024 * 1024;
+        // and this much of every download on the session together
+        static constexpr uint64_t SESSION_WINDOW_BYTES = 16 * 1024 * 1024;
+        std::map<uint16_t, std::unique_ptr<Download>> downloads_; // by channel id
+        std::map<uint16_t, std::unique_ptr<DeltaReceiver>> deltas_; // by channel id, from DELTA_START until FILE_END
+        // DELTA_SIGNATURES still to send, one message per pumpSignatures so out never holds all of a big file's
+        struct SignatureStream {
+            std::vector<FTPProtocol::BlockSignature> signatures;
+            size_t next;
+        };
+        std::map<uint16_t, SignatureStream> signatureStreams_; // by channel id
+
+        // one DEDUPE_START in progress, its manifest is written once every missing chunk is in
+        // a CHUNK_DATA held until its batch is hashed and stored on the pool
+        struct ChunkPut {
+            FTPProtocol::ChunkRef chunk;
+            std::vector<uint8_t> payload; // the whole message, data points into it
+            const uint8_t* data;
+            uint32_t length;
+        };
+        // input waits while a batch this big is written, and at FILE_END for whatever is left
+        static constexpr uint64_t CHUNK_BATCH_BYTES = 4 * 1024 * 1024;
+        struct Dedupe {
+            std::string filePath;
+            uint64_t fileSize;
+            std::vector<FTPProtocol::ChunkRef> chunks;
+            std::vector<char> pending; // by chunk index, still expected in CHUNK_DATA
+            uint32_t pendingCount;
+            uint64_t newBytes;
+            bool failed;
+            std::vector<ChunkPut> unwritten;
+            uint64_t unwrittenBytes;
+        };
+        std::map<uint16_t, std::unique_ptr<Dedupe>> dedupes_; // by channel id
+
+        // the work one message handed off, from handleTransferMessage until finishJob
+        struct Job {
+            std::function<void(BackgroundPool&, std::function<void()>)> start; // may not touch the session, it runs on the pool
+            std::function<void(std::vector<uint8_t>&)> finish; // queues the replies once the work is done
+        };
+        std::unique_ptr<Job> job_;
+
+        // striped uploads live across connections, a channel may be writing a part of one
+        UploadRegistry& uploads_;
+        HashIndex& hashes_; // every finished upload goes in, FILE_START looks content up in it
+        ChunkStore* chunks_; // null unless the server runs with --dedupe=on
+        bool disconnectRequested_;
+        bool sendFailed_; // a reply could not be encrypted, the connection has to be dropped without sending it
+
+        // FILE_ACK goes out every ACK_EVERY_CHUNKS chunks or ACK_INTERVAL, whichever is first
+        // big chunks are acked sooner, ACK_EVERY_BYTES caps how much goes unacknowledged
+        static constexpr uint32_t ACK_EVERY_CHUNKS = 16;
+        static constexpr uint64_t ACK_EVERY_BYTES = 256 * 1024;
+        static constexpr std::chrono::milliseconds ACK_INTERVAL{20};
+        std::vector<uint8_t> ackPayload_; // reused by every FILE_ACK
+
+        // counters for the end of session summary
+        std::chrono::steady_clock::time_point startedAt_;
+        uint64_t messagesReceived_;
+        uint64_t messagesSent_;
+        uint64_t payloadBytesReceived_;
+        uint64_t bytesSent_;
+        uint64_t filesReceived_;
+        uint64_t filesSent_;
+
+        void queueReply(std::vector<uint8_t>& out, uint16_t channelId, uint8_t messageType, uint32_t sequenceNumber, const std::vector<uint8_t>& payload = {});
+        void queueAck(std::vector<uint8_t>& out, uint16_t channelId, Channel& channel);
+        // uploads, downloads, deltas and dedupes all count against MAX_CHANNELS
+        size_t channelsInUse() const { return channels_.size() + downloads_.size() + deltas_.size() + dedupes_.size(); }
+        // null when the connection already has MAX_CHANNELS files open
+        Channel* openChannel(uint16_t channelId, uint32_t requestedChunkSize);
+        bool finishFile(std::vector<uint8_t>& out, uint16_t channelId, bool reply);
+        // the start message carried the SHA-256 of content this user already has --> linked under
+        // filename and answered with FILE_PRESENT, false when the content has to be sent
+        // the caller has already refused names that would leave the upload directory
+        bool claimPresent(std::vector<uint8_t>& out, uint16_t channelId, const std::vector<uint8_t>& payload, const std::string& filename, uint64_t fileSize);
+        // sync the partial file, then record how much of it is committed
+        bool checkpoint(Channel& channel);
+        // the unwritten chunks of a deduplicated upload become the job, at FILE_END the manifest
+        // is written after them and the reply waits for both
+        void storeChunks(uint16_t channelId, bool fileEnd);
+        // unacked FILE_DATA bytes over every download
+        uint64_t downloadBytesInFlight() const;
+        // queue FILE_DATA until the window is full, FILE_END and the download is gone once all of it is queued
+        void pumpDownload(std::vector<uint8_t>& out, uint16_t channelId, Download& download);
+        bool handleMessage(uint8_t messageType, uint32_t sequenceNumber, uint16_t channelId, std::vector<uint8_t>& payload, std::vector<uint8_t>& out);
+
+    public:
+        Session(int socketFd, const std::string& uploadDir, UploadRegistry& uploads, HashIndex& hashes, ChunkStore* chunks = nullptr);
+        ~Session();
+
+        Session(const Session&) = delete;
+        Session& operator=(const Session&) = delete;
+
+        int socketFd() const { return socketFd_; }
+        FrameReader& reader() { return reader_; }
+
+        void setKexMatch(const KexMatch& kex) { kex_ = kex; }
+        const KexMatch& kexMatch() const { return kex_; }
+        // build both directions from the DH shared secret, each with the cipher and MAC KEXINIT
+        // agreed on for it, false when one of them is not in the cipher registry
+        bool setKeys(uint64_t sharedSecret);
+        bool hasKeys() const { return sendCrypto_ && recvCrypto_; }
+        PacketCipher& sendCrypto() { return *sendCrypto_; }
+        PacketCipher& recvCrypto() { return *recvCrypto_; }
+
+        void setUsername(const std::string& username) { username_ = username; }
+        const std::string& username() const { return username_; }
+
+        // try to set up io_uring for this connection, false means stay on blocking I/O
+        // anything already buffered by reader() is handed over to the ring
+        bool enableUring();
+        UringIo* uring() { return uring_.get(); }
+
+        // one decrypted FTP message in, encrypted replies appended to out
+        // false means the connection has to be dropped, out must not be sent then
+        bool handleTransferMessage(uint8_t messageType, uint32_t sequenceNumber, uint16_t channelId, std::vector<uint8_t>& payload, std::vector<uint8_t>& out);
+        // acks chunks still waiting on the next ACK_EVERY_CHUNKS on every channel, the loops call this once
+        // their input runs dry so a client with a full window is never left waiting
+        // false like handleTransferMessage when an ack could not be encrypted
+        bool flushAck(std::vector<uint8_t>& out);
+        bool disconnectRequested() const { return disconnectRequested_; }
+
+        // the last message left a job, nothing else may be handled until finishJob
+        bool jobPending() const { return job_ != nullptr; }
+        // hand the work to pool, done is called once from a pool thread when all of it is finished
+        void startJob(BackgroundPool& pool, std::function<void()> done);
+        // back on the connection's thread after done, false like handleTransferMessage
+        bool finishJob(std::vector<uint8_t>& out);
+
+        // a delta upload has signatures left, pumpSignatures once what is already queued has gone out
+        bool signaturesPending() const { return !signatureStreams_.empty(); }
+        // the next DELTA_SIGNATURES of every such upload, false like handleTransferMessage
+        bool pumpSignatures(std::vector<uint8_t>& out);
+
+        void logSummary() const;
+};
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <string>
+#include <set>
+#include <chrono>
+#include <cstdint>
+
+/**
+ * progress record for an upload that can be resumed after the connection drops
+ * the data goes to <file>.partial and a few lines in <file>.journal say how much of it is
+ * on disk, the journal is only rewritten after the data it covers was synced so a crash can
+ * lose progress but never claim bytes that are not there
+ */
+
+struct JournalEntry {
+    uint64_t fileSize;
+    uint64_t fileVersion;    // the client modification time, a changed file never resumes
+    uint64_t committedBytes; // every byte below this is in the partial file
+    uint64_t digest;         // FTPProtocol::updateDigest over the committed bytes
+};
+
+namespace UploadJournal {
+    std::string partialPath(const std::string& filePath);
+    std::string journalPath(const std::string& filePath);
+
+    bool load(const std::string& filePath, JournalEntry& entry);
+    // written to a temp name and renamed, a crash leaves either the old journal or the new one
+    bool save(const std::string& filePath, const JournalEntry& entry);
+    // journal and partial data both go
+    void discard(const std::string& filePath);
+
+    // partial uploads nobody touched for maxAge are removed, returns how many
+    // so are the <file>.part-<id> temp files of striped uploads a crashed server left behind,
+    // whatever is in inUse (a .partial or a part file) still belongs to a live upload and stays
+    size_t collectGarbage(const std::string& uploadDir, std::chrono::seconds maxAge, const std::set<std::string>& inUse);
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <map>
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <chrono>
+#include <cstdint>
+
+/**
+ * multipart uploads that span several connections
+ * UPLOAD_INIT creates a preallocated temp file next to the final one, every UPLOAD_PART
+ * connection writes its own byte range into it at the range offset, UPLOAD_COMPLETE checks
+ * that the parts cover the whole file and renames it into place so a half written file is
+ * never visible under the real name
+ * a client that never sends UPLOAD_COMPLETE does not hold its upload forever, expire drops
+ * the ones nobody touched for a while
+ * it also knows which resumable .partial files a connection still has open, so the sweeper
+ * never deletes one out from under a quiet upload
+ * shared by every connection, all calls are thread safe
+ */
+
+struct StripedUpload {
+    uint64_t id;
+    std::string owner;
+    std::string finalPath;
+    std::string tempPath;
+    uint64_t fileSize;
+    uint32_t partCount;
+    int fd;
+    std::vector<std::pair<uint64_t, uint64_t>> donePieces; // [offset, offset + length) of finished parts
+    std::chrono::steady_clock::time_point lastTouched;    // init, attach or a finished part, under the registry mutex
+
+    ~StripedUpload();
+};
+
+class UploadRegistry {
+    private:
+        std::mutex mutex_;
+        std::map<uint64_t, std::shared_ptr<StripedUpload>> uploads_;
+        std::multiset<std::string> partials_; // open .partial paths, one entry per channel writing it
+        uint64_t nextId_;
+
+        void drop(uint64_t uploadId);
+
+    public:
+        static constexpr uint32_t MAX_PARTS = 64;
+        // per user, every open upload is an fd and a preallocated temp file
+        static constexpr size_t MAX_UPLOADS_PER_USER = 16;
+        static constexpr uint64_t MAX_BYTES_PER_USER = 64ULL * 1024 * 1024 * 1024;
+
+        UploadRegistry();
+        ~UploadRegistry();
+
+        UploadRegistry(const UploadRegistry&) = delete;
+        UploadRegistry& operator=(const UploadRegistry&) = delete;
+
+        // init step, false past the per user limits or when the temp file cannot be created or sized
+        bool create(const std::string& owner, const std::string& finalPath, uint64_t fileSize, uint32_t partCount, uint64_t& uploadId);
+
+        // part step, the upload a connection writes into, null for an unknown id, another user or a range past the end
+        std::shared_ptr<StripedUpload> attach(uint64_t uploadId, const std::string& owner, uint64_t offset, uint64_t length);
+        void finishPart(uint64_t uploadId, uint64_t offset, uint64_t length);
+
+        // complete step, publishes the file only when every byte was written by some part
+        // and drops the upload either way, finalPath is where it went
+        bool complete(uint64_t uploadId, const std::string& owner, std::string& finalPath);
+
+        // drops uploads untouched for maxAge that no connection is writing a part of, returns how many
+        size_t expire(std::chrono::seconds maxAge);
+        // marks a .partial as open until the returned handle is gone
+        std::shared_ptr<const std::string> holdPartial(const std::string& partialPath);
+        // striped temp files and held partials, the sweeper leaves these alone
+        std::set<std::string> inUse();
+};
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#include <cstdint>
+
+/**
+ * fixed number of worker threads fed from a bounded queue of accepted sockets
+ * the accept loop decides what to do when the queue is full (reject or wait)
+ */
+
+class WorkerPool {
+    public:
+        struct Stats {
+            size_t workers;
+            size_t activeWorkers;
+            size_t queueDepth;
+            size_t queueCapacity;
+            size_t maxQueueDepth;
+            uint64_t completed;
+            uint64_t rejected;
+            double avgWaitMs; // time a socket sat in the queue before a worker picked it up
+            double maxWaitMs;
+        };
+
+    private:
+        struct PendingClient {
+            int socketFd;
+            std::chrono::steady_clock::time_point queuedAt;
+        };
+
+        size_t workerCount_;
+        size_t queueCapacity_;
+        std::function<void(int)> handler_;
+
+        std::vector<std::thread> workers_;
+        std::deque<PendingClient> queue_;
+        mutable std::mutex mutex_;
+        std::condition_variable notEmpty_;
+        std::condition_variable notFull_;
+        bool stopping_;
+
+        // counters for sizing the pool
+        size_t activeWorkers_;
+        size_t maxQueueDepth_;
+        uint64_t completed_;
+        uint64_t rejected_;
+        uint64_t dequeued_;
+        double totalWaitMs_;
+        double maxWaitMs_;
+
+        void workerLoop();
+
+    public:
+        WorkerPool(size_t workers, size_t queueCapacity, std::function<void(int)> handler);
+        ~WorkerPool();
+
+        void start();
+        void shutdown();
+
+        // false when the queue is full
+        bool tryPush(int socketFd);
+        // wait for room in the queue, false once the pool is shutting down
+        bool push(int socketFd);
+
+        Stats stats() const;
+};
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * XOR of a packet with the SimpleCrypto keystream, a vector at a time
+ * byte i of a packet is XORed with key[i % 32] ^ iv[i % 16] ^ ((i + sequence) & 0xFF), which
+ * repeats every 256 bytes, so one period is worked out per packet and the data is XORed
+ * against it 16 (SSE2), 32 (AVX2) or 64 (AVX-512) bytes per instruction
+ * the widest kernel the CPU supports is picked the first time one is needed
+ */
+
+namespace XorKernel {
+
+    constexpr size_t PERIOD = 256;
+    constexpr size_t MAX_WIDTH = 64;
+    // one period followed by its first MAX_WIDTH bytes again, so a full width load fits at any offset
+    constexpr size_t TABLE_SIZE = PERIOD + MAX_WIDTH;
+
+    // out = data ^ keystream, where data starts offset bytes into the period
+    using Kernel = void (*)(const uint8_t* data, size_t len, uint8_t* out, const uint8_t* table, size_t offset);
+
+    struct Choice {
+        const char* name;
+        Kernel kernel;
+    };
+
+    // key and iv sizes have to divide the period, SimpleCrypto's are 32 and 16
+    void fillTable(uint8_t* table, const std::vector<uint8_t>& key, const std::vector<uint8_t>& iv, uint32_t sequence);
+
+    // with the best kernel for this CPU
+    void apply(const uint8_t* data, size_t len, uint8_t* out, const uint8_t* table, size_t offset);
+    const char* bestName();
+
+    // every kernel this CPU can run, narrowest first, for comparing them
+    std::vector<Choice> available();
+}
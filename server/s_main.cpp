@@ -13,10 +13,61 @@
 
 #include "include/s_file_transfer_server.h"
 
+// optional flags after the port and upload directory
+// --mode=threads|pool|epoll|coro|sharded --loops=N --shards=N --workers=N --queue=N --when-full=reject|backlog --io=blocking|uring --resume-timeout=SECONDS --dedupe=on|off --cipher-cache=PATH
+static bool parseOptions(int argc, char* argv[], ServerConfig& config) {
+    for (int i = 3; i < argc; i++) {
+        std::string arg = argv[i];
+        try {
+            if (arg == "--mode=threads") {
+                config.mode = ServerMode::THREADS;
+            } else if (arg == "--mode=pool") {
+                config.mode = ServerMode::POOL;
+            } else if (arg == "--mode=epoll") {
+                config.mode = ServerMode::EPOLL;
+            } else if (arg == "--mode=coro") {
+                config.mode = ServerMode::CORO;
+            } else if (arg == "--mode=sharded") {
+                config.mode = ServerMode::SHARDED;
+            } else if (arg.rfind("--loops=", 0) == 0) {
+                config.eventLoops = std::stoi(arg.substr(8));
+            } else if (arg.rfind("--shards=", 0) == 0) {
+                config.shards = std::stoi(arg.substr(9));
+            } else if (arg.rfind("--workers=", 0) == 0) {
+                config.poolWorkers = std::stoi(arg.substr(10));
+            } else if (arg.rfind("--queue=", 0) == 0) {
+                config.poolQueueDepth = std::stoi(arg.substr(8));
+            } else if (arg == "--when-full=reject") {
+                config.queueFullPolicy = QueueFullPolicy::REJECT;
+            } else if (arg == "--when-full=backlog") {
+                config.queueFullPolicy = QueueFullPolicy::BACKLOG;
+            } else if (arg == "--io=blocking") {
+                config.ioBackend = IoBackend::BLOCKING;
+            } else if (arg == "--io=uring") {
+                config.ioBackend = IoBackend::URING;
+            } else if (arg.rfind("--resume-timeout=", 0) == 0) {
+                config.resumeTimeout = std::chrono::seconds(std::stol(arg.substr(17)));
+            } else if (arg == "--dedupe=on" || arg == "--dedupe=off") {
+                config.dedupe = arg == "--dedupe=on";
+            } else if (arg.rfind("--cipher-cache=", 0) == 0) {
+                config.cipherCache = arg.substr(15);
+            } else {
+                std::cerr << "Unknown option: " << arg << std::endl;
+                return false;
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Invalid value for option: " << arg << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
 int main(int argc, char* argv[]) {
     // error chekcing for incorrect paramaters
-    if (argc != 3) {
-        std::cerr << "Correct usage --> arg1 = port , arg2 = upload directory\n";
+    ServerConfig config;
+    if (argc < 3 || !parseOptions(argc, argv, config)) {
+        std::cerr << "Correct usage --> arg1 = port , arg2 = upload directory , [--mode=threads|pool|epoll|coro|sharded] [--loops=N] [--shards=N] [--workers=N] [--queue=N] [--when-full=reject|backlog] [--io=blocking|uring] [--resume-timeout=SECONDS] [--dedupe=on|off] [--cipher-cache=PATH]\n";
         return 1;
     }
     
@@ -24,7 +75,7 @@ int main(int argc, char* argv[]) {
     std::string uploadDir = argv[2];
     
     // create KimCloud object
-    FileTransferServer server(port, uploadDir);
+    FileTransferServer server(port, uploadDir, config);
     
     // will listen on socket
     if (!server.start()) {
@@ -35,4 +86,4 @@ int main(int argc, char* argv[]) {
     server.run();
     
     return 0;
-} 
\ No newline at end of file
+}
@@ -0,0 +1,110 @@
+#include "s_xor_kernel.h"
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <cstring>
+
+/**
+ * throughput of the SimpleCrypto XOR, the byte at a time loop it replaced against every kernel
+ * this CPU can run, after checking each one gives the same bytes
+ * usage: ./xor_bench [seconds per run]
+ */
+
+namespace {
+    // read after every run so the compiler cannot drop the work
+    volatile uint8_t sink;
+
+    // the loop SimpleCrypto::xorEncryptInto used to run
+    void xorReference(const uint8_t* data, size_t len, uint8_t* out, const std::vector<uint8_t>& key, const std::vector<uint8_t>& iv, uint32_t sequence, size_t position) {
+        for (size_t n = 0; n < len; n++) {
+            size_t i = position + n;
+            uint8_t key_byte = key[i % key.size()];
+            uint8_t iv_byte = iv[i % iv.size()];
+            uint8_t pos_byte = (i + sequence) & 0xFF;
+
+            out[n] = data[n] ^ key_byte ^ iv_byte ^ pos_byte;
+        }
+    }
+
+    template <typename Run>
+    double megabytesPerSecond(size_t len, double seconds, Run run) {
+        using Clock = std::chrono::steady_clock;
+        size_t rounds = 0;
+        auto start = Clock::now();
+        double elapsed = 0;
+        while (elapsed < seconds) {
+            for (int i = 0; i < 16; i++) {
+                run();
+            }
+            rounds += 16;
+            elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+        }
+        return (double)len * rounds / elapsed / (1024 * 1024);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    double seconds = argc > 1 ? std::stod(argv[1]) : 0.5;
+
+    std::mt19937 random(42);
+    std::vector<uint8_t> key(32), iv(16);
+    for (auto& byte : key) byte = random();
+    for (auto& byte : iv) byte = random();
+    uint32_t sequence = random();
+
+    uint8_t table[XorKernel::TABLE_SIZE];
+    XorKernel::fillTable(table, key, iv, sequence);
+
+    std::vector<uint8_t> data(4 * 1024 * 1024 + 3);
+    for (auto& byte : data) byte = random();
+    std::vector<uint8_t> expected(data.size()), out(data.size());
+
+    std::vector<XorKernel::Choice> kernels = XorKernel::available();
+
+    // every start offset and every tail length, plus a large unaligned run
+    for (const XorKernel::Choice& choice : kernels) {
+        for (size_t position = 0; position < 2 * XorKernel::PERIOD; position++) {
+            for (size_t len : {0, 1, 7, 15, 31, 63, 64, 65, 200, 300, 1500}) {
+                xorReference(data.data() + 1, len, expected.data(), key, iv, sequence, position);
+                choice.kernel(data.data() + 1, len, out.data(), table, position % XorKernel::PERIOD);
+                if (memcmp(expected.data(), out.data(), len) != 0) {
+                    std::cerr << choice.name << " differs at position " << position << " length " << len << std::endl;
+                    return 1;
+                }
+            }
+        }
+        xorReference(data.data() + 3, data.size() - 3, expected.data(), key, iv, sequence, 13);
+        choice.kernel(data.data() + 3, data.size() - 3, out.data(), table, 13);
+        if (memcmp(expected.data(), out.data(), data.size() - 3) != 0) {
+            std::cerr << choice.name << " differs on " << data.size() - 3 << " bytes" << std::endl;
+            return 1;
+        }
+    }
+    std::cout << "All kernels match the byte loop, default is " << XorKernel::bestName() << std::endl;
+
+    std::cout << std::left << std::setw(10) << "bytes" << std::setw(12) << "byte loop";
+    for (const XorKernel::Choice& choice : kernels) {
+        std::cout << std::setw(12) << choice.name;
+    }
+    std::cout << "(MB/s)" << std::endl;
+
+    // a header, a small chunk, the default chunk and a large one
+    for (size_t len : {64, 1500, 64 * 1024, 4 * 1024 * 1024}) {
+        std::cout << std::setw(10) << len << std::fixed << std::setprecision(0);
+        std::cout << std::setw(12) << megabytesPerSecond(len, seconds, [&]() {
+            xorReference(data.data(), len, out.data(), key, iv, sequence, 0);
+            sink = out[len - 1];
+        });
+        for (const XorKernel::Choice& choice : kernels) {
+            std::cout << std::setw(12) << megabytesPerSecond(len, seconds, [&]() {
+                choice.kernel(data.data(), len, out.data(), table, 0);
+                sink = out[len - 1];
+            });
+        }
+        std::cout << std::endl;
+    }
+    return 0;
+}
@@ -68,11 +68,11 @@ namespace AuthProtocol {
     }
 
     // check if request is of type auth request and get payload
-    bool receiveAuthRequest(int socket_fd, std::string& username, std::string& password) {
+    bool receiveAuthRequest(FrameReader& reader, std::string& username, std::string& password) {
         ITPProtocol::ITPHeader header;
         std::vector<uint8_t> payload;
         
-        if (!ITPProtocol::receiveMessage(socket_fd, header, payload)) {
+        if (!ITPProtocol::receiveMessage(reader, header, payload)) {
             return false;
         }
         
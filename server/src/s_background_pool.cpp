@@ -0,0 +1,87 @@
+#include "s_background_pool.h"
+
+#include <iostream>
+#include <algorithm>
+#include <cstdint>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+BackgroundPool::BackgroundPool(size_t threads) : stopping_(false) {
+    for (size_t i = 0; i < std::max<size_t>(1, threads); i++) {
+        threads_.emplace_back(&BackgroundPool::threadLoop, this);
+    }
+}
+
+BackgroundPool::~BackgroundPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    notEmpty_.notify_all();
+    for (auto& thread : threads_) {
+        thread.join();
+    }
+}
+
+void BackgroundPool::submit(std::function<void()> work) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queue_.push_back(std::move(work));
+    }
+    notEmpty_.notify_one();
+}
+
+void BackgroundPool::threadLoop() {
+    while (true) {
+        std::function<void()> work;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            notEmpty_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+            if (queue_.empty()) {
+                return;
+            }
+            work = std::move(queue_.front());
+            queue_.pop_front();
+        }
+        work();
+    }
+}
+
+CompletionQueue::CompletionQueue() {
+    eventFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (eventFd_ < 0) {
+        std::cerr << "Failed to create eventfd" << std::endl;
+    }
+}
+
+CompletionQueue::~CompletionQueue() {
+    if (eventFd_ >= 0) {
+        close(eventFd_);
+    }
+}
+
+void CompletionQueue::post(std::function<void()> fn) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        done_.push_back(std::move(fn));
+    }
+    uint64_t one = 1;
+    while (write(eventFd_, &one, sizeof(one)) < 0 && errno == EINTR) {
+    }
+}
+
+void CompletionQueue::runAll() {
+    uint64_t count;
+    while (read(eventFd_, &count, sizeof(count)) < 0 && errno == EINTR) {
+    }
+
+    std::vector<std::function<void()>> done;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        done.swap(done_);
+    }
+    for (auto& fn : done) {
+        fn();
+    }
+}
@@ -0,0 +1,170 @@
+#include "s_chunk_store.h"
+
+#include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+
+namespace {
+    const std::string MANIFEST_SUFFIX = ".manifest";
+    const std::string MANIFEST_MAGIC = "KimCloud-manifest-1";
+
+    std::string toHex(const uint8_t* data, size_t len) {
+        static const char digits[] = "0123456789abcdef";
+        std::string hex(len * 2, '0');
+        for (size_t i = 0; i < len; i++) {
+            hex[2 * i] = digits[data[i] >> 4];
+            hex[2 * i + 1] = digits[data[i] & 0xf];
+        }
+        return hex;
+    }
+
+    bool fromHex(const std::string& hex, uint8_t* out, size_t len) {
+        if (hex.size() != len * 2) {
+            return false;
+        }
+        for (size_t i = 0; i < len; i++) {
+            unsigned int byte;
+            if (sscanf(hex.c_str() + 2 * i, "%2x", &byte) != 1) {
+                return false;
+            }
+            out[i] = byte;
+        }
+        return true;
+    }
+
+    bool writeAll(int fd, const uint8_t* data, size_t len) {
+        while (len > 0) {
+            ssize_t written = write(fd, data, len);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                return false;
+            }
+            data += written;
+            len -= written;
+        }
+        return true;
+    }
+}
+
+ChunkStore::ChunkStore(const std::string& uploadDir) : tempCounter_(0) {
+    dir_ = uploadDir + "/.chunks";
+}
+
+bool ChunkStore::init() {
+    // the first byte of the hash picks the directory so no single one holds every chunk
+    if (mkdir(dir_.c_str(), 0755) < 0 && errno != EEXIST) {
+        std::cerr << "Failed to create chunk store: " << dir_ << std::endl;
+        return false;
+    }
+    for (int i = 0; i < 256; i++) {
+        uint8_t byte = i;
+        std::string sub = dir_ + "/" + toHex(&byte, 1);
+        if (mkdir(sub.c_str(), 0755) < 0 && errno != EEXIST) {
+            std::cerr << "Failed to create chunk store: " << sub << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string ChunkStore::chunkPath(const uint8_t* hash) const {
+    return dir_ + "/" + toHex(hash, 1) + "/" + toHex(hash, FTPProtocol::CHUNK_HASH_SIZE);
+}
+
+bool ChunkStore::has(const FTPProtocol::ChunkRef& chunk) const {
+    struct stat st;
+    return stat(chunkPath(chunk.hash).c_str(), &st) == 0 && (uint64_t)st.st_size == chunk.length;
+}
+
+bool ChunkStore::put(const FTPProtocol::ChunkRef& chunk, const uint8_t* data, uint32_t length) {
+    uint8_t digest[EVP_MAX_MD_SIZE];
+    unsigned int digestLength = 0;
+    EVP_Digest(data, length, digest, &digestLength, EVP_sha256(), nullptr);
+    if (length != chunk.length || memcmp(digest, chunk.hash, FTPProtocol::CHUNK_HASH_SIZE) != 0) {
+        std::cerr << "Chunk does not match its hash " << toHex(chunk.hash, FTPProtocol::CHUNK_HASH_SIZE) << std::endl;
+        return false;
+    }
+
+    std::string path = chunkPath(chunk.hash);
+    std::string tempPath = path + ".tmp" + std::to_string(tempCounter_++);
+    int fd = ::open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        std::cerr << "Failed to create file: " << tempPath << std::endl;
+        return false;
+    }
+    bool ok = writeAll(fd, data, length);
+    ok = ::close(fd) == 0 && ok;
+    if (!ok || rename(tempPath.c_str(), path.c_str()) < 0) {
+        std::cerr << "Failed to store chunk: " << path << std::endl;
+        unlink(tempPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+std::string ChunkStore::manifestPath(const std::string& filePath) {
+    return filePath + MANIFEST_SUFFIX;
+}
+
+bool ChunkStore::saveManifest(const std::string& filePath, uint64_t fileSize, const std::vector<FTPProtocol::ChunkRef>& chunks) {
+    std::string path = manifestPath(filePath);
+    std::string tempPath = path + ".tmp";
+
+    // magic line, size and chunk count, then "hash length" for every chunk
+    std::string text = MANIFEST_MAGIC + "\n"
+        + "size " + std::to_string(fileSize) + "\n"
+        + "chunks " + std::to_string(chunks.size()) + "\n";
+    for (const FTPProtocol::ChunkRef& chunk : chunks) {
+        text += toHex(chunk.hash, FTPProtocol::CHUNK_HASH_SIZE) + " " + std::to_string(chunk.length) + "\n";
+    }
+
+    int fd = ::open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        std::cerr << "Failed to create manifest: " << tempPath << std::endl;
+        return false;
+    }
+    bool ok = writeAll(fd, (const uint8_t*)text.data(), text.size());
+    ok = ::close(fd) == 0 && ok;
+    if (!ok || rename(tempPath.c_str(), path.c_str()) < 0) {
+        std::cerr << "Failed to write manifest: " << path << std::endl;
+        unlink(tempPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool ChunkStore::loadManifest(const std::string& filePath, uint64_t& fileSize, std::vector<FTPProtocol::ChunkRef>& chunks) {
+    std::ifstream in(manifestPath(filePath));
+    if (!in.is_open()) {
+        return false;
+    }
+
+    std::string magic;
+    std::string key;
+    size_t count = 0;
+    if (!(in >> magic) || magic != MANIFEST_MAGIC || !(in >> key >> fileSize) || key != "size" ||
+        !(in >> key >> count) || key != "chunks" || count > FTPProtocol::MAX_CHUNK_REFS) {
+        std::cerr << "Unreadable manifest for " << filePath << std::endl;
+        return false;
+    }
+
+    uint64_t total = 0;
+    chunks.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        std::string hex;
+        if (!(in >> hex >> chunks[i].length) || !fromHex(hex, chunks[i].hash, FTPProtocol::CHUNK_HASH_SIZE)) {
+            std::cerr << "Unreadable manifest for " << filePath << std::endl;
+            return false;
+        }
+        total += chunks[i].length;
+    }
+    return total == fileSize;
+}
@@ -0,0 +1,263 @@
+#include "../include/s_cipher_registry.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+
+namespace {
+    using Factory = std::unique_ptr<PacketCipher> (*)(const std::string& name, uint64_t sharedSecret, bool is_client);
+
+    template <typename Cipher>
+    std::unique_ptr<PacketCipher> make(const std::string& name, uint64_t sharedSecret, bool is_client) {
+        return std::make_unique<PacketCipher>(std::in_place_type<Cipher>, name, sharedSecret, is_client);
+    }
+
+    // each distinct type PacketCipher can hold, the names below are aliases of these
+    struct Implementation {
+        const char* name; // in the benchmark line and the cache file
+        Factory make;
+    };
+
+    const Implementation IMPLEMENTATIONS[] = {
+        {"aes-256-gcm", make<AesGcm>},
+        {"xor/hmac-sha2-256", make<SimpleCrypto<HmacSha256>>},
+        {"xor/hmac-kim", make<SimpleCrypto<KimMac>>},
+    };
+    constexpr size_t IMPLEMENTATION_COUNT = sizeof(IMPLEMENTATIONS) / sizeof(IMPLEMENTATIONS[0]);
+
+    // tier 0 is the strong one, the benchmark only orders names within a tier so a slow CPU
+    // never talks both sides down to the XOR cipher or the XOR hash, only --cipher=simple does
+    struct EncryptionEntry {
+        const char* name;
+        int aead; // implementation for ciphers with their own tag, -1 is the XOR cipher built by the MAC entry
+        int tier;
+    };
+
+    struct MacEntry {
+        const char* name;
+        int withXor;
+        int tier;
+    };
+
+    // in order of preference until benchmark() has measured them
+    const EncryptionEntry ENCRYPTIONS[] = {
+        {"hard-encrypt", 0, 0},
+        {"simple-encrypt", -1, 1},
+        {"abcd123-ctr", -1, 1}, // the XOR cipher under the name older clients offer server to client
+    };
+
+    const MacEntry MACS[] = {
+        {"hmac-sha2-256", 1, 0},
+        {"hmac-kim", 2, 1},
+        {"bigMac-meal", 2, 1},
+    };
+
+    const std::string CACHE_MAGIC = "KimCloud-cipherbench-1";
+    constexpr size_t BENCH_PACKET_SIZE = 64 * 1024; // the default chunk
+    constexpr auto BENCH_TIME = std::chrono::milliseconds(30);
+
+    // written once by benchmark() before any connection, only read after that
+    double speeds[IMPLEMENTATION_COUNT] = {};
+    CipherRegistry::Stats benchStats;
+
+    double encryptionSpeed(const EncryptionEntry& entry) {
+        if (entry.aead >= 0) {
+            return speeds[entry.aead];
+        }
+        // the XOR cipher is as fast as it gets with the best MAC
+        double best = 0;
+        for (const MacEntry& mac : MACS) {
+            best = std::max(best, speeds[mac.withXor]);
+        }
+        return best;
+    }
+
+    // the cache is only good on the CPU it was measured on
+    std::string cpuIdentity() {
+        std::string model = "unknown";
+        std::ifstream cpuinfo("/proc/cpuinfo");
+        std::string line;
+        while (std::getline(cpuinfo, line)) {
+            if (line.rfind("model name", 0) == 0) {
+                model = line.substr(line.find(':') + 2);
+                break;
+            }
+        }
+#if defined(__x86_64__)
+        __builtin_cpu_init();
+        model += __builtin_cpu_supports("aes") ? " aes" : "";
+        model += __builtin_cpu_supports("pclmul") ? " pclmul" : "";
+        model += __builtin_cpu_supports("avx2") ? " avx2" : "";
+        model += __builtin_cpu_supports("avx512f") ? " avx512f" : "";
+#endif
+        return model;
+    }
+
+    bool loadCache(const std::string& path, const std::string& cpu) {
+        std::ifstream in(path);
+        std::string line;
+        if (!in.is_open() || !std::getline(in, line) || line != CACHE_MAGIC || !std::getline(in, line) || line != "cpu " + cpu) {
+            return false;
+        }
+        bool found[IMPLEMENTATION_COUNT] = {};
+        while (std::getline(in, line)) {
+            std::istringstream fields(line);
+            std::string name;
+            double speed;
+            if (!(fields >> name >> speed)) {
+                continue;
+            }
+            for (size_t i = 0; i < IMPLEMENTATION_COUNT; i++) {
+                if (name == IMPLEMENTATIONS[i].name) {
+                    speeds[i] = speed;
+                    found[i] = true;
+                }
+            }
+        }
+        // one missing means the cache is from a build with other ciphers
+        return std::all_of(found, found + IMPLEMENTATION_COUNT, [](bool measured) { return measured; });
+    }
+
+    void saveCache(const std::string& path, const std::string& cpu) {
+        std::string tempPath = path + ".tmp";
+        std::ofstream out(tempPath, std::ios::trunc);
+        out << CACHE_MAGIC << "\ncpu " << cpu << "\n";
+        for (size_t i = 0; i < IMPLEMENTATION_COUNT; i++) {
+            out << IMPLEMENTATIONS[i].name << " " << speeds[i] << "\n";
+        }
+        out.close();
+        if (!out || rename(tempPath.c_str(), path.c_str()) < 0) {
+            std::cerr << "Failed to write cipher benchmark cache: " << path << std::endl;
+            remove(tempPath.c_str());
+        }
+    }
+
+    // MB/s of encrypting and then decrypting BENCH_PACKET_SIZE packets, what one side pays per byte
+    // for a transfer each way
+    double measure(const Implementation& implementation) {
+        using Clock = std::chrono::steady_clock;
+        std::unique_ptr<PacketCipher> sender = implementation.make(implementation.name, 1, true);
+        std::unique_ptr<PacketCipher> receiver = implementation.make(implementation.name, 1, true);
+        std::vector<uint8_t> packet(BENCH_PACKET_SIZE + PacketCipher::MAC_SIZE);
+        for (size_t i = 0; i < packet.size(); i++) {
+            packet[i] = i * 131;
+        }
+
+        // one untimed round so the first one does not pay for page faults and key setup
+        if (!sender->valid() || !receiver->valid() || !sender->encryptInPlace(packet) || !receiver->decryptInPlace(packet)) {
+            return 0;
+        }
+
+        size_t rounds = 0;
+        auto start = Clock::now();
+        auto elapsed = Clock::duration::zero();
+        while (elapsed < BENCH_TIME) {
+            if (!sender->encryptInPlace(packet) || !receiver->decryptInPlace(packet)) {
+                return 0;
+            }
+            rounds++;
+            elapsed = Clock::now() - start;
+        }
+        double seconds = std::chrono::duration<double>(elapsed).count();
+        return (double)BENCH_PACKET_SIZE * rounds / seconds / (1024 * 1024);
+    }
+}
+
+namespace CipherRegistry {
+
+    void benchmark(const std::string& cachePath) {
+        auto start = std::chrono::steady_clock::now();
+        std::string cpu = cpuIdentity();
+        benchStats.fromCache = !cachePath.empty() && loadCache(cachePath, cpu);
+        if (!benchStats.fromCache) {
+            for (size_t i = 0; i < IMPLEMENTATION_COUNT; i++) {
+                speeds[i] = measure(IMPLEMENTATIONS[i]);
+            }
+            if (!cachePath.empty()) {
+                saveCache(cachePath, cpu);
+            }
+        }
+        benchStats.benchmarkMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        benchStats.measurements.clear();
+        for (size_t i = 0; i < IMPLEMENTATION_COUNT; i++) {
+            benchStats.measurements.push_back({IMPLEMENTATIONS[i].name, speeds[i]});
+        }
+        std::stable_sort(benchStats.measurements.begin(), benchStats.measurements.end(),
+                         [](const Measurement& a, const Measurement& b) { return a.megabytesPerSecond > b.megabytesPerSecond; });
+    }
+
+    Stats stats() {
+        return benchStats;
+    }
+
+    std::vector<std::string> encryptionNames() {
+        // a stable sort keeps the table order until something has been measured
+        std::vector<const EncryptionEntry*> entries;
+        for (const EncryptionEntry& entry : ENCRYPTIONS) {
+            entries.push_back(&entry);
+        }
+        std::stable_sort(entries.begin(), entries.end(), [](const EncryptionEntry* a, const EncryptionEntry* b) {
+            if (a->tier != b->tier) {
+                return a->tier < b->tier;
+            }
+            return encryptionSpeed(*a) > encryptionSpeed(*b);
+        });
+        std::vector<std::string> names;
+        for (const EncryptionEntry* entry : entries) {
+            names.push_back(entry->name);
+        }
+        return names;
+    }
+
+    std::vector<std::string> macNames() {
+        std::vector<const MacEntry*> entries;
+        for (const MacEntry& entry : MACS) {
+            entries.push_back(&entry);
+        }
+        std::stable_sort(entries.begin(), entries.end(), [](const MacEntry* a, const MacEntry* b) {
+            if (a->tier != b->tier) {
+                return a->tier < b->tier;
+            }
+            return speeds[a->withXor] > speeds[b->withXor];
+        });
+        std::vector<std::string> names;
+        for (const MacEntry* entry : entries) {
+            names.push_back(entry->name);
+        }
+        return names;
+    }
+
+    std::unique_ptr<PacketCipher> create(const std::string& encryption, const std::string& mac, uint64_t sharedSecret, bool is_client) {
+        for (const EncryptionEntry& cipher : ENCRYPTIONS) {
+            if (encryption != cipher.name) {
+                continue;
+            }
+            int implementation = cipher.aead;
+            std::string name = encryption;
+            if (implementation < 0) {
+                for (const MacEntry& entry : MACS) {
+                    if (mac == entry.name) {
+                        implementation = entry.withXor;
+                        name += "/" + mac;
+                    }
+                }
+            }
+            if (implementation < 0) {
+                std::cerr << "No MAC registered as " << mac << std::endl;
+                return nullptr;
+            }
+            std::unique_ptr<PacketCipher> created = IMPLEMENTATIONS[implementation].make(name, sharedSecret, is_client);
+            if (!created->valid()) {
+                std::cerr << "Failed to set up " << name << std::endl;
+                return nullptr;
+            }
+            created->setMeasuredSpeed(speeds[implementation]);
+            return created;
+        }
+        std::cerr << "No cipher registered as " << encryption << std::endl;
+        return nullptr;
+    }
+}
@@ -0,0 +1,307 @@
+#include "s_coro_loop.h"
+#include "s_handshake.h"
+#include "s_session.h"
+#include "s_internet_traffic_protocol.h"
+
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+namespace {
+    constexpr size_t MAX_VERSION_LENGTH = 255;
+    constexpr uint32_t MAX_FRAME_SIZE = 1 << 24;
+    constexpr size_t REPLY_BATCH_BYTES = 64 * 1024; // held replies are sent once this much is waiting
+
+    // the summary goes out however the connection ends, including a scheduler shutting down mid transfer
+    struct SummaryOnExit {
+        Session& session;
+        ~SummaryOnExit() {
+            session.logSummary();
+            std::cout << "Client connection closed" << std::endl;
+        }
+    };
+}
+
+CoroLoop::CoroLoop(int listenFd, const std::string& uploadDir, const std::map<std::string, std::string>& users, UploadRegistry& uploads, HashIndex& hashes, ChunkStore* chunks, std::atomic<bool>& running, BackgroundPool& background)
+    : listenFd_(listenFd), uploadDir_(uploadDir), users_(users), uploads_(uploads), hashes_(hashes), chunks_(chunks), running_(running), background_(background), scheduler_(running) {
+}
+
+bool CoroLoop::init() {
+    if (!scheduler_.init()) {
+        return false;
+    }
+    // every loop waits on the shared listening socket
+    return scheduler_.add(listenFd_, true);
+}
+
+void CoroLoop::run() {
+    acceptLoop(scheduler_.roots());
+    scheduler_.run();
+}
+
+Coro::DetachedTask CoroLoop::acceptLoop(Coro::RootSet&) {
+    while (running_) {
+        struct sockaddr_in clientAddr;
+        socklen_t clientAddrLen = sizeof(clientAddr);
+
+        int clientSocket = accept4(listenFd_, (struct sockaddr*)&clientAddr, &clientAddrLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (clientSocket < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                co_await scheduler_.readable(listenFd_);
+            } else if (errno != EINTR && running_) {
+                std::cerr << "Failed to accept connection: " << strerror(errno) << std::endl;
+            }
+            continue;
+        }
+
+        // get ip of connection
+        char clientIP[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &clientAddr.sin_addr, clientIP, INET_ADDRSTRLEN);
+        std::cout << " !!! New connection from " << clientIP << ":" << ntohs(clientAddr.sin_port) << " !!!" << std::endl;
+
+        if (!scheduler_.add(clientSocket)) {
+            close(clientSocket);
+            continue;
+        }
+
+        // runs until its first wait, then control comes back here
+        handleClient(scheduler_.roots(), clientSocket);
+    }
+}
+
+Coro::DetachedTask CoroLoop::handleClient(Coro::RootSet&, int clientSocket) {
+    AsyncSocket socket(scheduler_, clientSocket);
+    Session session(clientSocket, uploadDir_, uploads_, hashes_, chunks_);
+    SummaryOnExit summary{session};
+
+    // first step --> version exchange
+    if (!co_await handleVersionExchange(socket)) {
+        std::cerr << "Version exchange failed :(" << std::endl;
+        co_return;
+    }
+
+    // second step --> KEXINIT exchange
+    if (!co_await handleKexinitExchange(socket, session)) {
+        std::cerr << "Key exchange failed :(" << std::endl;
+        co_return;
+    }
+
+    // third step --> DH key exchange
+    if (!co_await handleKeyExchange(socket, session)) {
+        std::cerr << "Key exchange failed :(" << std::endl;
+        co_return;
+    }
+
+    // fourth step --> authentication
+    std::string username;
+    if (!co_await handleAuthentication(socket, username)) {
+        std::cerr << "Authentication failed" << std::endl;
+        co_return;
+    }
+    session.setUsername(username);
+
+    // fifth step --> file transfer
+    co_await handleFileTransfer(socket, session);
+}
+
+// one [4 byte big endian length][body] packet, length included like unwrapPacket expects
+Coro::Task<bool> CoroLoop::receivePacket(AsyncSocket& socket, std::vector<uint8_t>& packet) {
+    uint8_t lengthBytes[4];
+    if (!co_await socket.recvExact(lengthBytes, sizeof(lengthBytes))) {
+        co_return false;
+    }
+
+    uint32_t length = (lengthBytes[0] << 24) | (lengthBytes[1] << 16) | (lengthBytes[2] << 8) | lengthBytes[3];
+    if (length > MAX_FRAME_SIZE) {
+        std::cerr << "Frame too large: " << length << " bytes" << std::endl;
+        co_return false;
+    }
+
+    packet.resize(4 + length);
+    memcpy(packet.data(), lengthBytes, sizeof(lengthBytes));
+    co_return co_await socket.recvExact(packet.data() + 4, length);
+}
+
+// the body of one packet without its length
+Coro::Task<bool> CoroLoop::receiveFrame(AsyncSocket& socket, std::vector<uint8_t>& frame) {
+    uint32_t length;
+    if (!co_await socket.recvExact(&length, sizeof(length))) {
+        co_return false;
+    }
+    length = ntohl(length);
+    if (length > MAX_FRAME_SIZE) {
+        std::cerr << "Frame too large: " << length << " bytes" << std::endl;
+        co_return false;
+    }
+
+    frame.resize(length);
+    co_return co_await socket.recvExact(frame.data(), length);
+}
+
+Coro::Task<bool> CoroLoop::receiveEncryptedMessage(AsyncSocket& socket, Session& session, FTPProtocol::FTPHeader& header, std::vector<uint8_t>& payload) {
+    // gcc 12.2 never runs the body of a coroutine that awaits in an if condition and declares
+    // no variable at all, this reference is what keeps the function out of that case
+    PacketCipher& crypto = session.recvCrypto();
+
+    // both frames are read into payload and decrypted there, it keeps its capacity between messages
+    // encrypted header, its payload length says if a payload frame follows
+    if (!co_await receiveFrame(socket, payload)) {
+        co_return false;
+    }
+    if (!FTPProtocol::openEncryptedHeader(payload, header, crypto)) {
+        co_return false;
+    }
+
+    payload.clear();
+    if (header.payloadLength > 0) {
+        if (!co_await receiveFrame(socket, payload)) {
+            co_return false;
+        }
+        if (!FTPProtocol::openEncryptedPayload(payload, crypto)) {
+            co_return false;
+        }
+    }
+
+    co_return true;
+}
+
+Coro::Task<bool> CoroLoop::handleVersionExchange(AsyncSocket& socket) {
+    // Send server version
+    if (!co_await socket.sendAll(std::vector<uint8_t>(Handshake::SERVER_VERSION.begin(), Handshake::SERVER_VERSION.end()))) {
+        co_return false;
+    }
+
+    // Receive client version
+    std::string clientVersion;
+    if (!co_await socket.recvLine(clientVersion, MAX_VERSION_LENGTH)) {
+        co_return false;
+    }
+
+    co_return Handshake::checkVersion(clientVersion);
+}
+
+Coro::Task<bool> CoroLoop::handleKexinitExchange(AsyncSocket& socket, Session& session) {
+    std::vector<uint8_t> clientKexPacket;
+    if (!co_await receivePacket(socket, clientKexPacket)) {
+        std::cerr << "Failed to receive client KEXINIT" << std::endl;
+        co_return false;
+    }
+
+    std::vector<uint8_t> reply;
+    if (!Handshake::answerKexinit(session, clientKexPacket, reply)) {
+        co_return false;
+    }
+    co_return co_await socket.sendAll(reply);
+}
+
+Coro::Task<bool> CoroLoop::handleKeyExchange(AsyncSocket& socket, Session& session) {
+    std::vector<uint8_t> clientKexdhPacket;
+    if (!co_await receivePacket(socket, clientKexdhPacket)) {
+        std::cerr << "Failed to receive client KEXDH_INIT" << std::endl;
+        co_return false;
+    }
+
+    // KEXDH_REPLY + NEWKEYS
+    std::vector<uint8_t> reply;
+    if (!Handshake::answerKexdh(session, clientKexdhPacket, reply)) {
+        co_return false;
+    }
+    if (!co_await socket.sendAll(reply)) {
+        co_return false;
+    }
+
+    // Receive client NEWKEYS
+    std::vector<uint8_t> clientNewkeys;
+    if (!co_await receivePacket(socket, clientNewkeys)) {
+        std::cerr << "Failed to receive client NEWKEYS" << std::endl;
+        co_return false;
+    }
+    co_return Handshake::checkNewkeys(clientNewkeys);
+}
+
+Coro::Task<bool> CoroLoop::handleAuthentication(AsyncSocket& socket, std::string& username) {
+    std::vector<uint8_t> headerData(ITPProtocol::HEADER_SIZE);
+    if (!co_await socket.recvExact(headerData.data(), headerData.size())) {
+        co_return false;
+    }
+
+    ITPProtocol::ITPHeader header;
+    if (!ITPProtocol::deserializeHeader(headerData, header) || header.payloadLength > ITPProtocol::MAX_PAYLOAD_SIZE) {
+        co_return false;
+    }
+
+    std::vector<uint8_t> payload(header.payloadLength);
+    if (!co_await socket.recvExact(payload.data(), payload.size())) {
+        co_return false;
+    }
+
+    // a failed login still gets its AUTH_FAILURE
+    std::vector<uint8_t> reply;
+    bool authenticated = Handshake::answerAuth(header, payload, users_, username, reply);
+    if (!reply.empty() && !co_await socket.sendAll(reply)) {
+        co_return false;
+    }
+    co_return authenticated;
+}
+
+Coro::Task<void> CoroLoop::handleFileTransfer(AsyncSocket& socket, Session& session) {
+    std::cout << "Starting file transfer session for user: " << session.username() << std::endl;
+
+    // replies for messages that arrived together go back in one send
+    std::vector<uint8_t> replies;
+
+    // reused for every message so steady state reads do not allocate
+    std::vector<uint8_t> payload;
+
+    while (!session.disconnectRequested()) {
+        FTPProtocol::FTPHeader header;
+
+        if (!co_await receiveEncryptedMessage(socket, session, header, payload)) {
+            std::cerr << "Failed to receive message" << std::endl;
+            break;
+        }
+
+        if (!session.handleTransferMessage(header.messageType, header.sequenceNumber, header.channelId, payload, replies)) {
+            break;
+        }
+        // disk work goes to the pool, only this connection waits for it
+        if (session.jobPending()) {
+            co_await scheduler_.offload([this, &session](std::function<void()> done) {
+                session.startJob(background_, std::move(done));
+            });
+            if (!session.finishJob(replies)) {
+                break;
+            }
+        }
+        if (socket.buffered() > 0 && replies.size() < REPLY_BATCH_BYTES) {
+            continue;
+        }
+        if (!session.flushAck(replies)) {
+            break;
+        }
+        if (!replies.empty() && !co_await socket.sendAll(replies)) {
+            std::cerr << "Failed to send reply" << std::endl;
+            break;
+        }
+        replies.clear();
+
+        // a delta upload's signatures go out one message at a time instead of all in replies
+        bool sent = true;
+        while (sent && session.signaturesPending()) {
+            if (!session.pumpSignatures(replies)) {
+                sent = false;
+            } else if (!co_await socket.sendAll(replies)) {
+                std::cerr << "Failed to send reply" << std::endl;
+                sent = false;
+            }
+            replies.clear();
+        }
+        if (!sent) {
+            break;
+        }
+    }
+}
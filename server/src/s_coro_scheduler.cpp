@@ -0,0 +1,239 @@
+#include "s_coro_scheduler.h"
+#include "s_background_pool.h"
+
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+namespace {
+    constexpr int MAX_EVENTS = 256;
+    constexpr int EPOLL_TIMEOUT_MS = 500; // how often the loop checks running_
+}
+
+CoroScheduler::CoroScheduler(std::atomic<bool>& running) : epollFd_(-1), running_(running), completions_(std::make_shared<CompletionQueue>()) {
+}
+
+CoroScheduler::~CoroScheduler() {
+    // destroying a root frees its whole chain of awaited tasks, which closes their sockets
+    Coro::RootSet roots = roots_;
+    for (auto handle : roots) {
+        handle.destroy();
+    }
+    if (epollFd_ >= 0) {
+        close(epollFd_);
+    }
+}
+
+bool CoroScheduler::init() {
+    epollFd_ = epoll_create1(0);
+    if (epollFd_ < 0) {
+        std::cerr << "Failed to create epoll instance" << std::endl;
+        return false;
+    }
+
+    // finished offloaded work
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = completions_->fd();
+    if (completions_->fd() < 0 || epoll_ctl(epollFd_, EPOLL_CTL_ADD, completions_->fd(), &ev) < 0) {
+        std::cerr << "Failed to add completion queue to epoll" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool CoroScheduler::add(int fd, bool exclusive) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    if (exclusive) {
+        // shared listening socket, wake only one scheduler per connection
+        ev.events |= EPOLLEXCLUSIVE;
+    } else {
+        ev.events |= EPOLLOUT | EPOLLRDHUP;
+    }
+    ev.data.fd = fd;
+    if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        std::cerr << "Failed to add fd to epoll: " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void CoroScheduler::remove(int fd) {
+    epoll_ctl(epollFd_, EPOLL_CTL_DEL, fd, nullptr);
+    waiters_.erase(fd);
+}
+
+void CoroScheduler::ReadyAwaiter::await_suspend(std::coroutine_handle<> handle) {
+    Waiters& waiters = scheduler.waiters_[fd];
+    if (forWrite) {
+        waiters.writer = handle;
+    } else {
+        waiters.reader = handle;
+    }
+}
+
+void CoroScheduler::OffloadAwaiter::await_suspend(std::coroutine_handle<> handle) {
+    // never resumed from inside done, it may be running on a pool thread
+    std::shared_ptr<CompletionQueue> completions = scheduler.completions_;
+    start([completions, handle] {
+        completions->post([handle] { handle.resume(); });
+    });
+}
+
+void CoroScheduler::run() {
+    struct epoll_event events[MAX_EVENTS];
+
+    while (running_) {
+        int n = epoll_wait(epollFd_, events, MAX_EVENTS, EPOLL_TIMEOUT_MS);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "epoll_wait failed: " << strerror(errno) << std::endl;
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.fd == completions_->fd()) {
+                completions_->runAll();
+                continue;
+            }
+
+            auto it = waiters_.find(events[i].data.fd);
+            if (it == waiters_.end()) {
+                continue;
+            }
+
+            // take the handles out first, a resumed coroutine may wait again or close the fd
+            bool hangup = events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP);
+            std::coroutine_handle<> reader;
+            std::coroutine_handle<> writer;
+            if (events[i].events & EPOLLIN || hangup) {
+                reader = std::exchange(it->second.reader, nullptr);
+            }
+            if (events[i].events & EPOLLOUT || hangup) {
+                writer = std::exchange(it->second.writer, nullptr);
+            }
+
+            // a hang up resumes both so the next syscall reports the error
+            if (reader) {
+                reader.resume();
+            }
+            if (writer) {
+                writer.resume();
+            }
+        }
+    }
+}
+
+AsyncSocket::AsyncSocket(CoroScheduler& scheduler, int fd) : scheduler_(scheduler), fd_(fd), readStart_(0), readEnd_(0) {
+}
+
+AsyncSocket::~AsyncSocket() {
+    if (fd_ >= 0) {
+        scheduler_.remove(fd_);
+        close(fd_);
+    }
+}
+
+Coro::Task<ssize_t> AsyncSocket::recvSome(void* data, size_t len) {
+    while (true) {
+        ssize_t bytesRead = recv(fd_, data, len, 0);
+        if (bytesRead >= 0) {
+            co_return bytesRead;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            co_await scheduler_.readable(fd_);
+            continue;
+        }
+        if (errno != EINTR) {
+            co_return -1;
+        }
+    }
+}
+
+Coro::Task<bool> AsyncSocket::recvExact(void* data, size_t len) {
+    uint8_t* out = static_cast<uint8_t*>(data);
+
+    // whatever is already buffered first
+    size_t buffered = std::min(len, readEnd_ - readStart_);
+    if (buffered > 0) {
+        memcpy(out, readBuffer_.data() + readStart_, buffered);
+        readStart_ += buffered;
+        out += buffered;
+        len -= buffered;
+    }
+
+    while (len > 0) {
+        if (len >= READ_BUFFER_SIZE) {
+            // big reads skip the buffer
+            ssize_t bytesRead = co_await recvSome(out, len);
+            if (bytesRead <= 0) {
+                co_return false;
+            }
+            out += bytesRead;
+            len -= bytesRead;
+            continue;
+        }
+
+        // small reads pull in as much as the socket has so the next frame is often already here
+        if (readBuffer_.empty()) {
+            readBuffer_.resize(READ_BUFFER_SIZE);
+        }
+        ssize_t bytesRead = co_await recvSome(readBuffer_.data(), readBuffer_.size());
+        if (bytesRead <= 0) {
+            co_return false;
+        }
+        readStart_ = 0;
+        readEnd_ = bytesRead;
+
+        size_t take = std::min(len, readEnd_);
+        memcpy(out, readBuffer_.data(), take);
+        readStart_ = take;
+        out += take;
+        len -= take;
+    }
+
+    co_return true;
+}
+
+Coro::Task<bool> AsyncSocket::recvLine(std::string& line, size_t maxLength) {
+    line.clear();
+    while (line.size() < maxLength) {
+        char c;
+        if (!co_await recvExact(&c, 1)) {
+            co_return false;
+        }
+        line.push_back(c);
+        if (c == '\n') {
+            co_return true;
+        }
+    }
+    co_return false;
+}
+
+Coro::Task<bool> AsyncSocket::sendAll(const std::vector<uint8_t>& data) {
+    size_t offset = 0;
+    while (offset < data.size()) {
+        ssize_t sent = send(fd_, data.data() + offset, data.size() - offset, MSG_NOSIGNAL);
+        if (sent >= 0) {
+            offset += sent;
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            co_await scheduler_.writable(fd_);
+            continue;
+        }
+        if (errno != EINTR) {
+            co_return false;
+        }
+    }
+    co_return true;
+}
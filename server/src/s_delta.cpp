@@ -0,0 +1,44 @@
+#include "s_delta.h"
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <openssl/evp.h>
+
+namespace Delta {
+
+    uint32_t blockSizeFor(uint64_t fileSize) {
+        uint64_t blockSize = (uint64_t)std::sqrt((double)fileSize);
+        blockSize = (blockSize + 1023) / 1024 * 1024;
+        blockSize = std::max<uint64_t>(blockSize, (fileSize + MAX_BLOCKS - 1) / MAX_BLOCKS);
+        return std::clamp<uint64_t>(blockSize, MIN_BLOCK_SIZE, FTPProtocol::MAX_CHUNK_SIZE);
+    }
+
+    uint32_t weakChecksum(const uint8_t* data, size_t len) {
+        // plain reductions over the block, the compiler vectorizes both sums
+        uint32_t a = 0;
+        uint32_t b = 0;
+        for (size_t i = 0; i < len; i++) {
+            a += data[i];
+            b += (uint32_t)(len - i) * data[i];
+        }
+        return (a & 0xffff) | (b << 16);
+    }
+
+    void strongHash(const uint8_t* data, size_t len, uint8_t* out) {
+        uint8_t digest[EVP_MAX_MD_SIZE];
+        unsigned int digestLength = 0;
+        EVP_Digest(data, len, digest, &digestLength, EVP_sha256(), nullptr);
+        memcpy(out, digest, FTPProtocol::STRONG_HASH_SIZE);
+    }
+
+    std::vector<FTPProtocol::BlockSignature> sign(const uint8_t* data, uint64_t size, uint32_t blockSize) {
+        std::vector<FTPProtocol::BlockSignature> signatures(size / blockSize);
+        for (size_t i = 0; i < signatures.size(); i++) {
+            const uint8_t* block = data + i * (uint64_t)blockSize;
+            signatures[i].weak = weakChecksum(block, blockSize);
+            strongHash(block, blockSize, signatures[i].strong);
+        }
+        return signatures;
+    }
+}
@@ -1,4 +1,5 @@
 #include "../include/s_dh.h"
+#include "../include/s_kex.h"
 #include <random>
 #include <iostream>
 #include <cstring>
@@ -60,4 +61,82 @@ uint64_t DH::bytesToUint64(const std::vector<uint8_t>& bytes) {
         value = (value << 8) | bytes[i];
     }
     return value;
-} 
\ No newline at end of file
+}
+
+std::vector<uint8_t> generateServerKexdhReply(const std::vector<uint8_t>& clientKexdhPayload, uint64_t& sharedSecret) {
+    /**
+     * messgae_id --> 30
+     * client public (e) --> mpint value
+     */
+
+    // read client kex_dh must start with message_id = 30
+    if (clientKexdhPayload.empty() || clientKexdhPayload[0] != 30) {
+        std::cerr << "Invalid KEXDH_INIT message" << std::endl;
+        return std::vector<uint8_t>();
+    }
+    
+    // Extract client's public key
+    size_t offset = 1;
+    if (offset + 4 > clientKexdhPayload.size()) {
+        std::cerr << "Invalid KEXDH_INIT packet size :(" << std::endl;
+        return std::vector<uint8_t>();
+    }
+    
+    uint32_t clientPublicLength = read32BigEndian(clientKexdhPayload, offset);
+    
+    if (offset + clientPublicLength > clientKexdhPayload.size()) {
+        std::cerr << "Invalid client public key length" << std::endl;
+        return std::vector<uint8_t>();
+    }
+    
+    std::vector<uint8_t> clientPublicBytes(clientKexdhPayload.begin() + offset, clientKexdhPayload.begin() + offset + clientPublicLength);
+    uint64_t clientPublicKey = DH::bytesToUint64(clientPublicBytes);
+    
+    std::cout << "Client public key length: " << clientPublicLength << std::endl;
+    std::cout << "Client public key bytes: ";
+    for (auto b : clientPublicBytes) {
+        std::cout << std::hex << (int)b << " ";
+    }
+    std::cout << std::dec << std::endl;
+    std::cout << "Client public key value: " << std::hex << clientPublicKey << std::dec << std::endl;
+    
+    // create the server DH
+    DH serverDH;
+    uint64_t serverPublicKey = serverDH.generatePublicKey();
+    std::cout << "Server public key: " << std::hex << serverPublicKey << std::dec << std::endl;
+    
+    // compute the shared secret
+    sharedSecret = serverDH.computeSharedSecret(clientPublicKey);
+    std::cout << "Server computed shared secret: " << std::hex << sharedSecret << std::dec << std::endl;
+    
+    /* KEXDH reply format
+        ssh_msh_kexdh_reply --> 31
+        server public host key
+        server public host key
+        signiture using server private key
+
+    */
+    std::vector<uint8_t> reply;
+
+    reply.push_back(31); 
+    
+    // add a hard coded host key --> hosung-kim
+    // TODO: make real soon?
+    std::vector<uint8_t> hostKey = {0x00, 0x00, 0x00, 0x0A, 0x68, 0x6F, 0x73, 0x75, 0x6E, 0x67, 0x2D, 0x6B, 0x69, 0x6D};
+    reply.insert(reply.end(), hostKey.begin(), hostKey.end());
+    
+    // add the public key
+    auto serverPublicBytes = DH::uint64ToBytes(serverPublicKey);
+    // convert to big endian and insert public key
+    uint32_t serverPublicLength = htonl(serverPublicBytes.size());
+    reply.insert(reply.end(), (uint8_t*)&serverPublicLength, (uint8_t*)&serverPublicLength + 4);
+    // insert public key
+    reply.insert(reply.end(), serverPublicBytes.begin(), serverPublicBytes.end());
+    
+    // add a fake signiture --> hosung-kim
+    // TODO: make real soon?
+    std::vector<uint8_t> signature = {0x00, 0x00, 0x00, 0x0A, 0x68, 0x6F, 0x73, 0x75, 0x6E, 0x67, 0x2D, 0x6B, 0x69, 0x6D};
+    reply.insert(reply.end(), signature.begin(), signature.end());
+    
+    return reply;
+}
@@ -0,0 +1,551 @@
+#include "s_event_loop.h"
+#include "s_handshake.h"
+#include "s_session.h"
+#include "s_file_transfer_protocol.h"
+#include "s_internet_traffic_protocol.h"
+#include "s_background_pool.h"
+
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <sched.h>
+
+namespace {
+    constexpr int MAX_EVENTS = 256;
+    constexpr int EPOLL_TIMEOUT_MS = 500; // how often the loop checks running_
+    constexpr size_t MAX_VERSION_LENGTH = 255;
+    constexpr uint32_t MAX_FRAME_SIZE = 1 << 24;
+    // past this much unsent output the connection stops reading until the client takes some of it
+    constexpr size_t MAX_PENDING_OUTPUT = 32 * 1024 * 1024;
+    // the sent front of outBuf is cut off once it is this big and bigger than what is left behind it
+    constexpr size_t TRIM_OUTPUT_AT = 1024 * 1024;
+    // a delta upload's next DELTA_SIGNATURES is only queued once less than this is left to send
+    constexpr size_t REFILL_OUTPUT_AT = 1024 * 1024;
+}
+
+struct EventLoop::Connection {
+    enum class Phase { VERSION, KEXINIT, KEXDH, NEWKEYS, AUTH, TRANSFER };
+
+    int fd;
+    uint64_t id;
+    Phase phase;
+
+    size_t pendingOutput() const { return outBuf.size() - outOffset; }
+    std::vector<uint8_t> outBuf;
+    size_t outOffset;
+    bool wantWrite;
+    bool inputPaused; // too much output is waiting or a job is out, EPOLLIN is off until that is over
+    bool closeAfterFlush;
+
+    // FTP header waiting for its payload frame
+    bool havePendingHeader;
+    FTPProtocol::FTPHeader pendingHeader;
+
+    // keys, username, counters, the receive buffer and the open upload
+    Session session;
+
+    Connection(int socketFd, uint64_t connectionId, const std::string& uploadDir, UploadRegistry& uploads, HashIndex& hashes, ChunkStore* chunks) : session(socketFd, uploadDir, uploads, hashes, chunks) {
+        fd = socketFd;
+        id = connectionId;
+        phase = Phase::VERSION;
+        outOffset = 0;
+        wantWrite = false;
+        inputPaused = false;
+        closeAfterFlush = false;
+        havePendingHeader = false;
+    }
+};
+
+EventLoop::EventLoop(int listenFd, const std::string& uploadDir, const std::map<std::string, std::string>& users, UploadRegistry& uploads, HashIndex& hashes, ChunkStore* chunks, std::atomic<bool>& running, BackgroundPool& background, bool sharedListener)
+    : epollFd_(-1), listenFd_(listenFd), sharedListener_(sharedListener), cpu_(-1), uploadDir_(uploadDir), users_(users), uploads_(uploads), hashes_(hashes), chunks_(chunks), running_(running),
+      background_(background), completions_(std::make_shared<CompletionQueue>()), nextConnectionId_(0) {
+}
+
+EventLoop::~EventLoop() {
+    while (!connections_.empty()) {
+        closeConnection(connections_.begin()->first);
+    }
+    if (epollFd_ >= 0) {
+        close(epollFd_);
+    }
+}
+
+bool EventLoop::init() {
+    epollFd_ = epoll_create1(0);
+    if (epollFd_ < 0) {
+        std::cerr << "Failed to create epoll instance" << std::endl;
+        return false;
+    }
+
+    // every loop waits on the shared listening socket, EPOLLEXCLUSIVE wakes only one of them
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    if (sharedListener_) {
+        ev.events |= EPOLLEXCLUSIVE;
+    }
+    ev.data.fd = listenFd_;
+    if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, listenFd_, &ev) < 0) {
+        std::cerr << "Failed to add listening socket to epoll" << std::endl;
+        return false;
+    }
+
+    // finished background jobs
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = completions_->fd();
+    if (completions_->fd() < 0 || epoll_ctl(epollFd_, EPOLL_CTL_ADD, completions_->fd(), &ev) < 0) {
+        std::cerr << "Failed to add completion queue to epoll" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+void EventLoop::run() {
+    if (cpu_ >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu_, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+            std::cerr << "Failed to pin event loop to cpu " << cpu_ << std::endl;
+        }
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+
+    while (running_) {
+        int n = epoll_wait(epollFd_, events, MAX_EVENTS, EPOLL_TIMEOUT_MS);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "epoll_wait failed: " << strerror(errno) << std::endl;
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == listenFd_) {
+                acceptConnections();
+                continue;
+            }
+            if (fd == completions_->fd()) {
+                completions_->runAll();
+                continue;
+            }
+
+            auto it = connections_.find(fd);
+            if (it == connections_.end()) {
+                continue;
+            }
+            Connection& conn = *it->second;
+
+            // drain what the peer sent before looking at hang ups
+            if (events[i].events & EPOLLIN) {
+                handleReadable(conn);
+                if (connections_.find(fd) == connections_.end()) {
+                    continue;
+                }
+            }
+            // with EPOLLIN off a half closed peer only shows up as EPOLLRDHUP
+            if (events[i].events & (EPOLLERR | EPOLLHUP) || (conn.inputPaused && (events[i].events & EPOLLRDHUP))) {
+                closeConnection(fd);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                bool wasPaused = conn.inputPaused;
+                if (!flush(conn)) {
+                    closeConnection(fd);
+                    continue;
+                }
+                // drained below the cap, carry on with whatever was already read
+                if (wasPaused && !conn.inputPaused && !processBuffered(conn)) {
+                    closeConnection(fd);
+                    continue;
+                }
+            }
+            if (conn.closeAfterFlush && conn.outOffset >= conn.outBuf.size()) {
+                closeConnection(fd);
+            }
+        }
+    }
+}
+
+void EventLoop::acceptConnections() {
+    while (true) {
+        struct sockaddr_in clientAddr;
+        socklen_t clientAddrLen = sizeof(clientAddr);
+
+        int clientSocket = accept4(listenFd_, (struct sockaddr*)&clientAddr, &clientAddrLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (clientSocket < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && running_) {
+                std::cerr << "Failed to accept connection: " << strerror(errno) << std::endl;
+            }
+            return;
+        }
+
+        // get ip of connection
+        char clientIP[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &clientAddr.sin_addr, clientIP, INET_ADDRSTRLEN);
+        std::cout << " !!! New connection from " << clientIP << ":" << ntohs(clientAddr.sin_port) << " !!!" << std::endl;
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.fd = clientSocket;
+        if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, clientSocket, &ev) < 0) {
+            std::cerr << "Failed to add client socket to epoll" << std::endl;
+            close(clientSocket);
+            continue;
+        }
+
+        auto conn = std::make_unique<Connection>(clientSocket, nextConnectionId_++, uploadDir_, uploads_, hashes_, chunks_);
+        Connection& ref = *conn;
+        connections_[clientSocket] = std::move(conn);
+
+        // first step --> version exchange, server speaks first
+        queueSend(ref, std::vector<uint8_t>(Handshake::SERVER_VERSION.begin(), Handshake::SERVER_VERSION.end()));
+        if (!flush(ref)) {
+            closeConnection(clientSocket);
+        }
+    }
+}
+
+void EventLoop::closeConnection(int fd) {
+    auto it = connections_.find(fd);
+    if (it == connections_.end()) {
+        return;
+    }
+
+    it->second->session.logSummary();
+    epoll_ctl(epollFd_, EPOLL_CTL_DEL, fd, nullptr);
+    connections_.erase(it);
+    close(fd);
+    std::cout << "Client connection closed" << std::endl;
+}
+
+void EventLoop::handleReadable(Connection& conn) {
+    int fd = conn.fd;
+
+    // one read per wake up straight into the session buffer, level triggered epoll brings us back if more is waiting
+    ssize_t bytesRead = conn.session.reader().fill();
+    if (bytesRead == 0) {
+        closeConnection(fd);
+        return;
+    }
+    if (bytesRead < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            closeConnection(fd);
+        }
+        return;
+    }
+
+    if (!processBuffered(conn)) {
+        closeConnection(fd);
+    }
+}
+
+bool EventLoop::processBuffered(Connection& conn) {
+    if (!processInput(conn)) {
+        return false;
+    }
+
+    // everything readable is handled, ack what is left before the client window fills up
+    if (conn.phase == Connection::Phase::TRANSFER && !conn.session.flushAck(conn.outBuf)) {
+        return false;
+    }
+
+    return flush(conn);
+}
+
+void EventLoop::queueSend(Connection& conn, const std::vector<uint8_t>& data) {
+    conn.outBuf.insert(conn.outBuf.end(), data.begin(), data.end());
+}
+
+bool EventLoop::flush(Connection& conn) {
+    while (true) {
+        if (conn.session.signaturesPending() && conn.pendingOutput() < REFILL_OUTPUT_AT && !conn.session.pumpSignatures(conn.outBuf)) {
+            return false;
+        }
+        if (conn.outOffset >= conn.outBuf.size()) {
+            break;
+        }
+        ssize_t sent = send(conn.fd, conn.outBuf.data() + conn.outOffset, conn.outBuf.size() - conn.outOffset, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        conn.outOffset += sent;
+    }
+
+    if (conn.outOffset >= conn.outBuf.size()) {
+        conn.outBuf.clear();
+        conn.outOffset = 0;
+    } else if (conn.outOffset >= TRIM_OUTPUT_AT && conn.outOffset >= conn.pendingOutput()) {
+        // a download keeps appending before the buffer ever empties, the moved tail is never bigger than what was cut
+        conn.outBuf.erase(conn.outBuf.begin(), conn.outBuf.begin() + conn.outOffset);
+        conn.outOffset = 0;
+    }
+
+    updateInterest(conn);
+    return true;
+}
+
+void EventLoop::updateInterest(Connection& conn) {
+    // only ask for EPOLLOUT while there is something left to send, and stop reading while too much of it is left
+    bool wantWrite = conn.outOffset < conn.outBuf.size();
+    bool inputPaused = conn.pendingOutput() >= MAX_PENDING_OUTPUT || conn.session.jobPending();
+    if (wantWrite == conn.wantWrite && inputPaused == conn.inputPaused) {
+        return;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLRDHUP;
+    if (!inputPaused) {
+        ev.events |= EPOLLIN;
+    }
+    if (wantWrite) {
+        ev.events |= EPOLLOUT;
+    }
+    ev.data.fd = conn.fd;
+    epoll_ctl(epollFd_, EPOLL_CTL_MOD, conn.fd, &ev);
+    conn.wantWrite = wantWrite;
+    conn.inputPaused = inputPaused;
+}
+
+bool EventLoop::processInput(Connection& conn) {
+    FrameReader& reader = conn.session.reader();
+
+    // messages left in the buffer wait until the client has taken some of the output, or until a job is back
+    while (!conn.closeAfterFlush && conn.pendingOutput() < MAX_PENDING_OUTPUT && !conn.session.jobPending()) {
+        size_t before = reader.available();
+        bool ok = true;
+
+        switch (conn.phase) {
+            case Connection::Phase::VERSION:
+                ok = processVersion(conn);
+                break;
+            case Connection::Phase::KEXINIT:
+                ok = processKexinit(conn);
+                break;
+            case Connection::Phase::KEXDH:
+                ok = processKexdh(conn);
+                break;
+            case Connection::Phase::NEWKEYS:
+                ok = processNewkeys(conn);
+                break;
+            case Connection::Phase::AUTH:
+                ok = processAuth(conn);
+                break;
+            case Connection::Phase::TRANSFER:
+                ok = processTransfer(conn);
+                break;
+        }
+
+        if (!ok) {
+            return false;
+        }
+        // wait for more bytes when nothing could be parsed, partial frames stay in the buffer
+        if (reader.available() == before) {
+            break;
+        }
+    }
+
+    return true;
+}
+
+bool EventLoop::processVersion(Connection& conn) {
+    FrameReader& reader = conn.session.reader();
+    const uint8_t* end = std::find(reader.data(), reader.data() + reader.available(), '\n');
+    if (end == reader.data() + reader.available()) {
+        if (reader.available() > MAX_VERSION_LENGTH) {
+            std::cerr << "Version string too long" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    std::string clientVersion(reader.data(), end + 1);
+    reader.consume(clientVersion.size());
+
+    if (!Handshake::checkVersion(clientVersion)) {
+        return false;
+    }
+
+    conn.phase = Connection::Phase::KEXINIT;
+    return true;
+}
+
+bool EventLoop::processKexinit(Connection& conn) {
+    std::vector<uint8_t> clientKexPacket;
+    int taken = conn.session.reader().takeFrame(clientKexPacket, true, MAX_FRAME_SIZE);
+    if (taken <= 0) {
+        return taken == 0;
+    }
+
+    std::vector<uint8_t> reply;
+    if (!Handshake::answerKexinit(conn.session, clientKexPacket, reply)) {
+        return false;
+    }
+    queueSend(conn, reply);
+
+    conn.phase = Connection::Phase::KEXDH;
+    return true;
+}
+
+bool EventLoop::processKexdh(Connection& conn) {
+    std::vector<uint8_t> clientKexdhPacket;
+    int taken = conn.session.reader().takeFrame(clientKexdhPacket, true, MAX_FRAME_SIZE);
+    if (taken <= 0) {
+        return taken == 0;
+    }
+
+    std::vector<uint8_t> reply;
+    if (!Handshake::answerKexdh(conn.session, clientKexdhPacket, reply)) {
+        return false;
+    }
+    queueSend(conn, reply);
+
+    conn.phase = Connection::Phase::NEWKEYS;
+    return true;
+}
+
+bool EventLoop::processNewkeys(Connection& conn) {
+    std::vector<uint8_t> newkeysPacket;
+    int taken = conn.session.reader().takeFrame(newkeysPacket, true, MAX_FRAME_SIZE);
+    if (taken <= 0) {
+        return taken == 0;
+    }
+
+    if (!Handshake::checkNewkeys(newkeysPacket)) {
+        return false;
+    }
+
+    conn.phase = Connection::Phase::AUTH;
+    return true;
+}
+
+bool EventLoop::processAuth(Connection& conn) {
+    FrameReader& reader = conn.session.reader();
+    if (reader.available() < ITPProtocol::HEADER_SIZE) {
+        return true;
+    }
+
+    std::vector<uint8_t> headerData(reader.data(), reader.data() + ITPProtocol::HEADER_SIZE);
+    ITPProtocol::ITPHeader header;
+    if (!ITPProtocol::deserializeHeader(headerData, header)) {
+        return false;
+    }
+    if (header.payloadLength > ITPProtocol::MAX_PAYLOAD_SIZE) {
+        std::cerr << "Payload too large: " << header.payloadLength << " > " << ITPProtocol::MAX_PAYLOAD_SIZE << std::endl;
+        return false;
+    }
+    if (reader.available() < ITPProtocol::HEADER_SIZE + header.payloadLength) {
+        return true;
+    }
+
+    const uint8_t* payloadStart = reader.data() + ITPProtocol::HEADER_SIZE;
+    std::vector<uint8_t> payload(payloadStart, payloadStart + header.payloadLength);
+    reader.consume(ITPProtocol::HEADER_SIZE + header.payloadLength);
+
+    std::string username;
+    std::vector<uint8_t> reply;
+    if (!Handshake::answerAuth(header, payload, users_, username, reply)) {
+        if (reply.empty()) {
+            return false;
+        }
+        // wrong credentials, the client still hears AUTH_FAILURE before the close
+        queueSend(conn, reply);
+        conn.closeAfterFlush = true;
+        return true;
+    }
+    queueSend(conn, reply);
+
+    conn.session.setUsername(username);
+    conn.phase = Connection::Phase::TRANSFER;
+    return true;
+}
+
+bool EventLoop::processTransfer(Connection& conn) {
+    FrameReader& reader = conn.session.reader();
+    std::vector<uint8_t>& frame = reader.scratch();
+
+    // encrypted header first, its payload length says if a payload frame follows
+    if (!conn.havePendingHeader) {
+        int taken = reader.takeFrame(frame, false, MAX_FRAME_SIZE);
+        if (taken <= 0) {
+            return taken == 0;
+        }
+
+        if (!FTPProtocol::openEncryptedHeader(frame, conn.pendingHeader, conn.session.recvCrypto())) {
+            return false;
+        }
+        conn.havePendingHeader = true;
+    }
+
+    // the payload is decrypted in the reader's scratch buffer and handed over from there
+    frame.clear();
+    if (conn.pendingHeader.payloadLength > 0) {
+        int taken = reader.takeFrame(frame, false, MAX_FRAME_SIZE);
+        if (taken <= 0) {
+            return taken == 0;
+        }
+        if (!FTPProtocol::openEncryptedPayload(frame, conn.session.recvCrypto())) {
+            return false;
+        }
+    }
+
+    conn.havePendingHeader = false;
+    if (!conn.session.handleTransferMessage(conn.pendingHeader.messageType, conn.pendingHeader.sequenceNumber, conn.pendingHeader.channelId, frame, conn.outBuf)) {
+        return false;
+    }
+    if (conn.session.jobPending()) {
+        startJob(conn);
+    }
+    if (conn.session.disconnectRequested()) {
+        conn.closeAfterFlush = true;
+    }
+    return true;
+}
+
+void EventLoop::startJob(Connection& conn) {
+    // done runs on a pool thread, only the completion queue may be touched there
+    int fd = conn.fd;
+    uint64_t id = conn.id;
+    std::shared_ptr<CompletionQueue> completions = completions_;
+    conn.session.startJob(background_, [this, completions, fd, id] {
+        completions->post([this, fd, id] { finishJob(fd, id); });
+    });
+}
+
+void EventLoop::finishJob(int fd, uint64_t connectionId) {
+    auto it = connections_.find(fd);
+    if (it == connections_.end() || it->second->id != connectionId) {
+        return;
+    }
+    Connection& conn = *it->second;
+
+    // the reply, then whatever arrived while the job was out
+    if (!conn.session.finishJob(conn.outBuf) || !processBuffered(conn)) {
+        closeConnection(fd);
+        return;
+    }
+    if (conn.closeAfterFlush && conn.outOffset >= conn.outBuf.size()) {
+        closeConnection(fd);
+    }
+}
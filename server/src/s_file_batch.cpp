@@ -0,0 +1,101 @@
+#include "s_file_batch.h"
+#include "s_upload_journal.h"
+#include "s_background_pool.h"
+
+#include <iostream>
+#include <algorithm>
+#include <cstdio>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+    constexpr size_t MAX_WRITERS = 4;
+    constexpr size_t FILES_PER_WRITER = 16; // a pool job for fewer files than this costs more than it saves
+
+    bool writeFile(const std::string& path, const std::string& tempPath, const uint8_t* data, uint64_t size) {
+        int fd = open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            std::cerr << "Failed to create file: " << tempPath << std::endl;
+            return false;
+        }
+
+        bool ok = true;
+        while (size > 0) {
+            ssize_t written = write(fd, data, size);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                ok = false;
+                break;
+            }
+            data += written;
+            size -= written;
+        }
+        ok = close(fd) == 0 && ok;
+
+        // only a finished file shows up under its real name
+        if (!ok || rename(tempPath.c_str(), path.c_str()) < 0) {
+            std::cerr << "Failed to write file: " << path << std::endl;
+            unlink(tempPath.c_str());
+            return false;
+        }
+        return true;
+    }
+}
+
+namespace FileBatch {
+
+    std::shared_ptr<Batch> parse(std::vector<uint8_t>& payload, const std::string& pathPrefix) {
+        auto batch = std::make_shared<Batch>();
+        batch->payload = std::move(payload);
+        if (!FTPProtocol::parseFileBatchMessage(batch->payload, batch->entries)) {
+            return nullptr;
+        }
+        batch->pathPrefix = pathPrefix;
+        batch->written.assign(batch->entries.size(), 0);
+        return batch;
+    }
+
+    void writeFiles(BackgroundPool& pool, std::shared_ptr<Batch> batch, std::function<void()> done) {
+        auto writeRange = [batch, done](size_t first, size_t last) {
+            for (size_t i = first; i < last; i++) {
+                const FTPProtocol::BatchEntry& entry = batch->entries[i];
+                // same rule as FILE_GET, a name may not climb out of the upload directory
+                if (entry.filename.empty() || entry.filename.find('/') != std::string::npos) {
+                    std::cerr << "Refusing batch file name: " << entry.filename << std::endl;
+                    continue;
+                }
+                // the index keeps two files of the same name in one batch from sharing a temp file
+                std::string path = batch->pathPrefix + entry.filename;
+                batch->written[i] = writeFile(path, UploadJournal::partialPath(path + "." + std::to_string(i)), entry.data, entry.size);
+            }
+            if (batch->slicesLeft.fetch_sub(1) == 1) {
+                done();
+            }
+        };
+
+        // contiguous slices, one pool job each, an empty batch still gets one so it is answered
+        size_t count = batch->entries.size();
+        size_t slices = std::max<size_t>(1, std::min({MAX_WRITERS, pool.size(), count / FILES_PER_WRITER}));
+        size_t slice = std::max<size_t>(1, (count + slices - 1) / slices);
+        batch->slicesLeft = std::max<size_t>(1, (count + slice - 1) / slice);
+        size_t first = 0;
+        do {
+            size_t last = std::min(first + slice, count);
+            pool.submit([writeRange, first, last] { writeRange(first, last); });
+            first = last;
+        } while (first < count);
+    }
+
+    std::vector<uint32_t> failedFiles(const Batch& batch) {
+        std::vector<uint32_t> failed;
+        for (size_t i = 0; i < batch.written.size(); i++) {
+            if (!batch.written[i]) {
+                failed.push_back(i);
+            }
+        }
+        return failed;
+    }
+}
@@ -0,0 +1,324 @@
+#include "s_file_receiver.h"
+#include "s_io_uring.h"
+#include "s_file_transfer_protocol.h"
+#include <iostream>
+#include <algorithm>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <cerrno>
+#include <openssl/evp.h>
+
+FileReceiver::FileReceiver() : doneBits_(REORDER_WINDOW / 64) {
+    fileFd_ = -1;
+    fileSize_ = 0;
+    bytesReceived_ = 0;
+    baseOffset_ = 0;
+    ownsFd_ = true;
+    expectedChunk_ = 0;
+    highestChunk_ = 0;
+    committedBytes_ = 0;
+    digestTracked_ = false;
+    digest_ = 0;
+    sha_ = nullptr;
+    hashTracked_ = false;
+    uring_ = nullptr;
+    uringAttached_ = false;
+}
+
+FileReceiver::~FileReceiver() {
+    close();
+    EVP_MD_CTX_free(sha_);
+}
+
+void FileReceiver::reset() {
+    bytesReceived_ = 0;
+    expectedChunk_ = 0;
+    highestChunk_ = 0;
+    std::fill(doneBits_.begin(), doneBits_.end(), 0);
+    aheadStarts_.clear();
+    aheadEnds_.clear();
+    committedBytes_ = 0;
+    digestTracked_ = false;
+    digest_ = 0;
+    hashTracked_ = false;
+}
+
+void FileReceiver::setDone(uint32_t chunk, bool done) {
+    uint64_t& word = doneBits_[(chunk % REORDER_WINDOW) / 64];
+    if (done) {
+        word |= 1ULL << (chunk % 64);
+    } else {
+        word &= ~(1ULL << (chunk % 64));
+    }
+}
+
+bool FileReceiver::open(const std::string& filePath, uint64_t fileSize) {
+    close();
+
+    // open file with writing perms, read back only when a resumable prefix closes over chunks written ahead
+    fileFd_ = ::open(filePath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fileFd_ < 0) {
+        std::cerr << "Failed to create file: " << filePath << std::endl;
+        return false;
+    }
+
+    filePath_ = filePath;
+    fileSize_ = fileSize;
+    baseOffset_ = 0;
+    ownsFd_ = true;
+    reset();
+
+    // fall back to plain writes if the ring cannot take this file or another channel has it
+    uringAttached_ = uring_ && !uring_->fileAttached() && uring_->attachFile(fileFd_);
+
+    return true;
+}
+
+bool FileReceiver::resume(const std::string& filePath, uint64_t fileSize, uint64_t committedBytes) {
+    close();
+
+    fileFd_ = ::open(filePath.c_str(), O_RDWR);
+    struct stat st;
+    if (fileFd_ < 0 || fstat(fileFd_, &st) < 0 || (uint64_t)st.st_size < committedBytes) {
+        // the partial file is gone or shorter than the journal says, start over
+        if (fileFd_ >= 0) {
+            ::close(fileFd_);
+            fileFd_ = -1;
+        }
+        return false;
+    }
+
+    filePath_ = filePath;
+    fileSize_ = fileSize;
+    baseOffset_ = 0;
+    ownsFd_ = true;
+    reset();
+    bytesReceived_ = committedBytes;
+    committedBytes_ = committedBytes;
+
+    uringAttached_ = uring_ && !uring_->fileAttached() && uring_->attachFile(fileFd_);
+
+    return true;
+}
+
+void FileReceiver::trackDigest(uint64_t digest) {
+    digestTracked_ = true;
+    digest_ = digest;
+}
+
+bool FileReceiver::trackHash() {
+    // a resumed prefix would have to be read back first
+    if (committedBytes_ > 0) {
+        return false;
+    }
+    if (!sha_) {
+        sha_ = EVP_MD_CTX_new();
+    }
+    if (!sha_ || EVP_DigestInit_ex(sha_, EVP_sha256(), nullptr) != 1) {
+        return false;
+    }
+    hashTracked_ = true;
+    return true;
+}
+
+bool FileReceiver::contentHash(uint8_t* hash) {
+    if (!hashTracked_ || committedBytes_ != fileSize_) {
+        return false;
+    }
+    hashTracked_ = false;
+    unsigned int length = 0;
+    return EVP_DigestFinal_ex(sha_, hash, &length) == 1;
+}
+
+bool FileReceiver::openPart(int fileFd, const std::string& filePath, uint64_t offset, uint64_t length) {
+    close();
+
+    fileFd_ = fileFd;
+    filePath_ = filePath;
+    fileSize_ = length;
+    baseOffset_ = offset;
+    ownsFd_ = false;
+    reset();
+
+    uringAttached_ = uring_ && !uring_->fileAttached() && uring_->attachFile(fileFd_);
+
+    return true;
+}
+
+bool FileReceiver::writeAll(const uint8_t* data, size_t len, uint64_t offset) {
+    if (uringAttached_) {
+        // written at its offset once the ring submits it
+        if (!uring_->queueWrite(data, len, offset)) {
+            std::cerr << "Failed to write to file" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // positioned writes so striped parts can share one fd, big chunks can come back short
+    while (len > 0) {
+        ssize_t bytesWritten = pwrite(fileFd_, data, len, offset);
+        if (bytesWritten < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "Failed to write to file" << std::endl;
+            return false;
+        }
+        offset += bytesWritten;
+        data += bytesWritten;
+        len -= bytesWritten;
+    }
+    return true;
+}
+
+bool FileReceiver::writeChunk(uint32_t chunkNumber, uint64_t offset, const uint8_t* data, size_t len) {
+    if (fileFd_ < 0) {
+        return false;
+    }
+
+    // duplicate chunks
+    if (chunkNumber < expectedChunk_ || (chunkNumber < highestChunk_ && isDone(chunkNumber))) {
+        std::cout << "Ignoring old duplicate chunk:  " << chunkNumber << " (expected: " << expectedChunk_ << ")" << std::endl;
+        return true;
+    }
+
+    // the bitmap only reaches so far, a client that runs further ahead is broken
+    if (chunkNumber - expectedChunk_ >= REORDER_WINDOW) {
+        std::cerr << "Chunk " << chunkNumber << " is too far ahead of " << expectedChunk_ << std::endl;
+        return false;
+    }
+    if (offset > fileSize_ || len > fileSize_ - offset) {
+        std::cerr << "Chunk " << chunkNumber << " at " << offset << " runs past the end of the file" << std::endl;
+        return false;
+    }
+    // the next chunk picks up where the prefix ends, anything past it can only start later
+    if (chunkNumber == expectedChunk_ ? offset != committedBytes_ : offset <= committedBytes_) {
+        std::cerr << "Chunk " << chunkNumber << " at " << offset << " does not follow the " << committedBytes_ << " bytes already written" << std::endl;
+        return false;
+    }
+
+    // straight to its place in the file, in order or not
+    if (!writeAll(data, len, baseOffset_ + offset)) {
+        return false;
+    }
+    bytesReceived_ += len;
+    highestChunk_ = std::max(highestChunk_, chunkNumber + 1);
+
+    if (chunkNumber != expectedChunk_) {
+        setDone(chunkNumber, true);
+        if (aheadEnds_.empty()) {
+            aheadStarts_.resize(REORDER_WINDOW);
+            aheadEnds_.resize(REORDER_WINDOW);
+        }
+        aheadStarts_[chunkNumber % REORDER_WINDOW] = offset;
+        aheadEnds_[chunkNumber % REORDER_WINDOW] = offset + len;
+        std::cout << "Out of order chunk written ahead!  " << chunkNumber << " (Expected: " << expectedChunk_ << ")" << std::endl;
+        return true;
+    }
+
+    if (digestTracked_) {
+        digest_ = FTPProtocol::updateDigest(digest_, data, len);
+    }
+    if (hashTracked_) {
+        EVP_DigestUpdate(sha_, data, len);
+    }
+    committedBytes_ = offset + len;
+
+    // the gap is closed, move past every chunk that was already written behind it
+    expectedChunk_++;
+    while (expectedChunk_ < highestChunk_ && isDone(expectedChunk_)) {
+        setDone(expectedChunk_, false);
+        if (aheadStarts_[expectedChunk_ % REORDER_WINDOW] != committedBytes_) {
+            std::cerr << "Chunk " << expectedChunk_ << " at " << aheadStarts_[expectedChunk_ % REORDER_WINDOW] << " does not follow the "
+                      << committedBytes_ << " bytes already written" << std::endl;
+            return false;
+        }
+        uint64_t end = aheadEnds_[expectedChunk_ % REORDER_WINDOW];
+        if ((digestTracked_ || hashTracked_) && !digestFromFile(committedBytes_, end)) {
+            return false;
+        }
+        committedBytes_ = end;
+        expectedChunk_++;
+    }
+
+    if (fileSize_ > 0) {
+        std::cout << "Progress: " << (bytesReceived_ * 100 / fileSize_) << "% (" << bytesReceived_ << "/" << fileSize_ << " bytes)" << std::endl;
+    }
+    return true;
+}
+
+std::vector<std::pair<uint32_t, uint32_t>> FileReceiver::heldRanges(size_t maxRanges) const {
+    std::vector<std::pair<uint32_t, uint32_t>> ranges;
+
+    // walk the bitmap in chunk order so neighbouring chunks join into one run
+    for (uint32_t chunk = expectedChunk_ + 1; chunk < highestChunk_; chunk++) {
+        if (!isDone(chunk)) {
+            continue;
+        }
+        if (!ranges.empty() && ranges.back().second + 1 == chunk) {
+            ranges.back().second = chunk;
+            continue;
+        }
+        if (ranges.size() == maxRanges) {
+            break;
+        }
+        ranges.emplace_back(chunk, chunk);
+    }
+    return ranges;
+}
+
+bool FileReceiver::digestFromFile(uint64_t from, uint64_t to) {
+    // queued ring writes have to land before they can be read back
+    if (uringAttached_ && !uring_->flushWrites()) {
+        return false;
+    }
+
+    std::vector<uint8_t> buffer(std::min<uint64_t>(to - from, 1024 * 1024));
+    while (from < to) {
+        ssize_t bytesRead = pread(fileFd_, buffer.data(), std::min<uint64_t>(to - from, buffer.size()), baseOffset_ + from);
+        if (bytesRead < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytesRead <= 0) {
+            std::cerr << "Failed to read back " << filePath_ << " for its digest" << std::endl;
+            return false;
+        }
+        if (digestTracked_) {
+            digest_ = FTPProtocol::updateDigest(digest_, buffer.data(), bytesRead);
+        }
+        if (hashTracked_) {
+            EVP_DigestUpdate(sha_, buffer.data(), bytesRead);
+        }
+        from += bytesRead;
+    }
+    return true;
+}
+
+bool FileReceiver::sync() {
+    if (fileFd_ < 0) {
+        return false;
+    }
+    if (uringAttached_ && !uring_->flushWrites()) {
+        return false;
+    }
+    return fdatasync(fileFd_) == 0;
+}
+
+bool FileReceiver::close() {
+    bool ok = true;
+    if (uringAttached_) {
+        // every queued write has to land before the file is closed
+        ok = uring_->flushWrites();
+        uring_->detachFile();
+        uringAttached_ = false;
+    }
+    if (fileFd_ >= 0) {
+        if (ownsFd_) {
+            ::close(fileFd_);
+        }
+        fileFd_ = -1;
+    }
+    return ok;
+}
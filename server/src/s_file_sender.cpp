@@ -0,0 +1,160 @@
+#include "s_file_sender.h"
+#include "s_chunk_store.h"
+#include <iostream>
+#include <algorithm>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+FileSender::FileSender() {
+    fileFd_ = -1;
+    map_ = nullptr;
+    mapLength_ = 0;
+    data_ = nullptr;
+    fileSize_ = 0;
+    offset_ = 0;
+    length_ = 0;
+    bytesSent_ = 0;
+    chunkSize_ = 0;
+    chunkNumber_ = 0;
+    segment_ = 0;
+}
+
+FileSender::~FileSender() {
+    close();
+}
+
+bool FileSender::open(const std::string& filePath, uint64_t offset, uint64_t length, uint32_t chunkSize) {
+    close();
+
+    fileFd_ = ::open(filePath.c_str(), O_RDONLY);
+    struct stat st;
+    if (fileFd_ < 0 || fstat(fileFd_, &st) < 0 || !S_ISREG(st.st_mode)) {
+        std::cerr << "Failed to open file for reading: " << filePath << std::endl;
+        close();
+        return false;
+    }
+
+    filePath_ = filePath;
+    fileSize_ = st.st_size;
+    offset_ = std::min(offset, fileSize_);
+    length_ = std::min(length, fileSize_ - offset_);
+    bytesSent_ = 0;
+    chunkSize_ = chunkSize;
+    chunkNumber_ = 0;
+
+    if (length_ == 0) {
+        return true;
+    }
+
+    // mmap wants a page aligned offset, map from the page the range starts in
+    uint64_t pageSize = sysconf(_SC_PAGESIZE);
+    uint64_t mapOffset = offset_ - offset_ % pageSize;
+    mapLength_ = length_ + (offset_ - mapOffset);
+    void* map = mmap(nullptr, mapLength_, PROT_READ, MAP_SHARED, fileFd_, mapOffset);
+    if (map == MAP_FAILED) {
+        std::cerr << "Failed to map " << filePath << std::endl;
+        map_ = nullptr;
+        close();
+        return false;
+    }
+    map_ = static_cast<uint8_t*>(map);
+    data_ = map_ + (offset_ - mapOffset);
+
+    // read ahead aggressively, pages behind the range are not needed again
+    madvise(map_, mapLength_, MADV_SEQUENTIAL);
+    return true;
+}
+
+bool FileSender::openManifest(const ChunkStore& store, const std::string& filePath, uint64_t offset, uint64_t length, uint32_t chunkSize) {
+    close();
+
+    std::vector<FTPProtocol::ChunkRef> chunks;
+    if (!ChunkStore::loadManifest(filePath, fileSize_, chunks)) {
+        std::cerr << "Failed to open file for reading: " << filePath << std::endl;
+        return false;
+    }
+
+    uint64_t position = 0;
+    for (const FTPProtocol::ChunkRef& chunk : chunks) {
+        segments_.push_back({store.chunkPath(chunk.hash), position, chunk.length});
+        position += chunk.length;
+    }
+
+    filePath_ = filePath;
+    offset_ = std::min(offset, fileSize_);
+    length_ = std::min(length, fileSize_ - offset_);
+    bytesSent_ = 0;
+    chunkSize_ = chunkSize;
+    chunkNumber_ = 0;
+
+    // the first stored chunk of the range, the rest follow in order
+    segment_ = 0;
+    while (segment_ < segments_.size() && segments_[segment_].offset + segments_[segment_].length <= offset_) {
+        segment_++;
+    }
+    return length_ == 0 || mapSegment(segment_);
+}
+
+bool FileSender::mapSegment(size_t index) {
+    if (map_) {
+        munmap(map_, mapLength_);
+        map_ = nullptr;
+    }
+    segment_ = index;
+
+    const Segment& segment = segments_[index];
+    int fd = ::open(segment.path.c_str(), O_RDONLY);
+    void* map = fd < 0 ? MAP_FAILED : mmap(nullptr, segment.length, PROT_READ, MAP_SHARED, fd, 0);
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    if (map == MAP_FAILED) {
+        std::cerr << "Failed to map stored chunk " << segment.path << std::endl;
+        return false;
+    }
+    map_ = static_cast<uint8_t*>(map);
+    mapLength_ = segment.length;
+    return true;
+}
+
+void FileSender::close() {
+    if (map_) {
+        munmap(map_, mapLength_);
+        map_ = nullptr;
+    }
+    mapLength_ = 0;
+    data_ = nullptr;
+    if (fileFd_ >= 0) {
+        ::close(fileFd_);
+        fileFd_ = -1;
+    }
+    segments_.clear();
+    segment_ = 0;
+}
+
+const uint8_t* FileSender::nextChunk(uint32_t& chunkNumber, uint64_t& offset, uint32_t& length) {
+    if (!segments_.empty() && !isComplete()) {
+        // stop at the end of the stored chunk, the next call maps the one after it
+        uint64_t position = offset_ + bytesSent_;
+        if (position >= segments_[segment_].offset + segments_[segment_].length && !mapSegment(segment_ + 1)) {
+            return nullptr;
+        }
+        const Segment& segment = segments_[segment_];
+        chunkNumber = chunkNumber_++;
+        offset = bytesSent_;
+        length = std::min<uint64_t>({chunkSize_, length_ - bytesSent_, segment.offset + segment.length - position});
+        bytesSent_ += length;
+        return map_ + (position - segment.offset);
+    }
+    if (!data_ || isComplete()) {
+        return nullptr;
+    }
+
+    chunkNumber = chunkNumber_++;
+    offset = bytesSent_;
+    length = std::min<uint64_t>(chunkSize_, length_ - bytesSent_);
+    bytesSent_ += length;
+    return data_ + offset;
+}
@@ -1,46 +1,53 @@
 #include "../include/s_file_transfer_protocol.h"
-#include "s_simple_crypto.h"
+#include "s_cipher_registry.h"
+#include "s_io_uring.h"
+#include "s_frame_reader.h"
+#include "s_send_batch.h"
 #include <iostream>
 #include <cstring>
+#include <algorithm>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 
 namespace FTPProtocol {
 
-    std::vector<uint8_t> serializeHeader(const FTPHeader& header) {
-        std::vector<uint8_t> data(sizeof(FTPHeader));
+    void serializeHeader(const FTPHeader& header, uint8_t* out) {
+        // channelId lives in the old padding, the header stays 12 bytes on the wire
+        static_assert(sizeof(FTPHeader) == 12);
         
         // convert to Big Endian network byte order
         uint32_t payloadLength = htonl(header.payloadLength);
         uint32_t sequenceNumber = htonl(header.sequenceNumber);
+        uint16_t channelId = htons(header.channelId);
         
-        // copy the data from the header to vector
-        data[0] = header.messageType;
-        memcpy(data.data() + 1, &payloadLength, sizeof(uint32_t));
-        memcpy(data.data() + 5, &sequenceNumber, sizeof(uint32_t));
-        
-        return data;
+        // copy the data from the header to out
+        out[0] = header.messageType;
+        memcpy(out + 1, &payloadLength, sizeof(uint32_t));
+        memcpy(out + 5, &sequenceNumber, sizeof(uint32_t));
+        memcpy(out + 9, &channelId, sizeof(uint16_t));
     }
 
-    bool deserializeHeader(const std::vector<uint8_t>& data, FTPHeader& header) {
+    bool deserializeHeader(std::span<const uint8_t> data, FTPHeader& header) {
         if (data.size() < sizeof(FTPHeader)) {
             return false;
         }
         
-        // copy data from vector to a FTPHeader
+        // copy data from the bytes to a FTPHeader
         header.messageType = data[0];
         memcpy(&header.payloadLength, data.data() + 1, sizeof(uint32_t));
         memcpy(&header.sequenceNumber, data.data() + 5, sizeof(uint32_t));
+        memcpy(&header.channelId, data.data() + 9, sizeof(uint16_t));
         
         // convert form Big Endian
         header.payloadLength = ntohl(header.payloadLength);
         header.sequenceNumber = ntohl(header.sequenceNumber);
+        header.channelId = ntohs(header.channelId);
         
         return true;
     }
 
-    bool parseFileStartMessage(const std::vector<uint8_t>& data, std::string& filename, uint64_t& fileSize, uint32_t& chunkSize) {
+    bool parseFileStartMessage(const std::vector<uint8_t>& data, std::string& filename, uint64_t& fileSize, uint32_t& chunkSize, uint64_t& fileVersion) {
         // std::cout << "parseFileStartMessage - data size = " << data.size() << ", FileStartMessage size = " << sizeof(FileStartMessage) << std::endl;
         
         // std::cout << "Server: First 16 bytes: ";
@@ -57,10 +64,13 @@ namespace FTPProtocol {
         uint32_t filenameLength;
         uint64_t fileSizeNet;
         uint32_t chunk_size_net;
+        uint64_t fileVersionNet;
         
         memcpy(&filenameLength, data.data(), sizeof(uint32_t));
         memcpy(&fileSizeNet, data.data() + 4, sizeof(uint64_t));
         memcpy(&chunk_size_net, data.data() + 12, sizeof(uint32_t));
+        static_assert(sizeof(FileStartMessage) >= FILE_VERSION_OFFSET + sizeof(uint64_t));
+        memcpy(&fileVersionNet, data.data() + FILE_VERSION_OFFSET, sizeof(uint64_t));
         
         // std::cout << "parseFileStartMessage: raw values - filenameLength=" << filenameLength 
         //         << ", fileSizeNet=" << fileSizeNet 
@@ -71,6 +81,7 @@ namespace FTPProtocol {
         filenameLength = ntohl(filenameLength);
         fileSize = be64toh(fileSizeNet);
         chunkSize = ntohl(chunk_size_net);
+        fileVersion = be64toh(fileVersionNet);
         
 
         // std::cout << "parseFileStartMessage: converted values - filenameLength=" << filenameLength 
@@ -87,7 +98,23 @@ namespace FTPProtocol {
         return true;
     }
 
-    bool parseFileDataMessage(const std::vector<uint8_t>& data, uint32_t& chunkNumber, std::vector<uint8_t>& file_data) {
+    bool parseContentHash(const std::vector<uint8_t>& data, uint8_t* hash) {
+        if (data.size() < sizeof(FileStartMessage)) {
+            return false;
+        }
+        uint32_t filenameLength;
+        memcpy(&filenameLength, data.data(), sizeof(uint32_t));
+        filenameLength = ntohl(filenameLength);
+
+        // older clients end the payload with the name
+        if (data.size() != sizeof(FileStartMessage) + (uint64_t)filenameLength + FILE_HASH_SIZE) {
+            return false;
+        }
+        memcpy(hash, data.data() + sizeof(FileStartMessage) + filenameLength, FILE_HASH_SIZE);
+        return true;
+    }
+
+    bool parseFileDataMessage(const std::vector<uint8_t>& data, uint32_t& chunkNumber, uint64_t& offset, const uint8_t*& chunkData, uint32_t& chunkLength) {
         if (data.size() < sizeof(FileDataMessage)) {
             return false;
         }
@@ -97,124 +124,549 @@ namespace FTPProtocol {
         
         uint32_t chunkNumberNet = ntohl(msg.chunkNumber);
         uint32_t dataLengthNet = ntohl(msg.dataLength);
+        uint64_t offsetNet = be64toh(msg.offset);
         
         if (data.size() < sizeof(FileDataMessage) + dataLengthNet) {
             return false;
         }
         
         chunkNumber = chunkNumberNet;
-        file_data.assign(data.begin() + sizeof(FileDataMessage), data.begin() + sizeof(FileDataMessage) + dataLengthNet);
+        offset = offsetNet;
+        chunkData = data.data() + sizeof(FileDataMessage);
+        chunkLength = dataLengthNet;
         
         return true;
     }
 
-    bool sendEncryptedMessage(int socket_fd, uint8_t messageType, const std::vector<uint8_t>& payload, uint32_t sequenceNumber, SimpleCrypto& crypto) {
-        FTPHeader header(messageType, payload.size(), sequenceNumber);
+    std::vector<uint8_t> createFileStartReply(uint32_t chunkSize, uint64_t resumeOffset, uint64_t digest) {
+        // [chunk size][resume offset][digest]
+        std::vector<uint8_t> data(sizeof(uint32_t) + 2 * sizeof(uint64_t));
+        uint32_t chunkSizeNet = htonl(chunkSize);
+        uint64_t resumeOffsetNet = htobe64(resumeOffset);
+        uint64_t digestNet = htobe64(digest);
+        memcpy(data.data(), &chunkSizeNet, sizeof(uint32_t));
+        memcpy(data.data() + 4, &resumeOffsetNet, sizeof(uint64_t));
+        memcpy(data.data() + 12, &digestNet, sizeof(uint64_t));
+        return data;
+    }
 
-        std::vector<uint8_t> headerData = serializeHeader(header);
-        
-        // simple encryption of the header
-        std::vector<uint8_t> encryptedHeader = crypto.encryptPacket(headerData);
-        
-        // send encrypted header size
-        uint32_t headerSize = htonl(encryptedHeader.size());
-        ssize_t sent = send(socket_fd, &headerSize, sizeof(headerSize), 0);
-        if (sent != sizeof(headerSize)) {
+    uint64_t updateDigest(uint64_t digest, const uint8_t* data, size_t len) {
+        for (size_t i = 0; i < len; i++) {
+            digest ^= data[i];
+            digest *= 0x100000001b3ULL;
+        }
+        return digest;
+    }
+
+    bool parseUploadInitMessage(const std::vector<uint8_t>& data, std::string& filename, uint64_t& fileSize, uint32_t& partCount) {
+        // same bytes as FILE_START, the chunk size slot carries the part count
+        static_assert(sizeof(UploadInitMessage) == sizeof(FileStartMessage));
+        uint64_t fileVersion;
+        return parseFileStartMessage(data, filename, fileSize, partCount, fileVersion);
+    }
+
+    bool parseUploadPartMessage(const std::vector<uint8_t>& data, uint64_t& uploadId, uint64_t& offset, uint64_t& length, uint32_t& chunkSize) {
+        if (data.size() < sizeof(UploadPartMessage)) {
             return false;
         }
-        
-        // send encrypted header data
-        sent = send(socket_fd, encryptedHeader.data(), encryptedHeader.size(), 0);
-        if (sent != (ssize_t)encryptedHeader.size()) {
-            std::cerr << "Server: Failed to send encrypted header, sent " << sent << " bytes" << std::endl;
+
+        uint64_t uploadIdNet;
+        uint64_t offsetNet;
+        uint64_t lengthNet;
+        uint32_t chunkSizeNet;
+        memcpy(&uploadIdNet, data.data(), sizeof(uint64_t));
+        memcpy(&offsetNet, data.data() + 8, sizeof(uint64_t));
+        memcpy(&lengthNet, data.data() + 16, sizeof(uint64_t));
+        memcpy(&chunkSizeNet, data.data() + 24, sizeof(uint32_t));
+
+        // convert from Big Endian
+        uploadId = be64toh(uploadIdNet);
+        offset = be64toh(offsetNet);
+        length = be64toh(lengthNet);
+        chunkSize = ntohl(chunkSizeNet);
+        return true;
+    }
+
+    std::vector<uint8_t> createUploadIdMessage(uint64_t uploadId) {
+        std::vector<uint8_t> data(sizeof(uint64_t));
+        uint64_t uploadIdNet = htobe64(uploadId);
+        memcpy(data.data(), &uploadIdNet, sizeof(uint64_t));
+        return data;
+    }
+
+    bool parseUploadIdMessage(const std::vector<uint8_t>& data, uint64_t& uploadId) {
+        if (data.size() < sizeof(uint64_t)) {
             return false;
         }
-        
-        // send encrypted payload
-        if (!payload.empty()) {
-            std::vector<uint8_t> encryptedPayload = crypto.encryptPacket(payload);
-            
-            // payload size
-            uint32_t payloadSize = htonl(encryptedPayload.size());
-            sent = send(socket_fd, &payloadSize, sizeof(payloadSize), 0);
-            if (sent != sizeof(payloadSize)) {
+        uint64_t uploadIdNet;
+        memcpy(&uploadIdNet, data.data(), sizeof(uint64_t));
+        uploadId = be64toh(uploadIdNet);
+        return true;
+    }
+
+    void createFileAckMessage(std::vector<uint8_t>& data, uint32_t nextChunk, const std::vector<ChunkRange>& ranges) {
+        uint32_t rangeCount = std::min<size_t>(ranges.size(), MAX_ACK_RANGES);
+        data.resize(sizeof(FileAckMessage) + rangeCount * 8);
+
+        // Big Endian
+        uint32_t nextChunkNet = htonl(nextChunk);
+        uint32_t rangeCountNet = htonl(rangeCount);
+        memcpy(data.data(), &nextChunkNet, sizeof(uint32_t));
+        memcpy(data.data() + 4, &rangeCountNet, sizeof(uint32_t));
+
+        // selective ranges after the fixed part
+        for (uint32_t i = 0; i < rangeCount; i++) {
+            uint32_t first = htonl(ranges[i].first);
+            uint32_t last = htonl(ranges[i].second);
+            memcpy(data.data() + sizeof(FileAckMessage) + i * 8, &first, sizeof(uint32_t));
+            memcpy(data.data() + sizeof(FileAckMessage) + i * 8 + 4, &last, sizeof(uint32_t));
+        }
+    }
+
+    bool parseFileAckMessage(const std::vector<uint8_t>& data, uint32_t& nextChunk) {
+        if (data.size() < sizeof(FileAckMessage)) {
+            return false;
+        }
+        uint32_t nextChunkNet;
+        memcpy(&nextChunkNet, data.data(), sizeof(uint32_t));
+        nextChunk = ntohl(nextChunkNet);
+        return true;
+    }
+
+    bool parseFileGetMessage(const std::vector<uint8_t>& data, std::string& filename, uint64_t& offset, uint64_t& length, uint32_t& chunkSize) {
+        if (data.size() < sizeof(FileGetMessage)) {
+            std::cerr << "parseFileGetMessage: data too small" << std::endl;
+            return false;
+        }
+
+        uint64_t offsetNet;
+        uint64_t lengthNet;
+        uint32_t chunkSizeNet;
+        uint32_t filenameLength;
+        memcpy(&offsetNet, data.data(), sizeof(uint64_t));
+        memcpy(&lengthNet, data.data() + 8, sizeof(uint64_t));
+        memcpy(&chunkSizeNet, data.data() + 16, sizeof(uint32_t));
+        memcpy(&filenameLength, data.data() + 20, sizeof(uint32_t));
+
+        // convert from Big Endian
+        offset = be64toh(offsetNet);
+        length = be64toh(lengthNet);
+        chunkSize = ntohl(chunkSizeNet);
+        filenameLength = ntohl(filenameLength);
+
+        if (filenameLength > MAX_FILENAME_LENGTH || data.size() < sizeof(FileGetMessage) + filenameLength) {
+            std::cerr << "parseFileGetMessage: bad filename length" << std::endl;
+            return false;
+        }
+        filename.assign(data.begin() + sizeof(FileGetMessage), data.begin() + sizeof(FileGetMessage) + filenameLength);
+        return true;
+    }
+
+    std::vector<uint8_t> createFileGetReply(uint64_t fileSize, uint64_t offset, uint64_t length, uint32_t chunkSize) {
+        std::vector<uint8_t> data(3 * sizeof(uint64_t) + sizeof(uint32_t));
+        uint64_t fileSizeNet = htobe64(fileSize);
+        uint64_t offsetNet = htobe64(offset);
+        uint64_t lengthNet = htobe64(length);
+        uint32_t chunkSizeNet = htonl(chunkSize);
+        memcpy(data.data(), &fileSizeNet, sizeof(uint64_t));
+        memcpy(data.data() + 8, &offsetNet, sizeof(uint64_t));
+        memcpy(data.data() + 16, &lengthNet, sizeof(uint64_t));
+        memcpy(data.data() + 24, &chunkSizeNet, sizeof(uint32_t));
+        return data;
+    }
+
+    std::vector<uint8_t> createDeltaStartReply(uint32_t blockSize, uint32_t blockCount) {
+        std::vector<uint8_t> data(2 * sizeof(uint32_t));
+        uint32_t blockSizeNet = htonl(blockSize);
+        uint32_t blockCountNet = htonl(blockCount);
+        memcpy(data.data(), &blockSizeNet, sizeof(uint32_t));
+        memcpy(data.data() + 4, &blockCountNet, sizeof(uint32_t));
+        return data;
+    }
+
+    std::vector<uint8_t> createDeltaSignaturesMessage(const std::vector<BlockSignature>& signatures, size_t first, size_t count) {
+        constexpr size_t SIGNATURE_SIZE = sizeof(uint32_t) + STRONG_HASH_SIZE;
+        std::vector<uint8_t> data(sizeof(uint32_t) + count * SIGNATURE_SIZE);
+        uint32_t countNet = htonl(count);
+        memcpy(data.data(), &countNet, sizeof(uint32_t));
+
+        uint8_t* p = data.data() + sizeof(uint32_t);
+        for (size_t i = first; i < first + count; i++) {
+            uint32_t weakNet = htonl(signatures[i].weak);
+            memcpy(p, &weakNet, sizeof(uint32_t));
+            memcpy(p + 4, signatures[i].strong, STRONG_HASH_SIZE);
+            p += SIGNATURE_SIZE;
+        }
+        return data;
+    }
+
+    bool parseDeltaDataMessage(const std::vector<uint8_t>& data, std::vector<DeltaOp>& ops) {
+        ops.clear();
+        size_t pos = 0;
+        while (pos < data.size()) {
+            DeltaOp op{};
+            op.type = data[pos++];
+            uint32_t first;
+            uint32_t second;
+            if (op.type == DELTA_COPY && data.size() - pos >= 2 * sizeof(uint32_t)) {
+                memcpy(&first, data.data() + pos, sizeof(uint32_t));
+                memcpy(&second, data.data() + pos + 4, sizeof(uint32_t));
+                op.firstBlock = ntohl(first);
+                op.blockCount = ntohl(second);
+                pos += 2 * sizeof(uint32_t);
+            } else if (op.type == DELTA_LITERAL && data.size() - pos >= sizeof(uint32_t)) {
+                memcpy(&first, data.data() + pos, sizeof(uint32_t));
+                op.length = ntohl(first);
+                pos += sizeof(uint32_t);
+                if (data.size() - pos < op.length) {
+                    std::cerr << "parseDeltaDataMessage: literal cut short" << std::endl;
+                    return false;
+                }
+                op.literal = data.data() + pos;
+                pos += op.length;
+            } else {
+                std::cerr << "parseDeltaDataMessage: bad instruction " << (int)op.type << std::endl;
                 return false;
             }
-            
-            // encryped payload send
-            sent = send(socket_fd, encryptedPayload.data(), encryptedPayload.size(), 0);
-            if (sent != (ssize_t)encryptedPayload.size()) {
+            ops.push_back(op);
+        }
+        return true;
+    }
+
+    bool parseFileBatchMessage(const std::vector<uint8_t>& data, std::vector<BatchEntry>& entries) {
+        if (data.size() < sizeof(uint32_t)) {
+            return false;
+        }
+        uint32_t fileCount;
+        memcpy(&fileCount, data.data(), sizeof(uint32_t));
+        fileCount = ntohl(fileCount);
+        if (fileCount > MAX_BATCH_FILES) {
+            std::cerr << "parseFileBatchMessage: " << fileCount << " files in one batch" << std::endl;
+            return false;
+        }
+
+        entries.clear();
+        entries.reserve(fileCount);
+        size_t pos = sizeof(uint32_t);
+        for (uint32_t i = 0; i < fileCount; i++) {
+            if (data.size() - pos < sizeof(FileBatchEntry)) {
+                std::cerr << "parseFileBatchMessage: batch cut short at file " << i << std::endl;
+                return false;
+            }
+            uint64_t fileSizeNet;
+            uint32_t filenameLength;
+            memcpy(&fileSizeNet, data.data() + pos, sizeof(uint64_t));
+            memcpy(&filenameLength, data.data() + pos + 8, sizeof(uint32_t));
+            pos += sizeof(FileBatchEntry);
+
+            // convert from Big Endian
+            uint64_t fileSize = be64toh(fileSizeNet);
+            filenameLength = ntohl(filenameLength);
+            if (filenameLength > MAX_FILENAME_LENGTH || data.size() - pos < filenameLength || data.size() - pos - filenameLength < fileSize) {
+                std::cerr << "parseFileBatchMessage: batch cut short at file " << i << std::endl;
                 return false;
             }
+
+            BatchEntry entry;
+            entry.filename.assign(data.begin() + pos, data.begin() + pos + filenameLength);
+            entry.data = data.data() + pos + filenameLength;
+            entry.size = fileSize;
+            entries.push_back(std::move(entry));
+            pos += filenameLength + fileSize;
         }
-        
         return true;
     }
 
-    bool receiveEncryptedMessage(int socket_fd, FTPHeader& header, std::vector<uint8_t>& payload, SimpleCrypto& crypto) {
-        // recieve the size of the encryped message
-        std::cout << "Lisening for encrypted message..." << std::endl;
+    std::vector<uint8_t> createFileBatchReply(uint32_t fileCount, const std::vector<uint32_t>& failed) {
+        std::vector<uint8_t> data(2 * sizeof(uint32_t) + failed.size() * sizeof(uint32_t));
+        uint32_t fileCountNet = htonl(fileCount);
+        uint32_t failedCountNet = htonl(failed.size());
+        memcpy(data.data(), &fileCountNet, sizeof(uint32_t));
+        memcpy(data.data() + 4, &failedCountNet, sizeof(uint32_t));
+        for (size_t i = 0; i < failed.size(); i++) {
+            uint32_t indexNet = htonl(failed[i]);
+            memcpy(data.data() + 8 + i * 4, &indexNet, sizeof(uint32_t));
+        }
+        return data;
+    }
 
-        uint32_t encryptedSize;
-        ssize_t received = recv(socket_fd, &encryptedSize, sizeof(encryptedSize), MSG_WAITALL);
-        if (received != sizeof(encryptedSize)) {
-            std::cerr << "Failed to receive encrypted size, got " << received << " bytes" << std::endl;
+    bool parseDedupeStartMessage(const std::vector<uint8_t>& data, std::string& filename, uint64_t& fileSize, std::vector<ChunkRef>& chunks) {
+        if (data.size() < sizeof(DedupeStartMessage)) {
+            std::cerr << "parseDedupeStartMessage: data too small" << std::endl;
             return false;
         }
-        encryptedSize = ntohl(encryptedSize);
-        
-        // receive the encrypted header
-        std::vector<uint8_t> encryptedHeaderData(encryptedSize);
-        received = recv(socket_fd, encryptedHeaderData.data(), encryptedHeaderData.size(), MSG_WAITALL);
-        if (received != (ssize_t)encryptedHeaderData.size()) {
-            std::cerr << "Failed to receive encrypted header, got " << received << " bytes, expected " << encryptedHeaderData.size() << std::endl;
+
+        uint64_t fileSizeNet;
+        uint32_t chunkCount;
+        uint32_t filenameLength;
+        memcpy(&fileSizeNet, data.data(), sizeof(uint64_t));
+        memcpy(&chunkCount, data.data() + 8, sizeof(uint32_t));
+        memcpy(&filenameLength, data.data() + 12, sizeof(uint32_t));
+
+        // convert from Big Endian
+        fileSize = be64toh(fileSizeNet);
+        chunkCount = ntohl(chunkCount);
+        filenameLength = ntohl(filenameLength);
+
+        constexpr size_t REF_SIZE = sizeof(uint32_t) + CHUNK_HASH_SIZE;
+        if (filenameLength > MAX_FILENAME_LENGTH || chunkCount > MAX_CHUNK_REFS ||
+            data.size() != sizeof(DedupeStartMessage) + filenameLength + chunkCount * REF_SIZE) {
+            std::cerr << "parseDedupeStartMessage: bad length" << std::endl;
             return false;
         }
-        
-        // decrypt header
-        std::vector<uint8_t> headerData;
-        if (!crypto.decryptPacket(encryptedHeaderData, headerData)) {
+        filename.assign(data.begin() + sizeof(DedupeStartMessage), data.begin() + sizeof(DedupeStartMessage) + filenameLength);
+
+        // the chunks have to add up to the file
+        uint64_t total = 0;
+        chunks.resize(chunkCount);
+        const uint8_t* p = data.data() + sizeof(DedupeStartMessage) + filenameLength;
+        for (uint32_t i = 0; i < chunkCount; i++) {
+            uint32_t lengthNet;
+            memcpy(&lengthNet, p, sizeof(uint32_t));
+            chunks[i].length = ntohl(lengthNet);
+            memcpy(chunks[i].hash, p + 4, CHUNK_HASH_SIZE);
+            if (chunks[i].length == 0 || chunks[i].length > MAX_DEDUPE_CHUNK_SIZE) {
+                std::cerr << "parseDedupeStartMessage: chunk " << i << " is " << chunks[i].length << " bytes" << std::endl;
+                return false;
+            }
+            total += chunks[i].length;
+            p += REF_SIZE;
+        }
+        if (total != fileSize) {
+            std::cerr << "parseDedupeStartMessage: chunks cover " << total << " of " << fileSize << " bytes" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    std::vector<uint8_t> createMissingChunksReply(const std::vector<uint32_t>& missing) {
+        std::vector<uint8_t> data(sizeof(uint32_t) + missing.size() * sizeof(uint32_t));
+        uint32_t countNet = htonl(missing.size());
+        memcpy(data.data(), &countNet, sizeof(uint32_t));
+        for (size_t i = 0; i < missing.size(); i++) {
+            uint32_t indexNet = htonl(missing[i]);
+            memcpy(data.data() + 4 + i * 4, &indexNet, sizeof(uint32_t));
+        }
+        return data;
+    }
+
+    bool parseChunkDataMessage(const std::vector<uint8_t>& data, uint32_t& index, const uint8_t*& chunkData, uint32_t& chunkLength) {
+        if (data.size() < sizeof(uint32_t)) {
+            std::cerr << "parseChunkDataMessage: data too small" << std::endl;
+            return false;
+        }
+        uint32_t indexNet;
+        memcpy(&indexNet, data.data(), sizeof(uint32_t));
+        index = ntohl(indexNet);
+        chunkData = data.data() + sizeof(uint32_t);
+        chunkLength = data.size() - sizeof(uint32_t);
+        return true;
+    }
+
+    namespace {
+        // [size][packet], the size is filled in once the packet is encrypted, on false out is left as it was
+        bool appendEncryptedFrame(std::vector<uint8_t>& out, PacketCipher& crypto, const uint8_t* head, size_t headLength, const uint8_t* body, size_t bodyLength) {
+            size_t sizeAt = out.size();
+            out.resize(sizeAt + 4);
+            if (!crypto.encryptPacketInto(out, head, headLength, body, bodyLength)) {
+                out.resize(sizeAt);
+                return false;
+            }
+            uint32_t packetSize = htonl(out.size() - sizeAt - 4);
+            memcpy(out.data() + sizeAt, &packetSize, sizeof(uint32_t));
+            return true;
+        }
+    }
+
+    bool appendEncryptedFileData(std::vector<uint8_t>& out, uint32_t chunkNumber, uint64_t offset, const uint8_t* data, uint32_t length, uint32_t sequenceNumber, PacketCipher& crypto, uint16_t channelId) {
+        FTPHeader header(static_cast<uint8_t>(FTPMessageType::FILE_DATA), sizeof(FileDataMessage) + length, sequenceNumber, channelId);
+        uint8_t headerData[sizeof(FTPHeader)];
+        serializeHeader(header, headerData);
+
+        // Big Endian, the chunk itself goes in behind this without a copy
+        uint8_t prefix[sizeof(FileDataMessage)];
+        uint32_t chunkNumberNet = htonl(chunkNumber);
+        uint32_t lengthNet = htonl(length);
+        uint64_t offsetNet = htobe64(offset);
+        memcpy(prefix, &chunkNumberNet, sizeof(uint32_t));
+        memcpy(prefix + 4, &lengthNet, sizeof(uint32_t));
+        memcpy(prefix + 8, &offsetNet, sizeof(uint64_t));
+
+        return appendEncryptedFrame(out, crypto, headerData, sizeof(headerData), nullptr, 0) &&
+               appendEncryptedFrame(out, crypto, prefix, sizeof(prefix), data, length);
+    }
+
+    bool appendEncryptedMessage(std::vector<uint8_t>& out, uint8_t messageType, const std::vector<uint8_t>& payload, uint32_t sequenceNumber, PacketCipher& crypto, uint16_t channelId) {
+        FTPHeader header(messageType, payload.size(), sequenceNumber, channelId);
+        uint8_t headerData[sizeof(FTPHeader)];
+        serializeHeader(header, headerData);
+
+        // encrypt header then payload so the crypto sequence matches sendEncryptedMessage
+        if (!appendEncryptedFrame(out, crypto, headerData, sizeof(headerData), nullptr, 0)) {
+            return false;
+        }
+        return payload.empty() || appendEncryptedFrame(out, crypto, payload.data(), payload.size(), nullptr, 0);
+    }
+
+    bool queueEncryptedMessage(SendBatch& batch, uint8_t messageType, const std::vector<uint8_t>& payload, uint32_t sequenceNumber, PacketCipher& crypto, uint16_t channelId) {
+        FTPHeader header(messageType, payload.size(), sequenceNumber, channelId);
+
+        // header first then payload, the crypto sequence numbers depend on the order
+        // both are built and encrypted in the batch's own buffer
+        std::span<uint8_t> headerFrame = batch.stageFrame(sizeof(FTPHeader) + PacketCipher::MAC_SIZE);
+        serializeHeader(header, headerFrame.data());
+        if (!crypto.encryptInPlace(headerFrame)) {
+            return false;
+        }
+        if (!payload.empty()) {
+            std::span<uint8_t> payloadFrame = batch.stageFrame(payload.size() + PacketCipher::MAC_SIZE);
+            memcpy(payloadFrame.data(), payload.data(), payload.size());
+            return crypto.encryptInPlace(payloadFrame);
+        }
+        return true;
+    }
+
+    bool sendEncryptedMessage(int socket_fd, uint8_t messageType, const std::vector<uint8_t>& payload, uint32_t sequenceNumber, PacketCipher& crypto) {
+        // sizes, header and payload leave in a single sendmsg
+        SendBatch batch;
+        if (!queueEncryptedMessage(batch, messageType, payload, sequenceNumber, crypto)) {
+            std::cerr << "Failed to encrypt message" << std::endl;
+            return false;
+        }
+        if (!batch.flush(socket_fd)) {
+            std::cerr << "Failed to send encrypted message" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    bool openEncryptedHeader(std::span<uint8_t> frame, FTPHeader& header, PacketCipher& crypto) {
+        if (!crypto.decryptInPlace(frame)) {
             std::cerr << "Failed to decrypt header" << std::endl;
             return false;
         }
-        
-        // parse header
-        if (!deserializeHeader(headerData, header)) {
+        if (!deserializeHeader(frame, header)) {
             std::cerr << "Failed to deserialize header" << std::endl;
             return false;
         }
-        
-        // receive encrupted payload
-        if (header.payloadLength > 0) {
-            // receive payload size
-            uint32_t payloadEncryptedSize;
-            received = recv(socket_fd, &payloadEncryptedSize, sizeof(payloadEncryptedSize), MSG_WAITALL);
-            if (received != sizeof(payloadEncryptedSize)) {
-                std::cerr << "Failed to receive payload encrypted size, got " << received << " bytes" << std::endl;
+        return true;
+    }
+
+    bool openEncryptedPayload(std::vector<uint8_t>& frame, PacketCipher& crypto) {
+        if (!crypto.decryptInPlace(frame)) {
+            std::cerr << "Failed to decrypt payload" << std::endl;
+            return false;
+        }
+        frame.resize(frame.size() - PacketCipher::MAC_SIZE);
+        return true;
+    }
+
+    namespace {
+        // shared by every byte source, recvExact(buffer, len) fills exactly len bytes or fails
+        template <typename RecvExact>
+        bool receiveEncryptedMessageFrom(RecvExact recvExact, FTPHeader& header, std::vector<uint8_t>& payload, PacketCipher& crypto) {
+            // recieve the size of the encryped message
+            uint32_t encryptedSize;
+            if (!recvExact(&encryptedSize, sizeof(encryptedSize))) {
+                std::cerr << "Failed to receive encrypted size" << std::endl;
                 return false;
             }
-            payloadEncryptedSize = ntohl(payloadEncryptedSize);
+            encryptedSize = ntohl(encryptedSize);
             
-            // receive encrypted payload
-            std::vector<uint8_t> encryptedPayload(payloadEncryptedSize);
-            received = recv(socket_fd, encryptedPayload.data(), encryptedPayload.size(), MSG_WAITALL);
-            if (received != (ssize_t)encryptedPayload.size()) {
-                std::cerr << "Failed to receive encrypted payload, got " << received << " bytes, expected " << encryptedPayload.size() << std::endl;
+            // the header is always the same size, it fits on the stack
+            uint8_t headerFrame[sizeof(FTPHeader) + PacketCipher::MAC_SIZE];
+            if (encryptedSize != sizeof(headerFrame)) {
+                std::cerr << "Unexpected encrypted header size: " << encryptedSize << " bytes" << std::endl;
+                return false;
+            }
+            if (!recvExact(headerFrame, sizeof(headerFrame))) {
+                std::cerr << "Failed to receive encrypted header, expected " << sizeof(headerFrame) << " bytes" << std::endl;
                 return false;
             }
             
-            // decrypt payload
-            if (!crypto.decryptPacket(encryptedPayload, payload)) {
-                std::cerr << "Failed to decrypt payload" << std::endl;
+            if (!openEncryptedHeader(headerFrame, header, crypto)) {
                 return false;
             }
-            // std::cout << "Decrypted payload size: " << payload.size() << " bytes" << std::endl;
             
-        } else {
+            // receive encrupted payload
+            if (header.payloadLength > 0) {
+                // receive payload size
+                uint32_t payloadEncryptedSize;
+                if (!recvExact(&payloadEncryptedSize, sizeof(payloadEncryptedSize))) {
+                    std::cerr << "Failed to receive payload encrypted size" << std::endl;
+                    return false;
+                }
+                payloadEncryptedSize = ntohl(payloadEncryptedSize);
+                if (payloadEncryptedSize > MAX_ENCRYPTED_FRAME_SIZE) {
+                    std::cerr << "Encrypted payload too large: " << payloadEncryptedSize << " bytes" << std::endl;
+                    return false;
+                }
+                
+                // receive encrypted payload into payload itself and decrypt it there
+                payload.resize(payloadEncryptedSize);
+                if (!recvExact(payload.data(), payload.size())) {
+                    std::cerr << "Failed to receive encrypted payload, expected " << payload.size() << " bytes" << std::endl;
+                    return false;
+                }
+                if (!openEncryptedPayload(payload, crypto)) {
+                    return false;
+                }
+                
+            } else {
+                payload.clear();
+            }
+            
+            return true;
+        }
+    }
+
+    bool receiveEncryptedMessage(FrameReader& reader, FTPHeader& header, std::vector<uint8_t>& payload, PacketCipher& crypto) {
+        std::vector<uint8_t>& frame = reader.scratch();
+
+        // encrypted header is small, usually already sitting in the buffer
+        if (!reader.readFrame(frame, false, MAX_ENCRYPTED_FRAME_SIZE)) {
+            std::cerr << "Failed to receive encrypted header" << std::endl;
+            return false;
+        }
+
+        if (!openEncryptedHeader(frame, header, crypto)) {
+            return false;
+        }
+
+        if (header.payloadLength == 0) {
             payload.clear();
+            return true;
+        }
+
+        // payload body goes through readExact so a big one skips the buffer
+        uint32_t payloadEncryptedSize;
+        if (!reader.readExact(&payloadEncryptedSize, sizeof(payloadEncryptedSize))) {
+            std::cerr << "Failed to receive payload encrypted size" << std::endl;
+            return false;
+        }
+        payloadEncryptedSize = ntohl(payloadEncryptedSize);
+        if (payloadEncryptedSize > MAX_ENCRYPTED_FRAME_SIZE) {
+            std::cerr << "Encrypted payload too large: " << payloadEncryptedSize << " bytes" << std::endl;
+            return false;
+        }
+
+        // straight into payload and decrypted there
+        payload.resize(payloadEncryptedSize);
+        if (!reader.readExact(payload.data(), payload.size())) {
+            std::cerr << "Failed to receive encrypted payload, expected " << payload.size() << " bytes" << std::endl;
+            return false;
+        }
+        if (!openEncryptedPayload(payload, crypto)) {
+            return false;
         }
-        
         return true;
     }
 
+    bool receiveEncryptedMessage(UringIo& io, FTPHeader& header, std::vector<uint8_t>& payload, PacketCipher& crypto) {
+        auto recvExact = [&io](void* data, size_t len) {
+            return io.recvExact(data, len);
+        };
+        return receiveEncryptedMessageFrom(recvExact, header, payload, crypto);
+    }
+
 }
\ No newline at end of file
@@ -1,10 +1,15 @@
 #include "s_file_transfer_server.h"
 #include "s_kex.h"
-#include "s_dh.h"
-#include "s_packet.h"
-#include "s_simple_crypto.h"
+#include "s_handshake.h"
 #include "s_file_transfer_protocol.h"
-#include "s_authentication_protocol.h"
+#include "s_internet_traffic_protocol.h"
+#include "s_session.h"
+#include "s_event_loop.h"
+#include "s_coro_loop.h"
+#include "s_worker_pool.h"
+#include "s_io_uring.h"
+#include "s_upload_journal.h"
+#include "s_cipher_registry.h"
 
 #include <iostream>
 #include <vector>
@@ -13,18 +18,45 @@
 #include <map>
 #include <atomic>
 #include <thread>
+#include <memory>
+#include <algorithm>
+#include <future>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <cerrno>
+#include <csignal>
+
+namespace {
+    constexpr uint32_t MAX_HANDSHAKE_PACKET_SIZE = 35000; // RFC 4253 packet limit
+    constexpr size_t BACKGROUND_THREADS = 4; // FILE_BATCH writes from every connection share these
+    constexpr size_t REPLY_BATCH_BYTES = 64 * 1024; // held replies are sent once this much is waiting
+
+    // blocking send of the whole buffer, replies can be several messages back to back
+    bool sendAll(int socketFd, const std::vector<uint8_t>& data) {
+        size_t offset = 0;
+        while (offset < data.size()) {
+            ssize_t sent = send(socketFd, data.data() + offset, data.size() - offset, MSG_NOSIGNAL);
+            if (sent < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            offset += sent;
+        }
+        return true;
+    }
+}
 
-FileTransferServer::FileTransferServer(int port, const std::string& uploadDir) {
+FileTransferServer::FileTransferServer(int port, const std::string& uploadDir, const ServerConfig& config) {
+    serverSocket_ = -1;
     port_ = port;
     uploadDir_ = uploadDir;
+    config_ = config;
     running_ = false;
-    sendCrypto_ = nullptr;
-    recvCrypto_ = nullptr;
 
     // TODO: make this better :/
     // create users for login
@@ -36,28 +68,86 @@ FileTransferServer::FileTransferServer(int port, const std::string& uploadDir) {
 
 // on destruction
 FileTransferServer::~FileTransferServer() {
-    if (sendCrypto_) {
-        delete sendCrypto_;
-        sendCrypto_ = nullptr;
-    }
-    if (recvCrypto_) {
-        delete recvCrypto_;
-        recvCrypto_ = nullptr;
-    }
     stop();
 }
 
 bool FileTransferServer::start() {
+    // a client that hangs up while queued or mid transfer must not kill the server on the next send
+    signal(SIGPIPE, SIG_IGN);
+
+    if (config_.mode == ServerMode::SHARDED) {
+        // one listener per shard on the same port, the kernel spreads new connections across them
+        int shardCount = config_.shards;
+        if (shardCount <= 0) {
+            shardCount = std::max(1u, std::thread::hardware_concurrency());
+        }
+        for (int i = 0; i < shardCount; i++) {
+            int shardSocket = createListener(true);
+            if (shardSocket < 0) {
+                stop();
+                return false;
+            }
+            shardSockets_.push_back(shardSocket);
+        }
+    } else {
+        serverSocket_ = createListener(false);
+        if (serverSocket_ < 0) {
+            return false;
+        }
+    }
+    
+    hashes_ = std::make_unique<HashIndex>(uploadDir_);
+    if (!hashes_->init()) {
+        stop();
+        return false;
+    }
+
+    if (config_.dedupe) {
+        chunks_ = std::make_unique<ChunkStore>(uploadDir_);
+        if (!chunks_->init()) {
+            stop();
+            return false;
+        }
+    }
+    
+    background_ = std::make_unique<BackgroundPool>(BACKGROUND_THREADS);
+
+    // before the first KEXINIT, sessions report their cipher's speed from it
+    CipherRegistry::benchmark(config_.cipherCache);
+    CipherRegistry::Stats ciphers = CipherRegistry::stats();
+    std::cout << "Ciphers, fastest first:";
+    for (const CipherRegistry::Measurement& measurement : ciphers.measurements) {
+        std::cout << " " << measurement.name << " " << (uint64_t)measurement.megabytesPerSecond << " MB/s";
+    }
+    std::cout << (ciphers.fromCache ? " (from " + config_.cipherCache + ")" : " (measured in " + std::to_string((int)ciphers.benchmarkMs) + " ms)") << std::endl;
+    
+    running_ = true;
+    std::cout << "KimCloud server started on port " << port_ << std::endl;
+    std::cout << "Upload directory set to: " << uploadDir_ << std::endl;
+
+    sweeper_ = std::thread(&FileTransferServer::sweepPartialUploads, this);
+
+    return true;
+}
+
+int FileTransferServer::createListener(bool reusePort) {
     // use IPv4 and TCP
-    serverSocket_ = socket(AF_INET, SOCK_STREAM, 0);
-    if (serverSocket_ < 0) {
+    int listenSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenSocket < 0) {
         std::cerr << "Failed to create socket" << std::endl;
-        return false;
+        return -1;
     }
     
     // let rebinding to the port
     int opt = 1; // enable
-    setsockopt(serverSocket_, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    // every shard binds the same port, has to be set on all of them before bind
+    if (reusePort && setsockopt(listenSocket, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        std::cerr << "Failed to set SO_REUSEPORT" << std::endl;
+        close(listenSocket);
+        return -1;
+    }
 
     // struct sockaddr_in {
 	// __uint8_t       sin_len;
@@ -74,470 +164,442 @@ bool FileTransferServer::start() {
     serverAddr.sin_port = htons(port_); // server port in Big Endian
     
     
-    if (bind(serverSocket_, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
+    if (bind(listenSocket, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
         std::cerr << "Failed to bind socket" << std::endl;
-        close(serverSocket_);
-        return false;
+        close(listenSocket);
+        return -1;
     }
     
-    if (listen(serverSocket_, 2) < 0) {
+    if (listen(listenSocket, config_.listenBacklog) < 0) {
         std::cerr << "Failed to listen on socket" << std::endl;
-        close(serverSocket_);
-        return false;
+        close(listenSocket);
+        return -1;
     }
-    
-    running_ = true;
-    std::cout << "KimCloud server started on port " << port_ << std::endl;
-    std::cout << "Upload directory set to: " << uploadDir_ << std::endl;
 
-    return true;
+    return listenSocket;
 }
 
 void FileTransferServer::run() {
+    if (config_.mode == ServerMode::SHARDED) {
+        runShards();
+        return;
+    }
+    if (config_.mode == ServerMode::EPOLL) {
+        runEventLoops();
+        return;
+    }
+    if (config_.mode == ServerMode::CORO) {
+        runCoroLoops();
+        return;
+    }
+    if (config_.mode == ServerMode::POOL) {
+        runWorkerPool();
+        return;
+    }
+
     while (running_) {
-        struct sockaddr_in clientAddr;
-        socklen_t clientAddrLen = sizeof(clientAddr);
-        
-        // Wait for client to connect
-        std::cout << "Waiting to accept new connection..." << std::endl;
-        int clientSocket = accept(serverSocket_, (struct sockaddr*)&clientAddr, &clientAddrLen);
+        int clientSocket = acceptClient();
         if (clientSocket < 0) {
-            if (running_) {
-                std::cerr << "Failed to accept connection" << std::endl;
-            }
             continue;
         }
         
-        // get ip of connection
-        char clientIP[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &clientAddr.sin_addr, clientIP, INET_ADDRSTRLEN);
-        std::cout << " !!! New connection from " << clientIP << ":" << ntohs(clientAddr.sin_port) << " !!!" << std::endl;
-        
         // Handle each client in a separate thread
         std::thread clientThread(&FileTransferServer::handleClient, this, clientSocket);
         clientThread.detach();
     }
 }
 
+int FileTransferServer::acceptClient() {
+    struct sockaddr_in clientAddr;
+    socklen_t clientAddrLen = sizeof(clientAddr);
+    
+    // Wait for client to connect
+    std::cout << "Waiting to accept new connection..." << std::endl;
+    int clientSocket = accept(serverSocket_, (struct sockaddr*)&clientAddr, &clientAddrLen);
+    if (clientSocket < 0) {
+        if (running_) {
+            std::cerr << "Failed to accept connection" << std::endl;
+        }
+        return -1;
+    }
+    
+    // get ip of connection
+    char clientIP[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &clientAddr.sin_addr, clientIP, INET_ADDRSTRLEN);
+    std::cout << " !!! New connection from " << clientIP << ":" << ntohs(clientAddr.sin_port) << " !!!" << std::endl;
+
+    return clientSocket;
+}
+
+void FileTransferServer::runWorkerPool() {
+    int workers = config_.poolWorkers;
+    if (workers <= 0) {
+        workers = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    WorkerPool pool(workers, config_.poolQueueDepth, [this](int clientSocket) { handleClient(clientSocket); });
+    pool.start();
+    std::cout << "Serving clients from a pool of " << workers << " workers, queue depth " << config_.poolQueueDepth << std::endl;
+
+    while (running_) {
+        int clientSocket = acceptClient();
+        if (clientSocket < 0) {
+            continue;
+        }
+
+        if (config_.queueFullPolicy == QueueFullPolicy::BACKLOG) {
+            // blocks while the queue is full, later clients wait in the listen backlog
+            if (!pool.push(clientSocket)) {
+                close(clientSocket);
+            }
+        } else if (!pool.tryPush(clientSocket)) {
+            // tell the client why instead of just hanging up
+            std::string busy = "KimCloud_Busy server is at capacity, try again later\r\n";
+            send(clientSocket, busy.c_str(), busy.length(), MSG_NOSIGNAL);
+            close(clientSocket);
+            std::cout << "Rejected connection, worker queue is full" << std::endl;
+        }
+
+        WorkerPool::Stats stats = pool.stats();
+        std::cout << "Pool: " << stats.activeWorkers << "/" << stats.workers << " workers busy, queue " << stats.queueDepth << "/" << stats.queueCapacity
+                  << " (max " << stats.maxQueueDepth << "), wait avg " << stats.avgWaitMs << " ms max " << stats.maxWaitMs << " ms, "
+                  << stats.completed << " completed, " << stats.rejected << " rejected" << std::endl;
+    }
+
+    pool.shutdown();
+}
+
+void FileTransferServer::runEventLoops() {
+    // event loops accept on their own, listening socket must not block
+    int flags = fcntl(serverSocket_, F_GETFL, 0);
+    fcntl(serverSocket_, F_SETFL, flags | O_NONBLOCK);
+
+    int loopCount = config_.eventLoops;
+    if (loopCount <= 0) {
+        loopCount = std::max(1u, std::thread::hardware_concurrency());
+    }
+    std::cout << "Serving clients from " << loopCount << " epoll event loops" << std::endl;
+
+    std::vector<std::unique_ptr<EventLoop>> loops;
+    for (int i = 0; i < loopCount; i++) {
+        auto loop = std::make_unique<EventLoop>(serverSocket_, uploadDir_, users_, uploads_, *hashes_, chunks_.get(), running_, *background_);
+        if (!loop->init()) {
+            std::cerr << "Failed to start event loop " << i << std::endl;
+            running_ = false;
+            return;
+        }
+        loops.push_back(std::move(loop));
+    }
+
+    std::vector<std::thread> threads;
+    for (auto& loop : loops) {
+        threads.emplace_back(&EventLoop::run, loop.get());
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+void FileTransferServer::runCoroLoops() {
+    // schedulers accept on their own, listening socket must not block
+    int flags = fcntl(serverSocket_, F_GETFL, 0);
+    fcntl(serverSocket_, F_SETFL, flags | O_NONBLOCK);
+
+    int loopCount = config_.eventLoops;
+    if (loopCount <= 0) {
+        loopCount = std::max(1u, std::thread::hardware_concurrency());
+    }
+    std::cout << "Serving clients from " << loopCount << " coroutine schedulers" << std::endl;
+
+    std::vector<std::unique_ptr<CoroLoop>> loops;
+    for (int i = 0; i < loopCount; i++) {
+        auto loop = std::make_unique<CoroLoop>(serverSocket_, uploadDir_, users_, uploads_, *hashes_, chunks_.get(), running_, *background_);
+        if (!loop->init()) {
+            std::cerr << "Failed to start coroutine scheduler " << i << std::endl;
+            running_ = false;
+            return;
+        }
+        loops.push_back(std::move(loop));
+    }
+
+    std::vector<std::thread> threads;
+    for (auto& loop : loops) {
+        threads.emplace_back(&CoroLoop::run, loop.get());
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+void FileTransferServer::runShards() {
+    int cpuCount = std::max(1u, std::thread::hardware_concurrency());
+    std::cout << "Serving clients from " << shardSockets_.size() << " SO_REUSEPORT shards" << std::endl;
+
+    // each shard owns its listener, its connections and one core, nothing is shared between them
+    std::vector<std::unique_ptr<EventLoop>> shards;
+    for (size_t i = 0; i < shardSockets_.size(); i++) {
+        int listenSocket = shardSockets_[i];
+        int cpu = i % cpuCount;
+
+        int flags = fcntl(listenSocket, F_GETFL, 0);
+        fcntl(listenSocket, F_SETFL, flags | O_NONBLOCK);
+
+        // prefer handing this listener connections whose packets the NIC steers to the same core
+        setsockopt(listenSocket, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+
+        auto shard = std::make_unique<EventLoop>(listenSocket, uploadDir_, users_, uploads_, *hashes_, chunks_.get(), running_, *background_, false);
+        shard->pinToCpu(cpu);
+        if (!shard->init()) {
+            std::cerr << "Failed to start shard " << i << std::endl;
+            running_ = false;
+            return;
+        }
+        shards.push_back(std::move(shard));
+    }
+
+    std::vector<std::thread> threads;
+    for (auto& shard : shards) {
+        threads.emplace_back(&EventLoop::run, shard.get());
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
 void FileTransferServer::stop() {
     running_ = false;
     // close listening socket
     if (serverSocket_ >= 0) {
         close(serverSocket_);
+        serverSocket_ = -1;
+    }
+    for (int shardSocket : shardSockets_) {
+        close(shardSocket);
+    }
+    shardSockets_.clear();
+    if (sweeper_.joinable()) {
+        sweeper_.join();
+    }
+}
+
+void FileTransferServer::sweepPartialUploads() {
+    // often enough that nothing outlives the timeout by much, never more than every few minutes
+    auto interval = std::clamp<std::chrono::seconds>(config_.resumeTimeout / 4, std::chrono::seconds(1), std::chrono::minutes(5));
+    auto nextSweep = std::chrono::steady_clock::now();
+
+    while (running_) {
+        if (std::chrono::steady_clock::now() >= nextSweep) {
+            // registry first, whatever it expires takes its temp file with it
+            uploads_.expire(config_.resumeTimeout);
+            UploadJournal::collectGarbage(uploadDir_, config_.resumeTimeout, uploads_.inUse());
+            nextSweep = std::chrono::steady_clock::now() + interval;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
     }
 }
 
 void FileTransferServer::handleClient(int clientSocket) {
+    // per connection state, freed when this handler returns
+    Session session(clientSocket, uploadDir_, uploads_, *hashes_, chunks_.get());
+
     try {
         
-        // first step --> version exchange
-        if (!handleVersionExchange(clientSocket)) {
+        // version exchange --> KEXINIT exchange --> DH key exchange --> authentication
+        // the first step that fails ends the connection
+        std::string username;
+        if (!handleVersionExchange(session)) {
             std::cerr << "Version exchange failed :(" << std::endl;
-            close(clientSocket);
-            return;
-        }
-        
-        // second step --> KEXINIT exchange
-        KexMatch MatchedKex;
-        if (!handleKexinitExchange(clientSocket, MatchedKex)) {
+        } else if (!handleKexinitExchange(session)) {
             std::cerr << "Key exchange failed :(" << std::endl;
-            close(clientSocket);
-            return;
-        }
-
-        // third step --> DH key exchange
-        if (!handleKeyExchange(clientSocket)) {
+        } else if (!handleKeyExchange(session)) {
             std::cerr << "Key exchange failed :(" << std::endl;
-            close(clientSocket);
-            return;
-        }
-        
-        // fourth step --> authentication
-        std::string username;
-        if (!handleAuthentication(clientSocket, username)) {
+        } else if (!handleAuthentication(session, username)) {
             std::cerr << "Authentication failed" << std::endl;
-            close(clientSocket);
-            return;
+        } else {
+            session.setUsername(username);
+
+            // fifth step --> file transfer
+            handleFileTransfer(session);
         }
         
-        std::cout << "User " << username << " authenticated successfully" << std::endl;
-        
-        // fifth step --> file transfer
-        handleFileTransfer(clientSocket, username);
-        
     } catch (const std::exception& e) {
         std::cerr << "Exception in client handler: " << e.what() << std::endl;
     }
     
+    // every way out ends here so a failed handshake gets its summary too
+    session.logSummary();
     std::cout << "Client connection closed" << std::endl;
     close(clientSocket);
 }
 
-bool FileTransferServer::handleVersionExchange(int clientSocket) {
+bool FileTransferServer::handleVersionExchange(Session& session) {
     // Send server version
-    std::string serverVersion = "KimCloud_Protocol_v1\r\n";
     std::cout << "1. Starting Version String Exchange" << std::endl;
-    send(clientSocket, serverVersion.c_str(), serverVersion.length(), 0);
+    send(session.socketFd(), Handshake::SERVER_VERSION.c_str(), Handshake::SERVER_VERSION.length(), 0);
     
-    // Receive client version
-    char buffer[1024];
-    ssize_t bytesRead = recv(clientSocket, buffer, sizeof(buffer) - 1, 0);
-    if (bytesRead <= 0) {
+    // Receive client version, only up to the newline so a KEXINIT right behind it stays buffered
+    std::string clientVersion;
+    if (!session.reader().readLine(clientVersion, 1023)) {
         return false;
     }
-    buffer[bytesRead] = '\0';
-    std::string clientVersion(buffer);
 
-    if (clientVersion != serverVersion) {
-        std::cout << "Server version of: " << serverVersion << "\nDoes not match client version of: " << clientVersion << std::endl;
+    if (!Handshake::checkVersion(clientVersion)) {
         return false;
     }
 
     std::cout << "Client version: " << clientVersion << std::endl;
-    std::cout << "Server version matches: " << serverVersion << std::endl;
+    std::cout << "Server version matches: " << Handshake::SERVER_VERSION << std::endl;
     std::cout << "End of Version String Exchange" << std::endl;
     
     return true;
 }
 
-bool FileTransferServer::handleKexinitExchange(int clientSocket, KexMatch& matchedKex) {
-    
+bool FileTransferServer::handleKexinitExchange(Session& session) {
     std::cout << "2. Starting KEXINIT Payload exchange" << std::endl;
     
-    // read socket to buffer
-    uint8_t kexBuf[2048] = {0};
-    ssize_t kexLen = recv(clientSocket, kexBuf, sizeof(kexBuf), 0);
-    if (kexLen <= 0) {
+    // read one whole packet
+    std::vector<uint8_t> clientKexPacket;
+    if (!session.reader().readFrame(clientKexPacket, true, MAX_HANDSHAKE_PACKET_SIZE)) {
         std::cerr << "Failed to receive client KEXINIT" << std::endl;
         return false;
     }
-    std::vector<uint8_t> clientKexPacket(kexBuf, kexBuf + kexLen);
-    std::cout << "Received client KEXINIT (" << kexLen << " bytes)" << std::endl;
+    std::cout << "Received client KEXINIT (" << clientKexPacket.size() << " bytes)" << std::endl;
     
     // Send server KEXINIT
-            std::vector<uint8_t> serverKexPayload = buildKexPayload();
-
-    // load the KexInformation struct
-    KexInformation serverKexInfo = parseKexPayload(serverKexPayload);
-    // load the client KexInformation struct
-    std::vector<uint8_t> clientKexUnwrapped = unwrapPacket(clientKexPacket);
-    KexInformation clientKexInfo = parseKexPayload(clientKexUnwrapped);
-
-    std::vector<uint8_t> serverKexPacket = wrapPacket(serverKexPayload);
-    send(clientSocket, serverKexPacket.data(), serverKexPacket.size(), 0);
-    std::cout << "Sent server KEXINIT (304 bytes)" << std::endl;
-    
-    std::cout << "Server Kex Info" << std::endl;
-    printKexInformation(serverKexInfo);
-
-    std::cout << "Client Kex Info" << std::endl;
-    printKexInformation(clientKexInfo);
-
-    if (!(kexFirstMatch(matchedKex, serverKexInfo, clientKexInfo))) {
-        std::cout << "KexFirstMatch failed" << std::endl;
+    std::vector<uint8_t> serverKexPacket;
+    if (!Handshake::answerKexinit(session, clientKexPacket, serverKexPacket)) {
         return false;
     }
+    if (!sendAll(session.socketFd(), serverKexPacket)) {
+        return false;
+    }
+    std::cout << "Sent server KEXINIT (" << serverKexPacket.size() << " bytes)" << std::endl;
+
     std::cout << "=============================" << std::endl;
-    printMatchKex(matchedKex);
+    printMatchKex(session.kexMatch());
 
     return true;
 }
 
-bool FileTransferServer::handleKeyExchange(int clientSocket) {
-
+bool FileTransferServer::handleKeyExchange(Session& session) {
     // step 3 DH Key Exchange
     std::cout << "3. Starting DH Key exchange" << std::endl;
 
     // recieve dh from client
-    uint8_t buffer[4096];
-    ssize_t bytesRead = recv(clientSocket, buffer, sizeof(buffer), 0);
-    if (bytesRead <= 0) {
+    std::vector<uint8_t> clientKexdhPacket;
+    if (!session.reader().readFrame(clientKexdhPacket, true, MAX_HANDSHAKE_PACKET_SIZE)) {
         std::cerr << "Failed to receive client KEXDH_INIT" << std::endl;
         return false;
     }
-    std::cout << "Received client KEXDH_INIT (" << bytesRead << " bytes)" << std::endl;
-    
-    std::vector<uint8_t> clientKexdhPacket(buffer, buffer + bytesRead);
-    std::vector<uint8_t> clientKexdhPayload = unwrapPacket(clientKexdhPacket);
+    std::cout << "Received client KEXDH_INIT (" << clientKexdhPacket.size() << " bytes)" << std::endl;
     
-    // generate server DH
-    std::vector<uint8_t> serverKexdhReply = generateServerKexdhReply(clientKexdhPayload);
-    std::vector<uint8_t> serverKexdhPacket = wrapPacket(serverKexdhReply);
-    
-    // add KEXDH_REPLY
+    // KEXDH_REPLY + NEWKEYS, the session now owns its crypto for both directions
     std::vector<uint8_t> res;
-    res.insert(res.end(), serverKexdhPacket.begin(), serverKexdhPacket.end());
-    
-    // add NEWKEYS to start encryption
-    std::vector<uint8_t> newkeysMsg = {21}; // NEWKEYS CODE
-    std::vector<uint8_t> newkeysPacket = wrapPacket(newkeysMsg);
-    res.insert(res.end(), newkeysPacket.begin(), newkeysPacket.end());
-    
-    send(clientSocket, res.data(), res.size(), 0);
+    if (!Handshake::answerKexdh(session, clientKexdhPacket, res)) {
+        return false;
+    }
+    if (!sendAll(session.socketFd(), res)) {
+        return false;
+    }
     std::cout << "Sent KEXDH_REPLY + NEWKEYS (" << res.size() << " bytes)" << std::endl;
     
     // Receive client NEWKEYS
-    uint8_t newkeysBuf[1024];
-    ssize_t newkeysLen = recv(clientSocket, newkeysBuf, sizeof(newkeysBuf), 0);
-    if (newkeysLen <= 0) {
+    std::vector<uint8_t> clientNewkeysPacket;
+    if (!session.reader().readFrame(clientNewkeysPacket, true, MAX_HANDSHAKE_PACKET_SIZE)) {
         std::cerr << "Failed to receive client NEWKEYS" << std::endl;
         return false;
     }
-    std::cout << "Received client NEWKEYS (" << newkeysLen << " bytes)" << std::endl;
+    std::cout << "Received client NEWKEYS (" << clientNewkeysPacket.size() << " bytes)" << std::endl;
+    if (!Handshake::checkNewkeys(clientNewkeysPacket)) {
+        return false;
+    }
     
     std::cout << "Key exchange completed successfully" << std::endl;
     return true;
 }
 
-std::vector<uint8_t> FileTransferServer::generateServerKexdhReply(const std::vector<uint8_t>& clientKexdhPayload) {
-    /**
-     * messgae_id --> 30
-     * client public (e) --> mpint value
-     */
-
-    // read client kex_dh must start with message_id = 30
-    if (clientKexdhPayload.empty() || clientKexdhPayload[0] != 30) {
-        std::cerr << "Invalid KEXDH_INIT message" << std::endl;
-        return std::vector<uint8_t>();
-    }
-    
-    // Extract client's public key
-    size_t offset = 1;
-    if (offset + 4 > clientKexdhPayload.size()) {
-        std::cerr << "Invalid KEXDH_INIT packet size :(" << std::endl;
-        return std::vector<uint8_t>();
-    }
-    
-    uint32_t clientPublicLength = read32BigEndian(clientKexdhPayload, offset);
-    
-    if (offset + clientPublicLength > clientKexdhPayload.size()) {
-        std::cerr << "Invalid client public key length" << std::endl;
-        return std::vector<uint8_t>();
-    }
-    
-    std::vector<uint8_t> clientPublicBytes(clientKexdhPayload.begin() + offset, clientKexdhPayload.begin() + offset + clientPublicLength);
-    uint64_t clientPublicKey = DH::bytesToUint64(clientPublicBytes);
-    
-    std::cout << "Client public key length: " << clientPublicLength << std::endl;
-    std::cout << "Client public key bytes: ";
-    for (auto b : clientPublicBytes) {
-        std::cout << std::hex << (int)b << " ";
-    }
-    std::cout << std::dec << std::endl;
-    std::cout << "Client public key value: " << std::hex << clientPublicKey << std::dec << std::endl;
-    
-    // create the server DH
-    DH serverDH;
-    uint64_t serverPublicKey = serverDH.generatePublicKey();
-    std::cout << "Server public key: " << std::hex << serverPublicKey << std::dec << std::endl;
-    
-    // compute the shared secret
-    uint64_t sharedSecret = serverDH.computeSharedSecret(clientPublicKey);
-    std::cout << "Server computed shared secret: " << std::hex << sharedSecret << std::dec << std::endl;
-    
-    // Create cypto objects for both directions
-    sendCrypto_ = new SimpleCrypto(sharedSecret, false); // server_to_client for sending
-    recvCrypto_ = new SimpleCrypto(sharedSecret, true);  // client_to_server for receiving
-    
-    /* KEXDH reply format
-        ssh_msh_kexdh_reply --> 31
-        server public host key
-        server public host key
-        signiture using server private key
-
-    */
-    std::vector<uint8_t> reply;
-
-    reply.push_back(31); 
-    
-    // add a hard coded host key --> hosung-kim
-    // TODO: make real soon?
-    std::vector<uint8_t> hostKey = {0x00, 0x00, 0x00, 0x0A, 0x68, 0x6F, 0x73, 0x75, 0x6E, 0x67, 0x2D, 0x6B, 0x69, 0x6D};
-    reply.insert(reply.end(), hostKey.begin(), hostKey.end());
-    
-    // add the public key
-    auto serverPublicBytes = DH::uint64ToBytes(serverPublicKey);
-    // convert to big endian and insert public key
-    uint32_t serverPublicLength = htonl(serverPublicBytes.size());
-    reply.insert(reply.end(), (uint8_t*)&serverPublicLength, (uint8_t*)&serverPublicLength + 4);
-    // insert public key
-    reply.insert(reply.end(), serverPublicBytes.begin(), serverPublicBytes.end());
-    
-    // add a fake signiture --> hosung-kim
-    // TODO: make real soon?
-    std::vector<uint8_t> signature = {0x00, 0x00, 0x00, 0x0A, 0x68, 0x6F, 0x73, 0x75, 0x6E, 0x67, 0x2D, 0x6B, 0x69, 0x6D};
-    reply.insert(reply.end(), signature.begin(), signature.end());
-    
-    return reply;
-}
-
-bool FileTransferServer::handleAuthentication(int clientSocket, std::string& username) {
-    std::string auth_username, auth_password;
-    
-    if (!AuthProtocol::receiveAuthRequest(clientSocket, auth_username, auth_password)) {
+bool FileTransferServer::handleAuthentication(Session& session, std::string& username) {
+    ITPProtocol::ITPHeader header;
+    std::vector<uint8_t> payload;
+    if (!ITPProtocol::receiveMessage(session.reader(), header, payload)) {
         std::cerr << "Failed to receive authentication request" << std::endl;
         return false;
     }
     
-    // check credentials
-    bool auth_success = AuthProtocol::validateCredentials(auth_username, auth_password, users_);
-    
-    if (!auth_success) {
-        std::cout << "Authentication failed for user: " << auth_username << std::endl;
-        AuthProtocol::sendAuthResponse(clientSocket, false);
+    // check credentials, a failed login still gets its AUTH_FAILURE
+    std::vector<uint8_t> reply;
+    bool authenticated = Handshake::answerAuth(header, payload, users_, username, reply);
+    if (!reply.empty() && !sendAll(session.socketFd(), reply)) {
         return false;
     }
-    
-    std::cout << "User " << auth_username << " authenticated successfully" << std::endl;
-    
-    // send sucess auth responce
-    AuthProtocol::sendAuthResponse(clientSocket, true);
-    
-    username = auth_username; // set username pointer
-    return true;
+    return authenticated;
 }
 
-/**
- * Order of file transfer messages:
- *
- * FILE_START from client
- * FILE_START to client
- * 
- * FILE_DATA from client
- * FILE_DATA to client
- * 
- * FILE_END from client
- * FILE_END
- */
-
-void FileTransferServer::handleFileTransfer(int clientSocket, const std::string& username) {
-    std::cout << "Starting file transfer session for user: " << username << std::endl;
-    
-    uint32_t sequenceNumber = 0;
+void FileTransferServer::handleFileTransfer(Session& session) {
+    std::cout << "Starting file transfer session for user: " << session.username() << std::endl;
+    int clientSocket = session.socketFd();
+
+    // optional io_uring backend, blocking recv/write stay the fallback
+    if (config_.ioBackend == IoBackend::URING && !session.enableUring()) {
+        std::cerr << "io_uring unavailable, using blocking I/O" << std::endl;
+    }
     
-    while (true) {
+    // replies for messages that arrived together go back in one send
+    std::vector<uint8_t> replies;
+    // reused for every message so steady state reads do not allocate
+    std::vector<uint8_t> payload;
+
+    while (!session.disconnectRequested()) {
         FTPProtocol::FTPHeader header;
-        std::vector<uint8_t> payload;
         
-        if (!FTPProtocol::receiveEncryptedMessage(clientSocket, header, payload, *recvCrypto_)) {
+        bool received = session.uring()
+            ? FTPProtocol::receiveEncryptedMessage(*session.uring(), header, payload, session.recvCrypto())
+            : FTPProtocol::receiveEncryptedMessage(session.reader(), header, payload, session.recvCrypto());
+        if (!received) {
             std::cerr << "Failed to receive message" << std::endl;
             break;
         }
         
-        sequenceNumber++;
-        
-        // FILE_START or FILE_END
-        switch (static_cast<FTPProtocol::FTPMessageType>(header.messageType)) {
-            case FTPProtocol::FTPMessageType::FILE_START: {
-                std::string filename;
-                uint64_t fileSize;
-                uint32_t chunkSize;
-                
-                // std::cout << "Parsing file start message, payload size: " << payload.size() << " bytes" << std::endl;
-                if (FTPProtocol::parseFileStartMessage(payload, filename, fileSize, chunkSize)) {
-                    std::cout << "Receiving file: " << filename << " (" << fileSize << " bytes)" << std::endl;
-                    
-                    // create file path in upload directory with username in front of file name
-                    std::string filePath = uploadDir_ + "/" + username + "_" + filename;
-                    
-                    // open file with writing perms
-                    int fileFd = open(filePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                    if (fileFd < 0) {
-                        std::cerr << "Failed to create file: " << filePath << std::endl;
-                        FTPProtocol::sendEncryptedMessage(clientSocket, static_cast<uint8_t>(FTPProtocol::FTPMessageType::FILE_END), {}, sequenceNumber, *sendCrypto_);
-                        continue;
-                    }
-                    
-                    // send success response
-                    FTPProtocol::sendEncryptedMessage(clientSocket, static_cast<uint8_t>(FTPProtocol::FTPMessageType::FILE_START), {}, sequenceNumber, *sendCrypto_);
-                    std::cout << "Sent encrypted FILE_START response to client" << std::endl;
-                    
-                    size_t bytesReceived = 0;
-                    uint32_t expected_chunk = 0;
-                    std::map<uint32_t, std::vector<uint8_t>> chunkBuffer; // buffer for out of order chunks mapping of chunk number : chunk data
-                    
-                    while (bytesReceived < fileSize) {
-                        FTPProtocol::FTPHeader dataHeader;
-                        std::vector<uint8_t> dataPayload;
-                        
-                        if (!FTPProtocol::receiveEncryptedMessage(clientSocket, dataHeader, dataPayload, *recvCrypto_)) {
-                            std::cerr << "Failed to receive file data" << std::endl;
-                            close(fileFd);
-                            return;
-                        }
-                        
-                        if (static_cast<FTPProtocol::FTPMessageType>(dataHeader.messageType) == FTPProtocol::FTPMessageType::FILE_DATA) {
-                            uint32_t chunkNumber;
-                            if (FTPProtocol::parseFileDataMessage(dataPayload, chunkNumber, dataPayload)) {
-                                
-                                // send chunk received to client
-                                FTPProtocol::sendEncryptedMessage(clientSocket, static_cast<uint8_t>(FTPProtocol::FTPMessageType::FILE_DATA), {}, dataHeader.sequenceNumber, *sendCrypto_);
-                                
-                                if (chunkNumber == expected_chunk) {
-                                    // write the expected chunk that is in right order
-                                    ssize_t bytesWritten = write(fileFd, dataPayload.data(), dataPayload.size());
-                                    if (bytesWritten < 0) {
-                                        std::cerr << "Failed to write to file" << std::endl;
-                                        close(fileFd);
-                                        return;
-                                    }
-                                    bytesReceived += bytesWritten;
-                                    expected_chunk++;
-                                    
-                                    // check if there are chunks to write now from the buffer
-                                    while (chunkBuffer.find(expected_chunk) != chunkBuffer.end()) {
-                                        std::vector<uint8_t>& bufferedChunk = chunkBuffer[expected_chunk];
-                                        ssize_t bytesWritten = write(fileFd, bufferedChunk.data(), bufferedChunk.size());
-                                        if (bytesWritten < 0) {
-                                            std::cerr << "Failed to write buffered chunk to file" << std::endl;
-                                            close(fileFd);
-                                            return;
-                                        }
-                                        bytesReceived += bytesWritten;
-                                        chunkBuffer.erase(expected_chunk);
-                                        expected_chunk++;
-                                    }
-                                    
-                                    std::cout << "Progress: " << (bytesReceived * 100 / fileSize) << "% (" << bytesReceived << "/" << fileSize << " bytes)" << std::endl;
-                                } else if (chunkNumber > expected_chunk) {
-                                    // store the out of order chunks
-                                    chunkBuffer[chunkNumber] = dataPayload;
-                                    std::cout << "Out of order chunk in buffer!  " << chunkNumber << " (Expected: " << expected_chunk << ")" << std::endl;
-                                } else {
-                                    // duplicate chunks
-                                    std::cout << "Ignoring old duplicate chunk:  " << chunkNumber << " (expected: " << expected_chunk << ")" << std::endl;
-                                }
-                            }
-                        } else if (static_cast<FTPProtocol::FTPMessageType>(dataHeader.messageType) == FTPProtocol::FTPMessageType::FILE_END) {
-                            break;
-                        }
-                    }
-                    
-                    close(fileFd);
-                    std::cout << "File received successfully: " << filePath << std::endl;
-                    
-                    // file success message to client
-                    FTPProtocol::sendEncryptedMessage(clientSocket, static_cast<uint8_t>(FTPProtocol::FTPMessageType::FILE_END), {}, sequenceNumber, *sendCrypto_);
-                } else {
-                    std::cerr << "Failed to parse file start message" << std::endl;
-                }
+        if (!session.handleTransferMessage(header.messageType, header.sequenceNumber, header.channelId, payload, replies)) {
+            break;
+        }
+        // the same pool the event loops use, this thread just waits for it
+        if (session.jobPending()) {
+            auto finished = std::make_shared<std::promise<void>>();
+            session.startJob(*background_, [finished] { finished->set_value(); });
+            finished->get_future().wait();
+            if (!session.finishJob(replies)) {
                 break;
             }
-            case FTPProtocol::FTPMessageType::FILE_END:
-                std::cout << "Client sent FILE_END message" << std::endl;
-                // send to FILE_DATA to client
-                FTPProtocol::sendEncryptedMessage(clientSocket, static_cast<uint8_t>(FTPProtocol::FTPMessageType::FILE_END), {}, sequenceNumber, *sendCrypto_);
-                
-                break;
-
-            case FTPProtocol::FTPMessageType::DISCONNECT:
-                std::cout << "Client requested disconnect" << std::endl;
-
-                return;
+        }
 
-            default:
-                std::cerr << "Unknown message type: " << static_cast<int>(header.messageType) << std::endl;
-                break;
+        // hold replies while the next message is already buffered, the client never waits mid message
+        bool moreBuffered = !session.uring() && session.reader().available() > 0;
+        if (moreBuffered && replies.size() < REPLY_BATCH_BYTES) {
+            continue;
+        }
+        if (!session.flushAck(replies)) {
+            break;
+        }
+        if (!replies.empty() && !sendAll(clientSocket, replies)) {
+            std::cerr << "Failed to send reply" << std::endl;
+            break;
+        }
+        replies.clear();
+
+        // a delta upload's signatures go out one message at a time instead of all in replies
+        bool sent = true;
+        while (sent && session.signaturesPending()) {
+            if (!session.pumpSignatures(replies)) {
+                sent = false;
+            } else if (!sendAll(clientSocket, replies)) {
+                std::cerr << "Failed to send reply" << std::endl;
+                sent = false;
+            }
+            replies.clear();
+        }
+        if (!sent) {
+            break;
         }
     }
-} 
\ No newline at end of file
+}
@@ -0,0 +1,102 @@
+#include "s_handshake.h"
+#include "s_kex.h"
+#include "s_dh.h"
+#include "s_packet.h"
+#include "s_session.h"
+#include "s_authentication_protocol.h"
+
+#include <iostream>
+
+namespace {
+    constexpr uint8_t SSH_MSG_NEWKEYS = 21;
+}
+
+namespace Handshake {
+    const std::string SERVER_VERSION = "KimCloud_Protocol_v1\r\n";
+
+    bool checkVersion(const std::string& clientVersion) {
+        if (clientVersion != SERVER_VERSION) {
+            std::cout << "Server version of: " << SERVER_VERSION << "\nDoes not match client version of: " << clientVersion << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    bool answerKexinit(Session& session, const std::vector<uint8_t>& clientKexPacket, std::vector<uint8_t>& reply) {
+        std::vector<uint8_t> clientKexUnwrapped = unwrapPacket(clientKexPacket);
+        if (clientKexUnwrapped.empty()) {
+            std::cerr << "Failed to receive client KEXINIT" << std::endl;
+            return false;
+        }
+
+        std::vector<uint8_t> serverKexPayload = buildKexPayload();
+        KexInformation serverKexInfo = parseKexPayload(serverKexPayload);
+        KexInformation clientKexInfo = parseKexPayload(clientKexUnwrapped);
+
+        KexMatch matchedKex;
+        if (!kexFirstMatch(matchedKex, serverKexInfo, clientKexInfo)) {
+            std::cout << "KexFirstMatch failed" << std::endl;
+            return false;
+        }
+        session.setKexMatch(matchedKex);
+
+        reply = wrapPacket(serverKexPayload);
+        return true;
+    }
+
+    bool answerKexdh(Session& session, const std::vector<uint8_t>& clientKexdhPacket, std::vector<uint8_t>& reply) {
+        uint64_t sharedSecret = 0;
+        std::vector<uint8_t> serverKexdhReply = generateServerKexdhReply(unwrapPacket(clientKexdhPacket), sharedSecret);
+        if (serverKexdhReply.empty()) {
+            return false;
+        }
+
+        // crypto lives on the session so connections never share sequence numbers
+        if (!session.setKeys(sharedSecret)) {
+            return false;
+        }
+
+        // KEXDH_REPLY + NEWKEYS
+        reply = wrapPacket(serverKexdhReply);
+        std::vector<uint8_t> newkeysPacket = wrapPacket({SSH_MSG_NEWKEYS});
+        reply.insert(reply.end(), newkeysPacket.begin(), newkeysPacket.end());
+        return true;
+    }
+
+    bool checkNewkeys(const std::vector<uint8_t>& clientNewkeysPacket) {
+        std::vector<uint8_t> newkeysPayload = unwrapPacket(clientNewkeysPacket);
+        if (newkeysPayload.empty() || newkeysPayload[0] != SSH_MSG_NEWKEYS) {
+            std::cerr << "Failed to receive client NEWKEYS" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    bool answerAuth(const ITPProtocol::ITPHeader& header, const std::vector<uint8_t>& payload, const std::map<std::string, std::string>& users,
+                    std::string& username, std::vector<uint8_t>& reply) {
+        reply.clear();
+        if (!payload.empty() && !ITPProtocol::validateChecksum(payload, header.checksum)) {
+            std::cerr << "Checksum validation failed" << std::endl;
+            return false;
+        }
+
+        std::string authUsername, authPassword;
+        if (static_cast<AuthProtocol::AuthMessageType>(header.messageType) != AuthProtocol::AuthMessageType::AUTH_REQUEST ||
+            !AuthProtocol::parseAuthMessage(payload, authUsername, authPassword)) {
+            std::cerr << "Failed to receive authentication request" << std::endl;
+            return false;
+        }
+
+        // check credentials
+        if (!AuthProtocol::validateCredentials(authUsername, authPassword, users)) {
+            std::cout << "Authentication failed for user: " << authUsername << std::endl;
+            reply = ITPProtocol::serializeMessage(static_cast<uint8_t>(AuthProtocol::AuthMessageType::AUTH_FAILURE), {}, 0);
+            return false;
+        }
+
+        std::cout << "User " << authUsername << " authenticated successfully" << std::endl;
+        reply = ITPProtocol::serializeMessage(static_cast<uint8_t>(AuthProtocol::AuthMessageType::AUTH_SUCCESS), {}, 0);
+        username = authUsername;
+        return true;
+    }
+}
@@ -0,0 +1,287 @@
+#include "s_hash_index.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <cstdio>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+
+namespace {
+    const std::string INDEX_MAGIC = "KimCloud-hashindex-1";
+
+    std::string toHex(const std::string& bytes) {
+        static const char digits[] = "0123456789abcdef";
+        std::string hex(bytes.size() * 2, '0');
+        for (size_t i = 0; i < bytes.size(); i++) {
+            hex[2 * i] = digits[(uint8_t)bytes[i] >> 4];
+            hex[2 * i + 1] = digits[(uint8_t)bytes[i] & 0xf];
+        }
+        return hex;
+    }
+
+    bool fromHex(const std::string& hex, std::string& bytes) {
+        if (hex.size() != FTPProtocol::FILE_HASH_SIZE * 2) {
+            return false;
+        }
+        bytes.resize(FTPProtocol::FILE_HASH_SIZE);
+        for (size_t i = 0; i < bytes.size(); i++) {
+            unsigned int byte;
+            if (sscanf(hex.c_str() + 2 * i, "%2x", &byte) != 1) {
+                return false;
+            }
+            bytes[i] = byte;
+        }
+        return true;
+    }
+
+    // "hash size modified inode owner path", the path goes last since it may hold spaces
+    std::string entryLine(const std::string& path, const std::string& hash, const std::string& owner, uint64_t size, int64_t modified, uint64_t inode) {
+        return toHex(hash) + " " + std::to_string(size) + " " + std::to_string(modified) + " " +
+               std::to_string(inode) + " " + owner + " " + path + "\n";
+    }
+
+    int64_t modifiedTime(const struct stat& st) {
+        return (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    }
+
+    bool hashFile(int fd, std::string& hash) {
+        EVP_MD_CTX* sha = EVP_MD_CTX_new();
+        bool ok = sha && EVP_DigestInit_ex(sha, EVP_sha256(), nullptr) == 1;
+        std::vector<uint8_t> buffer(1024 * 1024);
+        while (ok) {
+            ssize_t bytesRead = read(fd, buffer.data(), buffer.size());
+            if (bytesRead < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytesRead <= 0) {
+                ok = bytesRead == 0;
+                break;
+            }
+            EVP_DigestUpdate(sha, buffer.data(), bytesRead);
+        }
+        unsigned int length = 0;
+        hash.resize(FTPProtocol::FILE_HASH_SIZE);
+        ok = ok && EVP_DigestFinal_ex(sha, (uint8_t*)hash.data(), &length) == 1;
+        EVP_MD_CTX_free(sha);
+        return ok;
+    }
+}
+
+HashIndex::HashIndex(const std::string& uploadDir) : logFd_(-1), stopping_(false) {
+    logPath_ = uploadDir + "/.hashindex";
+}
+
+HashIndex::~HashIndex() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wake_.notify_all();
+    if (hasher_.joinable()) {
+        hasher_.join();
+    }
+    if (logFd_ >= 0) {
+        ::close(logFd_);
+    }
+}
+
+bool HashIndex::matches(const std::string& path, const Entry& entry) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode) && (uint64_t)st.st_size == entry.size &&
+           modifiedTime(st) == entry.modified && (uint64_t)st.st_ino == entry.inode;
+}
+
+bool HashIndex::init() {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // later lines win, a path uploaded twice is in the log twice
+    std::ifstream in(logPath_);
+    std::string line;
+    if (in.is_open() && std::getline(in, line) && line == INDEX_MAGIC) {
+        while (std::getline(in, line)) {
+            std::istringstream fields(line);
+            std::string hex;
+            Entry entry;
+            std::string path;
+            if (!(fields >> hex >> entry.size >> entry.modified >> entry.inode >> entry.owner) || fields.get() != ' ' ||
+                !std::getline(fields, path) || path.empty() || !fromHex(hex, entry.hash)) {
+                continue;
+            }
+            forget(path);
+            byPath_[path] = entry;
+            byHash_.emplace(entry.hash, path);
+        }
+    }
+    in.close();
+
+    // whatever changed while the server was down is dropped before the log is compacted
+    std::string text = INDEX_MAGIC + "\n";
+    for (auto it = byPath_.begin(); it != byPath_.end();) {
+        if (!matches(it->first, it->second)) {
+            std::string path = it->first;
+            ++it;
+            forget(path);
+            continue;
+        }
+        text += entryLine(it->first, it->second.hash, it->second.owner, it->second.size, it->second.modified, it->second.inode);
+        ++it;
+    }
+
+    std::string tempPath = logPath_ + ".tmp";
+    int fd = ::open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = fd >= 0 && write(fd, text.data(), text.size()) == (ssize_t)text.size();
+    if (fd >= 0) {
+        ok = ::close(fd) == 0 && ok;
+    }
+    if (!ok || rename(tempPath.c_str(), logPath_.c_str()) < 0) {
+        std::cerr << "Failed to write hash index: " << logPath_ << std::endl;
+        unlink(tempPath.c_str());
+        return false;
+    }
+
+    logFd_ = ::open(logPath_.c_str(), O_WRONLY | O_APPEND);
+    if (logFd_ < 0) {
+        std::cerr << "Failed to open hash index: " << logPath_ << std::endl;
+        return false;
+    }
+    std::cout << "Hash index: " << byPath_.size() << " files" << std::endl;
+    hasher_ = std::thread(&HashIndex::runHasher, this);
+    return true;
+}
+
+void HashIndex::forget(const std::string& path) {
+    auto old = byPath_.find(path);
+    if (old == byPath_.end()) {
+        return;
+    }
+    auto range = byHash_.equal_range(old->second.hash);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (it->second == path) {
+            byHash_.erase(it);
+            break;
+        }
+    }
+    byPath_.erase(old);
+}
+
+void HashIndex::append(const std::string& path, const Entry& entry) {
+    // one write per line, O_APPEND keeps lines whole
+    std::string line = entryLine(path, entry.hash, entry.owner, entry.size, entry.modified, entry.inode);
+    if (logFd_ >= 0 && write(logFd_, line.data(), line.size()) != (ssize_t)line.size()) {
+        std::cerr << "Failed to append to hash index: " << logPath_ << std::endl;
+    }
+}
+
+void HashIndex::insert(const std::string& path, const Entry& entry) {
+    forget(path);
+    byPath_[path] = entry;
+    byHash_.emplace(entry.hash, path);
+    append(path, entry);
+}
+
+void HashIndex::add(const std::string& path, const std::string& owner, const uint8_t* hash) {
+    // a name that splits the log line is left out, it just never gets the short cut
+    struct stat st;
+    if (path.find('\n') != std::string::npos || owner.find_first_of(" \n") != std::string::npos || stat(path.c_str(), &st) < 0) {
+        return;
+    }
+
+    Entry entry{std::string((const char*)hash, FTPProtocol::FILE_HASH_SIZE), owner, (uint64_t)st.st_size, modifiedTime(st), (uint64_t)st.st_ino};
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    insert(path, entry);
+}
+
+void HashIndex::hashLater(const std::string& path, const std::string& owner) {
+    if (path.find('\n') != std::string::npos || owner.find_first_of(" \n") != std::string::npos) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        toHash_.emplace_back(path, owner);
+    }
+    wake_.notify_one();
+}
+
+void HashIndex::runHasher() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        wake_.wait(lock, [this]() { return stopping_ || !toHash_.empty(); });
+        if (stopping_) {
+            return;
+        }
+        auto [path, owner] = std::move(toHash_.front());
+        toHash_.pop_front();
+        lock.unlock();
+
+        // the entry is made for the file as it was before reading, matches() throws it out if it changed meanwhile
+        Entry entry;
+        entry.owner = owner;
+        struct stat st;
+        int fd = ::open(path.c_str(), O_RDONLY);
+        bool ok = fd >= 0 && fstat(fd, &st) == 0 && hashFile(fd, entry.hash);
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        if (ok) {
+            entry.size = st.st_size;
+            entry.modified = modifiedTime(st);
+            entry.inode = st.st_ino;
+        }
+
+        lock.lock();
+        if (ok && matches(path, entry)) {
+            insert(path, entry);
+        }
+    }
+}
+
+bool HashIndex::claim(const uint8_t* hash, uint64_t size, const std::string& owner, const std::string& path) {
+    std::string key((const char*)hash, FTPProtocol::FILE_HASH_SIZE);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string found;
+    std::vector<std::string> stale;
+    auto range = byHash_.equal_range(key);
+    for (auto it = range.first; it != range.second; ++it) {
+        const Entry& entry = byPath_[it->second];
+        if (!matches(it->second, entry)) {
+            stale.push_back(it->second);
+            continue;
+        }
+        if (entry.owner == owner && entry.size == size) {
+            found = it->second;
+            // the same name with the same content needs nothing at all
+            if (found == path) {
+                break;
+            }
+        }
+    }
+    for (const std::string& gone : stale) {
+        forget(gone);
+    }
+    if (found.empty()) {
+        return false;
+    }
+    if (found == path) {
+        return true;
+    }
+
+    // linked next to the target first, the rename swaps it in the same way a finished upload is
+    std::string tempPath = path + ".link";
+    unlink(tempPath.c_str());
+    if (link(found.c_str(), tempPath.c_str()) < 0 || rename(tempPath.c_str(), path.c_str()) < 0) {
+        std::cerr << "Failed to link " << found << " to " << path << std::endl;
+        unlink(tempPath.c_str());
+        return false;
+    }
+
+    Entry entry = byPath_[found];
+    insert(path, entry);
+    return true;
+}
@@ -0,0 +1,441 @@
+#include "s_io_uring.h"
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+namespace {
+    constexpr uint64_t READ_TAG = UINT64_MAX;
+    constexpr unsigned SOCKET_FILE_INDEX = 0;
+    constexpr unsigned UPLOAD_FILE_INDEX = 1;
+    constexpr unsigned RECV_BUFFER_INDEX = 0; // write slots follow at 1..WRITE_SLOTS
+
+    int ioUringSetup(unsigned entries, struct io_uring_params* params) {
+        return (int)syscall(__NR_io_uring_setup, entries, params);
+    }
+
+    int ioUringEnter(int ringFd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+        return (int)syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, flags, nullptr, 0);
+    }
+
+    int ioUringRegister(int ringFd, unsigned opcode, const void* arg, unsigned nrArgs) {
+        return (int)syscall(__NR_io_uring_register, ringFd, opcode, arg, nrArgs);
+    }
+}
+
+IoUring::IoUring() {
+    ringFd_ = -1;
+    entries_ = 0;
+    sqRing_ = nullptr;
+    cqRing_ = nullptr;
+    sqRingSize_ = 0;
+    cqRingSize_ = 0;
+    sqes_ = nullptr;
+    sqesSize_ = 0;
+    localTail_ = 0;
+    submittedTail_ = 0;
+}
+
+IoUring::~IoUring() {
+    destroy();
+}
+
+bool IoUring::init(unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ringFd_ = ioUringSetup(entries, &params);
+    if (ringFd_ < 0) {
+        std::cerr << "io_uring_setup failed: " << strerror(errno) << std::endl;
+        return false;
+    }
+    entries_ = params.sq_entries;
+
+    // map submission and completion rings, newer kernels share one mapping
+    sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMmap) {
+        sqRingSize_ = cqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+    }
+
+    sqRing_ = mmap(nullptr, sqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_SQ_RING);
+    if (sqRing_ == MAP_FAILED) {
+        sqRing_ = nullptr;
+        destroy();
+        return false;
+    }
+    if (singleMmap) {
+        cqRing_ = sqRing_;
+    } else {
+        cqRing_ = mmap(nullptr, cqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_CQ_RING);
+        if (cqRing_ == MAP_FAILED) {
+            cqRing_ = nullptr;
+            destroy();
+            return false;
+        }
+    }
+
+    sqesSize_ = params.sq_entries * sizeof(struct io_uring_sqe);
+    void* sqes = mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        destroy();
+        return false;
+    }
+    sqes_ = (struct io_uring_sqe*)sqes;
+
+    uint8_t* sq = (uint8_t*)sqRing_;
+    sqHead_ = (unsigned*)(sq + params.sq_off.head);
+    sqTail_ = (unsigned*)(sq + params.sq_off.tail);
+    sqMask_ = (unsigned*)(sq + params.sq_off.ring_mask);
+    sqArray_ = (unsigned*)(sq + params.sq_off.array);
+
+    uint8_t* cq = (uint8_t*)cqRing_;
+    cqHead_ = (unsigned*)(cq + params.cq_off.head);
+    cqTail_ = (unsigned*)(cq + params.cq_off.tail);
+    cqMask_ = (unsigned*)(cq + params.cq_off.ring_mask);
+    cqes_ = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    localTail_ = submittedTail_ = *sqTail_;
+    return true;
+}
+
+void IoUring::destroy() {
+    if (sqes_) {
+        munmap(sqes_, sqesSize_);
+        sqes_ = nullptr;
+    }
+    if (cqRing_ && cqRing_ != sqRing_) {
+        munmap(cqRing_, cqRingSize_);
+    }
+    cqRing_ = nullptr;
+    if (sqRing_) {
+        munmap(sqRing_, sqRingSize_);
+        sqRing_ = nullptr;
+    }
+    if (ringFd_ >= 0) {
+        close(ringFd_);
+        ringFd_ = -1;
+    }
+}
+
+bool IoUring::registerBuffers(const std::vector<struct iovec>& buffers) {
+    if (ioUringRegister(ringFd_, IORING_REGISTER_BUFFERS, buffers.data(), buffers.size()) < 0) {
+        std::cerr << "io_uring buffer registration failed: " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool IoUring::registerFiles(const std::vector<int>& fds) {
+    if (ioUringRegister(ringFd_, IORING_REGISTER_FILES, fds.data(), fds.size()) < 0) {
+        std::cerr << "io_uring file registration failed: " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool IoUring::updateFile(unsigned index, int fd) {
+    struct io_uring_files_update update;
+    memset(&update, 0, sizeof(update));
+    update.offset = index;
+    update.fds = (uint64_t)(uintptr_t)&fd;
+    return ioUringRegister(ringFd_, IORING_REGISTER_FILES_UPDATE, &update, 1) == 1;
+}
+
+io_uring_sqe* IoUring::getSqe() {
+    unsigned head = __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+    if (localTail_ - head >= entries_) {
+        return nullptr;
+    }
+
+    unsigned index = localTail_ & *sqMask_;
+    struct io_uring_sqe* sqe = &sqes_[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqArray_[index] = index;
+    localTail_++;
+    return sqe;
+}
+
+int IoUring::submit(unsigned waitNr) {
+    unsigned toSubmit = localTail_ - submittedTail_;
+    __atomic_store_n(sqTail_, localTail_, __ATOMIC_RELEASE);
+    submittedTail_ = localTail_;
+
+    if (toSubmit == 0 && waitNr == 0) {
+        return 0;
+    }
+
+    unsigned flags = waitNr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    int ret = ioUringEnter(ringFd_, toSubmit, waitNr, flags);
+    while (ret < 0 && errno == EINTR) {
+        // the sqes were already consumed, only keep waiting
+        ret = ioUringEnter(ringFd_, 0, waitNr, flags);
+    }
+
+    return ret;
+}
+
+io_uring_cqe* IoUring::peekCqe() {
+    unsigned head = *cqHead_;
+    unsigned tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return nullptr;
+    }
+    return &cqes_[head & *cqMask_];
+}
+
+void IoUring::cqeSeen() {
+    __atomic_store_n(cqHead_, *cqHead_ + 1, __ATOMIC_RELEASE);
+}
+
+UringIo::UringIo() {
+    socketFd_ = -1;
+    fileAttached_ = false;
+    recvStart_ = 0;
+    recvEnd_ = 0;
+    writesInFlight_ = 0;
+    writeFailed_ = false;
+    readPending_ = false;
+    readResult_ = 0;
+}
+
+UringIo::~UringIo() {
+    if (ring_.isReady()) {
+        flushWrites();
+    }
+}
+
+bool UringIo::init(int socketFd) {
+    if (!ring_.init(32)) {
+        return false;
+    }
+
+    recvBuffer_.resize(RECV_BUFFER_SIZE);
+    writeArena_.resize(WRITE_SLOT_SIZE * WRITE_SLOTS);
+
+    // buffer 0 is the receive buffer, then one per write slot
+    std::vector<struct iovec> buffers;
+    buffers.push_back({recvBuffer_.data(), recvBuffer_.size()});
+    for (size_t i = 0; i < WRITE_SLOTS; i++) {
+        buffers.push_back({writeArena_.data() + i * WRITE_SLOT_SIZE, WRITE_SLOT_SIZE});
+        freeSlots_.push_back(i);
+    }
+    if (!ring_.registerBuffers(buffers)) {
+        ring_.destroy();
+        return false;
+    }
+
+    // fixed file 0 is the socket, 1 is swapped to each upload as it opens
+    if (!ring_.registerFiles({socketFd, -1})) {
+        ring_.destroy();
+        return false;
+    }
+
+    socketFd_ = socketFd;
+    return true;
+}
+
+void UringIo::reapCompletions() {
+    struct io_uring_cqe* cqe;
+    while ((cqe = ring_.peekCqe()) != nullptr) {
+        if (cqe->user_data == READ_TAG) {
+            readPending_ = false;
+            readResult_ = cqe->res;
+        } else {
+            // write slot is free again, a short or failed write poisons the upload
+            unsigned slot = (unsigned)(cqe->user_data >> 32);
+            unsigned expected = (unsigned)(cqe->user_data & 0xFFFFFFFF);
+            if (cqe->res < 0 || (unsigned)cqe->res != expected) {
+                std::cerr << "io_uring file write failed: " << (cqe->res < 0 ? strerror(-cqe->res) : "short write") << std::endl;
+                writeFailed_ = true;
+            }
+            freeSlots_.push_back(slot);
+            writesInFlight_--;
+        }
+        ring_.cqeSeen();
+    }
+}
+
+bool UringIo::waitForRead() {
+    while (readPending_) {
+        if (ring_.submit(1) < 0) {
+            std::cerr << "io_uring_enter failed: " << strerror(errno) << std::endl;
+            return false;
+        }
+        reapCompletions();
+    }
+    return true;
+}
+
+bool UringIo::waitForSlot() {
+    while (freeSlots_.empty()) {
+        if (ring_.submit(1) < 0) {
+            std::cerr << "io_uring_enter failed: " << strerror(errno) << std::endl;
+            return false;
+        }
+        reapCompletions();
+    }
+    return true;
+}
+
+bool UringIo::preload(const uint8_t* data, size_t len) {
+    if (len == 0) {
+        return true;
+    }
+    if (len > RECV_BUFFER_SIZE - (recvEnd_ - recvStart_)) {
+        return false;
+    }
+    memmove(recvBuffer_.data(), recvBuffer_.data() + recvStart_, recvEnd_ - recvStart_);
+    recvEnd_ -= recvStart_;
+    recvStart_ = 0;
+    memcpy(recvBuffer_.data() + recvEnd_, data, len);
+    recvEnd_ += len;
+    return true;
+}
+
+bool UringIo::recvExact(void* data, size_t len) {
+    uint8_t* out = (uint8_t*)data;
+
+    while (len > 0) {
+        // serve from what is already buffered
+        size_t buffered = recvEnd_ - recvStart_;
+        if (buffered > 0) {
+            size_t n = std::min(buffered, len);
+            memcpy(out, recvBuffer_.data() + recvStart_, n);
+            recvStart_ += n;
+            out += n;
+            len -= n;
+            continue;
+        }
+        recvStart_ = recvEnd_ = 0;
+
+        struct io_uring_sqe* sqe = ring_.getSqe();
+        if (!sqe) {
+            ring_.submit(0);
+            sqe = ring_.getSqe();
+            if (!sqe) {
+                return false;
+            }
+        }
+
+        if (len >= RECV_BUFFER_SIZE) {
+            // too big to stage, receive straight into the caller buffer
+            sqe->opcode = IORING_OP_RECV;
+            sqe->fd = SOCKET_FILE_INDEX;
+            sqe->flags = IOSQE_FIXED_FILE;
+            sqe->addr = (uint64_t)(uintptr_t)out;
+            sqe->len = len;
+            sqe->msg_flags = MSG_WAITALL;
+        } else {
+            // read whatever the socket has into the registered receive buffer
+            sqe->opcode = IORING_OP_READ_FIXED;
+            sqe->fd = SOCKET_FILE_INDEX;
+            sqe->flags = IOSQE_FIXED_FILE;
+            sqe->addr = (uint64_t)(uintptr_t)recvBuffer_.data();
+            sqe->len = RECV_BUFFER_SIZE;
+            sqe->buf_index = RECV_BUFFER_INDEX;
+        }
+        sqe->user_data = READ_TAG;
+
+        readPending_ = true;
+        if (!waitForRead()) {
+            return false;
+        }
+        if (readResult_ <= 0) {
+            if (readResult_ < 0) {
+                std::cerr << "io_uring socket read failed: " << strerror(-readResult_) << std::endl;
+            }
+            return false;
+        }
+
+        if (len >= RECV_BUFFER_SIZE) {
+            out += readResult_;
+            len -= readResult_;
+        } else {
+            recvEnd_ = readResult_;
+        }
+    }
+
+    return true;
+}
+
+bool UringIo::attachFile(int fileFd) {
+    if (!flushWrites()) {
+        return false;
+    }
+    if (!ring_.updateFile(UPLOAD_FILE_INDEX, fileFd)) {
+        std::cerr << "io_uring file update failed: " << strerror(errno) << std::endl;
+        return false;
+    }
+    fileAttached_ = true;
+    writeFailed_ = false;
+    return true;
+}
+
+void UringIo::detachFile() {
+    if (!fileAttached_) {
+        return;
+    }
+    flushWrites();
+    ring_.updateFile(UPLOAD_FILE_INDEX, -1);
+    fileAttached_ = false;
+}
+
+bool UringIo::queueWrite(const uint8_t* data, size_t len, uint64_t offset) {
+    if (!fileAttached_ || writeFailed_) {
+        return false;
+    }
+
+    while (len > 0) {
+        if (!waitForSlot()) {
+            return false;
+        }
+
+        struct io_uring_sqe* sqe = ring_.getSqe();
+        if (!sqe) {
+            ring_.submit(0);
+            continue;
+        }
+
+        unsigned slot = freeSlots_.back();
+        freeSlots_.pop_back();
+
+        size_t n = std::min(len, WRITE_SLOT_SIZE);
+        uint8_t* slotData = writeArena_.data() + slot * WRITE_SLOT_SIZE;
+        memcpy(slotData, data, n);
+
+        // left in the submission queue until the next socket read or flush
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->fd = UPLOAD_FILE_INDEX;
+        sqe->flags = IOSQE_FIXED_FILE;
+        sqe->addr = (uint64_t)(uintptr_t)slotData;
+        sqe->len = n;
+        sqe->off = offset;
+        sqe->buf_index = RECV_BUFFER_INDEX + 1 + slot;
+        sqe->user_data = ((uint64_t)slot << 32) | n;
+        writesInFlight_++;
+
+        data += n;
+        len -= n;
+        offset += n;
+    }
+
+    return true;
+}
+
+bool UringIo::flushWrites() {
+    while (writesInFlight_ > 0 || ring_.pendingSubmissions() > 0) {
+        if (ring_.submit(writesInFlight_ > 0 ? 1 : 0) < 0) {
+            std::cerr << "io_uring_enter failed: " << strerror(errno) << std::endl;
+            return false;
+        }
+        reapCompletions();
+    }
+    return !writeFailed_;
+}
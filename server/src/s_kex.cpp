@@ -1,5 +1,6 @@
 #include "../include/s_kex.h"
 #include "../include/s_byte_stream.h"
+#include "../include/s_cipher_registry.h"
 #include <cstdlib>
 #include <iostream>
 #include <algorithm>
@@ -31,23 +32,11 @@ std::vector<uint8_t> buildKexPayload() {
         "RoseIsCoolDog"
     });
 
-    // Encryption algorithms
-    bs.writeNameList({
-        "simple-encrypt",
-        "hard-encrypt"
-    });
-    bs.writeNameList({
-        "abcd123-ctr"
-    });
-
-    // MAC algorithms
-    bs.writeNameList({
-        "hmac-kim",
-        "hmac-sha2-256"
-    });
-    bs.writeNameList({
-        "bigMac-meal"
-    });
+    // Encryption and MAC algorithms, whatever the cipher registry can build, both directions alike
+    bs.writeNameList(CipherRegistry::encryptionNames());
+    bs.writeNameList(CipherRegistry::encryptionNames());
+    bs.writeNameList(CipherRegistry::macNames());
+    bs.writeNameList(CipherRegistry::macNames());
 
     // Compression algorithms
     bs.writeNameList({"none"});
@@ -0,0 +1,107 @@
+#include "s_send_batch.h"
+
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <algorithm>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+int sendIovecs(int socketFd, struct iovec* iov, size_t count) {
+    int calls = 0;
+    size_t index = 0;
+
+    while (index < count) {
+        // skip anything already fully sent (or empty to begin with)
+        if (iov[index].iov_len == 0) {
+            index++;
+            continue;
+        }
+
+        struct msghdr msg = {};
+        msg.msg_iov = iov + index;
+        msg.msg_iovlen = std::min(count - index, (size_t)IOV_MAX);
+
+        ssize_t sent = sendmsg(socketFd, &msg, MSG_NOSIGNAL);
+        calls++;
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        // move past whatever the kernel took, the last one may be partial
+        size_t left = sent;
+        while (index < count && left >= iov[index].iov_len) {
+            left -= iov[index].iov_len;
+            index++;
+        }
+        if (left > 0) {
+            iov[index].iov_base = static_cast<uint8_t*>(iov[index].iov_base) + left;
+            iov[index].iov_len -= left;
+        }
+    }
+    return calls;
+}
+
+SendBatch::SendBatch() {
+    pendingBytes_ = 0;
+    sendCalls_ = 0;
+    stagedEnd_ = 0;
+}
+
+void SendBatch::addFrame(std::vector<uint8_t>&& bytes) {
+    pendingBytes_ += 4 + bytes.size();
+    pieces_.push_back(Piece{htonl(bytes.size()), true, std::move(bytes), 0, 0});
+}
+
+void SendBatch::addRaw(std::vector<uint8_t>&& bytes) {
+    pendingBytes_ += bytes.size();
+    pieces_.push_back(Piece{0, false, std::move(bytes), 0, 0});
+}
+
+std::span<uint8_t> SendBatch::stageFrame(size_t length) {
+    // grown, never shrunk, the bytes past stagedEnd_ are left over from earlier batches
+    size_t at = stagedEnd_;
+    if (staged_.size() < at + 4 + length) {
+        staged_.resize(std::max(at + 4 + length, staged_.size() * 2));
+    }
+    uint32_t lengthNet = htonl(length);
+    memcpy(staged_.data() + at, &lengthNet, sizeof(lengthNet));
+    stagedEnd_ = at + 4 + length;
+
+    pendingBytes_ += 4 + length;
+    pieces_.push_back(Piece{0, false, {}, at, 4 + length});
+    return std::span<uint8_t>(staged_.data() + at + 4, length);
+}
+
+bool SendBatch::flush(int socketFd) {
+    if (pieces_.empty()) {
+        return true;
+    }
+
+    // pieces_ does not change until the send is done so pointers into it stay valid
+    iov_.clear();
+    for (Piece& piece : pieces_) {
+        if (piece.prefixed) {
+            iov_.push_back({&piece.lengthNet, sizeof(piece.lengthNet)});
+        }
+        if (piece.stagedLength > 0) {
+            iov_.push_back({staged_.data() + piece.stagedAt, piece.stagedLength});
+        } else {
+            iov_.push_back({piece.bytes.data(), piece.bytes.size()});
+        }
+    }
+
+    int calls = sendIovecs(socketFd, iov_.data(), iov_.size());
+    pieces_.clear();
+    pendingBytes_ = 0;
+    stagedEnd_ = 0;
+
+    if (calls < 0) {
+        return false;
+    }
+    sendCalls_ += calls;
+    return true;
+}
@@ -0,0 +1,840 @@
+#include "s_session.h"
+#include "s_cipher_registry.h"
+#include "s_file_transfer_protocol.h"
+#include "s_io_uring.h"
+#include "s_file_batch.h"
+#include "s_background_pool.h"
+
+#include <iostream>
+#include <algorithm>
+#include <unordered_set>
+#include <cstdio>
+#include <unistd.h>
+
+Session::Session(int socketFd, const std::string& uploadDir, UploadRegistry& uploads, HashIndex& hashes, ChunkStore* chunks)
+    : reader_(socketFd), tuner_(socketFd), uploads_(uploads), hashes_(hashes), chunks_(chunks) {
+    socketFd_ = socketFd;
+    uploadDir_ = uploadDir;
+    sequenceNumber_ = 0;
+    disconnectRequested_ = false;
+    sendFailed_ = false;
+    startedAt_ = std::chrono::steady_clock::now();
+    messagesReceived_ = 0;
+    messagesSent_ = 0;
+    payloadBytesReceived_ = 0;
+    bytesSent_ = 0;
+    filesReceived_ = 0;
+    filesSent_ = 0;
+}
+
+Session::~Session() {
+    // a dropped connection leaves its uploads resumable from the last byte that made it
+    for (auto& [channelId, channel] : channels_) {
+        if (channel->fileVersion != 0) {
+            checkpoint(*channel);
+            std::cout << "Upload interrupted, " << channel->receiver.committedBytes() << " bytes kept for " << channel->filePath << std::endl;
+        }
+    }
+    // the receivers may still queue writes on the ring, they have to let go first
+    channels_.clear();
+}
+
+bool Session::setKeys(uint64_t sharedSecret) {
+    sendCrypto_ = CipherRegistry::create(kex_.encryptionServerToClient, kex_.MACServerToClient, sharedSecret, false); // server_to_client for sending
+    recvCrypto_ = CipherRegistry::create(kex_.encryptionClientToServer, kex_.MACClientToServer, sharedSecret, true);  // client_to_server for receiving
+    return hasKeys();
+}
+
+bool Session::enableUring() {
+    auto uring = std::make_unique<UringIo>();
+    if (!uring->init(socketFd_)) {
+        return false;
+    }
+    if (!uring->preload(reader_.data(), reader_.available())) {
+        return false;
+    }
+    reader_.consume(reader_.available());
+    uring_ = std::move(uring);
+    return true;
+}
+
+void Session::queueReply(std::vector<uint8_t>& out, uint16_t channelId, uint8_t messageType, uint32_t sequenceNumber, const std::vector<uint8_t>& payload) {
+    size_t before = out.size();
+    if (!FTPProtocol::appendEncryptedMessage(out, messageType, payload, sequenceNumber, *sendCrypto_, channelId)) {
+        std::cerr << "Failed to encrypt reply, dropping the connection" << std::endl;
+        sendFailed_ = true;
+    }
+    messagesSent_++;
+    bytesSent_ += out.size() - before;
+}
+
+void Session::queueAck(std::vector<uint8_t>& out, uint16_t channelId, Channel& channel) {
+    FTPProtocol::createFileAckMessage(ackPayload_, channel.receiver.expectedChunk(), channel.receiver.heldRanges(FTPProtocol::MAX_ACK_RANGES));
+    queueReply(out, channelId, static_cast<uint8_t>(FTPProtocol::FTPMessageType::FILE_ACK), channel.lastDataSequence, ackPayload_);
+    channel.chunksSinceAck = 0;
+    channel.bytesSinceAck = 0;
+    channel.lastAck = std::chrono::steady_clock::now();
+}
+
+bool Session::flushAck(std::vector<uint8_t>& out) {
+    for (auto& [channelId, channel] : channels_) {
+        if (channel->chunksSinceAck > 0) {
+            queueAck(out, channelId, *channel);
+        }
+    }
+    return !sendFailed_;
+}
+
+Session::Channel* Session::openChannel(uint16_t channelId, uint32_t requestedChunkSize) {
+    if (channelsInUse() >= MAX_CHANNELS) {
+        std::cerr << "Too many files in flight, refusing channel " << channelId << std::endl;
+        return nullptr;
+    }
+
+    auto channel = std::make_unique<Channel>();
+    channel->receiver.setUring(uring_.get());
+    // the client asks for a chunk size, it gets that or the server maximum
+    channel->chunkSize = requestedChunkSize == 0 ? FTPProtocol::DEFAULT_CHUNK_SIZE : std::clamp(requestedChunkSize, FTPProtocol::MIN_CHUNK_SIZE, FTPProtocol::MAX_CHUNK_SIZE);
+    channel->partOffset = 0;
+    channel->fileVersion = 0;
+    channel->journaledBytes = 0;
+    channel->chunksSinceAck = 0;
+    channel->bytesSinceAck = 0;
+    channel->lastDataSequence = 0;
+    channel->lastAck = std::chrono::steady_clock::now();
+
+    Channel* opened = channel.get();
+    channels_[channelId] = std::move(channel);
+    return opened;
+}
+
+bool Session::checkpoint(Channel& channel) {
+    if (!channel.receiver.sync()) {
+        std::cerr << "Failed to sync " << channel.receiver.filePath() << std::endl;
+        return false;
+    }
+    JournalEntry entry{channel.receiver.fileSize(), channel.fileVersion, channel.receiver.committedBytes(), channel.receiver.digest()};
+    if (!UploadJournal::save(channel.filePath, entry)) {
+        return false;
+    }
+    channel.journaledBytes = entry.committedBytes;
+    return true;
+}
+
+bool Session::finishFile(std::vector<uint8_t>& out, uint16_t channelId, bool reply) {
+    auto it = channels_.find(channelId);
+    std::unique_ptr<Channel> channel = std::move(it->second);
+    channels_.erase(it);
+
+    uint8_t hash[FTPProtocol::FILE_HASH_SIZE];
+    bool hashed = !channel->part && channel->receiver.contentHash(hash);
+    if (!channel->receiver.close()) {
+        std::cerr << "Failed to write to file" << std::endl;
+        return false;
+    }
+
+    if (channel->part) {
+        // the file itself is published by UPLOAD_COMPLETE
+        uploads_.finishPart(channel->part->id, channel->partOffset, channel->receiver.fileSize());
+        std::cout << "Part received: " << channel->receiver.fileSize() << " bytes at " << channel->partOffset << " of " << channel->part->finalPath << std::endl;
+    } else {
+        // only a finished file shows up under its real name
+        if (rename(channel->receiver.filePath().c_str(), channel->filePath.c_str()) < 0) {
+            std::cerr << "Failed to move " << channel->receiver.filePath() << " into place" << std::endl;
+            return false;
+        }
+        if (channel->fileVersion != 0) {
+            UploadJournal::discard(channel->filePath);
+        }
+        if (hashed) {
+            hashes_.add(channel->filePath, username_, hash);
+        } else {
+            hashes_.hashLater(channel->filePath, username_);
+        }
+        filesReceived_++;
+        std::cout << "File received successfully: " << channel->filePath << std::endl;
+    }
+
+    // file success message to client, when the last chunk completed the file it waits for the client FILE_END
+    if (reply) {
+        queueReply(out, channelId, static_cast<uint8_t>(FTPProtocol::FTPMessageType::FILE_END), sequenceNumber_);
+    }
+    return true;
+}
+
+void Session::storeChunks(uint16_t channelId, bool fileEnd) {
+    Dedupe& file = *dedupes_[channelId];
+
+    // what the pool works on, nothing in it points back into the session
+    struct Store {
+        std::vector<ChunkPut> puts;
+        std::atomic<bool> failed{false};
+        std::atomic<size_t> slicesLeft{0};
+        bool writeManifest = false;
+        bool saved = false;
+        std::string filePath;
+        uint64_t fileSize = 0;
+        std::vector<FTPProtocol::ChunkRef> chunks;
+    };
+    auto store = std::make_shared<Store>();
+    store->puts = std::move(file.unwritten);
+    file.unwritten.clear();
+    file.unwrittenBytes = 0;
+    // a file that already missed a chunk gets no manifest, the puts can still fail it after this
+    store->writeManifest = fileEnd && !file.failed && file.pendingCount == 0;
+    if (fileEnd) {
+        store->filePath = file.filePath;
+        store->fileSize = file.fileSize;
+        store->chunks = std::move(file.chunks);
+    }
+
+    ChunkStore* chunks = chunks_;
+    job_ = std::make_unique<Job>();
+    job_->start = [store, chunks](BackgroundPool& pool, std::function<void()> done) {
+        auto putRange = [store, chunks, done](size_t first, size_t last) {
+            // put() checks the hash, nothing unverified goes in the store
+            for (size_t i = first; i < last; i++) {
+                const ChunkPut& put = store->puts[i];
+                if (!chunks->put(put.chunk, put.data, put.length)) {
+                    store->failed = true;
+                }
+            }
+            if (store->slicesLeft.fetch_sub(1) != 1) {
+                return;
+            }
+            // the manifest only ever names chunks that are already in the store
+            // it takes the place of any plain copy, FILE_GET only falls back to it when there is none
+            if (store->writeManifest && !store->failed) {
+                store->saved = ChunkStore::saveManifest(store->filePath, store->fileSize, store->chunks);
+                if (store->saved) {
+                    unlink(store->filePath.c_str());
+                }
+            }
+            done();
+        };
+
+        // contiguous slices like a FILE_BATCH, one per pool thread, nothing to put still gets one
+        size_t count = store->puts.size();
+        size_t slices = std::max<size_t>(1, std::min(pool.size(), count));
+        size_t slice = std::max<size_t>(1, (count + slices - 1) / slices);
+        store->slicesLeft = std::max<size_t>(1, (count + slice - 1) / slice);
+        size_t first = 0;
+        do {
+            size_t last = std::min(first + slice, count);
+            pool.submit([putRange, first, last] { putRange(first, last); });
+            first = last;
+        } while (first < count);
+    };
+    job_->finish = [this, channelId, store, fileEnd](std::vector<uint8_t>& out) {
+        auto dedupe = dedupes_.find(channelId);
+        if (dedupe == dedupes_.end()) {
+            return;
+        }
+        Dedupe& file = *dedupe->second;
+        if (store->failed) {
+            file.failed = true;
+        }
+        if (!fileEnd) {
+            return;
+        }
+
+        if (store->saved) {
+            filesReceived_++;
+            std::cout << "File stored deduplicated: " << file.filePath << " (" << file.newBytes << " of " << file.fileSize
+                      << " bytes new, " << store->chunks.size() << " chunks)" << std::endl;
+        } else {
+            std::cerr << "Deduplicated upload of " << file.filePath << " is incomplete, dropped" << std::endl;
+        }
+        dedupes_.erase(dedupe);
+        queueReply(out, channelId, static_cast<uint8_t>(store->saved ? FTPProtocol::FTPMessageType::FILE_END : FTPProtocol::FTPMessageType::FILE_ERROR), sequenceNumber_);
+    };
+}
+
+bool Session::claimPresent(std::vector<uint8_t>& out, uint16_t channelId, const std::vector<uint8_t>& payload, const std::string& filename, uint64_t fileSize) {
+    uint8_t hash[FTPProtocol::FILE_HASH_SIZE];
+    std::string filePath = uploadDir_ + "/" + username_ + "_" + filename;
+    if (!FTPProtocol::parseContentHash(payload, hash) || !hashes_.claim(hash, fileSize, username_, filePath)) {
+        return false;
+    }
+
+    // whatever an earlier try left behind is not needed any more
+    UploadJournal::discard(filePath);
+    filesReceived_++;
+    std::cout << "Already have the content of " << filePath << " (" << fileSize << " bytes), nothing to receive" << std::endl;
+    queueReply(out, channelId, static_cast<uint8_t>(FTPProtocol::FTPMessageType::FILE_PRESENT), sequenceNumber_);
+    return true;
+}
+
+uint64_t Session::downloadBytesInFlight() const {
+    uint64_t bytes = 0;
+    for (const auto& [channelId, download] : downloads_) {
+        bytes += (uint64_t)(download->sender.chunksSent() - download->ackedChunks) * download->sender.chunkSize();
+    }
+    return bytes;
+}
+
+void Session::pumpDownload(std::vector<uint8_t>& out, uint16_t channelId, Download& download) {
+    FileSender& sender = download.sender;
+    size_t before = out.size();
+
+    // big chunks shrink the window so the bytes in flight stay bounded, and all downloads together
+    // never have more than SESSION_WINDOW_BYTES out however many channels the client opens
+    uint32_t window = std::max<uint64_t>(2, DOWNLOAD_WINDOW_BYTES / sender.chunkSize());
+    uint64_t inFlight = downloadBytesInFlight();
+    while (sender.chunksSent() - download.ackedChunks < window && inFlight < SESSION_WINDOW_BYTES) {
+        uint32_t chunkNumber;
+        uint64_t offset;
+        uint32_t length;
+        const uint8_t* chunk = sender.nextChunk(chunkNumber, offset, length);
+        if (!chunk) {
+            break;
+        }
+        if (!FTPProtocol::appendEncryptedFileData(out, chunkNumber, offset, chunk, length, sequenceNumber_, *sendCrypto_, channelId)) {
+            std::cerr << "Failed to encrypt file data, dropping the connection" << std::endl;
+            sendFailed_ = true;
+            return;
+        }
+        messagesSent_++;
+        inFlight += length;
+    }
+    bytesSent_ += out.size() - before;
+
+    if (sender.isComplete()) {
+        // FILE_END follows the last chunk on the same channel, nothing is left to ack
+        queueReply(out, channelId, static_cast<uint8_t>(FTPProtocol::FTPMessageType::FILE_END), sequenceNumber_);
+        filesSent_++;
+        std::cout << "File sent successfully: " << sender.filePath() << std::endl;
+        downloads_.erase(channelId);
+    }
+}
+
+/**
+ * Order of file transfer messages:
+ *
+ * FILE_START from client
+ * FILE_START to client, with the resume offset when an earlier attempt left part of the file
+ *
+ * FILE_DATA from client, as many as the client window allows
+ * FILE_ACK to client every few chunks
+ *
+ * FILE_END from client
+ * FILE_END
+ *
+ * FILE_ERROR from client in place of FILE_DATA drops the file and its journal, the client
+ * sends it when the resumed prefix is not the same as its copy
+ *
+ * FILE_START, DELTA_START and UPLOAD_INIT may end with the SHA-256 of the file, when this user
+ * already stored that content the reply is FILE_PRESENT and the exchange ends there
+ *
+ * a striped upload is UPLOAD_INIT on one connection, then on every connection UPLOAD_PART
+ * in place of FILE_START followed by the same FILE_DATA/FILE_END exchange for its range,
+ * and finally UPLOAD_COMPLETE which is answered with FILE_END once the file is in place
+ *
+ * FILE_GET from client
+ * FILE_GET to client, with the file size and the range that is actually sent
+ * FILE_DATA to client, as many as the download window allows
+ * FILE_ACK from client every few chunks, each one lets more FILE_DATA go out
+ * FILE_END to client after the last chunk
+ *
+ * FILE_ERROR from client cancels a download
+ *
+ * FILE_BATCH from client, any number of small files with their names and data
+ * FILE_BATCH to client, which of them could not be written
+ *
+ * DELTA_START from client, same payload as FILE_START with the block size in place of the chunk size
+ * DELTA_START to client, the block size and block count of the stored copy, a count of 0
+ * means there is nothing to diff against and the client sends the whole file instead
+ * DELTA_SIGNATURES to client, the signatures of every block
+ * DELTA_DATA from client, copy and literal instructions in file order
+ * FILE_END from client, with the SHA-256 of the new file
+ * FILE_END to client once the rebuilt file matches it, FILE_ERROR when it does not
+ *
+ * DEDUPE_START from client, the file as a list of chunk lengths and SHA-256 hashes
+ * DEDUPE_START to client, the index of every chunk the store does not have, FILE_ERROR when
+ * the server runs without a chunk store
+ * CHUNK_DATA from client for each of those chunks
+ * FILE_END from client, FILE_END to client once the manifest is written, FILE_ERROR when a chunk was missing or bad
+ *
+ * each exchange runs on the channel in the message header, replies go back on the same one,
+ * so the client can start the next file without waiting for the last one to finish
+ */
+
+bool Session::handleTransferMessage(uint8_t messageType, uint32_t sequenceNumber, uint16_t channelId, std::vector<uint8_t>& payload, std::vector<uint8_t>& out) {
+    // whatever was queued before a failed encrypt must not go out after it
+    return handleMessage(messageType, sequenceNumber, channelId, payload, out) && !sendFailed_;
+}
+
+void Session::startJob(BackgroundPool& pool, std::function<void()> done) {
+    job_->start(pool, std::move(done));
+}
+
+bool Session::finishJob(std::vector<uint8_t>& out) {
+    std::unique_ptr<Job> job = std::move(job_);
+    job->finish(out);
+    return !sendFailed_;
+}
+
+bool Session::pumpSignatures(std::vector<uint8_t>& out) {
+    for (auto it = signatureStreams_.begin(); it != signatureStreams_.end();) {
+        SignatureStream& stream = it->second;
+        size_t count = std::min<size_t>(FTPProtocol::SIGNATURES_PER_MESSAGE, stream.signatures.size() - stream.next);
+        queueReply(out, it->first, static_cast<uint8_t>(FTPProtocol::FTPMessageType::DELTA_SIGNATURES), sequenceNumber_,
+                   FTPProtocol::createDeltaSignaturesMessage(stream.signatures, stream.next, count));
+        stream.next += count;
+        if (stream.next >= stream.signatures.size()) {
+            it = signatureStreams_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    return !sendFailed_;
+}
+
+bool Session::handleMessage(uint8_t messageType, uint32_t sequenceNumber, uint16_t channelId, std::vector<uint8_t>& payload, std::vector<uint8_t>& out) {
+    auto type = static_cast<FTPProtocol::FTPMessageType>(messageType);
+    messagesReceived_++;
+    payloadBytesReceived_ += payload.size();
+    tuner_.maybeSample();
+
+    // a download only hears acks and cancels from the client
+    auto download = downloads_.find(channelId);
+    if (download != downloads_.end()) {
+        FileSender& sender = download->second->sender;
+        if (type == FTPProtocol::FTPMessageType::FILE_ACK) {
+            uint32_t nextChunk;
+            if (FTPProtocol::parseFileAckMessage(payload, nextChunk)) {
+                download->second->ackedChunks = std::max(download->second->ackedChunks, std::min(nextChunk, sender.chunksSent()));
+            }
+            pumpDownload(out, channelId, *download->second);
+            // the ack freed room in the session window, downloads held back by it get their turn too
+            for (auto it = downloads_.begin(); it != downloads_.end();) {
+                auto next = std::next(it);
+                pumpDownload(out, it->first, *it->second);
+                it = next;
+            }
+        } else if (type == FTPProtocol::FTPMessageType::FILE_ERROR) {
+            std::cout << "Client cancelled download of " << sender.filePath() << std::endl;
+            downloads_.erase(download);
+        }
+        return true;
+    }
+
+    // a delta upload applies DELTA_DATA until FILE_END says the file is complete
+    auto delta = deltas_.find(channelId);
+    if (delta != deltas_.end()) {
+        DeltaReceiver& receiver = *delta->second;
+        if (type == FTPProtocol::FTPMessageType::DELTA_DATA) {
+            receiver.apply(payload);
+        } else if (type == FTPProtocol::FTPMessageType::FILE_END) {
+            bool ok = receiver.finish(payload);
+            if (ok) {
+                // finish() checked the rebuilt file against this hash
+                hashes_.add(receiver.filePath(), username_, payload.data());
+                filesReceived_++;
+                std::cout << "File rebuilt from delta: " << receiver.filePath() << " (" << receiver.copiedBytes() << " of "
+                          << receiver.fileSize() << " bytes from the old copy)" << std::endl;
+            }
+            deltas_.erase(delta);
+            signatureStreams_.erase(channelId);
+            queueReply(out, channelId, static_cast<uint8_t>(ok ? FTPProtocol::FTPMessageType::FILE_END : FTPProtocol::FTPMessageType::FILE_ERROR), sequenceNumber_);
+        } else if (type == FTPProtocol::FTPMessageType::FILE_ERROR) {
+            std::cout << "Client abandoned delta upload of " << receiver.filePath() << std::endl;
+            deltas_.erase(delta);
+            signatureStreams_.erase(channelId);
+        }
+        return true;
+    }
+
+    // a deduplicated upload takes the missing chunks until FILE_END
+    auto dedupe = dedupes_.find(channelId);
+    if (dedupe != dedupes_.end()) {
+        Dedupe& file = *dedupe->second;
+        if (type == FTPProtocol::FTPMessageType::CHUNK_DATA) {
+            uint32_t index;
+            const uint8_t* chunkData;
+            uint32_t chunkLength;
+            if (!FTPProtocol::parseChunkDataMessage(payload, index, chunkData, chunkLength) || index >= file.chunks.size() || !file.pending[index]) {
+                file.failed = true;
+                return true;
+            }
+            file.pending[index] = 0;
+            file.pendingCount--;
+            file.newBytes += chunkLength;
+
+            // hashing and one file per chunk is disk work, it is kept until a batch is worth a trip to the pool
+            file.unwritten.push_back(ChunkPut{file.chunks[index], std::move(payload), chunkData, chunkLength});
+            file.unwrittenBytes += chunkLength;
+            if (file.unwrittenBytes >= CHUNK_BATCH_BYTES) {
+                storeChunks(channelId, false);
+            }
+        } else if (type == FTPProtocol::FTPMessageType::FILE_END) {
+            storeChunks(channelId, true);
+        } else if (type == FTPProtocol::FTPMessageType::FILE_ERROR) {
+            std::cout << "Client abandoned deduplicated upload of " << file.filePath << std::endl;
+            dedupes_.erase(dedupe);
+        }
+        return true;
+    }
+
+    // mid file, only FILE_DATA and FILE_END mean anything
+    auto open = channels_.find(channelId);
+    if (open != channels_.end()) {
+        Channel& channel = *open->second;
+        if (type == FTPProtocol::FTPMessageType::FILE_DATA) {
+            uint32_t chunkNumber;
+            uint64_t offset;
+            const uint8_t* chunkData;
+            uint32_t chunkLength;
+            if (!FTPProtocol::parseFileDataMessage(payload, chunkNumber, offset, chunkData, chunkLength)) {
+                return true;
+            }
+            if (chunkLength > channel.chunkSize) {
+                std::cerr << "Chunk " << chunkNumber << " is " << chunkLength << " bytes, agreed on " << channel.chunkSize << std::endl;
+                return false;
+            }
+
+            if (!channel.receiver.writeChunk(chunkNumber, offset, chunkData, chunkLength)) {
+                return false;
+            }
+            channel.chunksSinceAck++;
+            channel.bytesSinceAck += chunkLength;
+            channel.lastDataSequence = sequenceNumber;
+            if (channel.fileVersion != 0 && channel.receiver.committedBytes() - channel.journaledBytes >= JOURNAL_EVERY_BYTES) {
+                checkpoint(channel);
+            }
+
+            if (!channel.receiver.isComplete()) {
+                // cumulative ack every few chunks, or sooner when the chunks are big or the client is slow
+                if (channel.chunksSinceAck >= ACK_EVERY_CHUNKS || channel.bytesSinceAck >= ACK_EVERY_BYTES ||
+                    std::chrono::steady_clock::now() - channel.lastAck >= ACK_INTERVAL) {
+                    queueAck(out, channelId, channel);
+                }
+                return true;
+            }
+            return finishFile(out, channelId, false);
+        } else if (type == FTPProtocol::FTPMessageType::FILE_ERROR) {
+            // the client gave up on this file, nothing of it is worth resuming
+            std::cout << "Client abandoned " << (channel.part ? channel.receiver.filePath() : channel.filePath) << std::endl;
+            if (!channel.part) {
+                channel.receiver.close();
+                UploadJournal::discard(channel.filePath);
+            }
+            channels_.erase(open);
+            return true;
+        } else if (type != FTPProtocol::FTPMessageType::FILE_END) {
+            return true;
+        }
+
+        return finishFile(out, channelId, true);
+    }
+
+    sequenceNumber_++;
+
+    switch (type) {
+        case FTPProtocol::FTPMessageType::FILE_START: {
+            std::string filename;
+            uint64_t fileSize;
+            uint32_t chunkSize;
+            uint64_t fileVersion;
+
+            if (!FTPProtocol::parseFileStartMessage(payload, filename, fileSize, chunkSize, fileVersion)) {
+                std::cerr << "Failed to parse file start message" << std::endl;
+                break;
+            }
+            // the name goes into the upload, partial and journal paths, it may not climb out of the upload directory
+            if (filename.empty() || filename.find('/') != std::string::npos) {
+                std::cerr << "Refusing file name: " << filename << std::endl;
+                queueReply(out, channelId, static_cast<uint8_t>(FTPProtocol::FTPMessageType::FILE_ERROR), sequenceNumber_);
+                break;
+            }
+            if (claimPresent(out, channelId, payload, filename, fileSize)) {
+                break;
+            }
+            Channel* channel = openChannel(channelId, chunkSize);
+            if (!channel) {
+                queueReply(out, channelId, static_cast<uint8_t>(FTPProtocol::FTPMessageType::FILE_ERROR), sequenceNumber_);
+                break;
+            }
+            std::cout << "Receiving file: " << filename << " (" << fileSize << " bytes, " << channel->chunkSize << " byte chunks)" << std::endl;
+
+            // create file path in upload directory with username in front of file name
+            channel->filePath = uploadDir_ + "/" + username_ + "_" + filename;
+            channel->fileVersion = fileVersion;
+            std::string partialPath = UploadJournal::partialPath(channel->filePath);
+            channel->partialHold = uploads_.holdPartial(partialPath);
+
+            // same file as last time --> carry on after what the journal says is committed
+            JournalEntry entry;
+            bool resumed = fileVersion != 0 && UploadJournal::load(channel->filePath, entry) &&
+                           entry.fileSize == fileSize && entry.fileVersion == fileVersion &&
+                           channel->receiver.resume(partialPath, fileSize, entry.committedBytes);
+            if (!resumed) {
+                entry = JournalEntry{fileSize, fileVersion, 0, FTPProtocol::DIGEST_SEED};
+                if (!channel->receiver.open(partialPath, fileSize) || (fileVersion != 0 && !UploadJournal::save(channel->filePath, entry))) {
+                    channels_.erase(channelId);
+                    queueReply(out, channelId, static_cast<uint8_t>(FTPProtocol::FTPMessageType::FILE_END), sequenceNumber_);
+                    break;
+                }
+            }
+            // hashed for the index as it comes in, a resumed file is read back once it is complete
+            if (!resumed) {
+                channel->receiver.trackHash();
+            }
+            if (fileVersion != 0) {
+                channel->receiver.trackDigest(entry.digest);
+                channel->journaledBytes = entry.committedBytes;
+            }
+            if (resumed) {
+                std::cout << "Resuming " << filename << " at " << entry.committedBytes << " bytes" << std::endl;
+            }
+
+            // send success response with the agreed chunk size and where to carry on
+            queueReply(out, channelId, static_cast<uint8_t>(FTPProtocol::FTPMessageType::FILE_START), sequenceNumber_,
+                       FTPProtocol::createFileStartReply(channel->chunkSize, entry.committedBytes, entry.digest));
+
+            // empty file, or every byte already came in last time, is done as soon as it starts
+            if (channel->receiver.isComplete()) {
+                return finishFile(out, channelId, false);
+            }
+            break;
+        }
+        case FTPProtocol::FTPMessageType::UPLOAD_INIT: {
+            std::string filename;
+            uint64_t fileSize;
+            uint32_t partCount;
+            uint64_t uploadId;
+
+            if (!FTPProtocol::parseUploadInitMessage(payload, filename, fileSize, partCount) ||
+                filename.empty() || filename.find('/') != std::string::npos) {
+                queueReply(out, channelId, static_cast<uint8_t>(FTPProtocol::FTPMessageType::FILE_ERROR), sequenceNumber_);
+                break;
+            }
+            if (claimPresent(out, channelId, payload, filename, fileSize)) {
+                break;
+            }
+            if (!uploads_.create(username_, uploadDir_ + "/" + username_ + "_" + filename, fileSize, partCount, uploadId)) {
+                queueReply(out, channelId, static_cast<uint8_t>(FTPProtocol::FTPMessageType::FILE_ERROR), sequenceNumber_);
+                break;
+            }
+            std::cout << "Striped upload " << uploadId << ": " << filename << " (" << fileSize << " bytes in " << partCount << " parts)" << std::endl;
+            queueReply(out, channelId, static_cast<uint8_t>(FTPProtocol::FTPMessageType::UPLOAD_INIT), sequenceNumber_, FTPProtocol::createUploadIdMessage(uploadId));
+            break;
+        }
+        case FTPProtocol::FTPMessageType::UPLOAD_PART: {
+            uint64_t uploadId;
+            uint64_t offset;
+            uint64_t length;
+            uint32_t chunkSize;
+
+            std::shared_ptr<StripedUpload> upload;
+            if (FTPProtocol::parseUploadPartMessage(payload, uploadId, offset, length, chunkSize)) {
+                upload = uploads_.attach(uploadId, username_, offset, length);
+            }
+            Channel* channel = upload ? openChannel(channelId, chunkSize) : nullptr;
+            if (!channel || !channel->receiver.openPart(upload->fd, upload->tempPath, offset, length)) {
+                channels_.erase(channelId);
+                queueReply(out, channelId, static_cast<uint8_t>(FTPProtocol::FTPMessageType::FILE_ERROR), sequenceNumber_);
+                break;
+            }
+            channel->part = upload;
+            channel->partOffset = offset;
+
+            // same reply as FILE_START, the agreed chunk size
+            queueReply(out, channelId, static_cast<uint8_t>(FTPProtocol::FTPMessageType::UPLOAD_PART), sequenceNumber_, FTPProtocol::createFileStartReply(channel->chunkSize));
+            if (channel->receiver.isComplete()) {
+                return finishFile(out, channelId, false);
+            }
+            break;
+        }
+        case FTPProtocol::FTPMessageType::UPLOAD_COMPLETE: {
+            uint64_t uploadId;
+            std::string finalPath;
+            if (!FTPProtocol::parseUploadIdMessage(payload, uploadId) || !uploads_.complete(uploadId, username_, finalPath)) {
+                queueReply(out, channelId, static_cast<uint8_t>(FTPProtocol::FTPMessageType::FILE_ERROR), sequenceNumber_);
+                break;
+            }
+            // the parts came in side by side, nothing saw the file in order
+            hashes_.hashLater(finalPath, username_);
+            filesReceived_++;
+            std::cout << "Striped upload " << uploadId << " complete" << std::endl;
+            queueReply(out, channelId, static_cast<uint8_t>(FTPProtocol::FTPMessageType::FILE_END), sequenceNumber_);
+            break;
+        }
+        case FTPProtocol::FTPMessageType::FILE_GET: {
+            std::string filename;
+            uint64_t offset;
+            uint64_t length;
+            uint32_t chunkSize;
+
+            // only files this user uploaded, the name may not climb out of the upload directory
+            auto opened = std::make_unique<Download>();
+            bool ok = FTPProtocol::parseFileGetMessage(payload, filename, offset, length, chunkSize) &&
+                      !filename.empty() && filename.find('/') == std::string::npos &&
+                      channelsInUse() < MAX_CHANNELS;
+            chunkSize = chunkSize == 0 ? FTPProtocol::DEFAULT_CHUNK_SIZE : std::clamp(chunkSize, FTPProtocol::MIN_CHUNK_SIZE, FTPProtocol::MAX_CHUNK_SIZE);
+            // a deduplicated file only has its manifest
+            std::string path = uploadDir_ + "/" + username_ + "_" + filename;
+            bool deduplicated = ok && chunks_ && access(path.c_str(), F_OK) != 0 && access(ChunkStore::manifestPath(path).c_str(), F_OK) == 0;
+            if (!ok || !(deduplicated ? opened->sender.openManifest(*chunks_, path, offset, length, chunkSize)
+                                      : opened->sender.open(path, offset, length, chunkSize))) {
+                std::cerr << "Cannot send file: " << filename << std::endl;
+                queueReply(out, channelId, static_cast<uint8_t>(FTPProtocol::FTPMessageType::FILE_ERROR), sequenceNumber_);
+                break;
+            }
+            FileSender& sender = opened->sender;
+            opened->ackedChunks = 0;
+            std::cout << "Sending file: " << filename << " (" << sender.length() << " of " << sender.fileSize() << " bytes at " << sender.offset() << ")" << std::endl;
+
+            queueReply(out, channelId, static_cast<uint8_t>(FTPProtocol::FTPMessageType::FILE_GET), sequenceNumber_,
+                       FTPProtocol::createFileGetReply(sender.fileSize(), sender.offset(), sender.length(), sender.chunkSize()));
+            Download& started = *opened;
+            downloads_[channelId] = std::move(opened);
+            pumpDownload(out, channelId, started);
+            break;
+        }
+        case FTPProtocol::FTPMessageType::FILE_BATCH: {
+            // same names as a FILE_START upload, the batch takes the payload with it
+            std::shared_ptr<FileBatch::Batch> batch = FileBatch::parse(payload, uploadDir_ + "/" + username_ + "_");
+            if (!batch) {
+                queueReply(out, channelId, static_cast<uint8_t>(FTPProtocol::FTPMessageType::FILE_ERROR), sequenceNumber_);
+                break;
+            }
+
+            // written on the pool, one reply for the whole batch once all of it is on disk
+            job_ = std::make_unique<Job>();
+            job_->start = [batch](BackgroundPool& pool, std::function<void()> done) {
+                FileBatch::writeFiles(pool, batch, std::move(done));
+            };
+            job_->finish = [this, batch, channelId](std::vector<uint8_t>& out) {
+                std::vector<uint32_t> failed = FileBatch::failedFiles(*batch);
+                filesReceived_ += batch->entries.size() - failed.size();
+                std::cout << "Batch received: " << batch->entries.size() - failed.size() << " of " << batch->entries.size() << " files" << std::endl;
+                queueReply(out, channelId, static_cast<uint8_t>(FTPProtocol::FTPMessageType::FILE_BATCH), sequenceNumber_, FTPProtocol::createFileBatchReply(batch->entries.size(), failed));
+            };
+            break;
+        }
+        case FTPProtocol::FTPMessageType::DELTA_START: {
+            std::string filename;
+            uint64_t fileSize;
+            uint32_t blockSize;
+            uint64_t fileVersion;
+
+            if (!FTPProtocol::parseFileStartMessage(payload, filename, fileSize, blockSize, fileVersion) ||
+                filename.empty() || filename.find('/') != std::string::npos) {
+                queueReply(out, channelId, static_cast<uint8_t>(FTPProtocol::FTPMessageType::FILE_ERROR), sequenceNumber_);
+                break;
+            }
+            if (claimPresent(out, channelId, payload, filename, fileSize)) {
+                break;
+            }
+
+            // no stored copy worth diffing against --> block count 0, the client uploads the whole file
+            auto receiver = std::make_unique<DeltaReceiver>();
+            if (channelsInUse() >= MAX_CHANNELS ||
+                !receiver->open(uploadDir_ + "/" + username_ + "_" + filename, fileSize, blockSize)) {
+                queueReply(out, channelId, static_cast<uint8_t>(FTPProtocol::FTPMessageType::DELTA_START), sequenceNumber_, FTPProtocol::createDeltaStartReply(0, 0));
+                break;
+            }
+
+            // hashing every block of the old copy takes seconds for a big file, it runs on the pool
+            // the receiver goes along so its mapping outlives the connection if that closes first
+            struct Signing {
+                std::unique_ptr<DeltaReceiver> receiver;
+                std::vector<FTPProtocol::BlockSignature> signatures;
+            };
+            auto signing = std::make_shared<Signing>();
+            signing->receiver = std::move(receiver);
+
+            job_ = std::make_unique<Job>();
+            job_->start = [signing](BackgroundPool& pool, std::function<void()> done) {
+                pool.submit([signing, done] {
+                    signing->signatures = signing->receiver->signatures();
+                    done();
+                });
+            };
+            job_->finish = [this, signing, channelId, filename, fileSize](std::vector<uint8_t>& out) {
+                DeltaReceiver& started = *signing->receiver;
+                std::cout << "Delta upload: " << filename << " (" << fileSize << " bytes against " << signing->signatures.size() << " blocks of " << started.blockSize() << " bytes)" << std::endl;
+                queueReply(out, channelId, static_cast<uint8_t>(FTPProtocol::FTPMessageType::DELTA_START), sequenceNumber_,
+                           FTPProtocol::createDeltaStartReply(started.blockSize(), signing->signatures.size()));
+                if (!signing->signatures.empty()) {
+                    signatureStreams_[channelId] = SignatureStream{std::move(signing->signatures), 0};
+                }
+                deltas_[channelId] = std::move(signing->receiver);
+            };
+            break;
+        }
+        case FTPProtocol::FTPMessageType::DEDUPE_START: {
+            auto file = std::make_unique<Dedupe>();
+            std::string filename;
+            // said apart from FILE_ERROR so the client stops asking instead of giving up on one file
+            if (!chunks_) {
+                queueReply(out, channelId, static_cast<uint8_t>(FTPProtocol::FTPMessageType::DEDUPE_UNSUPPORTED), sequenceNumber_);
+                break;
+            }
+            if (!FTPProtocol::parseDedupeStartMessage(payload, filename, file->fileSize, file->chunks) ||
+                filename.empty() || filename.find('/') != std::string::npos ||
+                channelsInUse() >= MAX_CHANNELS) {
+                queueReply(out, channelId, static_cast<uint8_t>(FTPProtocol::FTPMessageType::FILE_ERROR), sequenceNumber_);
+                break;
+            }
+            file->filePath = uploadDir_ + "/" + username_ + "_" + filename;
+            file->newBytes = 0;
+            file->failed = false;
+            file->unwrittenBytes = 0;
+
+            // a chunk that repeats inside the file is only asked for once
+            std::vector<uint32_t> missing;
+            std::unordered_set<std::string> asked;
+            file->pending.assign(file->chunks.size(), 0);
+            for (uint32_t i = 0; i < file->chunks.size(); i++) {
+                std::string hash(file->chunks[i].hash, file->chunks[i].hash + FTPProtocol::CHUNK_HASH_SIZE);
+                if (!asked.count(hash) && !chunks_->has(file->chunks[i])) {
+                    missing.push_back(i);
+                    asked.insert(hash);
+                    file->pending[i] = 1;
+                }
+            }
+            file->pendingCount = missing.size();
+            std::cout << "Deduplicated upload: " << filename << " (" << file->fileSize << " bytes, " << missing.size() << " of "
+                      << file->chunks.size() << " chunks missing)" << std::endl;
+
+            queueReply(out, channelId, static_cast<uint8_t>(FTPProtocol::FTPMessageType::DEDUPE_START), sequenceNumber_, FTPProtocol::createMissingChunksReply(missing));
+            dedupes_[channelId] = std::move(file);
+            break;
+        }
+        case FTPProtocol::FTPMessageType::FILE_ACK:
+            // a download ack that crossed the FILE_END of its download
+            break;
+
+        case FTPProtocol::FTPMessageType::FILE_END:
+            std::cout << "Client sent FILE_END message" << std::endl;
+            queueReply(out, channelId, static_cast<uint8_t>(FTPProtocol::FTPMessageType::FILE_END), sequenceNumber_);
+            break;
+
+        case FTPProtocol::FTPMessageType::DISCONNECT:
+            std::cout << "Client requested disconnect" << std::endl;
+            disconnectRequested_ = true;
+            break;
+
+        default:
+            std::cerr << "Unknown message type: " << static_cast<int>(messageType) << std::endl;
+            break;
+    }
+
+    return true;
+}
+
+void Session::logSummary() const {
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startedAt_).count();
+    std::cout << "Session " << (username_.empty() ? "(unauthenticated)" : username_) << ": " << seconds << " s, "
+              << messagesReceived_ << " messages in (" << payloadBytesReceived_ << " payload bytes, " << reader_.recvCalls() << " recv calls), "
+              << messagesSent_ << " messages out (" << bytesSent_ << " bytes), "
+              << filesReceived_ << " files received, " << filesSent_ << " files sent" << std::endl;
+    std::cout << "Session " << (username_.empty() ? "(unauthenticated)" : username_) << " socket: " << tuner_.summary() << std::endl;
+    if (hasKeys()) {
+        std::cout << "Session " << (username_.empty() ? "(unauthenticated)" : username_) << " cipher: in " << recvCrypto_->name() << " ("
+                  << (uint64_t)recvCrypto_->measuredSpeed() << " MB/s here), out " << sendCrypto_->name() << " ("
+                  << (uint64_t)sendCrypto_->measuredSpeed() << " MB/s here)" << std::endl;
+    }
+}
@@ -2,8 +2,10 @@
 #include <iostream>
 #include <cstring>
 #include <algorithm>
+#include <openssl/crypto.h>
 
-SimpleCrypto::SimpleCrypto(uint64_t sharedSecret, bool is_client) {
+template <typename Mac>
+SimpleCrypto<Mac>::SimpleCrypto(uint64_t sharedSecret, bool is_client) : mac_(sharedSecret, is_client) {
 
     sequence_number_ = 0;
     
@@ -21,11 +23,13 @@ SimpleCrypto::SimpleCrypto(uint64_t sharedSecret, bool is_client) {
     if (iv_.size() < 16) {
         iv_.resize(16, 0);
     }
+    XorKernel::fillTable(keystream_, key_, iv_, sequence_number_);
 
     // std::cout << "Initialized SimpleCrypto with DH key (size: " << key_.size() << " bytes)" << std::endl;
 }
 
-std::vector<uint8_t> SimpleCrypto::deriveKey(uint64_t sharedSecret, const std::string& purpose) {
+template <typename Mac>
+std::vector<uint8_t> SimpleCrypto<Mac>::deriveKey(uint64_t sharedSecret, const std::string& purpose) {
     // hash shared secret with purpose string
     std::vector<uint8_t> input;
     
@@ -46,111 +50,90 @@ std::vector<uint8_t> SimpleCrypto::deriveKey(uint64_t sharedSecret, const std::s
     return hash;
 }
 
-std::vector<uint8_t> SimpleCrypto::simpleHash(const std::vector<uint8_t>& data) {
-    // hash function, XOR with position and rotate
-    std::vector<uint8_t> hash(16, 0);
-    
-    for (size_t i = 0; i < data.size(); i++) {
-        uint8_t byte = data[i];
-        uint8_t pos = i & 0xFF;
-        
-        // rotate and XOR
-        for (int j = 0; j < 16; j++) {
-            hash[j] ^= byte ^ pos ^ ((i + j) & 0xFF);
-            byte = (byte << 1) | (byte >> 7); // rotate left
-        }
-    }
-    
-    return hash;
-}
-
-void SimpleCrypto::updateIV() {
+template <typename Mac>
+void SimpleCrypto<Mac>::updateIV() {
     //IV update using sequence number
     for (size_t i = 0; i < iv_.size(); i++) {
         iv_[i] ^= (sequence_number_ >> (i % 4 * 8)) & 0xFF;
     }
+    XorKernel::fillTable(keystream_, key_, iv_, sequence_number_);
 }
 
-std::vector<uint8_t> SimpleCrypto::xorEncrypt(const std::vector<uint8_t>& data) {
-    std::vector<uint8_t> encrypted(data.size());
-    
-    for (size_t i = 0; i < data.size(); i++) {
-        // XOR with key, IV, and position
-        uint8_t key_byte = key_[i % key_.size()];
-        uint8_t iv_byte = iv_[i % iv_.size()];
-        uint8_t pos_byte = (i + sequence_number_) & 0xFF;
-        
-        encrypted[i] = data[i] ^ key_byte ^ iv_byte ^ pos_byte;
-    }
-    
-    return encrypted;
+template <typename Mac>
+void SimpleCrypto<Mac>::xorEncryptInto(const uint8_t* data, size_t len, uint8_t* out, size_t position) {
+    // XOR with key, IV, and position, all of them are in the keystream
+    XorKernel::apply(data, len, out, keystream_, position);
 }
 
-std::vector<uint8_t> SimpleCrypto::xorDecrypt(const std::vector<uint8_t>& data) {
-    // encryption is symmetric
-    return xorEncrypt(data);
-}
+template <typename Mac>
+bool SimpleCrypto<Mac>::encryptInPlace(std::span<uint8_t> packet) {
+    if (packet.size() < MAC_SIZE) {
+        std::cerr << "Packet too short for MAC" << std::endl;
+        return false;
+    }
 
-std::vector<uint8_t> SimpleCrypto::encryptPacket(const std::vector<uint8_t>& rawPacket) {
     // update IV for this sequence
     updateIV();
     
-    // encrypt the packet
-    std::vector<uint8_t> encrypted = xorEncrypt(rawPacket);
+    // [encrypted data][MAC]
+    size_t dataSize = packet.size() - MAC_SIZE;
+    xorEncryptInto(packet.data(), dataSize, packet.data(), 0);
+    bool ok = mac_.compute(sequence_number_, packet.data(), dataSize, packet.data() + dataSize);
     
-    // create MAC --> hash(sequenceNumber || encrypted_data)
-    std::vector<uint8_t> macInput;
-    macInput.push_back((sequence_number_ >> 24) & 0xFF);
-    macInput.push_back((sequence_number_ >> 16) & 0xFF);
-    macInput.push_back((sequence_number_ >> 8) & 0xFF);
-    macInput.push_back(sequence_number_ & 0xFF);
-    macInput.insert(macInput.end(), encrypted.begin(), encrypted.end());
-    
-    std::vector<uint8_t> mac = simpleHash(macInput);
+    sequence_number_++;
+    return ok;
+}
+
+template <typename Mac>
+bool SimpleCrypto<Mac>::encryptPacketInto(std::vector<uint8_t>& out, const uint8_t* head, size_t headLength, const uint8_t* body, size_t bodyLength) {
+    // update IV for this sequence
+    updateIV();
     
-    // combine encrypted data and MAC
-    std::vector<uint8_t> result;
-    result.insert(result.end(), encrypted.begin(), encrypted.end());
-    result.insert(result.end(), mac.begin(), mac.end());
+    // encrypt the packet, [encrypted data][MAC]
+    size_t start = out.size();
+    out.resize(start + headLength + bodyLength + MAC_SIZE);
+    uint8_t* encrypted = out.data() + start;
+    xorEncryptInto(head, headLength, encrypted, 0);
+    xorEncryptInto(body, bodyLength, encrypted + headLength, headLength);
+    bool ok = mac_.compute(sequence_number_, encrypted, headLength + bodyLength, encrypted + headLength + bodyLength);
     
     sequence_number_++;
-    
-    return result;
+    if (!ok) {
+        out.resize(start);
+    }
+    return ok;
 }
 
-bool SimpleCrypto::decryptPacket(const std::vector<uint8_t>& encryptedPacket, std::vector<uint8_t>& rawPacketOut) {
-    if (encryptedPacket.size() < 16) {
+template <typename Mac>
+bool SimpleCrypto<Mac>::decryptInPlace(std::span<uint8_t> packet) {
+    if (packet.size() < MAC_SIZE) {
         std::cerr << "Packet too short for MAC" << std::endl;
         return false;
     }
     
-    // seperate encrypted data and MAC
-    size_t data_size = encryptedPacket.size() - 16;
-    std::vector<uint8_t> encrypted_data(encryptedPacket.begin(), encryptedPacket.begin() + data_size);
-    std::vector<uint8_t> recievedMac(encryptedPacket.begin() + data_size, encryptedPacket.end());
-    
-    // verify MAC
-    std::vector<uint8_t> macInput;
-    macInput.push_back((sequence_number_ >> 24) & 0xFF);
-    macInput.push_back((sequence_number_ >> 16) & 0xFF);
-    macInput.push_back((sequence_number_ >> 8) & 0xFF);
-    macInput.push_back(sequence_number_ & 0xFF);
-    macInput.insert(macInput.end(), encrypted_data.begin(), encrypted_data.end());
-    
-    std::vector<uint8_t> computedMac = simpleHash(macInput);
-    
-    if (recievedMac != computedMac) {
+    // verify MAC before anything is touched
+    size_t dataSize = packet.size() - MAC_SIZE;
+    uint8_t computedMac[MAC_SIZE];
+    if (!mac_.compute(sequence_number_, packet.data(), dataSize, computedMac)) {
+        std::cerr << "Failed to compute MAC" << std::endl;
+        return false;
+    }
+    // constant time, how much of a forged tag matched must not show in the timing
+    if (CRYPTO_memcmp(packet.data() + dataSize, computedMac, MAC_SIZE) != 0) {
         std::cerr << "MAC verification failed" << std::endl;
         return false;
     }
     
-    // std::cout << "MAC verification passed! Sequence number: " << sequence_number_ << std::endl;
-    
     updateIV();
     
-    rawPacketOut = xorDecrypt(encrypted_data);
+    // encryption is symmetric
+    xorEncryptInto(packet.data(), dataSize, packet.data(), 0);
     
     sequence_number_++;
     
     return true;
-} 
\ No newline at end of file
+}
+
+// one of each for the MACs in the cipher registry
+template class SimpleCrypto<KimMac>;
+template class SimpleCrypto<HmacSha256>;
@@ -0,0 +1,153 @@
+#include "s_upload_journal.h"
+
+#include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <cstdio>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+    const std::string PARTIAL_SUFFIX = ".partial";
+    const std::string JOURNAL_SUFFIX = ".journal";
+    const std::string PART_INFIX = ".part-"; // UploadRegistry temp files, <file>.part-<id>
+    const std::string JOURNAL_MAGIC = "KimCloud-journal-1";
+
+    bool hasSuffix(const std::string& name, const std::string& suffix) {
+        return name.size() > suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+    }
+
+    bool isPartFile(const std::string& name) {
+        size_t at = name.rfind(PART_INFIX);
+        size_t digits = at == std::string::npos ? std::string::npos : at + PART_INFIX.size();
+        return digits != std::string::npos && digits < name.size() && name.find_first_not_of("0123456789", digits) == std::string::npos;
+    }
+}
+
+namespace UploadJournal {
+
+    std::string partialPath(const std::string& filePath) {
+        return filePath + PARTIAL_SUFFIX;
+    }
+
+    std::string journalPath(const std::string& filePath) {
+        return filePath + JOURNAL_SUFFIX;
+    }
+
+    bool load(const std::string& filePath, JournalEntry& entry) {
+        std::ifstream in(journalPath(filePath));
+        if (!in.is_open()) {
+            return false;
+        }
+
+        // magic line then one "key value" per line
+        std::string magic;
+        std::string key;
+        if (!(in >> magic) || magic != JOURNAL_MAGIC) {
+            std::cerr << "Ignoring unreadable journal for " << filePath << std::endl;
+            return false;
+        }
+        int fields = 0;
+        while (in >> key) {
+            if (key == "size" && in >> entry.fileSize) {
+                fields |= 1;
+            } else if (key == "version" && in >> entry.fileVersion) {
+                fields |= 2;
+            } else if (key == "committed" && in >> entry.committedBytes) {
+                fields |= 4;
+            } else if (key == "digest" && in >> std::hex >> entry.digest >> std::dec) {
+                fields |= 8;
+            } else {
+                break;
+            }
+        }
+        return fields == 15 && entry.committedBytes <= entry.fileSize;
+    }
+
+    bool save(const std::string& filePath, const JournalEntry& entry) {
+        std::string path = journalPath(filePath);
+        std::string tempPath = path + ".tmp";
+
+        std::string text = JOURNAL_MAGIC + "\n"
+            + "size " + std::to_string(entry.fileSize) + "\n"
+            + "version " + std::to_string(entry.fileVersion) + "\n"
+            + "committed " + std::to_string(entry.committedBytes) + "\n";
+        char digest[32];
+        snprintf(digest, sizeof(digest), "digest %016llx\n", (unsigned long long)entry.digest);
+        text += digest;
+
+        int fd = ::open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            std::cerr << "Failed to create journal: " << tempPath << std::endl;
+            return false;
+        }
+        bool ok = write(fd, text.data(), text.size()) == (ssize_t)text.size() && fdatasync(fd) == 0;
+        ::close(fd);
+        if (!ok || rename(tempPath.c_str(), path.c_str()) < 0) {
+            std::cerr << "Failed to write journal: " << path << std::endl;
+            unlink(tempPath.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    void discard(const std::string& filePath) {
+        unlink(journalPath(filePath).c_str());
+        unlink(partialPath(filePath).c_str());
+    }
+
+    size_t collectGarbage(const std::string& uploadDir, std::chrono::seconds maxAge, const std::set<std::string>& inUse) {
+        namespace fs = std::filesystem;
+        std::error_code ec;
+        auto now = fs::file_time_type::clock::now();
+        size_t removed = 0;
+
+        for (const auto& dirEntry : fs::directory_iterator(uploadDir, ec)) {
+            // both halves lead to the same upload, a partial file without a journal was never resumable
+            std::string name = dirEntry.path().string();
+            if (isPartFile(name)) {
+                // the registry only lives in memory, a part file it does not know is an orphan
+                // old enough that it was not just created after inUse was taken
+                std::error_code partEc;
+                auto partTouched = fs::last_write_time(dirEntry.path(), partEc);
+                if (!partEc && !inUse.count(name) && now - partTouched >= maxAge && fs::remove(dirEntry.path(), partEc)) {
+                    removed++;
+                    std::cout << "Removed orphaned striped upload part: " << name << std::endl;
+                }
+                continue;
+            }
+
+            std::string filePath;
+            if (hasSuffix(name, JOURNAL_SUFFIX)) {
+                filePath = name.substr(0, name.size() - JOURNAL_SUFFIX.size());
+            } else if (hasSuffix(name, PARTIAL_SUFFIX) && !fs::exists(journalPath(name.substr(0, name.size() - PARTIAL_SUFFIX.size())), ec)) {
+                filePath = name.substr(0, name.size() - PARTIAL_SUFFIX.size());
+            } else {
+                continue;
+            }
+            // a connected upload can go quiet for longer than maxAge, its channel still owns the file
+            if (inUse.count(partialPath(filePath))) {
+                continue;
+            }
+
+            // an upload in progress keeps writing the partial file, the newer of the two counts
+            std::error_code journalEc;
+            std::error_code partialEc;
+            auto journalTouched = fs::last_write_time(journalPath(filePath), journalEc);
+            auto partialTouched = fs::last_write_time(partialPath(filePath), partialEc);
+            if (journalEc && partialEc) {
+                continue; // already removed earlier in this sweep
+            }
+            auto lastTouched = journalEc ? partialTouched : (partialEc ? journalTouched : std::max(journalTouched, partialTouched));
+            if (now - lastTouched < maxAge) {
+                continue;
+            }
+
+            discard(filePath);
+            removed++;
+            std::cout << "Removed stale partial upload: " << filePath << std::endl;
+        }
+        return removed;
+    }
+}
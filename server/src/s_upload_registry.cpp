@@ -0,0 +1,203 @@
+#include "s_upload_registry.h"
+
+#include <iostream>
+#include <algorithm>
+#include <random>
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+StripedUpload::~StripedUpload() {
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    // never completed, the temp file is not worth keeping
+    if (!tempPath.empty()) {
+        unlink(tempPath.c_str());
+    }
+}
+
+UploadRegistry::UploadRegistry() {
+    // ids are not secrets, starting somewhere random just keeps a restarted server from reusing old ones
+    nextId_ = std::random_device{}() | 1;
+}
+
+UploadRegistry::~UploadRegistry() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uploads_.clear();
+}
+
+bool UploadRegistry::create(const std::string& owner, const std::string& finalPath, uint64_t fileSize, uint32_t partCount, uint64_t& uploadId) {
+    if (partCount == 0 || partCount > MAX_PARTS) {
+        std::cerr << "Upload rejected, " << partCount << " parts" << std::endl;
+        return false;
+    }
+
+    auto upload = std::make_shared<StripedUpload>();
+    upload->owner = owner;
+    upload->finalPath = finalPath;
+    upload->fileSize = fileSize;
+    upload->partCount = partCount;
+    upload->fd = -1;
+    upload->lastTouched = std::chrono::steady_clock::now();
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        // counted and registered under one lock so two inits at once cannot both slip under the limits
+        size_t openUploads = 0;
+        uint64_t openBytes = 0;
+        for (const auto& entry : uploads_) {
+            if (entry.second->owner == owner) {
+                openUploads++;
+                openBytes += entry.second->fileSize;
+            }
+        }
+        if (openUploads >= MAX_UPLOADS_PER_USER || fileSize > MAX_BYTES_PER_USER - openBytes) {
+            std::cerr << "Upload rejected, " << owner << " already has " << openUploads << " uploads of " << openBytes << " bytes open" << std::endl;
+            return false;
+        }
+
+        upload->id = nextId_++;
+        upload->tempPath = finalPath + ".part-" + std::to_string(upload->id);
+        uploads_[upload->id] = upload;
+    }
+
+    upload->fd = ::open(upload->tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (upload->fd < 0) {
+        std::cerr << "Failed to create file: " << upload->tempPath << std::endl;
+        upload->tempPath.clear();
+        drop(upload->id);
+        return false;
+    }
+
+    // reserve the blocks up front so the parts never extend the file under each other
+    // only a filesystem without fallocate gets a sparse file, a full disk is an error now and not halfway through
+    int err = fileSize > 0 ? posix_fallocate(upload->fd, 0, fileSize) : 0;
+    if ((err == EOPNOTSUPP || err == EINVAL) && ftruncate(upload->fd, fileSize) == 0) {
+        err = 0;
+    }
+    if (err != 0) {
+        std::cerr << "Failed to preallocate " << fileSize << " bytes for " << upload->tempPath << ": " << strerror(err) << std::endl;
+        drop(upload->id);
+        return false;
+    }
+
+    uploadId = upload->id;
+    return true;
+}
+
+void UploadRegistry::drop(uint64_t uploadId) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uploads_.erase(uploadId);
+}
+
+std::shared_ptr<StripedUpload> UploadRegistry::attach(uint64_t uploadId, const std::string& owner, uint64_t offset, uint64_t length) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto it = uploads_.find(uploadId);
+    if (it == uploads_.end() || it->second->owner != owner || it->second->fd < 0) {
+        std::cerr << "Unknown upload " << uploadId << " for " << owner << std::endl;
+        return nullptr;
+    }
+    if (offset > it->second->fileSize || length > it->second->fileSize - offset) {
+        std::cerr << "Part [" << offset << ", +" << length << ") is outside upload " << uploadId << std::endl;
+        return nullptr;
+    }
+    it->second->lastTouched = std::chrono::steady_clock::now();
+    return it->second;
+}
+
+void UploadRegistry::finishPart(uint64_t uploadId, uint64_t offset, uint64_t length) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto it = uploads_.find(uploadId);
+    if (it != uploads_.end()) {
+        it->second->donePieces.emplace_back(offset, offset + length);
+        it->second->lastTouched = std::chrono::steady_clock::now();
+    }
+}
+
+bool UploadRegistry::complete(uint64_t uploadId, const std::string& owner, std::string& finalPath) {
+    std::shared_ptr<StripedUpload> upload;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = uploads_.find(uploadId);
+        if (it == uploads_.end() || it->second->owner != owner) {
+            std::cerr << "Unknown upload " << uploadId << " for " << owner << std::endl;
+            return false;
+        }
+        upload = it->second;
+
+        // parts may come in any order, sorted they have to cover [0, fileSize) without a hole
+        std::vector<std::pair<uint64_t, uint64_t>> pieces = upload->donePieces;
+        std::sort(pieces.begin(), pieces.end());
+        uint64_t covered = 0;
+        for (const auto& piece : pieces) {
+            if (piece.first > covered) {
+                break;
+            }
+            covered = std::max(covered, piece.second);
+        }
+        // either way the upload is over, a failed one takes its temp file with it
+        uploads_.erase(it);
+        if (covered < upload->fileSize) {
+            std::cerr << "Upload " << uploadId << " incomplete, " << covered << " of " << upload->fileSize << " bytes" << std::endl;
+            return false;
+        }
+    }
+
+    // data on disk before the name points at it
+    if (fdatasync(upload->fd) < 0 || rename(upload->tempPath.c_str(), upload->finalPath.c_str()) < 0) {
+        std::cerr << "Failed to publish " << upload->finalPath << std::endl;
+        return false;
+    }
+    upload->tempPath.clear();
+    finalPath = upload->finalPath;
+    return true;
+}
+
+size_t UploadRegistry::expire(std::chrono::seconds maxAge) {
+    auto now = std::chrono::steady_clock::now();
+    size_t expired = 0;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = uploads_.begin(); it != uploads_.end();) {
+        // a part channel holds its own reference, an upload somebody is still writing is never idle
+        const StripedUpload& upload = *it->second;
+        if (it->second.use_count() > 1 || upload.fd < 0 || now - upload.lastTouched < maxAge) {
+            ++it;
+            continue;
+        }
+        std::cout << "Expired striped upload " << upload.id << " of " << upload.finalPath << std::endl;
+        it = uploads_.erase(it);
+        expired++;
+    }
+    return expired;
+}
+
+std::shared_ptr<const std::string> UploadRegistry::holdPartial(const std::string& partialPath) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        partials_.insert(partialPath);
+    }
+    // the registry outlives every session, the handle can call back into it
+    return std::shared_ptr<const std::string>(new std::string(partialPath), [this](const std::string* path) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            partials_.erase(partials_.find(*path));
+        }
+        delete path;
+    });
+}
+
+std::set<std::string> UploadRegistry::inUse() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::set<std::string> paths(partials_.begin(), partials_.end());
+    for (const auto& entry : uploads_) {
+        paths.insert(entry.second->tempPath);
+    }
+    return paths;
+}
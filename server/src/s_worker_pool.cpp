@@ -0,0 +1,124 @@
+#include "s_worker_pool.h"
+#include <iostream>
+#include <algorithm>
+#include <unistd.h>
+
+WorkerPool::WorkerPool(size_t workers, size_t queueCapacity, std::function<void(int)> handler) {
+    workerCount_ = std::max<size_t>(1, workers);
+    queueCapacity_ = std::max<size_t>(1, queueCapacity);
+    handler_ = handler;
+    stopping_ = false;
+    activeWorkers_ = 0;
+    maxQueueDepth_ = 0;
+    completed_ = 0;
+    rejected_ = 0;
+    dequeued_ = 0;
+    totalWaitMs_ = 0;
+    maxWaitMs_ = 0;
+}
+
+WorkerPool::~WorkerPool() {
+    shutdown();
+}
+
+void WorkerPool::start() {
+    for (size_t i = 0; i < workerCount_; i++) {
+        workers_.emplace_back(&WorkerPool::workerLoop, this);
+    }
+}
+
+void WorkerPool::shutdown() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopping_) {
+            return;
+        }
+        stopping_ = true;
+    }
+    notEmpty_.notify_all();
+    notFull_.notify_all();
+
+    for (auto& worker : workers_) {
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    // nobody will serve what is still queued
+    for (const auto& pending : queue_) {
+        close(pending.socketFd);
+    }
+    queue_.clear();
+}
+
+bool WorkerPool::tryPush(int socketFd) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopping_ || queue_.size() >= queueCapacity_) {
+            rejected_++;
+            return false;
+        }
+        queue_.push_back({socketFd, std::chrono::steady_clock::now()});
+        maxQueueDepth_ = std::max(maxQueueDepth_, queue_.size());
+    }
+    notEmpty_.notify_one();
+    return true;
+}
+
+bool WorkerPool::push(int socketFd) {
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        notFull_.wait(lock, [this] { return stopping_ || queue_.size() < queueCapacity_; });
+        if (stopping_) {
+            return false;
+        }
+        queue_.push_back({socketFd, std::chrono::steady_clock::now()});
+        maxQueueDepth_ = std::max(maxQueueDepth_, queue_.size());
+    }
+    notEmpty_.notify_one();
+    return true;
+}
+
+void WorkerPool::workerLoop() {
+    while (true) {
+        PendingClient pending;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            notEmpty_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+            if (stopping_) {
+                return;
+            }
+            pending = queue_.front();
+            queue_.pop_front();
+
+            double waitMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - pending.queuedAt).count();
+            totalWaitMs_ += waitMs;
+            maxWaitMs_ = std::max(maxWaitMs_, waitMs);
+            dequeued_++;
+            activeWorkers_++;
+        }
+        notFull_.notify_one();
+
+        handler_(pending.socketFd);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        activeWorkers_--;
+        completed_++;
+    }
+}
+
+WorkerPool::Stats WorkerPool::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    Stats s;
+    s.workers = workerCount_;
+    s.activeWorkers = activeWorkers_;
+    s.queueDepth = queue_.size();
+    s.queueCapacity = queueCapacity_;
+    s.maxQueueDepth = maxQueueDepth_;
+    s.completed = completed_;
+    s.rejected = rejected_;
+    s.avgWaitMs = dequeued_ > 0 ? totalWaitMs_ / dequeued_ : 0;
+    s.maxWaitMs = maxWaitMs_;
+    return s;
+}
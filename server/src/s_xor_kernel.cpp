@@ -0,0 +1,108 @@
+#include "s_xor_kernel.h"
+
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace {
+    // the bytes the wide loops leave over, fewer than one vector
+    void xorTail(const uint8_t* data, size_t len, uint8_t* out, const uint8_t* table, size_t offset) {
+        for (size_t n = 0; n < len; n++) {
+            out[n] = data[n] ^ table[(offset + n) & (XorKernel::PERIOD - 1)];
+        }
+    }
+
+    // 8 bytes at a time through a plain integer, for CPUs without any of the vector kernels
+    void xorWords(const uint8_t* data, size_t len, uint8_t* out, const uint8_t* table, size_t offset) {
+        size_t n = 0;
+        for (; n + 8 <= len; n += 8) {
+            uint64_t a, b;
+            memcpy(&a, data + n, 8);
+            memcpy(&b, table + offset, 8);
+            a ^= b;
+            memcpy(out + n, &a, 8);
+            offset = (offset + 8) & (XorKernel::PERIOD - 1);
+        }
+        xorTail(data + n, len - n, out + n, table, offset);
+    }
+
+#if defined(__x86_64__)
+    // every x86-64 CPU has SSE2
+    void xorSse2(const uint8_t* data, size_t len, uint8_t* out, const uint8_t* table, size_t offset) {
+        size_t n = 0;
+        for (; n + 16 <= len; n += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(data + n));
+            __m128i b = _mm_loadu_si128((const __m128i*)(table + offset));
+            _mm_storeu_si128((__m128i*)(out + n), _mm_xor_si128(a, b));
+            offset = (offset + 16) & (XorKernel::PERIOD - 1);
+        }
+        xorTail(data + n, len - n, out + n, table, offset);
+    }
+
+    __attribute__((target("avx2")))
+    void xorAvx2(const uint8_t* data, size_t len, uint8_t* out, const uint8_t* table, size_t offset) {
+        size_t n = 0;
+        for (; n + 32 <= len; n += 32) {
+            __m256i a = _mm256_loadu_si256((const __m256i*)(data + n));
+            __m256i b = _mm256_loadu_si256((const __m256i*)(table + offset));
+            _mm256_storeu_si256((__m256i*)(out + n), _mm256_xor_si256(a, b));
+            offset = (offset + 32) & (XorKernel::PERIOD - 1);
+        }
+        xorTail(data + n, len - n, out + n, table, offset);
+    }
+
+    __attribute__((target("avx512f")))
+    void xorAvx512(const uint8_t* data, size_t len, uint8_t* out, const uint8_t* table, size_t offset) {
+        size_t n = 0;
+        for (; n + 64 <= len; n += 64) {
+            __m512i a = _mm512_loadu_si512((const void*)(data + n));
+            __m512i b = _mm512_loadu_si512((const void*)(table + offset));
+            _mm512_storeu_si512((void*)(out + n), _mm512_xor_si512(a, b));
+            offset = (offset + 64) & (XorKernel::PERIOD - 1);
+        }
+        xorTail(data + n, len - n, out + n, table, offset);
+    }
+#endif
+
+    XorKernel::Choice pickBest() {
+        std::vector<XorKernel::Choice> kernels = XorKernel::available();
+        return kernels.back();
+    }
+}
+
+namespace XorKernel {
+
+    void fillTable(uint8_t* table, const std::vector<uint8_t>& key, const std::vector<uint8_t>& iv, uint32_t sequence) {
+        for (size_t i = 0; i < PERIOD; i++) {
+            table[i] = key[i % key.size()] ^ iv[i % iv.size()] ^ ((i + sequence) & 0xFF);
+        }
+        memcpy(table + PERIOD, table, MAX_WIDTH);
+    }
+
+    void apply(const uint8_t* data, size_t len, uint8_t* out, const uint8_t* table, size_t offset) {
+        static const Choice best = pickBest();
+        best.kernel(data, len, out, table, offset & (PERIOD - 1));
+    }
+
+    const char* bestName() {
+        static const Choice best = pickBest();
+        return best.name;
+    }
+
+    std::vector<Choice> available() {
+        std::vector<Choice> kernels = {{"words", xorWords}};
+#if defined(__x86_64__)
+        kernels.push_back({"sse2", xorSse2});
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            kernels.push_back({"avx2", xorAvx2});
+        }
+        if (__builtin_cpu_supports("avx512f")) {
+            kernels.push_back({"avx512", xorAvx512});
+        }
+#endif
+        return kernels;
+    }
+}